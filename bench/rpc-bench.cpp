@@ -0,0 +1,722 @@
+// rpc-bench: measure the codecs, method dispatch, round-trip latency and
+// broadcast fan-out throughput, and write the results as JSON.
+//
+//   rpc-bench [--output <file>] [--scale <factor>] [--filter <substring>]
+//
+// --scale multiplies every iteration count, so --scale 0.1 gives a quick run.
+// --filter runs only the benchmarks whose names contain the substring.
+
+#include "gen-bench.pb.hpp"
+#include "gen-dispatch1.pb.hpp"
+#include "gen-dispatch8.pb.hpp"
+#include "gen-dispatch64.pb.hpp"
+#include "gen-macrodispatch1.pb.hpp"
+#include "gen-macrodispatch8.pb.hpp"
+#include "gen-macrodispatch64.pb.hpp"
+
+#include <rpc/config.hpp>
+#include <rpc/message.hpp>
+#include <rpc/asio/client.hpp>
+#include <rpc/asio/server.hpp>
+#include <rpc/asio/local.hpp>
+
+#ifdef __linux__
+#include <rpc/asio/shmmessagequeue.hpp>
+#endif
+
+#ifdef RPC_BENCH_HAVE_SFP
+#include <sfp/asio/messagequeue.hpp>
+#endif
+
+#include <boost/asio.hpp>
+#include <boost/log/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Interface = bench::Bench;
+using MethodIn = rpc::MethodIn<Interface>;
+using MethodResult = rpc::MethodResult<Interface>;
+using Broadcast = rpc::Broadcast<Interface>;
+
+// Somewhere for benchmark loops to put their results, so the compiler can't
+// throw the work away.
+volatile uint64_t gSink;
+
+//////////////////////////////////////////////////////////////////////////////
+// Results
+
+// One benchmark's result: its name, and its parameters and measurements as
+// JSON members, already rendered.
+class Result {
+public:
+    explicit Result (std::string name) : mName(std::move(name)) {}
+
+    Result& add (const std::string& key, const std::string& value) {
+        mMembers.emplace_back(key, quote(value));
+        return *this;
+    }
+
+    Result& add (const std::string& key, const char* value) {
+        return add(key, std::string(value));
+    }
+
+    Result& add (const std::string& key, double value) {
+        std::ostringstream os;
+        if (std::isfinite(value)) {
+            os.precision(6);
+            os << value;
+        }
+        else {
+            os << "null";
+        }
+        mMembers.emplace_back(key, os.str());
+        return *this;
+    }
+
+    Result& add (const std::string& key, size_t value) {
+        mMembers.emplace_back(key, std::to_string(value));
+        return *this;
+    }
+
+    void write (std::ostream& os) const {
+        os << "{\"name\": " << quote(mName);
+        for (auto& member : mMembers) {
+            os << ", " << quote(member.first) << ": " << member.second;
+        }
+        os << "}";
+    }
+
+    static std::string quote (const std::string& s) {
+        std::string out = "\"";
+        for (auto c : s) {
+            if ('"' == c || '\\' == c) {
+                out += '\\';
+            }
+            out += c;
+        }
+        return out + "\"";
+    }
+
+private:
+    std::string mName;
+    std::vector<std::pair<std::string, std::string>> mMembers;
+};
+
+struct Options {
+    std::string output;
+    double scale = 1;
+    std::string filter;
+};
+
+class Bench {
+public:
+    explicit Bench (const Options& options) : mOptions(options) {}
+
+    bool wants (const std::string& name) const {
+        return mOptions.filter.empty() || std::string::npos != name.find(mOptions.filter);
+    }
+
+    size_t iterations (size_t n) const {
+        return std::max(size_t(1), size_t(double(n) * mOptions.scale));
+    }
+
+    Result& record (const std::string& name) {
+        std::cerr << name << "\n";
+        mResults.emplace_back(name);
+        return mResults.back();
+    }
+
+    void error (const std::string& name, const std::string& what) {
+        std::cerr << name << ": " << what << "\n";
+        mResults.emplace_back(name);
+        mResults.back().add("error", what);
+    }
+
+    void write (std::ostream& os) const {
+        char timestamp[32] = "";
+        auto now = std::time(nullptr);
+        std::strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+        os << "{\n"
+           << "  \"rpcVersion\": \"" << RPC_VERSION_MAJOR << '.' << RPC_VERSION_MINOR
+           << '.' << RPC_VERSION_PATCH << "\",\n"
+#ifdef __VERSION__
+           << "  \"compiler\": " << Result::quote(__VERSION__) << ",\n"
+#endif
+           << "  \"hardwareConcurrency\": " << std::thread::hardware_concurrency() << ",\n"
+           << "  \"timestamp\": \"" << timestamp << "\",\n"
+           << "  \"scale\": " << mOptions.scale << ",\n"
+           << "  \"results\": [";
+        auto first = true;
+        for (auto& result : mResults) {
+            os << (first ? "\n    " : ",\n    ");
+            result.write(os);
+            first = false;
+        }
+        os << "\n  ]\n}\n";
+    }
+
+private:
+    Options mOptions;
+    std::vector<Result> mResults;
+};
+
+// Average nanoseconds per call of f, after a short warm-up.
+template <class F>
+double nsPerOp (size_t iterations, F&& f) {
+    for (size_t i = 0; i < iterations / 10; ++i) {
+        f(i);
+    }
+    auto start = Clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        f(i);
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+    return elapsed / double(iterations);
+}
+
+// Record latency percentiles, in microseconds, of a set of samples.
+void addPercentiles (Result& result, std::vector<double> samples) {
+    if (samples.empty()) {
+        return;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto at = [&samples] (double p) {
+        auto i = size_t(p * double(samples.size() - 1) + 0.5);
+        return samples[std::min(i, samples.size() - 1)];
+    };
+    double sum = 0;
+    for (auto s : samples) {
+        sum += s;
+    }
+    result.add("samples", samples.size())
+        .add("meanUs", sum / double(samples.size()))
+        .add("p50Us", at(0.5))
+        .add("p90Us", at(0.9))
+        .add("p99Us", at(0.99))
+        .add("p999Us", at(0.999))
+        .add("maxUs", samples.back());
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Codecs
+
+template <class T>
+const char* codecPath () {
+    return rpc::FixedLayout<T>::value ? "fixed" : "nanopb";
+}
+
+// Encode and decode one shape of component message, on its own and inside a
+// FIRE request. Components with a FixedLayout codec are also measured through
+// nanopb's table-driven pb_encode and pb_decode, for comparison.
+template <class T>
+void benchCodec (Bench& bench, const std::string& shape, const T& message) {
+    uint8_t bytes[RPC_MESSAGE_MAX_SIZE];
+    pb_size_t size;
+    auto status = rpc::Status::OK;
+    auto n = bench.iterations(2000000);
+
+    rpc::encode(message, bytes, sizeof(bytes), size, status);
+    if (hasError(status)) {
+        bench.error("codec/" + shape, "encoding failed");
+        return;
+    }
+    auto encodedSize = size;
+
+    auto name = "codec/encode/" + shape;
+    if (bench.wants(name)) {
+        auto ns = nsPerOp(n, [&] (size_t) {
+            rpc::encode(message, bytes, sizeof(bytes), size, status);
+            gSink = gSink + size;
+        });
+        bench.record(name).add("path", codecPath<T>()).add("bytes", size_t(encodedSize))
+            .add("iterations", n).add("nsPerOp", ns);
+    }
+
+    name = "codec/decode/" + shape;
+    if (bench.wants(name)) {
+        T decoded;
+        auto ns = nsPerOp(n, [&] (size_t) {
+            rpc::decode(decoded, bytes, encodedSize, status);
+            gSink = gSink + uint64_t(status);
+        });
+        bench.record(name).add("path", codecPath<T>()).add("bytes", size_t(encodedSize))
+            .add("iterations", n).add("nsPerOp", ns);
+    }
+
+    name = "codec/encodeFire/" + shape;
+    if (bench.wants(name)) {
+        auto ns = nsPerOp(n, [&] (size_t i) {
+            rpc::encodeFire(uint32_t(i), message, 1000, bytes, sizeof(bytes), size, status);
+            gSink = gSink + size;
+        });
+        bench.record(name).add("path", codecPath<T>()).add("iterations", n).add("nsPerOp", ns);
+    }
+
+    if (!rpc::FixedLayout<T>::value) {
+        return;
+    }
+
+    rpc::_::encode(&message, rpc::_::pbFieldPtr<T>(), bytes, sizeof(bytes), size, status);
+    if (hasError(status)) {
+        bench.error("codec/" + shape + "/nanopb", "encoding failed");
+        return;
+    }
+    name = "codec/encode/" + shape + "/nanopb";
+    if (bench.wants(name)) {
+        auto ns = nsPerOp(n, [&] (size_t) {
+            rpc::_::encode(&message, rpc::_::pbFieldPtr<T>(), bytes, sizeof(bytes), size, status);
+            gSink = gSink + size;
+        });
+        bench.record(name).add("path", "nanopb").add("bytes", size_t(encodedSize))
+            .add("iterations", n).add("nsPerOp", ns);
+    }
+
+    name = "codec/decode/" + shape + "/nanopb";
+    if (bench.wants(name)) {
+        T decoded;
+        auto ns = nsPerOp(n, [&] (size_t) {
+            rpc::_::decode(&decoded, rpc::_::pbFieldPtr<T>(), bytes, encodedSize, status);
+            gSink = gSink + uint64_t(status);
+        });
+        bench.record(name).add("path", "nanopb").add("bytes", size_t(encodedSize))
+            .add("iterations", n).add("nsPerOp", ns);
+    }
+}
+
+void benchCodecs (Bench& bench) {
+    MethodIn::empty empty;
+    memset(&empty, 0, sizeof(empty));
+    benchCodec(bench, "empty", empty);
+
+    benchCodec(bench, "scalar", MethodIn::scalar{3.14159f});
+
+    MethodIn::wide wide;
+    memset(&wide, 0, sizeof(wide));
+    wide.a = 300;
+    wide.b = -2;
+    wide.c = -70000;
+    wide.d = 2.5f;
+    wide.e = 0xdeadbeef;
+    wide.f = true;
+    wide.g = uint64_t(1) << 40;
+    wide.h = -1;
+    benchCodec(bench, "wide", wide);
+
+    MethodIn::sparse sparse;
+    memset(&sparse, 0, sizeof(sparse));
+    sparse.has_value = true;
+    sparse.value = 1.5f;
+    benchCodec(bench, "sparse", sparse);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Dispatch
+
+// Implements every method of the dispatch interfaces, which all share the same
+// In and Result layout.
+struct DispatchServer {
+    template <class In>
+    typename rpc::ResultOf<In>::type onFire (In args) {
+        typename rpc::ResultOf<In>::type result;
+        result.value = args.value + 1;
+        return result;
+    }
+};
+
+// The runtime equivalent of rpc::hash.
+uint32_t componentIdOf (const std::string& name) {
+    uint32_t h = 0;
+    for (auto c : name) {
+        h = h * 101 + uint32_t(c);
+    }
+    return h;
+}
+
+// Decode, call onFire and encode the result for each method of the interface
+// in turn, as a server does for a FIRE request. The definition names how the
+// interface was defined: by ribbon-bridge-generator.py, or by RPCDEF_HPP.
+template <class DispatchInterface>
+void benchDispatch (Bench& bench, const std::string& definition, size_t size) {
+    auto name = "dispatch/" + definition + "/" + std::to_string(size);
+    if (!bench.wants(name)) {
+        return;
+    }
+    std::vector<uint32_t> ids;
+    for (size_t i = 0; i < size; ++i) {
+        ids.push_back(componentIdOf("m" + std::to_string(i)));
+    }
+
+    barobo_rpc_Request_Fire_payload_t in;
+    auto status = rpc::Status::OK;
+    rpc::encode(typename rpc::MethodIn<DispatchInterface>::m0{41},
+        in.bytes, sizeof(in.bytes), in.size, status);
+    if (hasError(status)) {
+        bench.error(name, "encoding failed");
+        return;
+    }
+
+    DispatchServer server;
+    barobo_rpc_Reply_Result_payload_t out;
+    rpc::MethodInUnion<DispatchInterface> methods;
+    methods.invoke(server, ids.back(), in, out, status);
+    if (hasError(status)) {
+        bench.error(name, "dispatch failed");
+        return;
+    }
+
+    auto n = bench.iterations(2000000);
+    auto ns = nsPerOp(n, [&] (size_t i) {
+        methods.invoke(server, ids[i % size], in, out, status);
+        gSink = gSink + out.size;
+    });
+    auto missNs = nsPerOp(n, [&] (size_t i) {
+        methods.invoke(server, uint32_t(i) | 1, in, out, status);
+        gSink = gSink + uint64_t(status);
+    });
+    bench.record(name).add("definition", definition).add("methods", size).add("iterations", n)
+        .add("nsPerOp", ns).add("unknownIdNsPerOp", missNs);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Round trips
+
+struct BenchServer {
+    MethodResult::empty onFire (MethodIn::empty) {
+        MethodResult::empty result;
+        memset(&result, 0, sizeof(result));
+        return result;
+    }
+
+    MethodResult::scalar onFire (MethodIn::scalar args) {
+        return MethodResult::scalar{args.value};
+    }
+
+    MethodResult::wide onFire (MethodIn::wide args) {
+        return MethodResult::wide{args.a};
+    }
+
+    MethodResult::sparse onFire (MethodIn::sparse args) {
+        MethodResult::sparse result;
+        memset(&result, 0, sizeof(result));
+        result.has_value = args.has_value;
+        result.value = args.value;
+        return result;
+    }
+};
+
+struct BenchClient {
+    void onBroadcast (Broadcast::tick) {
+        ++received;
+    }
+
+    size_t received = 0;
+};
+
+const auto kTimeout = std::chrono::seconds(5);
+
+// Fire scalar requests one after another, each as soon as the last one
+// completes, and time each one. The client's io_service must be run to
+// completion afterwards.
+template <class C>
+void fireSequentially (C& client, size_t n, std::vector<double>& samples,
+        boost::system::error_code& error, std::function<void()> done) {
+    if (samples.size() == n) {
+        done();
+        return;
+    }
+    auto start = Clock::now();
+    rpc::asio::asyncFire(client, MethodIn::scalar{float(samples.size())}, kTimeout,
+        [&client, n, &samples, &error, done, start]
+                (boost::system::error_code ec, MethodResult::scalar) {
+            if (ec) {
+                error = ec;
+                done();
+                return;
+            }
+            samples.push_back(std::chrono::duration<double, std::micro>(
+                Clock::now() - start).count());
+            fireSequentially(client, n, samples, error, done);
+        });
+}
+
+void benchLocalRoundTrips (Bench& bench) {
+    const std::string name = "roundtrip/local";
+    if (!bench.wants(name)) {
+        return;
+    }
+    boost::asio::io_service context;
+    BenchServer impl;
+    BenchClient clientImpl;
+    rpc::asio::LocalServer<Interface, BenchServer> server{context, impl};
+    rpc::asio::LocalClient<Interface, BenchServer> client{context, server};
+
+    auto n = bench.iterations(100000);
+    std::vector<double> samples;
+    samples.reserve(n);
+    boost::system::error_code error;
+    rpc::asio::asyncRunClient<Interface>(client, clientImpl, [] (boost::system::error_code) {});
+    rpc::asio::asyncConnect<Interface>(client, kTimeout, [&] (boost::system::error_code ec) {
+        if (ec) {
+            error = ec;
+            return;
+        }
+        fireSequentially(client, n, samples, error, [&] {
+            boost::system::error_code ignored;
+            client.close(ignored);
+        });
+    });
+    context.run();
+    if (error || samples.size() != n) {
+        bench.error(name, error ? error.message() : "round trips did not complete");
+        return;
+    }
+    auto& result = bench.record(name).add("transport", "local").add("method", "scalar");
+    addPercentiles(result, samples);
+}
+
+// Run a Server<MessageQueue> on its own thread, and fire requests at it from a
+// Client<MessageQueue> on this one. connect(server, client, error) must leave
+// both message queues ready to use.
+template <class MessageQueue, class Connect>
+void benchWireRoundTrips (Bench& bench, const std::string& transport, Connect&& connect) {
+    const auto name = "roundtrip/" + transport;
+    if (!bench.wants(name)) {
+        return;
+    }
+    boost::asio::io_service serverContext;
+    boost::asio::io_service clientContext;
+    rpc::asio::Server<MessageQueue> server{serverContext};
+    rpc::asio::Client<MessageQueue> client{clientContext};
+
+    boost::system::error_code error;
+    connect(server, client, error);
+    if (error) {
+        bench.error(name, error.message());
+        return;
+    }
+
+    BenchServer impl;
+    rpc::asio::asyncRunServer<Interface>(server, impl, [] (boost::system::error_code) {});
+    boost::asio::io_service::work work{serverContext};
+    std::thread serverThread{[&serverContext] { serverContext.run(); }};
+
+    auto n = bench.iterations(20000);
+    std::vector<double> samples;
+    samples.reserve(n);
+    rpc::asio::asyncConnect<Interface>(client, kTimeout, [&] (boost::system::error_code ec) {
+        if (ec) {
+            error = ec;
+            return;
+        }
+        fireSequentially(client, n, samples, error, [&] {
+            rpc::asio::asyncDisconnect(client, kTimeout, [&] (boost::system::error_code) {
+                boost::system::error_code ignored;
+                client.messageQueue().close(ignored);
+            });
+        });
+    });
+    clientContext.run();
+
+    serverContext.post([&server, &serverContext] {
+        boost::system::error_code ignored;
+        server.close(ignored);
+        serverContext.stop();
+    });
+    serverThread.join();
+
+    if (error || samples.size() != n) {
+        bench.error(name, error ? error.message() : "round trips did not complete");
+        return;
+    }
+    auto& result = bench.record(name).add("transport", transport).add("method", "scalar");
+    addPercentiles(result, samples);
+}
+
+void benchRoundTrips (Bench& bench) {
+    benchLocalRoundTrips(bench);
+
+#ifdef __linux__
+    using Shm = rpc::asio::ShmMessageQueue;
+    auto path = "/dev/shm/rpc-bench-" + std::to_string(getpid());
+    benchWireRoundTrips<Shm>(bench, "shm",
+        [&path] (rpc::asio::Server<Shm>& server, rpc::asio::Client<Shm>& client,
+                boost::system::error_code& ec) {
+            server.messageQueue().create(path, ec);
+            if (!ec) {
+                client.messageQueue().open(path, ec);
+            }
+            ::unlink(path.c_str());
+        });
+#endif
+
+#ifdef RPC_BENCH_HAVE_SFP
+    using Tcp = boost::asio::ip::tcp;
+    using TcpQueue = sfp::asio::MessageQueue<Tcp::socket>;
+    benchWireRoundTrips<TcpQueue>(bench, "tcp",
+        [] (rpc::asio::Server<TcpQueue>& server, rpc::asio::Client<TcpQueue>& client,
+                boost::system::error_code& ec) {
+            auto& context = client.get_io_service();
+            Tcp::acceptor acceptor{context, Tcp::endpoint{boost::asio::ip::address_v4::loopback(), 0}};
+            acceptor.async_accept(server.messageQueue().stream(), [&] (boost::system::error_code e) {
+                if (e) { ec = e; }
+            });
+            client.messageQueue().stream().async_connect(acceptor.local_endpoint(),
+                [&] (boost::system::error_code e) {
+                    if (e) { ec = e; }
+                });
+            context.run();
+            context.reset();
+            if (ec) {
+                return;
+            }
+            server.messageQueue().stream().set_option(Tcp::no_delay{true});
+            client.messageQueue().stream().set_option(Tcp::no_delay{true});
+
+            // The server's queue is bound to its own io_service, which isn't
+            // running yet, so run both to get through the handshake.
+            auto& serverContext = server.get_io_service();
+            server.messageQueue().asyncHandshake([&] (boost::system::error_code e) {
+                if (e) { ec = e; }
+            });
+            client.messageQueue().asyncHandshake([&] (boost::system::error_code e) {
+                if (e) { ec = e; }
+            });
+            std::thread serverThread{[&serverContext] { serverContext.run(); }};
+            context.run();
+            serverThread.join();
+            context.reset();
+            serverContext.reset();
+        });
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Broadcast fan-out
+
+// Broadcast to some number of in-process clients, and measure how many
+// deliveries per second they get.
+void benchFanOut (Bench& bench, size_t clients) {
+    const auto name = "fanout/local/" + std::to_string(clients);
+    if (!bench.wants(name)) {
+        return;
+    }
+    boost::asio::io_service context;
+    BenchServer impl;
+    rpc::asio::LocalServer<Interface, BenchServer> server{context, impl};
+
+    using Client = rpc::asio::LocalClient<Interface, BenchServer>;
+    std::vector<std::unique_ptr<Client>> connections;
+    std::vector<BenchClient> clientImpls(clients);
+    for (size_t i = 0; i < clients; ++i) {
+        connections.emplace_back(new Client{context, server});
+        rpc::asio::asyncRunClient<Interface>(*connections.back(), clientImpls[i],
+            [] (boost::system::error_code) {});
+        rpc::asio::asyncConnect<Interface>(*connections.back(), kTimeout,
+            [] (boost::system::error_code) {});
+    }
+    context.run();
+    context.reset();
+
+    auto broadcasts = std::max(size_t(1), bench.iterations(1 << 20) / clients);
+    auto start = Clock::now();
+    for (size_t i = 0; i < broadcasts; ++i) {
+        rpc::asio::asyncBroadcast(server, Broadcast::tick{uint32_t(i), 1.0f},
+            [] (boost::system::error_code) {});
+    }
+    context.run();
+    auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    context.reset();
+
+    size_t delivered = 0;
+    for (auto& clientImpl : clientImpls) {
+        delivered += clientImpl.received;
+    }
+    for (auto& connection : connections) {
+        boost::system::error_code ignored;
+        connection->close(ignored);
+    }
+    context.run();
+
+    bench.record(name).add("transport", "local").add("clients", clients)
+        .add("broadcasts", broadcasts).add("delivered", delivered)
+        .add("deliveriesPerSecond", double(delivered) / seconds);
+}
+
+bool parseOptions (int argc, char** argv, Options& options) {
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 < argc && "--output" == arg) {
+            options.output = argv[++i];
+        }
+        else if (i + 1 < argc && "--scale" == arg) {
+            options.scale = std::atof(argv[++i]);
+            if (!(options.scale > 0)) {
+                return false;
+            }
+        }
+        else if (i + 1 < argc && "--filter" == arg) {
+            options.filter = argv[++i];
+        }
+        else {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+int main (int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        std::cerr << "usage: " << argv[0]
+                  << " [--output <file>] [--scale <factor>] [--filter <substring>]\n";
+        return 2;
+    }
+
+    // Unless NDEBUG is defined, the asio code logs every request (see
+    // rpc/asio/log.hpp), which would swamp what we measure.
+    boost::log::core::get()->set_logging_enabled(false);
+
+    Bench bench{options};
+    benchCodecs(bench);
+    benchDispatch<bench::Dispatch1>(bench, "generator", 1);
+    benchDispatch<bench::Dispatch8>(bench, "generator", 8);
+    benchDispatch<bench::Dispatch64>(bench, "generator", 64);
+    benchDispatch<bench::MacroDispatch1>(bench, "rpcdef", 1);
+    benchDispatch<bench::MacroDispatch8>(bench, "rpcdef", 8);
+    benchDispatch<bench::MacroDispatch64>(bench, "rpcdef", 64);
+    benchRoundTrips(bench);
+    for (auto clients : { 1, 8, 64 }) {
+        benchFanOut(bench, size_t(clients));
+    }
+
+    if (options.output.empty()) {
+        bench.write(std::cout);
+    }
+    else {
+        std::ofstream file{options.output};
+        bench.write(file);
+        if (!file) {
+            std::cerr << "could not write " << options.output << "\n";
+            return 1;
+        }
+    }
+}
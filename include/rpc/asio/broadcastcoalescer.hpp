@@ -0,0 +1,193 @@
+#ifndef RPC_ASIO_BROADCASTCOALESCER_HPP
+#define RPC_ASIO_BROADCASTCOALESCER_HPP
+
+#include "rpc.pb.h"
+
+#include <rpc/asio/bufferpool.hpp>
+
+#include <rpc/componenttraits.hpp>
+#include <rpc/message.hpp>
+#include <rpc/subscriptions.hpp>
+
+#include <util/log.hpp>
+
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+
+namespace rpc {
+namespace asio {
+
+// An optional stage in front of an rpc::asio::Server for broadcasts which may
+// be produced faster than the transport can send them. Post broadcasts to it
+// instead of calling asyncBroadcast. At most one broadcast per component is
+// pending at a time: posting a newer one replaces it. Pending broadcasts go
+// out one at a time, through Server::asyncSendMessage, whenever the server's
+// previous send of any kind completes (see Server::setWritableHandler), and no
+// more often than their component's minimum interval.
+//
+// Create it with std::make_shared. The first post() takes the server's
+// writable handler, so a server can have only one coalescer. The coalescer
+// keeps itself alive while a send is in flight or a rate limit is being
+// waited out; call close() before closing the server to drop whatever is
+// pending. Like the Server, it must only be used from its io_service's thread.
+template <class S>
+class BroadcastCoalescer : public std::enable_shared_from_this<BroadcastCoalescer<S>> {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit BroadcastCoalescer (S& server)
+        : mServer(server)
+        , mTimer(server.get_io_service())
+    {}
+
+    // Send Broadcast at most once per interval. Zero, the default, means no
+    // limit other than the transport's.
+    template <class Broadcast>
+    void setMinimumInterval (Clock::duration interval) {
+        mEntries[componentId(Broadcast{})].interval = interval;
+    }
+
+    // Queue a broadcast for sending, replacing any pending broadcast of the
+    // same component. Broadcasts the client is not subscribed to are dropped.
+    template <class Broadcast>
+    Status post (const Broadcast& args) {
+        if (!isSubscribed<Broadcast>(mServer.subscriptions())) {
+            return Status::OK;
+        }
+        attach();
+
+        auto id = componentId(args);
+        auto& entry = mEntries[id];
+        auto size = MaxBroadcastMessageSize<MaxEncodedSize<Broadcast>::value>::value;
+        if (!entry.buffer) {
+            entry.buffer = mServer.bufferPool().acquire(size);
+        }
+        entry.buffer->bytes.resize(size);
+
+        pb_size_t bytesWritten;
+        Status status;
+        encodeBroadcast(args, entry.buffer->bytes.data(), entry.buffer->bytes.size(),
+            bytesWritten, status);
+        if (hasError(status)) {
+            if (entry.pending) {
+                entry.pending = false;
+                mQueue.erase(std::find(mQueue.begin(), mQueue.end(), id));
+            }
+            return status;
+        }
+        entry.buffer->bytes.resize(bytesWritten);
+
+        if (!entry.pending) {
+            entry.pending = true;
+            mQueue.push_back(id);
+        }
+        flush();
+        return Status::OK;
+    }
+
+    // Drop any pending broadcasts, stop waiting out rate limits, and give the
+    // server its writable handler back. A send already in flight still
+    // completes. Posting again starts over.
+    void close () {
+        boost::system::error_code ec;
+        mTimer.cancel(ec);
+        for (auto id : mQueue) {
+            mEntries[id].pending = false;
+        }
+        mQueue.clear();
+        if (mAttached) {
+            mAttached = false;
+            mServer.setWritableHandler(nullptr);
+        }
+    }
+
+private:
+    struct Entry {
+        // The pending broadcast, or when none is pending, a spare buffer.
+        BufferPtr buffer;
+        bool pending = false;
+        Clock::duration interval = Clock::duration::zero();
+        Clock::time_point lastSent = Clock::time_point::min();
+    };
+
+    void attach () {
+        if (mAttached) {
+            return;
+        }
+        mAttached = true;
+        std::weak_ptr<BroadcastCoalescer> weak = this->shared_from_this();
+        mServer.setWritableHandler([weak] {
+            if (auto self = weak.lock()) {
+                self->flush();
+            }
+        });
+    }
+
+    // Send the oldest pending broadcast whose minimum interval has passed. If
+    // they are all rate limited, try again when the first one may go.
+    void flush () {
+        if (mSending || mQueue.empty()) {
+            return;
+        }
+
+        auto now = Clock::now();
+        auto earliest = Clock::time_point::max();
+        for (auto iter = mQueue.begin(); iter != mQueue.end(); ++iter) {
+            auto id = *iter;
+            auto& entry = mEntries[id];
+            auto due = entry.lastSent + entry.interval;
+            if (due <= now) {
+                mQueue.erase(iter);
+                send(id, entry, now);
+                return;
+            }
+            earliest = std::min(earliest, due);
+        }
+
+        auto self = this->shared_from_this();
+        mTimer.expires_at(earliest);
+        mTimer.async_wait([self, this] (boost::system::error_code ec) {
+            if (!ec) {
+                flush();
+            }
+        });
+    }
+
+    void send (uint32_t id, Entry& entry, Clock::time_point now) {
+        entry.pending = false;
+        entry.lastSent = now;
+        mSending = true;
+
+        auto buf = std::move(entry.buffer);
+        auto self = this->shared_from_this();
+        mServer.asyncSendMessage(buf, [self, this, id, buf] (boost::system::error_code ec) {
+            mSending = false;
+            auto& entry = mEntries[id];
+            if (!entry.buffer) {
+                entry.buffer = buf;
+            }
+            // On success, the server's writable handler flushes next. On
+            // failure, anything pending is left until the next post.
+            if (ec) {
+                BOOST_LOG(mServer.log()) << "BroadcastCoalescer: " << ec.message();
+            }
+        });
+    }
+
+    S& mServer;
+    boost::asio::steady_timer mTimer;
+
+    std::map<uint32_t, Entry> mEntries;
+    std::deque<uint32_t> mQueue;
+    bool mSending = false;
+    bool mAttached = false;
+};
+
+}} // namespace rpc::asio
+
+#endif
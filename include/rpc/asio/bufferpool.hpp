@@ -0,0 +1,133 @@
+#ifndef RPC_ASIO_BUFFERPOOL_HPP
+#define RPC_ASIO_BUFFERPOOL_HPP
+
+#include <boost/intrusive_ptr.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace rpc {
+namespace asio {
+
+class BufferPool;
+
+// A message buffer drawn from a BufferPool. It goes back to the pool, keeping
+// its capacity, when the last BufferPtr to it is destroyed.
+class PooledBuffer {
+public:
+    std::vector<uint8_t> bytes;
+
+private:
+    friend class BufferPool;
+    friend void intrusive_ptr_add_ref (PooledBuffer* p);
+    friend void intrusive_ptr_release (PooledBuffer* p);
+
+    std::atomic<size_t> mRefs = { 0 };
+    std::shared_ptr<BufferPool> mPool;
+};
+
+// Copying a BufferPtr costs an atomic increment, and no allocation, so it can
+// be captured in completion handlers just like a shared_ptr.
+using BufferPtr = boost::intrusive_ptr<PooledBuffer>;
+
+// A pool of message buffers for one connection's sends and receives. Buffers
+// may be acquired and released from any thread: the pool is a fixed array of
+// slots, each holding a free buffer or nothing, and taking or returning a
+// buffer is a single atomic exchange on one of them. When every slot is empty
+// acquire() allocates a new buffer (a miss), and when every slot is full a
+// released buffer is deleted (a drop).
+//
+// Create it with std::make_shared, as every outstanding buffer keeps its pool
+// alive.
+class BufferPool : public std::enable_shared_from_this<BufferPool> {
+public:
+    static const size_t kCapacity = 32;
+
+    BufferPool () {
+        for (auto& slot : mSlots) {
+            slot.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    BufferPool (const BufferPool&) = delete;
+    BufferPool& operator= (const BufferPool&) = delete;
+
+    ~BufferPool () {
+        for (auto& slot : mSlots) {
+            delete slot.load(std::memory_order_acquire);
+        }
+    }
+
+    // A buffer of the given size. Its contents are unspecified.
+    BufferPtr acquire (size_t size) {
+        PooledBuffer* buffer = nullptr;
+        for (auto& slot : mSlots) {
+            if (slot.load(std::memory_order_relaxed)) {
+                buffer = slot.exchange(nullptr, std::memory_order_acquire);
+                if (buffer) {
+                    break;
+                }
+            }
+        }
+        if (buffer) {
+            mHits.fetch_add(1, std::memory_order_relaxed);
+        }
+        else {
+            mMisses.fetch_add(1, std::memory_order_relaxed);
+            buffer = new PooledBuffer;
+        }
+        buffer->bytes.resize(size);
+        buffer->mPool = shared_from_this();
+        return BufferPtr(buffer);
+    }
+
+    // Buffers handed out from a free slot.
+    uint64_t hits () const { return mHits.load(std::memory_order_relaxed); }
+    // Buffers which had to be allocated.
+    uint64_t misses () const { return mMisses.load(std::memory_order_relaxed); }
+    // Buffers deleted on release because the pool was full.
+    uint64_t drops () const { return mDrops.load(std::memory_order_relaxed); }
+
+private:
+    friend void intrusive_ptr_release (PooledBuffer* p);
+
+    void release (PooledBuffer* buffer) {
+        for (auto& slot : mSlots) {
+            if (!slot.load(std::memory_order_relaxed)) {
+                PooledBuffer* expected = nullptr;
+                if (slot.compare_exchange_strong(expected, buffer,
+                        std::memory_order_release, std::memory_order_relaxed)) {
+                    return;
+                }
+            }
+        }
+        mDrops.fetch_add(1, std::memory_order_relaxed);
+        delete buffer;
+    }
+
+    std::atomic<PooledBuffer*> mSlots[kCapacity];
+    std::atomic<uint64_t> mHits = { 0 };
+    std::atomic<uint64_t> mMisses = { 0 };
+    std::atomic<uint64_t> mDrops = { 0 };
+};
+
+inline void intrusive_ptr_add_ref (PooledBuffer* p) {
+    p->mRefs.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void intrusive_ptr_release (PooledBuffer* p) {
+    if (1 == p->mRefs.fetch_sub(1, std::memory_order_acq_rel)) {
+        // Hold on to the pool until the buffer is back in it: this may be the
+        // last reference.
+        auto pool = std::move(p->mPool);
+        pool->release(p);
+    }
+}
+
+}} // namespace rpc::asio
+
+#endif
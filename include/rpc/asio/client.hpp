@@ -7,7 +7,14 @@
 #include <util/asio/transparentservice.hpp>
 #include <util/producerconsumerqueue.hpp>
 
+#include <rpc/asio/bufferpool.hpp>
+#include <rpc/asio/log.hpp>
+#include <rpc/asio/metrics.hpp>
+#include <rpc/asio/replytable.hpp>
+#include <rpc/asio/timerwheel.hpp>
+
 #include <rpc/componenttraits.hpp>
+#include <rpc/enableif.hpp>
 #include <rpc/message.hpp>
 #include <rpc/system_error.hpp>
 #include <rpc/version.hpp>
@@ -21,11 +28,16 @@
 
 #include <boost/optional.hpp>
 
+#include <algorithm>
 #include <atomic>
-#include <map>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <memory>
 #include <queue>
 #include <utility>
+#include <vector>
 
 #include <boost/asio/yield.hpp>
 
@@ -33,12 +45,52 @@ namespace rpc { namespace asio {
 
 using namespace std::placeholders;
 
+// The timeout to send with a request whose reply is awaited for another
+// remaining. Milliseconds are rounded up, so the server never gives up before
+// the client does.
+template <class Duration>
+uint32_t requestTimeout (Duration remaining) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(remaining);
+    if (ms < remaining) {
+        ++ms;
+    }
+    return uint32_t(std::min<int64_t>(std::max<int64_t>(ms.count(), 1), UINT32_MAX));
+}
+
+// The reply to a FIRE request, decoded all but its RESULT payload, which is
+// left in the frame that carried it for the method's result struct to be
+// decoded from directly.
+struct FireReply {
+    barobo_rpc_Reply reply;
+    PayloadView payload;
+    BufferPtr frame;
+};
+
 template <class MessageQueue>
 struct ClientImpl : public std::enable_shared_from_this<ClientImpl<MessageQueue>> {
     using RequestId = uint32_t;
 
+    using Clock = std::chrono::steady_clock;
+    using Tick = std::chrono::milliseconds;
+    using ReplyHandler = std::function<void(boost::system::error_code,
+        boost::optional<barobo_rpc_Reply>)>;
+    using FrameHandler = std::function<void(boost::system::error_code, BufferPtr)>;
+    // If frameHandler is set, a reply goes to it undecoded. Failures always
+    // go to handler. Only a FIRE request is worth cancelling, as only a FIRE
+    // request's reply may be deferred.
+    struct PendingReply {
+        uint64_t deadline = 0;
+        ReplyHandler handler;
+        FrameHandler frameHandler;
+        bool fire = false;
+    };
+
     explicit ClientImpl (boost::asio::io_service& context)
         : mMessageQueue(context)
+        , mBufferPool(std::make_shared<BufferPool>())
+        , mMetrics(std::make_shared<Metrics>())
+        , mTimer(context)
+        , mEpoch(Clock::now())
     {
         mLog.add_attribute("Protocol", boost::log::attributes::constant<std::string>("RB-CL"));
     }
@@ -65,43 +117,232 @@ struct ClientImpl : public std::enable_shared_from_this<ClientImpl<MessageQueue>
         return mLog;
     }
 
+    // Every message the client sends or receives is in a buffer from here.
+    BufferPool& bufferPool () {
+        return *mBufferPool;
+    }
+
+    // The connection's traffic, and how long each method's replies take to
+    // arrive. See rpc/asio/metrics.hpp.
+    Metrics& metrics () {
+        return *mMetrics;
+    }
+    const Metrics& metrics () const {
+        return *mMetrics;
+    }
+
+    // Flow control: at most requestWindow() requests may be outstanding at
+    // once, counting from when they are sent until their reply arrives or
+    // times out. Further requests wait their turn in FIFO order. Zero, the
+    // default, means no limit. Time spent waiting counts against a request's
+    // timeout, and a request which times out while waiting is never sent.
+    size_t requestWindow () const {
+        return mRequestWindow;
+    }
+
+    void setRequestWindow (size_t window) {
+        mRequestWindow = window;
+        admitWaitingRequests();
+    }
+
+    struct FlowControlStats {
+        size_t window;
+        size_t outstanding;
+        size_t queueDepth;
+        size_t maxQueueDepth;
+        // Requests which had to wait for a slot, and how long they waited.
+        uint64_t queuedRequests;
+        std::chrono::steady_clock::duration totalWait;
+        std::chrono::steady_clock::duration maxWait;
+    };
+
+    FlowControlStats flowControlStats () const {
+        auto stats = mFlowControlStats;
+        stats.window = mRequestWindow;
+        stats.outstanding = mOutstandingRequests;
+        stats.queueDepth = mWaitingRequests.size();
+        return stats;
+    }
+
+    // Complete when the request window has room for another request. The
+    // slot must be given back with releaseRequestSlot().
+    template <class CompletionToken>
+    BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
+    asyncAcquireRequestSlot (CompletionToken&& token) {
+        return asyncAcquireRequestSlots(1, std::forward<CompletionToken>(token));
+    }
+
+    // As above, for n requests at once, such as those of a batch. If n is
+    // more than the whole window, complete once no other requests are
+    // outstanding. Each slot must be given back with releaseRequestSlot().
+    template <class CompletionToken>
+    BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
+    asyncAcquireRequestSlots (size_t n, CompletionToken&& token) {
+        util::asio::AsyncCompletion<
+            CompletionToken, void(boost::system::error_code)
+        > init { std::forward<CompletionToken>(token) };
+        auto& realHandler = init.handler;
+
+        if (mWaitingRequests.empty() && windowHasRoom(n)) {
+            mOutstandingRequests += n;
+            mMessageQueue.get_io_service().post(
+                std::bind(realHandler, boost::system::error_code()));
+        }
+        else {
+            mWaitingRequests.push_back(WaitingRequest{realHandler, Clock::now(), n});
+            auto& stats = mFlowControlStats;
+            stats.maxQueueDepth = std::max(stats.maxQueueDepth, mWaitingRequests.size());
+        }
+
+        return init.result.get();
+    }
+
+    void releaseRequestSlot () {
+        assert(mOutstandingRequests);
+        --mOutstandingRequests;
+        admitWaitingRequests();
+    }
+
     struct SendRequestOperation;
 
+    // Send a buffer containing an already-encoded barobo_rpc_ClientMessage.
     template <class CompletionToken>
     BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
-    asyncSendRequest (RequestId requestId, barobo_rpc_Request request, CompletionToken&& token) {
+    asyncSendMessage (BufferPtr buf, CompletionToken&& token) {
+        util::asio::AsyncCompletion<
+            CompletionToken, void(boost::system::error_code)
+        > init { std::forward<CompletionToken>(token) };
+        auto& realHandler = init.handler;
+
+        mMessageQueue.asyncSend(boost::asio::buffer(buf->bytes),
+            [buf, realHandler, metrics=mMetrics] (boost::system::error_code ec) mutable {
+                if (!ec) {
+                    metrics->addBytesOut(buf->bytes.size());
+                }
+                realHandler(ec);
+            });
+
+        return init.result.get();
+    }
+
+    // Request may be a barobo_rpc_Request, or a method input struct, in which
+    // case a FIRE request is encoded directly from it. The timeout, in
+    // milliseconds, tells the server how much longer we will wait for the
+    // reply (see requestTimeout); with kNoTimeout, a barobo_rpc_Request is
+    // sent with whatever timeout it already has.
+    template <class Request, class CompletionToken>
+    BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
+    asyncSendRequest (RequestId requestId, const Request& request, uint32_t timeout,
+            CompletionToken&& token) {
         util::asio::AsyncCompletion<
             CompletionToken, void(boost::system::error_code)
         > init { std::forward<CompletionToken>(token) };
 
         using Op = SendRequestOperation;
         util::asio::v1::makeOperation<Op>(std::move(init.handler),
-            this->shared_from_this(), requestId, request)();
+            this->shared_from_this(), requestId, request, timeout)();
 
         return init.result.get();
     }
 
+    template <class Request, class CompletionToken>
+    BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
+    asyncSendRequest (RequestId requestId, const Request& request, CompletionToken&& token) {
+        return asyncSendRequest(requestId, request, kNoTimeout,
+            std::forward<CompletionToken>(token));
+    }
+
+    // Wait for the reply to a request of the given type. If it is a FIRE
+    // request, and the reply times out or is cancelled, the server is told to
+    // drop the request.
     template <class Duration, class CompletionToken>
     BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken,
         void(boost::system::error_code, boost::optional<barobo_rpc_Reply>))
-    asyncReceiveReply (RequestId requestId, Duration&& timeout, CompletionToken&& token) {
+    asyncReceiveReply (RequestId requestId, barobo_rpc_Request_Type type,
+            Duration&& timeout, CompletionToken&& token) {
         util::asio::AsyncCompletion<
             CompletionToken, void(boost::system::error_code, boost::optional<barobo_rpc_Reply>)
         > init { std::forward<CompletionToken>(token) };
 
-        bool success;
-        typename decltype(mReplyMap)::iterator iter;
-        auto&& replyElement = std::make_pair(requestId, TimedReply(mMessageQueue.get_io_service()));
-        std::tie(iter, success) = mReplyMap.insert(
-            std::make_pair(requestId, TimedReply{mMessageQueue.get_io_service()}));
-        assert(success);
+        addPendingReply(requestId, Clock::now() + timeout,
+            PendingReply{0, std::move(init.handler), nullptr,
+                barobo_rpc_Request_Type_FIRE == type});
 
-        auto self = this->shared_from_this();
-        iter->second.timer->expires_from_now(timeout);
-        iter->second.timer->async_wait(
-            std::bind(&ClientImpl::handleReply, self, requestId, _1, boost::none));
-        iter->second.queue.consume(std::move(init.handler));
-        startReceivePump();
+        return init.result.get();
+    }
+
+    // As above, for a request which is never cancelled.
+    template <class Duration, class CompletionToken>
+    BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken,
+        void(boost::system::error_code, boost::optional<barobo_rpc_Reply>))
+    asyncReceiveReply (RequestId requestId, Duration&& timeout, CompletionToken&& token) {
+        return asyncReceiveReply(requestId, barobo_rpc_Request_Type_CONNECT,
+            std::forward<Duration>(timeout), std::forward<CompletionToken>(token));
+    }
+
+    // As asyncReceiveReply, but the reply is not decoded: the handler gets
+    // the encoded barobo_rpc_ServerMessage, or a null buffer if it timed out.
+    // For proxies, which need only rewrite its inReplyTo.
+    template <class Duration, class CompletionToken>
+    BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code, BufferPtr))
+    asyncReceiveReplyFrame (RequestId requestId, barobo_rpc_Request_Type type,
+            Duration&& timeout, CompletionToken&& token) {
+        util::asio::AsyncCompletion<
+            CompletionToken, void(boost::system::error_code, BufferPtr)
+        > init { std::forward<CompletionToken>(token) };
+
+        FrameHandler frameHandler = std::move(init.handler);
+        auto handler = [frameHandler] (boost::system::error_code ec,
+                boost::optional<barobo_rpc_Reply>) {
+            frameHandler(ec, nullptr);
+        };
+        addPendingReply(requestId, Clock::now() + timeout,
+            PendingReply{0, std::move(handler), frameHandler,
+                barobo_rpc_Request_Type_FIRE == type});
+
+        return init.result.get();
+    }
+
+    // As asyncReceiveReply for a FIRE request, but the RESULT payload is not
+    // copied out of the frame; see FireReply. The reply is boost::none if it
+    // timed out.
+    template <class Duration, class CompletionToken>
+    BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken,
+        void(boost::system::error_code, boost::optional<FireReply>))
+    asyncReceiveFireReply (RequestId requestId, Duration&& timeout, CompletionToken&& token) {
+        util::asio::AsyncCompletion<
+            CompletionToken, void(boost::system::error_code, boost::optional<FireReply>)
+        > init { std::forward<CompletionToken>(token) };
+
+        std::function<void(boost::system::error_code, boost::optional<FireReply>)>
+            fireHandler = std::move(init.handler);
+        auto frameHandler = [fireHandler] (boost::system::error_code ec, BufferPtr frame) {
+            if (ec || !frame) {
+                fireHandler(ec, boost::none);
+                return;
+            }
+            barobo_rpc_ServerMessage message;
+            FireReply reply;
+            Status status;
+            decode(message, reply.payload, frame->bytes.data(), frame->bytes.size(), status);
+            if (hasError(status)) {
+                fireHandler(status, boost::none);
+            }
+            else if (barobo_rpc_ServerMessage_Type_REPLY != message.type || !message.has_reply) {
+                fireHandler(Status::PROTOCOL_ERROR, boost::none);
+            }
+            else {
+                reply.reply = message.reply;
+                reply.frame = std::move(frame);
+                fireHandler(boost::system::error_code(), reply);
+            }
+        };
+        auto handler = [fireHandler] (boost::system::error_code ec,
+                boost::optional<barobo_rpc_Reply>) {
+            fireHandler(ec, boost::none);
+        };
+        addPendingReply(requestId, Clock::now() + timeout,
+            PendingReply{0, std::move(handler), std::move(frameHandler), true});
 
         return init.result.get();
     }
@@ -119,14 +360,121 @@ struct ClientImpl : public std::enable_shared_from_this<ClientImpl<MessageQueue>
         return init.result.get();
     }
 
+    // As asyncReceiveBroadcast, but the broadcast is not decoded: the handler
+    // gets the encoded barobo_rpc_ServerMessage. Once this has been called,
+    // every broadcast is delivered this way rather than to
+    // asyncReceiveBroadcast.
+    template <class Handler>
+    BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code, BufferPtr))
+    asyncReceiveBroadcastFrame (Handler&& handler) {
+        util::asio::AsyncCompletion<
+            Handler, void(boost::system::error_code, BufferPtr)
+        > init { std::forward<Handler>(handler) };
+
+        mBroadcastFrames = true;
+        mBroadcastFrameQueue.consume(std::move(init.handler));
+        startReceivePump();
+
+        return init.result.get();
+    }
+
+    // Call the handler waiting for the reply to a request with an error, if it
+    // is still waiting: e.g., because the request could not be sent after
+    // all.
+    void abandonReply (RequestId requestId, boost::system::error_code ec) {
+        handleReply(requestId, ec, boost::none);
+    }
+
+    // Give up on the reply to a request: its handler is called with
+    // operation_aborted, and, if it was a FIRE request, the server is told to
+    // drop it.
+    void cancel (RequestId requestId) {
+        PendingReply pending;
+        if (mReplies.take(requestId, pending)) {
+            mMessageQueue.get_io_service().post(std::bind(std::move(pending.handler),
+                boost::system::error_code(boost::asio::error::operation_aborted), boost::none));
+            if (pending.fire) {
+                sendCancel(requestId);
+            }
+        }
+    }
+
+    // Give up on every outstanding reply, as above, and on every request
+    // still waiting for a slot in the request window.
+    void cancel () {
+        auto& ios = mMessageQueue.get_io_service();
+        boost::system::error_code ec = boost::asio::error::operation_aborted;
+        std::vector<RequestId> cancelled;
+        mReplies.drain([&] (RequestId requestId, PendingReply pending) {
+            ios.post(std::bind(std::move(pending.handler), ec, boost::none));
+            if (pending.fire) {
+                cancelled.push_back(requestId);
+            }
+        });
+        for (auto requestId : cancelled) {
+            sendCancel(requestId);
+        }
+        auto waiting = std::move(mWaitingRequests);
+        mWaitingRequests.clear();
+        for (auto& request : waiting) {
+            ios.post(std::bind(std::move(request.handler), ec));
+        }
+    }
+
+    void addPendingReply (RequestId requestId, Clock::time_point deadline,
+            PendingReply pending) {
+        // Bring the wheel up to date first, so the deadline is filed
+        // relative to the present.
+        expireReplies();
+        pending.deadline = mTimerWheel.insert(requestId, ticksAt(deadline));
+        auto success = mReplies.insert(requestId, std::move(pending));
+        assert(success);
+        (void)success;
+
+        armTimer();
+        startReceivePump();
+    }
+
+    // Hand over a reply, or a broadcast, undecoded if that is how it is
+    // wanted. Return false if it should be decoded after all.
+    bool handleFrame (const uint8_t* data, size_t size) {
+        uint32_t type;
+        bool hasInReplyTo;
+        uint32_t inReplyTo;
+        if (!peekServerMessage(data, size, type, hasInReplyTo, inReplyTo)) {
+            return false;
+        }
+        if (barobo_rpc_ServerMessage_Type_REPLY == type && hasInReplyTo) {
+            auto pending = mReplies.find(inReplyTo);
+            if (!pending || !pending->frameHandler) {
+                return false;
+            }
+            PendingReply taken;
+            mReplies.take(inReplyTo, taken);
+            taken.frameHandler(boost::system::error_code(), copyFrame(data, size));
+            return true;
+        }
+        if (barobo_rpc_ServerMessage_Type_BROADCAST == type && mBroadcastFrames) {
+            mBroadcastFrameQueue.produce(boost::system::error_code(), copyFrame(data, size));
+            return true;
+        }
+        return false;
+    }
+
+    BufferPtr copyFrame (const uint8_t* data, size_t size) {
+        auto buf = mBufferPool->acquire(size);
+        std::copy(data, data + size, buf->bytes.begin());
+        return buf;
+    }
+
+    // The reply's entry in the timer wheel is left to expire harmlessly: by
+    // then its request ID is gone from mReplies, or belongs to a request with
+    // a different deadline.
     void handleReply (RequestId requestId,
             boost::system::error_code ec, boost::optional<barobo_rpc_Reply> reply) {
-        auto iter = mReplyMap.find(requestId);
-        if (mReplyMap.cend() != iter) {
-            auto& elem = iter->second;
-            elem.timer->cancel();
-            elem.queue.produce(ec, reply);
-            mReplyMap.erase(iter);
+        PendingReply pending;
+        if (mReplies.take(requestId, pending)) {
+            pending.handler(ec, reply);
         }
         else if (reply) {
             using boost::log::add_value;
@@ -135,6 +483,117 @@ struct ClientImpl : public std::enable_shared_from_this<ClientImpl<MessageQueue>
         }
     }
 
+    bool windowHasRoom (size_t n) const {
+        return !mRequestWindow || !mOutstandingRequests
+            || mOutstandingRequests + n <= mRequestWindow;
+    }
+
+    void admitWaitingRequests () {
+        while (!mWaitingRequests.empty() && windowHasRoom(mWaitingRequests.front().slots)) {
+            auto waiting = std::move(mWaitingRequests.front());
+            mWaitingRequests.pop_front();
+            mOutstandingRequests += waiting.slots;
+
+            auto wait = Clock::now() - waiting.since;
+            auto& stats = mFlowControlStats;
+            ++stats.queuedRequests;
+            stats.totalWait += wait;
+            stats.maxWait = std::max(stats.maxWait, wait);
+
+            mMessageQueue.get_io_service().post(
+                std::bind(std::move(waiting.handler), boost::system::error_code()));
+        }
+    }
+
+    // The server's versions, from its VERSIONS reply to CONNECT, if it has
+    // been seen.
+    const boost::optional<Versions>& serverVersions () const {
+        return mServerVersions;
+    }
+
+    void setServerVersions (const Versions& versions) {
+        mServerVersions = versions;
+    }
+
+    // Tell the server that nobody is waiting for the reply to a request any
+    // more, so it may skip the work. CANCEL requests bypass the request window
+    // and have no reply. Servers which have not said they understand CANCEL
+    // are left to finish the work.
+    void sendCancel (RequestId requestId) {
+        if (!mServerVersions || !acceptsExtendedRequests(mServerVersions->rpc())) {
+            return;
+        }
+        barobo_rpc_Request request;
+        memset(&request, 0, sizeof(request));
+        request.type = barobo_rpc_Request_Type_CANCEL;
+        request.has_cancel = true;
+        request.cancel.id = requestId;
+        auto self = this->shared_from_this();
+        asyncSendRequest(nextRequestId(), request, [self, this] (boost::system::error_code ec) {
+            if (ec) {
+                BOOST_LOG(mLog) << "error sending CANCEL request: " << ec.message();
+            }
+        });
+    }
+
+    // Time out every reply whose deadline has passed, and cancel its request.
+    void expireReplies () {
+        auto& ios = mMessageQueue.get_io_service();
+        auto self = this->shared_from_this();
+        mTimerWheel.advance(ticksAt(Clock::now()),
+                [this, &ios, &self] (RequestId requestId, uint64_t deadline) {
+            auto pending = mReplies.find(requestId);
+            if (pending && pending->deadline == deadline) {
+                PendingReply expired;
+                mReplies.take(requestId, expired);
+                // Posted, as the handler may well issue another request, and
+                // we are in the middle of advancing the wheel.
+                ios.post(std::bind(std::move(expired.handler),
+                    boost::system::error_code(), boost::none));
+                if (expired.fire) {
+                    ios.post([self, this, requestId] { sendCancel(requestId); });
+                }
+            }
+        });
+    }
+
+    // Make sure the client's timer will fire in time for the wheel's next
+    // event.
+    void armTimer () {
+        if (mTimerWheel.empty()) {
+            return;
+        }
+        auto next = mTimerWheel.nextEvent();
+        if (mTimerArmed && mArmedTick <= next) {
+            return;
+        }
+        mTimerArmed = true;
+        mArmedTick = next;
+        auto generation = ++mTimerGeneration;
+        mTimer.expires_at(mEpoch + Tick(next));
+        mTimer.async_wait([self=this->shared_from_this(), this, generation]
+                (boost::system::error_code ec) {
+            // A newer wait, or voidHandlers, supersedes this one.
+            if (ec || generation != mTimerGeneration) {
+                return;
+            }
+            mTimerArmed = false;
+            expireReplies();
+            armTimer();
+        });
+    }
+
+    // Round up, so that timeouts never fire early.
+    template <class TimePoint>
+    uint64_t ticksAt (TimePoint time) const {
+        auto elapsed = time - mEpoch;
+        auto ticks = std::chrono::duration_cast<Tick>(elapsed);
+        if (ticks < elapsed) {
+            ++ticks;
+        }
+        return ticks.count() > 0 ? uint64_t(ticks.count()) : 0;
+    }
+
     struct ReceivePumpOperation;
 
     void startReceivePump () {
@@ -153,12 +612,31 @@ struct ClientImpl : public std::enable_shared_from_this<ClientImpl<MessageQueue>
         util::asio::v1::makeOperation<Op>(std::move(handler), self)();
     }
 
-    void handleMessage (uint8_t* data, size_t size, boost::system::error_code& ec) {
+    // A BATCH may only contain REPLY messages, so batches do not nest.
+    void handleMessage (const uint8_t* data, size_t size, boost::system::error_code& ec,
+            bool inBatch = false) {
         ec = {};
+        if (handleFrame(data, size)) {
+            return;
+        }
         auto status = rpc::Status::OK;
+        uint32_t type;
+        bool hasInReplyTo;
+        uint32_t inReplyTo;
+        if (!inBatch && peekServerMessage(data, size, type, hasInReplyTo, inReplyTo)
+                && barobo_rpc_ServerMessage_Type_BATCH == type) {
+            // Walk the batch where it lies, rather than decoding it into a
+            // barobo_rpc_ServerMessage first.
+            handleBatch(data, size, ec);
+            return;
+        }
         barobo_rpc_ServerMessage message;
         decode(message, data, size, status);
         if (rpc::hasError(status)) { ec = status; return; }
+        if (inBatch && barobo_rpc_ServerMessage_Type_REPLY != message.type) {
+            ec = Status::PROTOCOL_ERROR;
+            return;
+        }
 
         switch (message.type) {
             case barobo_rpc_ServerMessage_Type_REPLY:
@@ -175,27 +653,55 @@ struct ClientImpl : public std::enable_shared_from_this<ClientImpl<MessageQueue>
                 }
                 mBroadcastQueue.produce(boost::system::error_code(), message.broadcast);
                 break;
+            case barobo_rpc_ServerMessage_Type_BATCH:
+                handleBatch(data, size, ec);
+                break;
             default:
                 ec = Status::PROTOCOL_ERROR;
                 return;
         }
     }
 
+    void handleBatch (const uint8_t* data, size_t size, boost::system::error_code& ec) {
+        auto status = rpc::Status::OK;
+        PayloadView batch;
+        PayloadView entry;
+        rpc::decodeBatch(data, size, batch, status);
+        while (!rpc::hasError(status) && rpc::nextBatchEntry(batch, entry, status)) {
+            handleMessage(entry.bytes, entry.size, ec, true);
+            if (ec) {
+                return;
+            }
+        }
+        if (rpc::hasError(status)) {
+            ec = status;
+        }
+    }
+
     void voidHandlers (boost::system::error_code ec) {
         BOOST_LOG(mLog) << "voiding all handlers with " << ec.message();
-        for (auto& pair : mReplyMap) {
-            pair.second.timer->cancel();
-            while (pair.second.queue.depth() < 0) {
-                pair.second.queue.produce(ec, boost::none);
-            }
-            while (pair.second.queue.depth() > 0) {
-                pair.second.queue.consume([this](boost::system::error_code ec2,
-                        boost::optional<barobo_rpc_Reply>) {
-                    BOOST_LOG(mLog) << "RPC client discarding reply: " << ec2.message();
-                });
-            }
+        ++mTimerGeneration;
+        mTimerArmed = false;
+        mTimer.cancel();
+        mTimerWheel.clear();
+        // Handlers may issue new requests, so empty the table before calling
+        // any of them.
+        std::vector<ReplyHandler> handlers;
+        handlers.reserve(mReplies.size());
+        mReplies.drain([&handlers] (RequestId, PendingReply pending) {
+            handlers.push_back(std::move(pending.handler));
+        });
+        for (auto& handler : handlers) {
+            handler(ec, boost::none);
+        }
+
+        // Requests still waiting for a slot never got one, so they have
+        // nothing to release.
+        auto waiting = std::move(mWaitingRequests);
+        mWaitingRequests.clear();
+        for (auto& request : waiting) {
+            request.handler(ec);
         }
-        mReplyMap.clear();
 
         while (mBroadcastQueue.depth() < 0) {
             mBroadcastQueue.produce(ec, barobo_rpc_Broadcast());
@@ -205,27 +711,48 @@ struct ClientImpl : public std::enable_shared_from_this<ClientImpl<MessageQueue>
                 BOOST_LOG(mLog) << "RPC client discarding broadcast: " << ec2.message();
             });
         }
+        while (mBroadcastFrameQueue.depth() < 0) {
+            mBroadcastFrameQueue.produce(ec, nullptr);
+        }
+        while (mBroadcastFrameQueue.depth() > 0) {
+            mBroadcastFrameQueue.consume([this](boost::system::error_code ec2, BufferPtr) {
+                BOOST_LOG(mLog) << "RPC client discarding broadcast: " << ec2.message();
+            });
+        }
     }
 
     RequestId nextRequestId () { return mNextRequestId++; }
 
     MessageQueue mMessageQueue;
+    std::shared_ptr<BufferPool> mBufferPool;
+    std::shared_ptr<Metrics> mMetrics;
 
     std::atomic<RequestId> mNextRequestId = { 0 };
 
-    using ReplyQueue = util::ProducerConsumerQueue<boost::system::error_code,
-        boost::optional<barobo_rpc_Reply>>;
-    struct TimedReply {
-        explicit TimedReply (boost::asio::io_service& context)
-            : timer(std::make_shared<boost::asio::steady_timer>(context))
-        {}
-        std::shared_ptr<boost::asio::steady_timer> timer;
-        // hack to make TimedReply copyable, required by mReplyMap.emplace() for some reason
-        ReplyQueue queue;
+    // Outstanding requests, indexed by request ID, and their timeouts, in a
+    // wheel driven by a single timer. Timeouts have a resolution of one Tick.
+    ReplyTable<PendingReply> mReplies;
+    TimerWheel<RequestId> mTimerWheel;
+    boost::optional<Versions> mServerVersions;
+    boost::asio::steady_timer mTimer;
+    Clock::time_point mEpoch;
+    uint64_t mArmedTick = 0;
+    uint64_t mTimerGeneration = 0;
+    bool mTimerArmed = false;
+
+    struct WaitingRequest {
+        std::function<void(boost::system::error_code)> handler;
+        Clock::time_point since;
+        size_t slots;
     };
-    std::map<RequestId, TimedReply> mReplyMap;
+    std::deque<WaitingRequest> mWaitingRequests;
+    size_t mRequestWindow = 0;
+    size_t mOutstandingRequests = 0;
+    FlowControlStats mFlowControlStats = {};
 
     util::ProducerConsumerQueue<boost::system::error_code, barobo_rpc_Broadcast> mBroadcastQueue;
+    util::ProducerConsumerQueue<boost::system::error_code, BufferPtr> mBroadcastFrameQueue;
+    bool mBroadcastFrames = false;
 
     bool mReceivePumpRunning = false;
     boost::system::error_code mReceivePumpError;
@@ -239,19 +766,26 @@ struct ClientImpl<MessageQueue>::SendRequestOperation {
     using Nest = ClientImpl<MessageQueue>;
     using RequestId = typename Nest::RequestId;
 
-    SendRequestOperation (
-            std::shared_ptr<Nest> nest, RequestId requestId, barobo_rpc_Request request)
+    // The request is encoded up front, so the caller's request object need
+    // not outlive the operation's construction.
+    template <class Request>
+    SendRequestOperation (std::shared_ptr<Nest> nest,
+            RequestId requestId, const Request& request, uint32_t timeout)
         : nest_(std::move(nest))
         , requestId_(requestId)
-        , request_(request)
-        , buf_(1024)
-    {}
+        , buf_(nest_->mBufferPool->acquire(maxMessageSize(request)))
+    {
+        pb_size_t bytesWritten;
+        encodeRequest(requestId, request, timeout,
+            buf_->bytes.data(), buf_->bytes.size(), bytesWritten, status_);
+        buf_->bytes.resize(bytesWritten);
+    }
 
     std::shared_ptr<Nest> nest_;
     typename Nest::RequestId requestId_;
-    barobo_rpc_Request request_;
 
-    std::vector<uint8_t> buf_;
+    BufferPtr buf_;
+    rpc::Status status_ = rpc::Status::OK;
 
     boost::system::error_code rc_ = boost::asio::error::operation_aborted;
 
@@ -259,29 +793,52 @@ struct ClientImpl<MessageQueue>::SendRequestOperation {
         return std::make_tuple(rc_);
     }
 
+    static size_t maxMessageSize (const barobo_rpc_Request&) {
+        return barobo_rpc_ClientMessage_size;
+    }
+
+    template <class Method>
+    static size_t maxMessageSize (const Method&) {
+        return MaxFireMessageSize<MaxEncodedSize<Method>::value>::value;
+    }
+
+    static void encodeRequest (RequestId requestId, const barobo_rpc_Request& request,
+            uint32_t timeout,
+            uint8_t* bytes, size_t size, pb_size_t& bytesWritten, rpc::Status& status) {
+        barobo_rpc_ClientMessage message;
+        memset(&message, 0, sizeof(message));
+        message.id = requestId;
+        memcpy(&message.request, &request, sizeof(request));
+        if (kNoTimeout != timeout) {
+            message.request.has_timeout = true;
+            message.request.timeout = timeout;
+        }
+        rpc::encode(message, bytes, size, bytesWritten, status);
+    }
+
+    template <class Method>
+    static void encodeRequest (RequestId requestId, const Method& args,
+            uint32_t timeout,
+            uint8_t* bytes, size_t size, pb_size_t& bytesWritten, rpc::Status& status) {
+        rpc::encodeFire(requestId, args, timeout, bytes, size, bytesWritten, status);
+    }
+
     template <class Op>
     void operator() (Op&& op, boost::system::error_code ec = {}) {
         reenter (op) {
             yield {
-                barobo_rpc_ClientMessage message;
-                memset(&message, 0, sizeof(message));
-                message.id = requestId_;
-                memcpy(&message.request, &request_, sizeof(request_));
-                pb_size_t bytesWritten;
-                auto status = rpc::Status::OK;
-                rpc::encode(message, buf_.data(), buf_.size(), bytesWritten, status);
-                if (rpc::hasError(status)) {
-                    rc_ = status;
+                if (rpc::hasError(status_)) {
+                    rc_ = status_;
                     BOOST_LOG(nest_->mLog) << "SendRequestOperation: " << rc_.message();
                     break;
                 }
-                buf_.resize(bytesWritten);
-                nest_->mMessageQueue.asyncSend(boost::asio::buffer(buf_), std::move(op));
+                nest_->mMessageQueue.asyncSend(boost::asio::buffer(buf_->bytes), std::move(op));
             }
             if (!ec) {
+                nest_->mMetrics->addBytesOut(buf_->bytes.size());
                 using boost::log::add_value;
                 using std::to_string;
-                BOOST_LOG(nest_->mLog) << add_value("RequestId", to_string(requestId_))
+                RPC_ASIO_LOG_REQUEST(nest_->mLog) << add_value("RequestId", to_string(requestId_))
                     << "sent request";
             }
             rc_ = ec;
@@ -295,12 +852,13 @@ struct ClientImpl<MessageQueue>::ReceivePumpOperation {
 
     ReceivePumpOperation (std::shared_ptr<Nest> nest)
         : nest_(std::move(nest))
-        , buf_(1024)
+        , buf_(nest_->mBufferPool->acquire(
+            std::max<size_t>(barobo_rpc_ServerMessage_size, RPC_BATCH_MAX_SIZE)))
     {}
 
     std::shared_ptr<Nest> nest_;
 
-    std::vector<uint8_t> buf_;
+    BufferPtr buf_;
 
     boost::system::error_code rc_ = boost::asio::error::operation_aborted;
 
@@ -311,11 +869,13 @@ struct ClientImpl<MessageQueue>::ReceivePumpOperation {
     template <class Op>
     void operator() (Op&& op, boost::system::error_code ec = {}, size_t nBytesTransferred = 0) {
         if (!ec) reenter (op) {
-            while (nest_->mReplyMap.size() || (nest_->mBroadcastQueue.depth() < 0)) {
-                yield nest_->mMessageQueue.asyncReceive(boost::asio::buffer(buf_), std::move(op));
+            while (!nest_->mReplies.empty() || (nest_->mBroadcastQueue.depth() < 0)
+                    || (nest_->mBroadcastFrameQueue.depth() < 0)) {
+                yield nest_->mMessageQueue.asyncReceive(boost::asio::buffer(buf_->bytes), std::move(op));
                 if (nBytesTransferred) {
                     //BOOST_LOG(mLog) << "handleReceive: received " << nBytesTransferred << " bytes";
-                    nest_->handleMessage(buf_.data(), nBytesTransferred, ec);
+                    nest_->mMetrics->addBytesIn(nBytesTransferred);
+                    nest_->handleMessage(buf_->bytes.data(), nBytesTransferred, ec);
                     if (ec) {
                         rc_ = ec;
                         BOOST_LOG(nest_->mLog) << "ReceivePumpOperation: " << ec.message();
@@ -336,53 +896,169 @@ struct ClientImpl<MessageQueue>::ReceivePumpOperation {
     }
 };
 
-template <class C, class Duration>
+// The outcome of a FIRE request, given its reply, or null if it timed out.
+inline boost::system::error_code
+fireReplyError (boost::system::error_code ec, const barobo_rpc_Reply* reply) {
+    if (ec) {
+        return ec;
+    }
+    else if (!reply) {
+        return Status::TIMED_OUT;
+    }
+    else if (barobo_rpc_Reply_Type_RESULT == reply->type && reply->has_result) {
+        return {};
+    }
+    else if (barobo_rpc_Reply_Type_STATUS == reply->type && reply->has_status) {
+        return make_error_code(RemoteStatus(reply->status.value));
+    }
+    return Status::PROTOCOL_ERROR;
+}
+
+inline boost::system::error_code
+fireReplyError (boost::system::error_code ec, const boost::optional<barobo_rpc_Reply>& reply) {
+    return fireReplyError(ec, reply ? &*reply : nullptr);
+}
+
+inline boost::system::error_code
+fireReplyError (boost::system::error_code ec, const boost::optional<FireReply>& reply) {
+    return fireReplyError(ec, reply ? &reply->reply : nullptr);
+}
+
+// Method requests are counted in the client's metrics, with the time from
+// sending the request to receiving its reply; control requests are not.
+template <class Request, class Reply, class Latency>
+void recordReply (Metrics& metrics, const Request& request, boost::system::error_code ec,
+        const Reply& reply, Latency latency,
+        ONLY_IF(IsMethod<Request>::value)) {
+    if (!ec && reply) {
+        metrics.record(componentId(request), fireReplyError(ec, reply), latency);
+    }
+    else {
+        metrics.record(componentId(request), fireReplyError(ec, reply));
+    }
+}
+
+template <class Request, class Reply, class Latency>
+void recordReply (Metrics&, const Request&, boost::system::error_code,
+        const Reply&, Latency,
+        ONLY_IF(!IsMethod<Request>::value)) {
+}
+
+// Methods are sent as FIRE requests, whose replies are received as FireReply,
+// so their results need not be copied out of the frame.
+template <class Request>
+struct ReplyOf {
+    using type = typename If<IsMethod<Request>::value,
+        boost::optional<FireReply>, boost::optional<barobo_rpc_Reply>>::type;
+};
+
+template <class C, class Request, class Duration, class Handler>
+void asyncReceiveReplyTo (C& client, typename C::RequestId requestId, const Request&,
+        Duration&& timeout, Handler&& handler, ONLY_IF(IsMethod<Request>::value)) {
+    client.asyncReceiveFireReply(requestId, std::forward<Duration>(timeout),
+        std::forward<Handler>(handler));
+}
+
+template <class C, class Duration, class Handler>
+void asyncReceiveReplyTo (C& client, typename C::RequestId requestId,
+        const barobo_rpc_Request& request, Duration&& timeout, Handler&& handler) {
+    client.asyncReceiveReply(requestId, request.type, std::forward<Duration>(timeout),
+        std::forward<Handler>(handler));
+}
+
+// The request's deadline is fixed when the operation starts: time spent
+// waiting for a slot in the request window counts against it, and the server
+// is told how much of it remains.
+template <class C, class Request, class Duration>
 struct RequestOperation {
-    RequestOperation (C& client, barobo_rpc_Request request, Duration&& timeout)
+    using Clock = std::chrono::steady_clock;
+    using Reply = typename ReplyOf<Request>::type;
+
+    RequestOperation (C& client, Request request, Duration&& timeout)
         : client_(client)
         , request_(request)
-        , timeout_(std::forward<Duration>(timeout))
+        , deadline_(Clock::now() + timeout)
     {}
 
     C& client_;
-    barobo_rpc_Request request_;
-    Duration timeout_;
+    Request request_;
+    Clock::time_point deadline_;
 
     typename C::RequestId requestId_;
+    bool slotHeld_ = false;
+    Clock::time_point sent_;
 
     boost::system::error_code rc_ = boost::asio::error::operation_aborted;
-    boost::optional<barobo_rpc_Reply> reply_ = boost::none;
+    Reply reply_ = boost::none;
 
     auto result () const {
         return std::make_tuple(rc_, reply_);
     }
 
     template <class Op>
-    void operator() (Op&& op, boost::system::error_code ec = {},
-            boost::optional<barobo_rpc_Reply> reply = {}) {
+    void operator() (Op&& op, boost::system::error_code ec = {}, Reply reply = {}) {
         if (!ec) reenter (op) {
+            yield client_.asyncAcquireRequestSlot(std::move(op));
+            slotHeld_ = true;
+            if (deadline_ <= Clock::now()) {
+                // Timed out in the queue; don't make the server do the work.
+                releaseSlot();
+                recordReply(client_.metrics(), request_, {}, Reply(), Clock::duration());
+                rc_ = {};
+                yield break;
+            }
             requestId_ = client_.nextRequestId();
-            yield client_.asyncSendRequest(requestId_, request_, std::move(op));
-            yield client_.asyncReceiveReply(requestId_, timeout_, std::move(op));
+            sent_ = Clock::now();
+            // On some transports, a reply may arrive before the send
+            // completes, so wait for the reply before sending. If the send
+            // fails, so does the wait.
+            yield {
+                auto& client = client_;
+                auto requestId = requestId_;
+                auto timeout = requestTimeout(deadline_ - Clock::now());
+                asyncReceiveReplyTo(client, requestId, request_,
+                    deadline_ - Clock::now(), std::move(op));
+                client.asyncSendRequest(requestId, request_, timeout,
+                    [&client, requestId] (boost::system::error_code ec) {
+                        if (ec) {
+                            client.abandonReply(requestId, ec);
+                        }
+                    });
+            }
+            releaseSlot();
+            recordReply(client_.metrics(), request_, ec, reply, Clock::now() - sent_);
             rc_ = ec;
             reply_ = reply;
         }
-        else if (boost::asio::error::operation_aborted != ec) {
-            rc_ = ec;
+        else {
+            releaseSlot();
+            recordReply(client_.metrics(), request_, ec, Reply(), Clock::duration());
+            if (boost::asio::error::operation_aborted != ec) {
+                rc_ = ec;
+            }
+        }
+    }
+
+    void releaseSlot () {
+        if (slotHeld_) {
+            slotHeld_ = false;
+            client_.releaseRequestSlot();
         }
     }
 };
 
-template <class C, class Duration, class CompletionToken>
+// Request may be a barobo_rpc_Request or a method input struct, see
+// ClientImpl::asyncSendRequest. The reply to a method is a FireReply.
+template <class C, class Request, class Duration, class CompletionToken>
 BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken,
-    void(boost::system::error_code, boost::optional<barobo_rpc_Reply>))
+    void(boost::system::error_code, typename ReplyOf<Request>::type))
 asyncRequest (
-        C& client, barobo_rpc_Request request, Duration&& timeout, CompletionToken&& token) {
+        C& client, Request request, Duration&& timeout, CompletionToken&& token) {
     util::asio::AsyncCompletion<
-        CompletionToken, void(boost::system::error_code, boost::optional<barobo_rpc_Reply>)
+        CompletionToken, void(boost::system::error_code, typename ReplyOf<Request>::type)
     > init { std::forward<CompletionToken>(token) };
 
-    using Op = RequestOperation<C, Duration>;
+    using Op = RequestOperation<C, Request, Duration>;
     util::asio::v1::makeOperation<Op>(std::move(init.handler),
         client, request, std::forward<Duration>(timeout))();
 
@@ -447,6 +1123,70 @@ asyncDisconnect (RpcClient& client, Duration&& timeout, Handler&& handler) {
     return init.result.get();
 }
 
+// Make a SUBSCRIBE (subscribed == true) or UNSUBSCRIBE request for the
+// broadcast with the given component ID.
+template <class RpcClient, class Duration, class Handler>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code))
+asyncSetSubscription (RpcClient& client, uint32_t id, bool subscribed,
+        Duration&& timeout, Handler&& handler) {
+    util::asio::AsyncCompletion<
+        Handler, void(boost::system::error_code)
+    > init { std::forward<Handler>(handler) };
+    auto& realHandler = init.handler;
+
+    auto log = client.log();
+    auto name = subscribed ? "SUBSCRIBE" : "UNSUBSCRIBE";
+
+    barobo_rpc_Request request;
+    memset(&request, 0, sizeof(request));
+    request.type = subscribed
+        ? barobo_rpc_Request_Type_SUBSCRIBE
+        : barobo_rpc_Request_Type_UNSUBSCRIBE;
+    request.has_subscription = true;
+    request.subscription.id = id;
+    asyncRequest(client, request, std::forward<Duration>(timeout),
+        [realHandler, log, name] (boost::system::error_code ec,
+                boost::optional<barobo_rpc_Reply> reply) mutable {
+            if (ec) {
+                BOOST_LOG(log) << name << " request completed with error: " << ec.message();
+                realHandler(ec);
+                return;
+            }
+            else if (!reply) {
+                BOOST_LOG(log) << name << " request timed out";
+                realHandler(Status::TIMED_OUT);
+                return;
+            }
+            if (barobo_rpc_Reply_Type_STATUS != reply->type || !reply->has_status) {
+                BOOST_LOG(log) << name << " request completed with inconsistent reply";
+                realHandler(Status::PROTOCOL_ERROR);
+                return;
+            }
+            auto remoteEc = make_error_code(RemoteStatus(reply->status.value));
+            BOOST_LOG(log) << name << " request completed with STATUS: " << remoteEc.message();
+            realHandler(remoteEc);
+        });
+
+    return init.result.get();
+}
+
+// Subscribe to a broadcast. Selective broadcasts are only sent to clients
+// which subscribe to them; all others are sent unless unsubscribed.
+template <class Broadcast, class RpcClient, class Duration, class Handler>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code))
+asyncSubscribe (RpcClient& client, Duration&& timeout, Handler&& handler) {
+    return asyncSetSubscription(client, componentId(Broadcast{}), true,
+        std::forward<Duration>(timeout), std::forward<Handler>(handler));
+}
+
+// Ask the server to stop sending a broadcast.
+template <class Broadcast, class RpcClient, class Duration, class Handler>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code))
+asyncUnsubscribe (RpcClient& client, Duration&& timeout, Handler&& handler) {
+    return asyncSetSubscription(client, componentId(Broadcast{}), false,
+        std::forward<Duration>(timeout), std::forward<Handler>(handler));
+}
+
 // Make a connection request to the remote server, error on version mismatch.
 // FIXME I think it probably makes more sense for the client to pass version
 // information to the server, and let the server reject based on version
@@ -498,6 +1238,7 @@ asyncConnect (RpcClient& client, Duration&& timeout, Handler&& handler) {
                         BOOST_LOG(log) << "Local RPC version " << rpc::Version<>::triplet()
                                        << ", interface version " << rpc::Version<Interface>::triplet();
 
+                        client.setServerVersions(vers);
                         if (vers.rpc() != rpc::Version<>::triplet() ||
                             vers.interface() != rpc::Version<Interface>::triplet()) {
                             asyncDisconnect(client, timeout, [&ios, realHandler] (boost::system::error_code) {
@@ -534,10 +1275,127 @@ asyncConnect (RpcClient& client, Duration&& timeout, Handler&& handler) {
     return init.result.get();
 }
 
+// Completes a FIRE request with its reply: a RESULT is decoded into the
+// method's result struct, and anything else becomes an error.
+template <class Result, class Handler>
+struct FireReplyHandler {
+    Handler realHandler;
+    util::log::Logger log;
+
+    void operator() (boost::system::error_code ec, const boost::optional<FireReply>& reply) {
+        complete(ec, reply ? &reply->reply : nullptr,
+            reply ? reply->payload : PayloadView{nullptr, 0});
+    }
+
+    // The reply is null if it timed out. A RESULT's payload is given
+    // separately, as it need not have been copied into the reply.
+    void complete (boost::system::error_code ec, const barobo_rpc_Reply* reply,
+            PayloadView payload) {
+        if (ec) {
+            BOOST_LOG(log) << "FIRE request completed with error: " << ec.message();
+            realHandler(ec, Result());
+            return;
+        }
+        else if (!reply) {
+            BOOST_LOG(log) << "FIRE request timed out";
+            realHandler(Status::TIMED_OUT, Result());
+            return;
+        }
+        switch (reply->type) {
+            case barobo_rpc_Reply_Type_VERSIONS:
+                BOOST_LOG(log) << "FIRE request completed with VERSIONS (inconsistent reply)";
+                realHandler(Status::PROTOCOL_ERROR, Result());
+                break;
+            case barobo_rpc_Reply_Type_STATUS:
+                if (!reply->has_status) {
+                    BOOST_LOG(log) << "FIRE request completed with inconsistent STATUS reply";
+                    realHandler(Status::PROTOCOL_ERROR, Result());
+                }
+                else {
+                    auto remoteEc = make_error_code(RemoteStatus(reply->status.value));
+                    BOOST_LOG(log) << "FIRE request completed with STATUS: " << remoteEc.message();
+                    realHandler(remoteEc, Result());
+                }
+                break;
+            case barobo_rpc_Reply_Type_RESULT:
+                if (!reply->has_result) {
+                    BOOST_LOG(log) << "FIRE request completed with inconsistent RESULT reply";
+                    realHandler(Status::PROTOCOL_ERROR, Result());
+                }
+                else {
+                    Status status;
+                    Result result;
+                    memset(&result, 0, sizeof(result));
+                    rpc::decode(result, payload.bytes, payload.size, status);
+                    auto decodingEc = make_error_code(status);
+                    if (decodingEc) {
+                        BOOST_LOG(log) << "FIRE request completed with RESULT (decoding status: "
+                                       << decodingEc.message() << ")";
+                    }
+                    else {
+                        RPC_ASIO_LOG_REQUEST(log) << "FIRE request completed with RESULT";
+                    }
+                    realHandler(decodingEc, result);
+                }
+                break;
+            default:
+                BOOST_LOG(log) << "FIRE request completed with unrecognized reply type";
+                realHandler(Status::PROTOCOL_ERROR, Result());
+                break;
+        }
+    }
+};
+
+template <class Result, class Handler>
+FireReplyHandler<Result, typename std::decay<Handler>::type>
+makeFireReplyHandler (Handler&& handler, const util::log::Logger& log) {
+    return {std::forward<Handler>(handler), log};
+}
+
+// Make a fire-and-forget method request to the remote server. No reply is
+// expected, so the handler is called as soon as the request is sent, with an
+// empty result, and the timeout is unused.
+template <class RpcClient, class Method, class Duration, class Handler, class Result = typename ResultOf<Method>::type>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code, Result))
+asyncFire (RpcClient& client, Method args, Duration&&, Handler&& handler,
+        ONLY_IF(IsFireAndForget<Method>::value)) {
+    util::asio::AsyncCompletion<
+        Handler, void(boost::system::error_code, Result)
+    > init { std::forward<Handler>(handler) };
+    auto& realHandler = init.handler;
+
+    auto log = client.log();
+
+    // The request holds a slot in the client's request window only until it
+    // is sent.
+    client.asyncAcquireRequestSlot(
+        [&client, args, realHandler, log] (boost::system::error_code ec) mutable {
+            if (ec) {
+                BOOST_LOG(log) << "FIRE request completed with error: " << ec.message();
+                client.metrics().record(componentId(args), ec);
+                realHandler(ec, Result());
+                return;
+            }
+            RPC_ASIO_LOG_REQUEST(log) << "sending fire-and-forget FIRE request";
+            client.asyncSendRequest(client.nextRequestId(), args,
+                [&client, realHandler, log] (boost::system::error_code ec) mutable {
+                    client.releaseRequestSlot();
+                    client.metrics().record(componentId(Method()), ec);
+                    if (ec) {
+                        BOOST_LOG(log) << "FIRE request completed with error: " << ec.message();
+                    }
+                    realHandler(ec, Result());
+                });
+        });
+
+    return init.result.get();
+}
+
 // Make a fire method request to the remote server.
 template <class RpcClient, class Method, class Duration, class Handler, class Result = typename ResultOf<Method>::type>
 BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code, Result))
-asyncFire (RpcClient& client, Method args, Duration&& timeout, Handler&& handler) {
+asyncFire (RpcClient& client, Method args, Duration&& timeout, Handler&& handler,
+        ONLY_IF(!IsFireAndForget<Method>::value)) {
     util::asio::AsyncCompletion<
         Handler, void(boost::system::error_code, Result)
     > init { std::forward<Handler>(handler) };
@@ -545,75 +1403,206 @@ asyncFire (RpcClient& client, Method args, Duration&& timeout, Handler&& handler
 
     auto log = client.log();
 
-    barobo_rpc_Request request;
-    memset(&request, 0, sizeof(request));
-    request.type = barobo_rpc_Request_Type_FIRE;
-    request.has_fire = true;
-    request.fire.id = componentId(args);
-    Status status;
-    rpc::encode(args,
-        request.fire.payload.bytes,
-        sizeof(request.fire.payload.bytes),
-        request.fire.payload.size, status);
-    if (hasError(status)) {
-        auto encodingEc = make_error_code(status);
-        BOOST_LOG(log) << "FIRE request failed to encode: " << encodingEc.message();
-        client.get_io_service().post(std::bind(realHandler, encodingEc, Result()));
+    RPC_ASIO_LOG_REQUEST(log) << "sending FIRE request";
+    asyncRequest(client, args, std::forward<Duration>(timeout),
+        makeFireReplyHandler<Result>(realHandler, log));
+
+    return init.result.get();
+}
+
+// Several FIRE requests to send in a single frame with asyncFireBatch, for
+// transports where the cost of a frame outweighs that of a small message.
+// Each request completes its own handler, exactly as asyncFire would; the
+// handlers must be plain callables, not completion tokens.
+template <class RpcClient>
+class FireBatch {
+public:
+    using RequestId = typename RpcClient::RequestId;
+
+    explicit FireBatch (RpcClient& client) : mClient(client) {}
+
+    // The request is encoded now, so its deadline runs from now.
+    template <class Method, class Duration, class Handler,
+              class Result = typename ResultOf<Method>::type>
+    void add (Method args, Duration timeout, Handler handler) {
+        Entry entry;
+        entry.requestId = mClient.nextRequestId();
+        entry.message = mClient.bufferPool().acquire(
+            MaxFireMessageSize<MaxEncodedSize<Method>::value>::value);
+        pb_size_t bytesWritten = 0;
+        rpc::encodeFire(entry.requestId, args,
+            IsFireAndForget<Method>::value ? kNoTimeout : requestTimeout(timeout),
+            entry.message->bytes.data(), entry.message->bytes.size(), bytesWritten, entry.status);
+        entry.message->bytes.resize(bytesWritten);
+        setHandlers<Method, Result>(entry,
+            std::chrono::steady_clock::now() + timeout, std::move(handler));
+        mEntries.push_back(std::move(entry));
     }
-    else {
-        BOOST_LOG(log) << "sending FIRE request";
-        asyncRequest(client, request, std::forward<Duration>(timeout),
-            [realHandler, log] (boost::system::error_code ec,
-                    boost::optional<barobo_rpc_Reply> reply) mutable {
-                if (ec) {
-                    BOOST_LOG(log) << "FIRE request completed with error: " << ec.message();
-                    realHandler(ec, Result());
-                    return;
+
+    size_t size () const { return mEntries.size(); }
+    bool empty () const { return mEntries.empty(); }
+
+private:
+    template <class C, class CompletionToken>
+    friend BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
+    asyncFireBatch (C& client, FireBatch<C> batch, CompletionToken&& token);
+
+    struct Entry {
+        RequestId requestId;
+        BufferPtr message;
+        Status status = Status::OK;
+        // Wait for the reply, holding one of the batch's slots in the
+        // client's request window until it arrives. Null for fire-and-forget
+        // methods.
+        std::function<void()> expectReply;
+        // Complete the request without a reply: a fire-and-forget request,
+        // once the batch is sent, or any request which failed before it was.
+        std::function<void(boost::system::error_code)> complete;
+    };
+
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    template <class Method, class Result, class Handler>
+    void setHandlers (Entry& entry, TimePoint, Handler handler,
+            ONLY_IF(IsFireAndForget<Method>::value)) {
+        auto& client = mClient;
+        entry.complete = [&client, handler] (boost::system::error_code ec) mutable {
+            client.metrics().record(componentId(Method()), ec);
+            handler(ec, Result());
+        };
+    }
+
+    template <class Method, class Result, class Handler>
+    void setHandlers (Entry& entry, TimePoint deadline, Handler handler,
+            ONLY_IF(!IsFireAndForget<Method>::value)) {
+        auto& client = mClient;
+        auto requestId = entry.requestId;
+        auto replyHandler = makeFireReplyHandler<Result>(std::move(handler), client.log());
+        entry.expectReply = [&client, requestId, deadline, replyHandler] () mutable {
+            auto sent = std::chrono::steady_clock::now();
+            client.asyncReceiveFireReply(requestId, deadline - sent,
+                [&client, replyHandler, sent] (boost::system::error_code ec,
+                        boost::optional<FireReply> reply) mutable {
+                    client.releaseRequestSlot();
+                    recordReply(client.metrics(), Method(), ec, reply,
+                        std::chrono::steady_clock::now() - sent);
+                    replyHandler(ec, reply);
+                });
+        };
+        entry.complete = [&client, replyHandler] (boost::system::error_code ec) mutable {
+            recordReply(client.metrics(), Method(), ec, boost::optional<FireReply>(),
+                std::chrono::steady_clock::duration());
+            replyHandler.complete(ec, nullptr, PayloadView{nullptr, 0});
+        };
+    }
+
+    RpcClient& mClient;
+    std::vector<Entry> mEntries;
+};
+
+// Send a FireBatch as one BATCH request. The handler is called once the frame
+// is sent; each request's own handler is called with its result as its reply
+// arrives. A batch whose frame would exceed RPC_BATCH_MAX_SIZE fails with
+// ENCODING_FAILURE. Every request in the batch which expects a reply takes up
+// a slot in the client's request window until its reply arrives, as it would
+// if sent with asyncFire; fire-and-forget requests take up none.
+template <class RpcClient, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
+asyncFireBatch (RpcClient& client, FireBatch<RpcClient> batch, CompletionToken&& token) {
+    util::asio::AsyncCompletion<
+        CompletionToken, void(boost::system::error_code)
+    > init { std::forward<CompletionToken>(token) };
+    auto& realHandler = init.handler;
+
+    auto entries = std::make_shared<decltype(batch.mEntries)>(std::move(batch.mEntries));
+    auto log = client.log();
+
+    // Requests which could not be encoded fail on their own, and need no slot.
+    size_t slots = 0;
+    for (auto& entry : *entries) {
+        if (!hasError(entry.status) && entry.expectReply) {
+            ++slots;
+        }
+    }
+
+    client.asyncAcquireRequestSlots(slots,
+        [&client, entries, slots, realHandler, log] (boost::system::error_code ec) mutable {
+            auto fail = [&] (boost::system::error_code ec, size_t slotsHeld) {
+                BOOST_LOG(log) << "BATCH request completed with error: " << ec.message();
+                while (slotsHeld--) {
+                    client.releaseRequestSlot();
                 }
-                else if (!reply) {
-                    BOOST_LOG(log) << "FIRE request timed out";
-                    realHandler(Status::TIMED_OUT, Result());
-                    return;
+                for (auto& entry : *entries) {
+                    entry.complete(hasError(entry.status) ? make_error_code(entry.status) : ec);
                 }
-                switch (reply->type) {
-                    case barobo_rpc_Reply_Type_VERSIONS:
-                        BOOST_LOG(log) << "FIRE request completed with VERSIONS (inconsistent reply)";
-                        realHandler(Status::PROTOCOL_ERROR, Result());
-                        break;
-                    case barobo_rpc_Reply_Type_STATUS:
-                        if (!reply->has_status) {
-                            BOOST_LOG(log) << "FIRE request completed with inconsistent STATUS reply";
-                            realHandler(Status::PROTOCOL_ERROR, Result());
-                        }
-                        else {
-                            auto remoteEc = make_error_code(RemoteStatus(reply->status.value));
-                            BOOST_LOG(log) << "FIRE request completed with STATUS: " << remoteEc.message();
-                            realHandler(remoteEc, Result());
+                realHandler(ec);
+            };
+            if (ec) {
+                fail(ec, 0);
+                return;
+            }
+
+            size_t size = kBatchOverhead;
+            for (auto& entry : *entries) {
+                if (!hasError(entry.status)) {
+                    size += kBatchEntryOverhead + entry.message->bytes.size();
+                }
+            }
+            if (size > RPC_BATCH_MAX_SIZE) {
+                fail(Status::ENCODING_FAILURE, slots);
+                return;
+            }
+            auto buf = client.bufferPool().acquire(size);
+            BatchWriter writer{buf->bytes.data(), buf->bytes.size()};
+            for (auto& entry : *entries) {
+                if (!hasError(entry.status)) {
+                    auto success = writer.append(
+                        entry.message->bytes.data(), entry.message->bytes.size());
+                    assert(success);
+                    (void)success;
+                }
+            }
+            pb_size_t bytesWritten = 0;
+            Status status;
+            writer.finishRequest(client.nextRequestId(), bytesWritten, status);
+            if (hasError(status)) {
+                fail(status, slots);
+                return;
+            }
+            buf->bytes.resize(bytesWritten);
+
+            // On some transports, a reply may arrive before the send
+            // completes, so wait for the replies before sending.
+            for (auto& entry : *entries) {
+                if (hasError(entry.status)) {
+                    entry.complete(make_error_code(entry.status));
+                }
+                else if (entry.expectReply) {
+                    entry.expectReply();
+                }
+            }
+
+            RPC_ASIO_LOG_REQUEST(log) << "sending BATCH request of " << entries->size()
+                                      << " FIRE requests";
+            client.asyncSendMessage(buf,
+                [&client, entries, realHandler, log] (boost::system::error_code ec) mutable {
+                    if (ec) {
+                        BOOST_LOG(log) << "BATCH request completed with error: " << ec.message();
+                    }
+                    for (auto& entry : *entries) {
+                        if (hasError(entry.status)) {
+                            continue;
                         }
-                        break;
-                    case barobo_rpc_Reply_Type_RESULT:
-                        if (!reply->has_result) {
-                            BOOST_LOG(log) << "FIRE request completed with inconsistent RESULT reply";
-                            realHandler(Status::PROTOCOL_ERROR, Result());
+                        if (!entry.expectReply) {
+                            entry.complete(ec);
                         }
-                        else {
-                            Status status;
-                            Result result;
-                            memset(&result, 0, sizeof(result));
-                            rpc::decode(result, reply->result.payload.bytes, reply->result.payload.size, status);
-                            auto decodingEc = make_error_code(status);
-                            BOOST_LOG(log) << "FIRE request completed with RESULT (decoding status: "
-                                           << decodingEc.message() << ")";
-                            realHandler(decodingEc, result);
+                        else if (ec) {
+                            client.abandonReply(entry.requestId, ec);
                         }
-                        break;
-                    default:
-                        BOOST_LOG(log) << "FIRE request completed with unrecognized reply type";
-                        realHandler(Status::PROTOCOL_ERROR, Result());
-                        break;
-                }
-            });
-    }
+                    }
+                    realHandler(ec);
+                });
+        });
 
     return init.result.get();
 }
@@ -634,25 +1623,34 @@ struct RunClientOperation {
         return std::make_tuple(rc_);
     }
 
+    // Broadcasts are received undecoded, so that each is decoded straight
+    // into the implementation's broadcast struct.
     template <class Op>
-    void operator() (Op&& op, boost::system::error_code ec = {},
-            barobo_rpc_Broadcast broadcast = {}) {
+    void operator() (Op&& op, boost::system::error_code ec = {}, BufferPtr frame = nullptr) {
         if (!ec) reenter (op) {
-            yield client_.asyncReceiveBroadcast(std::move(op));
+            yield client_.asyncReceiveBroadcastFrame(std::move(op));
             while (1) {
-                BOOST_LOG(client_.log()) << "broadcast received";
+                RPC_ASIO_LOG_REQUEST(client_.log()) << "broadcast received";
                 yield {
-                    rpc::BroadcastUnion<Interface> b;
+                    barobo_rpc_ServerMessage message;
+                    PayloadView payload;
                     rpc::Status status;
-                    b.invoke(impl_, broadcast.id, broadcast.payload, status);
+                    decode(message, payload, frame->bytes.data(), frame->bytes.size(), status);
+                    if (!hasError(status) && !message.has_broadcast) {
+                        status = Status::PROTOCOL_ERROR;
+                    }
+                    if (!hasError(status)) {
+                        rpc::BroadcastUnion<Interface> b;
+                        b.invoke(impl_, message.broadcast.id, payload, status);
+                    }
                     if (hasError(status)) {
                         rc_ = status;
                         BOOST_LOG(client_.log())
-                            << "RunClientOperation: broadcast invocation error: " << ec.message();
+                            << "RunClientOperation: broadcast invocation error: " << rc_.message();
                         break;
                     }
                     else {
-                        client_.asyncReceiveBroadcast(std::move(op));
+                        client_.asyncReceiveBroadcastFrame(std::move(op));
                     }
                 }
             }
@@ -694,6 +1692,10 @@ public:
     MessageQueue& messageQueue () {
         return this->get_implementation()->messageQueue();
     }
+
+    Metrics& metrics () {
+        return this->get_implementation()->metrics();
+    }
     const MessageQueue& messageQueue () const {
         return this->get_implementation()->messageQueue();
     }
@@ -702,13 +1704,61 @@ public:
         return this->get_implementation()->log();
     }
 
+    BufferPool& bufferPool () {
+        return this->get_implementation()->bufferPool();
+    }
+
     RequestId nextRequestId () {
         return this->get_implementation()->nextRequestId();
     }
 
+    size_t requestWindow () const {
+        return this->get_implementation()->requestWindow();
+    }
+
+    void setRequestWindow (size_t window) {
+        this->get_implementation()->setRequestWindow(window);
+    }
+
+    using FlowControlStats = typename ClientImpl<MessageQueue>::FlowControlStats;
+
+    FlowControlStats flowControlStats () const {
+        return this->get_implementation()->flowControlStats();
+    }
+
+    void releaseRequestSlot () {
+        this->get_implementation()->releaseRequestSlot();
+    }
+
+    void abandonReply (RequestId requestId, boost::system::error_code ec) {
+        this->get_implementation()->abandonReply(requestId, ec);
+    }
+
+    const boost::optional<Versions>& serverVersions () const {
+        return this->get_implementation()->serverVersions();
+    }
+
+    void setServerVersions (const Versions& versions) {
+        this->get_implementation()->setServerVersions(versions);
+    }
+
+    void cancel (RequestId requestId) {
+        this->get_implementation()->cancel(requestId);
+    }
+
+    void cancel () {
+        this->get_implementation()->cancel();
+    }
+
+    UTIL_ASIO_DECL_ASYNC_METHOD(asyncAcquireRequestSlot)
+    UTIL_ASIO_DECL_ASYNC_METHOD(asyncAcquireRequestSlots)
+    UTIL_ASIO_DECL_ASYNC_METHOD(asyncSendMessage)
     UTIL_ASIO_DECL_ASYNC_METHOD(asyncSendRequest)
     UTIL_ASIO_DECL_ASYNC_METHOD(asyncReceiveReply)
+    UTIL_ASIO_DECL_ASYNC_METHOD(asyncReceiveReplyFrame)
+    UTIL_ASIO_DECL_ASYNC_METHOD(asyncReceiveFireReply)
     UTIL_ASIO_DECL_ASYNC_METHOD(asyncReceiveBroadcast)
+    UTIL_ASIO_DECL_ASYNC_METHOD(asyncReceiveBroadcastFrame)
 };
 
 }} // namespace rpc::asio
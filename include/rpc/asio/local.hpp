@@ -0,0 +1,457 @@
+#ifndef RPC_ASIO_LOCAL_HPP
+#define RPC_ASIO_LOCAL_HPP
+
+#include "rpc.pb.h"
+
+#include <util/log.hpp>
+#include <util/asio/asynccompletion.hpp>
+
+#include <rpc/asio/client.hpp>
+
+#include <rpc/componenttraits.hpp>
+#include <rpc/message.hpp>
+#include <rpc/subscriptions.hpp>
+#include <rpc/system_error.hpp>
+
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <boost/log/attributes/constant.hpp>
+
+#include <boost/optional.hpp>
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <cstring>
+
+// An in-process binding between rpc::asio clients and a server implementation,
+// for simulators and tests where both live in the same process. Instead of
+// encoding each request, sending it, and decoding it again, asyncFire on a
+// LocalClient calls the implementation's onFire with the method's In struct,
+// and asyncBroadcast on a LocalServer calls each client's onBroadcast with
+// the broadcast struct.
+//
+// The overloads below take the place of the message-based ones in
+// rpc/asio/client.hpp and rpc/asio/server.hpp, with the same completion
+// semantics: handlers are always posted, never called from the initiating
+// function, and errors are reported with the same error codes. Code written
+// against those functions works unchanged with a LocalClient or LocalServer.
+// asyncFireBatch is not supported.
+//
+// The client and server may run on different io_services, on different
+// threads. What the server knows about each client is only touched on the
+// server's io_service, so a client posts its changes there, and they take
+// effect in the order it made them as long as the server's io_service is run
+// by one thread.
+
+namespace rpc { namespace asio {
+
+template <class Interface, class T>
+class LocalServer;
+
+template <class Interface, class T>
+class LocalClient;
+
+namespace _ {
+
+using LocalBroadcastTable = std::vector<std::function<void(const void*)>>;
+
+// What a LocalServer knows about each of its clients. context is the
+// client's io_service.
+template <class Interface>
+struct LocalClientState {
+    explicit LocalClientState (boost::asio::io_service& c) : context(c) {}
+
+    boost::asio::io_service& context;
+
+    // Only touched on the server's io_service.
+    bool connected = false;
+    rpc::SubscriptionBitmap<BroadcastList<Interface>::size> subscriptions;
+
+    // Only touched on the client's io_service: the client implementation's
+    // onBroadcast overloads, by BroadcastIndex, while asyncRunClient is
+    // running.
+    LocalBroadcastTable onBroadcast;
+    std::function<void(boost::system::error_code)> runHandler;
+};
+
+template <class Impl>
+struct LocalBroadcastBinder {
+    Impl& impl;
+    LocalBroadcastTable& table;
+
+    template <class Broadcast>
+    void operator() (const Broadcast&, size_t index) {
+        auto& client = impl;
+        table[index] = [&client] (const void* broadcast) {
+            client.onBroadcast(*static_cast<const Broadcast*>(broadcast));
+        };
+    }
+};
+
+// A deferred reply to a local FIRE request. The Deferred hands us an encoded
+// reply, which we decode as a remote client would: the implementation may
+// complete it from any thread, so it cannot call the handler directly.
+template <class Result, class Handler>
+struct LocalDeferredReply {
+    LocalDeferredReply (boost::asio::io_service& context, Handler handler,
+            const util::log::Logger& log)
+        : context(context)
+        , timer(context)
+        , replyHandler(makeFireReplyHandler<Result>(std::move(handler), log))
+    {}
+
+    boost::asio::io_service& context;
+    boost::asio::steady_timer timer;
+    FireReplyHandler<Result, Handler> replyHandler;
+    bool done = false;
+
+    void complete (const std::vector<uint8_t>& bytes) {
+        if (done) {
+            return;
+        }
+        done = true;
+        timer.cancel();
+        if (bytes.empty()) {
+            // Fire-and-forget, so there is no reply to decode.
+            replyHandler.realHandler(boost::system::error_code(), Result());
+            return;
+        }
+        barobo_rpc_ServerMessage message;
+        PayloadView payload;
+        Status status;
+        rpc::decode(message, payload, bytes.data(), bytes.size(), status);
+        if (hasError(status)) {
+            replyHandler.realHandler(status, Result());
+        }
+        else if (barobo_rpc_ServerMessage_Type_REPLY != message.type || !message.has_reply) {
+            replyHandler.realHandler(Status::PROTOCOL_ERROR, Result());
+        }
+        else {
+            replyHandler.complete(boost::system::error_code(), &message.reply, payload);
+        }
+    }
+
+    void expire () {
+        if (!done) {
+            done = true;
+            replyHandler.complete(boost::system::error_code(), nullptr, PayloadView{nullptr, 0});
+        }
+    }
+
+    // DeferredTarget::send, whose context is a heap-allocated shared_ptr to
+    // the reply, freed here as send is called exactly once.
+    static void send (void* context, uint32_t, const uint8_t* bytes, size_t size) {
+        std::unique_ptr<std::shared_ptr<LocalDeferredReply>> self {
+            static_cast<std::shared_ptr<LocalDeferredReply>*>(context)
+        };
+        auto reply = std::move(*self);
+        auto copy = std::vector<uint8_t>(bytes, bytes + size);
+        reply->context.post([reply, copy] {
+            reply->complete(copy);
+        });
+    }
+};
+
+// The result sink for rpc::_::fire: the result goes straight to the handler,
+// or the Deferred to a LocalDeferredReply.
+template <class Handler, class Duration>
+struct LocalReplySink {
+    boost::asio::io_service& context;
+    Handler handler;
+    Duration timeout;
+    util::log::Logger log;
+
+    template <class Result>
+    void operator() (const Result& result, Status& status) {
+        status = Status::OK;
+        context.post(std::bind(std::move(handler), boost::system::error_code(), result));
+    }
+
+    template <class Result>
+    Deferred<Result> defer (Status& status) {
+        using Reply = LocalDeferredReply<Result, Handler>;
+        status = Status::OK;
+        auto reply = std::make_shared<Reply>(context, std::move(handler), log);
+        reply->timer.expires_from_now(timeout);
+        reply->timer.async_wait([reply] (boost::system::error_code ec) {
+            if (!ec) {
+                reply->expire();
+            }
+        });
+        auto target = DeferredTarget{nullptr, &Reply::send, nullptr,
+            new std::shared_ptr<Reply>(reply)};
+        return Deferred<Result>{target, 0, 0};
+    }
+};
+
+} // namespace _
+
+// The server end of an in-process binding: a server implementation, and the
+// io_service on which its onFire overloads are called. It must outlive its
+// clients and their outstanding requests.
+template <class Interface, class T>
+class LocalServer {
+public:
+    LocalServer (boost::asio::io_service& context, T& impl)
+        : mContext(context)
+        , mImpl(impl)
+    {
+        (void)AssertServerImplementsInterface<T, Interface>();
+        mLog.add_attribute("Protocol", boost::log::attributes::constant<std::string>("RB-LOCAL"));
+    }
+
+    LocalServer (const LocalServer&) = delete;
+    LocalServer& operator= (const LocalServer&) = delete;
+
+    boost::asio::io_service& get_io_service () { return mContext; }
+
+    T& impl () { return mImpl; }
+
+    util::log::Logger& log () { return mLog; }
+
+    using ClientState = _::LocalClientState<Interface>;
+
+    // Only to be used on the server's io_service, as are attach and detach.
+    const std::vector<std::shared_ptr<ClientState>>& clients () const { return mClients; }
+
+    void attach (std::shared_ptr<ClientState> client) {
+        mClients.push_back(std::move(client));
+    }
+
+    void detach (const ClientState* client) {
+        auto iter = std::find_if(mClients.begin(), mClients.end(),
+            [client] (const std::shared_ptr<ClientState>& c) { return c.get() == client; });
+        if (iter != mClients.end()) {
+            mClients.erase(iter);
+        }
+    }
+
+    // Change what the server knows about a client, on the server's
+    // io_service.
+    template <class Function>
+    void update (std::shared_ptr<ClientState> client, Function&& f) {
+        mContext.post([client, f] () mutable { f(*client); });
+    }
+
+private:
+    boost::asio::io_service& mContext;
+    T& mImpl;
+    std::vector<std::shared_ptr<ClientState>> mClients;
+
+    util::log::Logger mLog;
+};
+
+// The client end of an in-process binding. Its handlers run on its own
+// io_service, which may be the server's.
+template <class Interface, class T>
+class LocalClient {
+public:
+    using Server = LocalServer<Interface, T>;
+    using State = _::LocalClientState<Interface>;
+
+    LocalClient (boost::asio::io_service& context, Server& server)
+        : mServer(server)
+        , mState(std::make_shared<State>(context))
+    {
+        auto& s = mServer;
+        mServer.update(mState, [&s, state = mState] (State&) { s.attach(state); });
+    }
+
+    ~LocalClient () {
+        boost::system::error_code ec;
+        close(ec);
+        auto& s = mServer;
+        mServer.update(mState, [&s] (State& state) { s.detach(&state); });
+    }
+
+    LocalClient (const LocalClient&) = delete;
+    LocalClient& operator= (const LocalClient&) = delete;
+
+    boost::asio::io_service& get_io_service () { return mState->context; }
+
+    Server& server () { return mServer; }
+
+    State& state () { return *mState; }
+    const std::shared_ptr<State>& sharedState () const { return mState; }
+
+    util::log::Logger& log () { return mServer.log(); }
+
+    // Disconnect, and stop delivering broadcasts to asyncRunClient's
+    // implementation.
+    void close (boost::system::error_code& ec) {
+        ec = {};
+        mServer.update(mState, [] (State& state) { state.connected = false; });
+        mState->onBroadcast.clear();
+        if (mState->runHandler) {
+            mState->context.post(std::bind(std::move(mState->runHandler),
+                boost::system::error_code(boost::asio::error::operation_aborted)));
+            mState->runHandler = nullptr;
+        }
+    }
+
+private:
+    Server& mServer;
+    std::shared_ptr<State> mState;
+};
+
+template <class Interface, class T, class Duration, class Handler>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code))
+asyncConnect (LocalClient<Interface, T>& client, Duration&&, Handler&& handler) {
+    util::asio::AsyncCompletion<
+        Handler, void(boost::system::error_code)
+    > init { std::forward<Handler>(handler) };
+
+    // Both ends were built from the same interface definition, so there is
+    // no version to check.
+    auto& context = client.get_io_service();
+    client.server().update(client.sharedState(),
+        [&context, handler = init.handler] (_::LocalClientState<Interface>& state) {
+            state.connected = true;
+            state.subscriptions.clear();
+            context.post(std::bind(handler, boost::system::error_code()));
+        });
+
+    return init.result.get();
+}
+
+template <class Interface, class T, class Duration, class Handler>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code))
+asyncDisconnect (LocalClient<Interface, T>& client, Duration&&, Handler&& handler) {
+    util::asio::AsyncCompletion<
+        Handler, void(boost::system::error_code)
+    > init { std::forward<Handler>(handler) };
+
+    auto& context = client.get_io_service();
+    client.server().update(client.sharedState(),
+        [&context, handler = init.handler] (_::LocalClientState<Interface>& state) {
+            state.connected = false;
+            context.post(std::bind(handler, boost::system::error_code()));
+        });
+
+    return init.result.get();
+}
+
+template <class Interface, class T, class Duration, class Handler>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code))
+asyncSetSubscription (LocalClient<Interface, T>& client, uint32_t id, bool subscribed,
+        Duration&&, Handler&& handler) {
+    util::asio::AsyncCompletion<
+        Handler, void(boost::system::error_code)
+    > init { std::forward<Handler>(handler) };
+
+    auto& context = client.get_io_service();
+    client.server().update(client.sharedState(),
+        [&context, id, subscribed, handler = init.handler]
+                (_::LocalClientState<Interface>& state) {
+            auto status = state.connected
+                ? setSubscription<Interface>(state.subscriptions, id, subscribed)
+                : Status::NOT_CONNECTED;
+            auto ec = hasError(status)
+                ? make_error_code(RemoteStatus(status))
+                : boost::system::error_code();
+            context.post(std::bind(handler, ec));
+        });
+
+    return init.result.get();
+}
+
+// Call the server implementation's onFire on the server's io_service, and
+// complete the handler with its result on the client's. A method with a
+// deferred reply is timed out like a remote one; one which returns its
+// result does not need to be.
+template <class Interface, class T, class Method, class Duration, class Handler,
+          class Result = typename ResultOf<Method>::type>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code, Result))
+asyncFire (LocalClient<Interface, T>& client, Method args, Duration&& timeout, Handler&& handler) {
+    util::asio::AsyncCompletion<
+        Handler, void(boost::system::error_code, Result)
+    > init { std::forward<Handler>(handler) };
+    auto& realHandler = init.handler;
+
+    auto& context = client.get_io_service();
+    using Sink = _::LocalReplySink<typename std::decay<decltype(realHandler)>::type,
+        typename std::decay<Duration>::type>;
+    auto& server = client.server();
+    server.update(client.sharedState(),
+        [&server, &context, args, realHandler, timeout, log = client.log()]
+                (_::LocalClientState<Interface>& state) mutable {
+            auto sink = Sink{context, std::move(realHandler), timeout, log};
+            auto status = Status::OK;
+            if (!state.connected) {
+                status = Status::NOT_CONNECTED;
+            }
+            else {
+                rpc::_::fire(server.impl(), args, sink, status);
+            }
+            if (hasError(status)) {
+                context.post(std::bind(std::move(sink.handler),
+                    make_error_code(RemoteStatus(status)), Result()));
+            }
+        });
+
+    return init.result.get();
+}
+
+// Call onBroadcast on every client implementation which is connected and
+// subscribed to the broadcast, each on its client's io_service. Call this on
+// the server's io_service.
+template <class Interface, class T, class Broadcast, class Handler>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code))
+asyncBroadcast (LocalServer<Interface, T>& server, Broadcast args, Handler&& handler) {
+    static_assert(IsBroadcast<Broadcast>::value, "asyncBroadcast needs a broadcast struct");
+
+    util::asio::AsyncCompletion<
+        Handler, void(boost::system::error_code)
+    > init { std::forward<Handler>(handler) };
+
+    for (auto& client : server.clients()) {
+        if (client->connected && isSubscribed<Broadcast>(client->subscriptions)) {
+            auto state = client;
+            client->context.post([state, args] {
+                const auto index = BroadcastIndex<Broadcast>::value;
+                if (index < state->onBroadcast.size() && state->onBroadcast[index]) {
+                    state->onBroadcast[index](&args);
+                }
+            });
+        }
+    }
+    server.get_io_service().post(std::bind(init.handler, boost::system::error_code()));
+
+    return init.result.get();
+}
+
+// Deliver broadcasts to impl until the client is closed, when the handler is
+// called with operation_aborted, as asyncRunClient's would be. Broadcasts
+// sent while no asyncRunClient is running are dropped.
+template <class Interface, class T, class Impl, class Handler>
+BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code))
+asyncRunClient (LocalClient<Interface, T>& client, Impl& impl, Handler&& handler) {
+    (void)AssertClientImplementsInterface<Impl, Interface>();
+
+    util::asio::AsyncCompletion<
+        Handler, void(boost::system::error_code)
+    > init { std::forward<Handler>(handler) };
+
+    auto& state = client.state();
+    if (state.runHandler) {
+        client.get_io_service().post(std::bind(init.handler,
+            boost::system::error_code(boost::asio::error::already_started)));
+        return init.result.get();
+    }
+    state.onBroadcast.assign(BroadcastList<Interface>::size, nullptr);
+    auto binder = _::LocalBroadcastBinder<Impl>{impl, state.onBroadcast};
+    BroadcastList<Interface>::forEach(binder);
+    state.runHandler = init.handler;
+
+    return init.result.get();
+}
+
+}} // namespace rpc::asio
+
+#endif
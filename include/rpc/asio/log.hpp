@@ -0,0 +1,59 @@
+#ifndef RPC_ASIO_LOG_HPP
+#define RPC_ASIO_LOG_HPP
+
+#include <util/log.hpp>
+
+#include <atomic>
+
+// rpc::asio logs in two levels of detail:
+//   RPC_ASIO_LOG_LIFECYCLE: connections, disconnections, subscriptions, and
+//     errors;
+//   RPC_ASIO_LOG_REQUESTS: all that, plus a record for every request, reply,
+//     and broadcast, which is costly on a busy connection.
+// RPC_ASIO_LOG_LEVEL is the most detail compiled in. Define it before including
+// any rpc/asio header to override the default, which is RPC_ASIO_LOG_LIFECYCLE
+// when NDEBUG is defined and RPC_ASIO_LOG_REQUESTS otherwise. Below that,
+// rpc::asio::setLogLevel() chooses the detail at run time.
+
+#define RPC_ASIO_LOG_LIFECYCLE 1
+#define RPC_ASIO_LOG_REQUESTS 2
+
+#ifndef RPC_ASIO_LOG_LEVEL
+#ifdef NDEBUG
+#define RPC_ASIO_LOG_LEVEL RPC_ASIO_LOG_LIFECYCLE
+#else
+#define RPC_ASIO_LOG_LEVEL RPC_ASIO_LOG_REQUESTS
+#endif
+#endif
+
+namespace rpc {
+namespace asio {
+
+namespace _ {
+
+inline std::atomic<int>& logLevel () {
+    static std::atomic<int> level = { RPC_ASIO_LOG_LEVEL };
+    return level;
+}
+
+} // namespace _
+
+inline int logLevel () {
+    return _::logLevel().load(std::memory_order_relaxed);
+}
+
+inline void setLogLevel (int level) {
+    _::logLevel().store(level, std::memory_order_relaxed);
+}
+
+}} // namespace rpc::asio
+
+// BOOST_LOG for per-request records. Unless requests are being logged, the
+// record's contents are never evaluated, and if RPC_ASIO_LOG_LEVEL leaves them
+// out, the whole statement compiles to nothing.
+#define RPC_ASIO_LOG_REQUEST(logger) \
+    if (RPC_ASIO_LOG_LEVEL < RPC_ASIO_LOG_REQUESTS \
+            || ::rpc::asio::logLevel() < RPC_ASIO_LOG_REQUESTS) {} \
+    else BOOST_LOG(logger)
+
+#endif
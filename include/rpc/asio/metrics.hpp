@@ -0,0 +1,337 @@
+#ifndef RPC_ASIO_METRICS_HPP
+#define RPC_ASIO_METRICS_HPP
+
+#include "rpc.pb.h"
+
+#include <rpc/system_error.hpp>
+
+#include <boost/system/error_code.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace rpc {
+namespace asio {
+
+// A histogram of durations, in nanoseconds, with HdrHistogram's bucketing:
+// values below kSubBuckets get a bucket each, and every power of two above
+// that is split into kSubBuckets equal buckets, so any recorded value is known
+// to within 1/kSubBuckets of itself. Durations of 2^kMaxExponent ns (about 69
+// seconds) or more share the last bucket. Recording is a relaxed atomic
+// increment or two, and may happen on any thread.
+class LatencyHistogram {
+public:
+    static const unsigned kSubBucketBits = 4;
+    static const size_t kSubBuckets = size_t(1) << kSubBucketBits;
+    static const unsigned kMaxExponent = 36;
+    static const size_t kBuckets = (kMaxExponent - kSubBucketBits + 1) * kSubBuckets;
+
+    LatencyHistogram () {
+        for (auto& bucket : mBuckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    LatencyHistogram (const LatencyHistogram&) = delete;
+    LatencyHistogram& operator= (const LatencyHistogram&) = delete;
+
+    template <class Duration>
+    void record (Duration duration) {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+        auto value = ns > 0 ? uint64_t(ns) : 0;
+        mBuckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        mCount.fetch_add(1, std::memory_order_relaxed);
+        mSum.fetch_add(value, std::memory_order_relaxed);
+        auto max = mMax.load(std::memory_order_relaxed);
+        while (value > max && !mMax.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+    }
+
+    // The histogram's counts at some moment while it was being read. Samples
+    // recorded during the read may or may not be included.
+    struct Snapshot {
+        std::array<uint64_t, kBuckets> buckets;
+        uint64_t count;
+        uint64_t sumNs;
+        uint64_t maxNs;
+
+        double meanNs () const {
+            return count ? double(sumNs) / double(count) : 0;
+        }
+
+        // The smallest value at least the given fraction of samples are no
+        // greater than, to the histogram's precision: e.g., valueAt(0.99) is
+        // the 99th percentile.
+        std::chrono::nanoseconds valueAt (double quantile) const {
+            auto total = uint64_t(0);
+            for (auto n : buckets) {
+                total += n;
+            }
+            if (!total) {
+                return std::chrono::nanoseconds(0);
+            }
+            auto rank = std::max(uint64_t(1), uint64_t(std::ceil(quantile * double(total))));
+            auto seen = uint64_t(0);
+            for (size_t i = 0; i < kBuckets; ++i) {
+                seen += buckets[i];
+                if (seen >= rank) {
+                    return std::chrono::nanoseconds(std::min(bucketUpperBound(i), maxNs));
+                }
+            }
+            return std::chrono::nanoseconds(maxNs);
+        }
+    };
+
+    Snapshot snapshot () const {
+        Snapshot s;
+        for (size_t i = 0; i < kBuckets; ++i) {
+            s.buckets[i] = mBuckets[i].load(std::memory_order_relaxed);
+        }
+        s.count = mCount.load(std::memory_order_relaxed);
+        s.sumNs = mSum.load(std::memory_order_relaxed);
+        s.maxNs = mMax.load(std::memory_order_relaxed);
+        return s;
+    }
+
+    static size_t bucketOf (uint64_t ns) {
+        if (ns < kSubBuckets) {
+            return size_t(ns);
+        }
+        auto exponent = highestBit(ns);
+        if (exponent >= kMaxExponent) {
+            return kBuckets - 1;
+        }
+        auto shift = exponent - kSubBucketBits;
+        return (shift + 1) * kSubBuckets + size_t((ns >> shift) & (kSubBuckets - 1));
+    }
+
+    // The range of values, in nanoseconds, counted in a bucket.
+    static uint64_t bucketLowerBound (size_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        auto shift = unsigned(bucket / kSubBuckets - 1);
+        return (kSubBuckets + bucket % kSubBuckets) << shift;
+    }
+
+    static uint64_t bucketUpperBound (size_t bucket) {
+        if (bucket == kBuckets - 1) {
+            return UINT64_MAX;
+        }
+        return bucketLowerBound(bucket + 1) - 1;
+    }
+
+private:
+    static unsigned highestBit (uint64_t value) {
+#if defined(__GNUC__)
+        return 63 - unsigned(__builtin_clzll(value));
+#else
+        unsigned bit = 0;
+        while (value >>= 1) {
+            ++bit;
+        }
+        return bit;
+#endif
+    }
+
+    std::atomic<uint64_t> mBuckets[kBuckets];
+    std::atomic<uint64_t> mCount = { 0 };
+    std::atomic<uint64_t> mSum = { 0 };
+    std::atomic<uint64_t> mMax = { 0 };
+};
+
+// Request counts and latencies by component ID, and traffic totals, for one
+// connection. A client records each method request from when it is sent until
+// its reply arrives; a server records how long each onFire call takes. Every
+// counter is a relaxed atomic, so recording never blocks, and snapshot() may
+// be called from any thread while the connection's io_service runs.
+//
+// Components are filed in a fixed table of kComponentCapacity entries, which
+// are claimed as component IDs are first seen and never given back. Requests
+// for components which find the table full are counted as unlisted.
+class Metrics {
+public:
+    static const size_t kComponentCapacity = 64;
+    // Errors are counted by their rpc::Status (or rpc::RemoteStatus) value.
+    static const size_t kStatusCount = size_t(_barobo_rpc_Status_MAX) + 1;
+
+    Metrics () {
+        for (auto& entry : mComponents) {
+            entry.key.store(0, std::memory_order_relaxed);
+            entry.counters.store(nullptr, std::memory_order_relaxed);
+        }
+    }
+
+    ~Metrics () {
+        for (auto& entry : mComponents) {
+            delete entry.counters.load(std::memory_order_acquire);
+        }
+    }
+
+    Metrics (const Metrics&) = delete;
+    Metrics& operator= (const Metrics&) = delete;
+
+    // Count a request which has completed with the given error, or none.
+    void record (uint32_t componentId, boost::system::error_code ec) {
+        count(countersFor(componentId), ec);
+    }
+
+    // As above, for a request which took the given time.
+    template <class Duration>
+    void record (uint32_t componentId, boost::system::error_code ec, Duration latency) {
+        auto& counters = countersFor(componentId);
+        count(counters, ec);
+        counters.latency.record(latency);
+    }
+
+    // Count a message sent or received over the connection.
+    void addBytesIn (size_t size) {
+        mMessagesIn.fetch_add(1, std::memory_order_relaxed);
+        mBytesIn.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    void addBytesOut (size_t size) {
+        mMessagesOut.fetch_add(1, std::memory_order_relaxed);
+        mBytesOut.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    struct ComponentStats {
+        uint32_t componentId;
+        uint64_t requests;
+        // Failed requests. Those whose error was neither an rpc::Status nor an
+        // rpc::RemoteStatus, e.g., a transport error, are in errors but not
+        // errorsByStatus.
+        uint64_t errors;
+        std::array<uint64_t, kStatusCount> errorsByStatus;
+        // Requests which never completed, e.g., because they timed out, have
+        // no latency sample.
+        LatencyHistogram::Snapshot latency;
+    };
+
+    struct Snapshot {
+        uint64_t messagesIn;
+        uint64_t bytesIn;
+        uint64_t messagesOut;
+        uint64_t bytesOut;
+        std::vector<ComponentStats> components;
+        ComponentStats unlisted;
+    };
+
+    Snapshot snapshot () const {
+        Snapshot s;
+        s.messagesIn = mMessagesIn.load(std::memory_order_relaxed);
+        s.bytesIn = mBytesIn.load(std::memory_order_relaxed);
+        s.messagesOut = mMessagesOut.load(std::memory_order_relaxed);
+        s.bytesOut = mBytesOut.load(std::memory_order_relaxed);
+        for (auto& entry : mComponents) {
+            auto key = entry.key.load(std::memory_order_acquire);
+            auto counters = entry.counters.load(std::memory_order_acquire);
+            if (key && counters) {
+                s.components.push_back(counters->stats(uint32_t(key - 1)));
+            }
+        }
+        s.unlisted = mUnlisted.stats(0);
+        return s;
+    }
+
+private:
+    struct Counters {
+        Counters () {
+            for (auto& n : errorsByStatus) {
+                n.store(0, std::memory_order_relaxed);
+            }
+        }
+
+        ComponentStats stats (uint32_t componentId) const {
+            ComponentStats s;
+            s.componentId = componentId;
+            s.requests = requests.load(std::memory_order_relaxed);
+            s.errors = errors.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < kStatusCount; ++i) {
+                s.errorsByStatus[i] = errorsByStatus[i].load(std::memory_order_relaxed);
+            }
+            s.latency = latency.snapshot();
+            return s;
+        }
+
+        std::atomic<uint64_t> requests = { 0 };
+        std::atomic<uint64_t> errors = { 0 };
+        std::atomic<uint64_t> errorsByStatus[kStatusCount];
+        LatencyHistogram latency;
+    };
+
+    // An entry's key is its component ID plus one, or zero while the entry is
+    // free. Its counters are allocated by whichever thread first finds them
+    // missing.
+    struct Entry {
+        std::atomic<uint64_t> key;
+        std::atomic<Counters*> counters;
+    };
+
+    static void count (Counters& counters, boost::system::error_code ec) {
+        counters.requests.fetch_add(1, std::memory_order_relaxed);
+        if (ec) {
+            counters.errors.fetch_add(1, std::memory_order_relaxed);
+            auto status = statusOf(ec);
+            if (status < kStatusCount) {
+                counters.errorsByStatus[status].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    static size_t statusOf (boost::system::error_code ec) {
+        if (ec.category() == errorCategory() || ec.category() == remoteErrorCategory()) {
+            return size_t(ec.value());
+        }
+        return kStatusCount;
+    }
+
+    Counters& countersFor (uint32_t componentId) {
+        const uint64_t key = uint64_t(componentId) + 1;
+        auto start = size_t(componentId * 2654435761u) % kComponentCapacity;
+        for (size_t probe = 0; probe < kComponentCapacity; ++probe) {
+            auto& entry = mComponents[(start + probe) % kComponentCapacity];
+            auto found = entry.key.load(std::memory_order_acquire);
+            if (!found && entry.key.compare_exchange_strong(found, key,
+                    std::memory_order_acq_rel, std::memory_order_acquire)) {
+                found = key;
+            }
+            if (found == key) {
+                return countersOf(entry);
+            }
+        }
+        return mUnlisted;
+    }
+
+    static Counters& countersOf (Entry& entry) {
+        auto counters = entry.counters.load(std::memory_order_acquire);
+        if (!counters) {
+            auto fresh = new Counters;
+            if (entry.counters.compare_exchange_strong(counters, fresh,
+                    std::memory_order_acq_rel, std::memory_order_acquire)) {
+                counters = fresh;
+            }
+            else {
+                delete fresh;
+            }
+        }
+        return *counters;
+    }
+
+    Entry mComponents[kComponentCapacity];
+    Counters mUnlisted;
+
+    std::atomic<uint64_t> mMessagesIn = { 0 };
+    std::atomic<uint64_t> mBytesIn = { 0 };
+    std::atomic<uint64_t> mMessagesOut = { 0 };
+    std::atomic<uint64_t> mBytesOut = { 0 };
+};
+
+}} // namespace rpc::asio
+
+#endif
@@ -0,0 +1,583 @@
+#ifndef RPC_ASIO_MULTIPLEXPROXY_HPP
+#define RPC_ASIO_MULTIPLEXPROXY_HPP
+
+#include "rpc.pb.h"
+
+#include <rpc/asio/client.hpp>
+#include <rpc/asio/proxy.hpp>
+#include <rpc/asio/server.hpp>
+
+#include <rpc/message.hpp>
+#include <rpc/subscriptions.hpp>
+#include <rpc/system_error.hpp>
+
+#include <util/log.hpp>
+#include <util/asio/asynccompletion.hpp>
+#include <util/asio/operation.hpp>
+#include <util/asio/transparentservice.hpp>
+
+#include <boost/asio/io_service.hpp>
+
+#include <boost/log/attributes/constant.hpp>
+
+#include <boost/optional.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include <cstring>
+
+#include <boost/asio/yield.hpp>
+
+namespace rpc { namespace asio {
+
+template <class Interface, class C, class S>
+class MultiplexedConnection;
+
+// The STATUS to give a downstream client for the outcome of an upstream
+// request. Errors which are not RPC statuses mean the upstream link failed.
+inline Status downstreamStatus (boost::system::error_code ec) {
+    if (!ec) {
+        return Status::OK;
+    }
+    if (ec.category() == errorCategory() || ec.category() == remoteErrorCategory()) {
+        return Status(ec.value());
+    }
+    return Status::NOT_CONNECTED;
+}
+
+// One upstream client shared by many downstream servers of Interface, for
+// gateways whose clients far outnumber the connections the robot behind them
+// can take.
+//
+// Downstream requests are forwarded as frames (see ForwardOneFrameOperation),
+// each under a fresh upstream request ID, so requests from different
+// connections never collide. CONNECT and DISCONNECT are answered here, as
+// forwarding them would disturb every other connection. SUBSCRIBE and
+// UNSUBSCRIBE are answered here too, following rpc/subscriptions.hpp, and the
+// upstream is told to send a broadcast exactly when some downstream
+// connection receives it. Each upstream broadcast is received once, and its
+// frame sent as is to every downstream connection which receives it.
+template <class Interface, class C, class S>
+struct MultiplexProxyImpl : std::enable_shared_from_this<MultiplexProxyImpl<Interface, C, S>> {
+    using Connection = MultiplexedConnection<Interface, C, S>;
+
+    explicit MultiplexProxyImpl (boost::asio::io_service& context)
+        : mClient(context)
+    {
+        mLog.add_attribute("Protocol", boost::log::attributes::constant<std::string>("RB-MX"));
+    }
+
+    void close (boost::system::error_code& ec) {
+        // Closing a connection ends its serving operation, which detaches it.
+        auto connections = mConnections;
+        for (auto& connection : connections) {
+            boost::system::error_code connectionEc;
+            connection->close(connectionEc);
+            if (connectionEc) {
+                BOOST_LOG(mLog) << "Ignoring downstream close error: " << connectionEc.message();
+            }
+        }
+        mClient.close(ec);
+    }
+
+    C& client () { return mClient; }
+
+    auto& log () { return mLog; }
+
+    // The upstream server's reply to our CONNECT request, which downstream
+    // clients get in reply to theirs. None until the upstream is connected.
+    const boost::optional<barobo_rpc_Reply>& versions () const { return mVersions; }
+    void setVersions (const barobo_rpc_Reply& versions) { mVersions = versions; }
+
+    const std::vector<std::shared_ptr<Connection>>& connections () const {
+        return mConnections;
+    }
+
+    void attach (std::shared_ptr<Connection> connection) {
+        mConnections.push_back(std::move(connection));
+    }
+
+    void detach (const Connection* connection) {
+        auto iter = std::find_if(mConnections.begin(), mConnections.end(),
+            [connection] (const std::shared_ptr<Connection>& c) { return c.get() == connection; });
+        if (iter != mConnections.end()) {
+            mConnections.erase(iter);
+        }
+    }
+
+    // Count a downstream connection starting, or ceasing, to receive a
+    // broadcast.
+    void countReceiver (uint32_t componentId, bool receives) {
+        if (receives) {
+            ++mReceivers[componentId];
+            return;
+        }
+        auto iter = mReceivers.find(componentId);
+        assert(iter != mReceivers.end() && iter->second);
+        if (!--iter->second) {
+            mReceivers.erase(iter);
+        }
+    }
+
+    bool hasReceivers (uint32_t componentId) const {
+        return mReceivers.count(componentId);
+    }
+
+    // If the upstream server must be told to start or stop sending a
+    // broadcast, because it has gained its first receiver or lost its last,
+    // record the change as made, and return true. revertUpstream undoes the
+    // record if the upstream server refuses.
+    bool updateUpstream (uint32_t componentId) {
+        auto subscribe = hasReceivers(componentId);
+        if (subscribe == isSubscribed<Interface>(mUpstream, componentId)) {
+            return false;
+        }
+        setSubscription<Interface>(mUpstream, componentId, subscribe);
+        return true;
+    }
+
+    void revertUpstream (uint32_t componentId, bool subscribed) {
+        setSubscription<Interface>(mUpstream, componentId, !subscribed);
+    }
+
+    // As updateUpstream, but tell the upstream server too, and just log any
+    // failure: for changes nobody is waiting on.
+    void syncUpstream (uint32_t componentId) {
+        if (!updateUpstream(componentId)) {
+            return;
+        }
+        auto subscribe = hasReceivers(componentId);
+        auto self = this->shared_from_this();
+        asyncSetSubscription(mClient, componentId, subscribe, std::chrono::seconds(60),
+            [self, this, componentId, subscribe] (boost::system::error_code ec) {
+                if (ec) {
+                    BOOST_LOG(mLog) << "Error updating upstream subscription: " << ec.message();
+                    revertUpstream(componentId, subscribe);
+                }
+            });
+    }
+
+    C mClient;
+    boost::optional<barobo_rpc_Reply> mVersions;
+    std::vector<std::shared_ptr<Connection>> mConnections;
+    // How many downstream connections receive each broadcast, and the
+    // upstream connection's own subscription toggles.
+    std::map<uint32_t, size_t> mReceivers;
+    DynamicSubscriptionBitmap mUpstream;
+
+    mutable util::log::Logger mLog;
+};
+
+template <class Interface, class C, class S>
+class MultiplexProxy : public util::asio::TransparentIoObject<MultiplexProxyImpl<Interface, C, S>> {
+public:
+    using Client = C;
+    using Server = S;
+
+    explicit MultiplexProxy (boost::asio::io_service& context)
+        : util::asio::TransparentIoObject<MultiplexProxyImpl<Interface, C, S>>(context)
+    {}
+
+    Client& client () { return this->get_implementation()->client(); }
+
+    util::log::Logger& log () { return this->get_implementation()->log(); }
+
+    size_t connectionCount () const {
+        return this->get_implementation()->connections().size();
+    }
+};
+
+// A downstream connection of a MultiplexProxy. It looks enough like a Proxy
+// for ForwardOneFrameOperation: its client is the shared upstream client, and
+// closing it closes only its own server.
+template <class Interface, class C, class S>
+class MultiplexedConnection : public std::enable_shared_from_this<MultiplexedConnection<Interface, C, S>> {
+public:
+    using Client = C;
+    using Server = S;
+    using Mux = MultiplexProxyImpl<Interface, C, S>;
+    using RequestPair = typename S::RequestPair;
+    using ForwardedMap = std::map<typename S::RequestId, typename C::RequestId>;
+
+    MultiplexedConnection (std::shared_ptr<Mux> mux, std::shared_ptr<S> server)
+        : mMux(std::move(mux))
+        , mServer(std::move(server))
+    {}
+
+    Mux& mux () { return *mMux; }
+    Client& client () { return mMux->client(); }
+    Server& server () { return *mServer; }
+
+    util::log::Logger& log () { return mMux->log(); }
+
+    // The upstream request ID under which each request still awaiting a reply
+    // was forwarded.
+    ForwardedMap& forwarded () { return mForwarded; }
+
+    void close () {
+        boost::system::error_code ec;
+        close(ec);
+    }
+
+    void close (boost::system::error_code& ec) {
+        mServer->close(ec);
+    }
+
+    // Whether the connection's client receives the broadcast, given its
+    // subscription toggles.
+    bool isSubscribed (uint32_t componentId) const {
+        return rpc::isSubscribed<Interface>(mToggles, componentId);
+    }
+
+    // Start serving: the connection receives the broadcasts which are not
+    // selective, so the upstream server must send them.
+    void attach () {
+        mMux->attach(this->shared_from_this());
+        forEachReceived([this] (uint32_t id) {
+            mMux->countReceiver(id, true);
+            mMux->syncUpstream(id);
+        });
+    }
+
+    // A CONNECT request starts the client's session afresh, so it receives
+    // the broadcasts which are not selective again, and no others.
+    void resetSubscriptions () {
+        auto visitor = [this] (const auto& broadcast, size_t index) {
+            using Broadcast = typename std::decay<decltype(broadcast)>::type;
+            if (!mToggles.test(index)) {
+                return;
+            }
+            auto received = rpc::isSubscribed<Broadcast>(mToggles);
+            mToggles.set(index, false);
+            mMux->countReceiver(componentId(broadcast), !received);
+            mMux->syncUpstream(componentId(broadcast));
+        };
+        BroadcastList<Interface>::forEach(visitor);
+    }
+
+    // Handle a SUBSCRIBE or UNSUBSCRIBE request. Only the first connection to
+    // receive a broadcast, and the last to stop, need the upstream server's
+    // subscription changed; the rest are answered here.
+    void updateSubscription (const RequestPair& rp) {
+        if (!rp.request.has_subscription) {
+            sendStatus(rp.id, Status::PROTOCOL_ERROR);
+            return;
+        }
+        auto id = rp.request.subscription.id;
+        auto subscribe = barobo_rpc_Request_Type_SUBSCRIBE == rp.request.type;
+        auto received = isSubscribed(id);
+        auto status = setSubscription<Interface>(mToggles, id, subscribe);
+        if (hasError(status) || subscribe == received) {
+            sendStatus(rp.id, status);
+            return;
+        }
+        mMux->countReceiver(id, subscribe);
+        if (!mMux->updateUpstream(id)) {
+            sendStatus(rp.id, Status::OK);
+            return;
+        }
+
+        auto self = this->shared_from_this();
+        auto requestId = rp.id;
+        asyncSetSubscription(client(), id, subscribe,
+            forwardingDeadline(rp) - std::chrono::steady_clock::now(),
+            [self, this, id, subscribe, requestId] (boost::system::error_code ec) {
+                // The upstream server's subscriptions are as they were, so
+                // undo ours to match.
+                if (ec) {
+                    mMux->revertUpstream(id, subscribe);
+                    if (!mDetached && subscribe == isSubscribed(id)) {
+                        setSubscription<Interface>(mToggles, id, !subscribe);
+                        mMux->countReceiver(id, !subscribe);
+                    }
+                }
+                sendStatus(requestId, downstreamStatus(ec));
+            });
+    }
+
+    // Give up on everything the connection started: its forwarded requests
+    // are cancelled upstream, and it stops receiving broadcasts.
+    void detach () {
+        for (auto& entry : ForwardedMap(std::move(mForwarded))) {
+            client().cancel(entry.second);
+        }
+        mForwarded.clear();
+
+        forEachReceived([this] (uint32_t id) {
+            mMux->countReceiver(id, false);
+            mMux->syncUpstream(id);
+        });
+        mDetached = true;
+
+        mMux->detach(this);
+    }
+
+    void sendStatus (typename S::RequestId requestId, Status status) {
+        auto self = this->shared_from_this();
+        asyncReply(server(), requestId, status, [self] (boost::system::error_code ec) {
+            if (ec) {
+                BOOST_LOG(self->log()) << "Error replying downstream: " << ec.message();
+            }
+        });
+    }
+
+private:
+    // Call visit with the component ID of each broadcast the connection's
+    // client receives.
+    template <class Visitor>
+    void forEachReceived (Visitor visit) {
+        auto visitor = [this, &visit] (const auto& broadcast, size_t) {
+            using Broadcast = typename std::decay<decltype(broadcast)>::type;
+            if (rpc::isSubscribed<Broadcast>(mToggles)) {
+                visit(componentId(broadcast));
+            }
+        };
+        BroadcastList<Interface>::forEach(visitor);
+    }
+
+    std::shared_ptr<Mux> mMux;
+    std::shared_ptr<S> mServer;
+    ForwardedMap mForwarded;
+    // The client's subscription toggles; see rpc/subscriptions.hpp.
+    DynamicSubscriptionBitmap mToggles;
+    bool mDetached = false;
+};
+
+template <class Interface, class C, class S>
+struct ServeDownstreamOperation {
+    using Connection = MultiplexedConnection<Interface, C, S>;
+    using RequestPair = typename S::RequestPair;
+
+    ServeDownstreamOperation (std::shared_ptr<MultiplexProxyImpl<Interface, C, S>> mux,
+            std::shared_ptr<S> server)
+        : connection_(std::make_shared<Connection>(std::move(mux), std::move(server)))
+    {}
+
+    std::shared_ptr<Connection> connection_;
+
+    boost::system::error_code rc_ = boost::asio::error::operation_aborted;
+
+    std::tuple<boost::system::error_code> result () const {
+        return std::make_tuple(rc_);
+    }
+
+    template <class Op>
+    void operator() (Op&& op, boost::system::error_code ec = {}, RequestPair rp = {}) {
+        if (!ec) reenter (op) {
+            connection_->attach();
+            while (true) {
+                yield connection_->server().asyncReceiveRequest(std::move(op));
+                if (barobo_rpc_Request_Type_CONNECT == rp.request.type) {
+                    connection_->resetSubscriptions();
+                    if (connection_->mux().versions()) {
+                        yield connection_->server().asyncSendReply(rp.id,
+                            *connection_->mux().versions(), std::move(op));
+                    }
+                    else {
+                        yield asyncReply(connection_->server(), rp.id,
+                            Status::NOT_CONNECTED, std::move(op));
+                    }
+                }
+                else if (barobo_rpc_Request_Type_DISCONNECT == rp.request.type) {
+                    yield asyncReply(connection_->server(), rp.id, Status::OK, std::move(op));
+                    break;
+                }
+                else if (barobo_rpc_Request_Type_SUBSCRIBE == rp.request.type
+                        || barobo_rpc_Request_Type_UNSUBSCRIBE == rp.request.type) {
+                    connection_->updateSubscription(rp);
+                }
+                else {
+                    // The handler keeps the connection alive until the reply
+                    // is forwarded, even if we finish first.
+                    auto connection = connection_;
+                    asyncForwardOneFrame(*connection_, rp,
+                        [connection] (boost::system::error_code) {});
+                }
+            }
+            connection_->detach();
+            rc_ = ec;
+        }
+        else {
+            connection_->detach();
+            if (boost::asio::error::operation_aborted != ec) {
+                rc_ = ec;
+                BOOST_LOG(connection_->log()) << "ServeDownstreamOperation I/O error: " << ec.message();
+            }
+        }
+    }
+};
+
+// Serve a downstream connection, whose server's message queue is already
+// connected, until its client disconnects or the connection fails.
+template <class Interface, class C, class S, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, ForwardHandlerSignature)
+asyncServeDownstream (MultiplexProxy<Interface, C, S>& proxy, std::shared_ptr<S> server,
+        CompletionToken&& token) {
+    util::asio::AsyncCompletion<
+        CompletionToken, ForwardHandlerSignature
+    > init { std::forward<CompletionToken>(token) };
+
+    using Op = ServeDownstreamOperation<Interface, C, S>;
+    util::asio::v1::makeOperation<Op>(std::move(init.handler),
+        proxy.get_implementation(), std::move(server))();
+
+    return init.result.get();
+}
+
+// Fan each upstream broadcast out to the downstream connections which
+// receive it. Every connection is sent the same frame, so a broadcast is encoded
+// once however many connections receive it, and a slow connection does not
+// hold up the others.
+template <class Interface, class C, class S>
+struct FanOutBroadcastsOperation {
+    using Mux = MultiplexProxyImpl<Interface, C, S>;
+
+    explicit FanOutBroadcastsOperation (std::shared_ptr<Mux> mux)
+        : mux_(std::move(mux))
+    {}
+
+    std::shared_ptr<Mux> mux_;
+
+    boost::system::error_code rc_ = boost::asio::error::operation_aborted;
+
+    std::tuple<boost::system::error_code> result () const {
+        return std::make_tuple(rc_);
+    }
+
+    template <class Op>
+    void operator() (Op&& op, boost::system::error_code ec = {}, BufferPtr frame = nullptr) {
+        if (!ec) reenter (op) {
+            while (true) {
+                yield mux_->client().asyncReceiveBroadcastFrame(std::move(op));
+                fanOut(frame);
+            }
+        }
+        else if (boost::asio::error::operation_aborted != ec) {
+            rc_ = ec;
+            BOOST_LOG(mux_->log()) << "FanOutBroadcastsOperation I/O error: " << ec.message();
+        }
+    }
+
+    void fanOut (const BufferPtr& frame) {
+        uint32_t componentId;
+        if (!peekBroadcastId(frame->bytes.data(), frame->bytes.size(), componentId)) {
+            BOOST_LOG(mux_->log()) << "Dropping malformed upstream broadcast";
+            return;
+        }
+        auto connections = mux_->connections();
+        for (auto& connection : connections) {
+            if (connection->isSubscribed(componentId)) {
+                connection->server().asyncSendMessage(frame,
+                    [connection] (boost::system::error_code ec) {
+                        if (ec) {
+                            BOOST_LOG(connection->log())
+                                << "Error forwarding broadcast downstream: " << ec.message();
+                        }
+                    });
+            }
+        }
+    }
+};
+
+template <class Interface, class C, class S, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, ForwardHandlerSignature)
+asyncFanOutBroadcasts (std::shared_ptr<MultiplexProxyImpl<Interface, C, S>> mux, CompletionToken&& token) {
+    util::asio::AsyncCompletion<
+        CompletionToken, ForwardHandlerSignature
+    > init { std::forward<CompletionToken>(token) };
+
+    using Op = FanOutBroadcastsOperation<Interface, C, S>;
+    util::asio::v1::makeOperation<Op>(std::move(init.handler), std::move(mux))();
+
+    return init.result.get();
+}
+
+template <class Interface, class C, class S, class Duration>
+struct RunMultiplexProxyOperation {
+    using Mux = MultiplexProxyImpl<Interface, C, S>;
+
+    RunMultiplexProxyOperation (std::shared_ptr<Mux> mux, Duration timeout)
+        : mux_(std::move(mux))
+        , timeout_(timeout)
+    {}
+
+    std::shared_ptr<Mux> mux_;
+    Duration timeout_;
+
+    boost::system::error_code rc_ = boost::asio::error::operation_aborted;
+
+    std::tuple<boost::system::error_code> result () const {
+        return std::make_tuple(rc_);
+    }
+
+    template <class Op>
+    void operator() (Op&& op, boost::system::error_code ec = {},
+            boost::optional<barobo_rpc_Reply> reply = {}) {
+        if (!ec) reenter (op) {
+            yield {
+                barobo_rpc_Request request;
+                memset(&request, 0, sizeof(request));
+                request.type = barobo_rpc_Request_Type_CONNECT;
+                asyncRequest(mux_->client(), request, timeout_, std::move(op));
+            }
+            if (!reply) {
+                rc_ = Status::TIMED_OUT;
+            }
+            else if (barobo_rpc_Reply_Type_VERSIONS != reply->type || !reply->has_versions) {
+                rc_ = Status::PROTOCOL_ERROR;
+            }
+            else {
+                mux_->setVersions(*reply);
+                mux_->client().setServerVersions(Versions{reply->versions});
+                yield asyncFanOutBroadcasts(mux_, std::move(op));
+                rc_ = ec;
+                yield break;
+            }
+            BOOST_LOG(mux_->log()) << "Upstream CONNECT request failed: " << rc_.message();
+            close();
+        }
+        else if (boost::asio::error::operation_aborted != ec) {
+            rc_ = ec;
+            BOOST_LOG(mux_->log()) << "RunMultiplexProxyOperation I/O error: " << ec.message();
+            close();
+        }
+    }
+
+    void close () {
+        boost::system::error_code ec;
+        mux_->close(ec);
+        if (ec) {
+            BOOST_LOG(mux_->log()) << "Error closing multiplexing proxy: " << ec.message();
+        }
+    }
+};
+
+// Connect the multiplexing proxy's client, whose message queue must already
+// be connected, to the upstream server, then fan out its broadcasts until the
+// upstream connection fails. Downstream connections are served separately,
+// with asyncServeDownstream, and may be added before the upstream is
+// connected; their CONNECT requests fail until it is.
+template <class Interface, class C, class S, class Duration, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, ForwardHandlerSignature)
+asyncRunMultiplexProxy (MultiplexProxy<Interface, C, S>& proxy, Duration&& timeout, CompletionToken&& token) {
+    util::asio::AsyncCompletion<
+        CompletionToken, ForwardHandlerSignature
+    > init { std::forward<CompletionToken>(token) };
+
+    using Op = RunMultiplexProxyOperation<Interface, C, S, typename std::decay<Duration>::type>;
+    util::asio::v1::makeOperation<Op>(std::move(init.handler),
+        proxy.get_implementation(), std::forward<Duration>(timeout))();
+
+    return init.result.get();
+}
+
+}} // namespace rpc::asio
+
+#include <boost/asio/unyield.hpp>
+
+#endif
@@ -8,11 +8,18 @@
 #include <util/asio/operation.hpp>
 #include <util/asio/transparentservice.hpp>
 
+#include <rpc/asio/client.hpp>
+#include <rpc/asio/log.hpp>
+
 #include <boost/asio/io_service.hpp>
 
 #include <boost/log/utility/manipulators/add_value.hpp>
 
 #include <chrono>
+#include <map>
+#include <type_traits>
+
+#include <cstring>
 
 #include <boost/asio/yield.hpp>
 
@@ -27,6 +34,18 @@ std::string to_string (const std::pair<T, U> &rid) {
     return oss.str();
 }
 
+// The ID of the request named by a CANCEL request. A CANCEL comes from the
+// same client as the request it cancels, so with PolyServer request IDs, it
+// shares the CANCEL request's subserver.
+inline uint32_t cancelledRequestId (uint32_t, uint32_t id) {
+    return id;
+}
+
+template <class T>
+std::pair<T, uint32_t> cancelledRequestId (const std::pair<T, uint32_t>& rid, uint32_t id) {
+    return std::make_pair(rid.first, id);
+}
+
 template <class Client, class Server>
 struct ProxyImpl {
     explicit ProxyImpl (boost::asio::io_service& context)
@@ -49,8 +68,14 @@ struct ProxyImpl {
 
     auto& log () { return mLog; }
 
+    // The client request ID under which each request still awaiting a reply
+    // was forwarded.
+    using ForwardedMap = std::map<typename Server::RequestId, typename Client::RequestId>;
+    ForwardedMap& forwarded () { return mForwarded; }
+
     Client mClient;
     Server mServer;
+    ForwardedMap mForwarded;
 
     mutable util::log::Logger mLog;
 };
@@ -69,14 +94,73 @@ public:
     Server& server () { return this->get_implementation()->server(); }
 
     util::log::Logger& log () { return this->get_implementation()->log(); }
+
+    auto& forwarded () { return this->get_implementation()->forwarded(); }
 };
 
 typedef void ForwardHandlerSignature(boost::system::error_code);
 
+// Cancel a forwarded request downstream in turn. This aborts the operation
+// forwarding it, so it sends no reply.
+template <class Proxy, class RequestPair>
+void forwardCancel (Proxy& proxy, const RequestPair& rp) {
+    if (!rp.request.has_cancel) {
+        return;
+    }
+    auto& forwarded = proxy.forwarded();
+    auto iter = forwarded.find(cancelledRequestId(rp.id, rp.request.cancel.id));
+    if (iter != forwarded.end()) {
+        auto requestId = iter->second;
+        forwarded.erase(iter);
+        proxy.client().cancel(requestId);
+    }
+}
+
+// The proxy's client learns what the server understands from the VERSIONS
+// reply to the CONNECT request it forwards, as if it had connected itself.
+template <class Proxy>
+void noteServerVersions (Proxy& proxy, const barobo_rpc_Reply& reply) {
+    if (barobo_rpc_Reply_Type_VERSIONS == reply.type && reply.has_versions) {
+        proxy.client().setServerVersions(Versions{reply.versions});
+    }
+}
+
+template <class Proxy>
+void noteServerVersions (Proxy& proxy, const PooledBuffer& frame) {
+    barobo_rpc_ServerMessage message;
+    Status status;
+    decode(message, frame.bytes.data(), frame.bytes.size(), status);
+    if (!hasError(status) && message.has_reply) {
+        noteServerVersions(proxy, message.reply);
+    }
+}
+
+// Forget a request once its reply is in, unless its ID has since been reused.
+template <class Proxy, class SRequestId, class CRequestId>
+void forgetForwarded (Proxy& proxy, const SRequestId& serverRequestId,
+        const CRequestId& clientRequestId) {
+    auto& forwarded = proxy.forwarded();
+    auto iter = forwarded.find(serverRequestId);
+    if (iter != forwarded.end() && iter->second == clientRequestId) {
+        forwarded.erase(iter);
+    }
+}
+
+// When to give up on the reply to a forwarded request. The request's deadline
+// runs from when we received it, so time it spent queued here is not passed on
+// downstream. Requests without one get a minute.
+template <class RequestPair>
+std::chrono::steady_clock::time_point forwardingDeadline (const RequestPair& rp) {
+    return rp.request.has_timeout
+        ? rp.received + std::chrono::milliseconds(rp.request.timeout)
+        : std::chrono::steady_clock::now() + std::chrono::seconds(60);
+}
+
 template <class Proxy>
 struct ForwardOneRequestOperation {
     using SRequestPair = typename Proxy::Server::RequestPair;
     using CRequestId = typename Proxy::Client::RequestId;
+    using Clock = std::chrono::steady_clock;
 
     explicit ForwardOneRequestOperation (Proxy& proxy, SRequestPair rp)
         : proxy_(proxy)
@@ -87,7 +171,8 @@ struct ForwardOneRequestOperation {
 
     SRequestPair rp_;
 
-    CRequestId clientRequestId_;
+    CRequestId clientRequestId_ = {};
+    Clock::time_point deadline_;
 
     boost::system::error_code rc_ = boost::asio::error::operation_aborted;
 
@@ -103,17 +188,69 @@ struct ForwardOneRequestOperation {
         using rpc::asio::to_string;
 
         if (!ec) reenter (op) {
+            // A batch's entries are not in rp_.request, so re-encoding it
+            // would lose them.
+            if (barobo_rpc_Request_Type_BATCH == rp_.request.type) {
+                BOOST_LOG(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
+                               << "BATCH requests cannot be forwarded";
+                yield asyncReply(proxy_.server(), rp_.id, Status::PROTOCOL_ERROR, std::move(op));
+                rc_ = ec;
+                yield break;
+            }
+            if (barobo_rpc_Request_Type_CANCEL == rp_.request.type) {
+                forwardCancel(proxy_, rp_);
+                rc_ = ec;
+                yield break;
+            }
+            if (!restoreFirePayload()) {
+                BOOST_LOG(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
+                               << "FIRE payload too large to forward";
+                yield asyncReply(proxy_.server(), rp_.id, Status::DECODING_FAILURE, std::move(op));
+                rc_ = ec;
+                yield break;
+            }
+            if (hasExpired(rp_.request, rp_.age())) {
+                BOOST_LOG(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
+                               << "Request expired before it could be forwarded";
+                yield asyncReply(proxy_.server(), rp_.id, Status::TIMED_OUT, std::move(op));
+                rc_ = ec;
+                yield break;
+            }
+            deadline_ = forwardingDeadline(rp_);
             clientRequestId_ = proxy_.client().nextRequestId();
-            yield proxy_.client().asyncSendRequest(clientRequestId_, rp_.request, std::move(op));
             if (barobo_rpc_Request_Type_DISCONNECT == rp_.request.type) {
+                yield proxy_.client().asyncSendRequest(clientRequestId_, rp_.request,
+                    rp_.request.has_timeout ? requestTimeout(deadline_ - Clock::now()) : kNoTimeout,
+                    std::move(op));
                 proxy_.close();
                 yield break;
             }
-            yield proxy_.client().asyncReceiveReply(clientRequestId_,
-                std::chrono::seconds(60), std::move(op));
+            // The reply may arrive, or the connected client may CANCEL the
+            // request, before the send completes, so be ready for both first.
+            // If the send fails, so does the wait, and the request is
+            // forgotten.
+            proxy_.forwarded()[rp_.id] = clientRequestId_;
+            yield {
+                auto& client = proxy_.client();
+                auto clientRequestId = clientRequestId_;
+                auto timeout = rp_.request.has_timeout
+                    ? requestTimeout(deadline_ - Clock::now()) : kNoTimeout;
+                client.asyncReceiveReply(clientRequestId, rp_.request.type,
+                    deadline_ - Clock::now(), std::move(op));
+                client.asyncSendRequest(clientRequestId, rp_.request, timeout,
+                    [&client, clientRequestId] (boost::system::error_code ec) {
+                        if (ec) {
+                            client.abandonReply(clientRequestId, ec);
+                        }
+                    });
+            }
+            forget();
+            if (reply && barobo_rpc_Request_Type_CONNECT == rp_.request.type) {
+                noteServerVersions(proxy_, *reply);
+            }
             if (reply) {
-                BOOST_LOG(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
-                               << "Forwarding reply to connected client";
+                RPC_ASIO_LOG_REQUEST(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
+                                          << "Forwarding reply to connected client";
                 yield proxy_.server().asyncSendReply(rp_.id, *reply, std::move(op));
             }
             else {
@@ -123,12 +260,34 @@ struct ForwardOneRequestOperation {
             }
             rc_ = ec;
         }
-        else if (boost::asio::error::operation_aborted != ec) {
-            rc_ = ec;
-            BOOST_LOG(proxy_.log()) << "ForwardOneRequestOperation I/O error: " << ec.message();
-            proxy_.close(ec);
-            BOOST_LOG(proxy_.log()) << "Error closing proxy: " << ec.message();
+        else {
+            forget();
+            if (boost::asio::error::operation_aborted != ec) {
+                rc_ = ec;
+                BOOST_LOG(proxy_.log()) << "ForwardOneRequestOperation I/O error: " << ec.message();
+                proxy_.close(ec);
+                BOOST_LOG(proxy_.log()) << "Error closing proxy: " << ec.message();
+            }
+        }
+    }
+
+    void forget () {
+        forgetForwarded(proxy_, rp_.id, clientRequestId_);
+    }
+
+    // The server leaves FIRE payloads in the received frame, but the request
+    // we forward is re-encoded from rp_.request, so copy the payload back.
+    bool restoreFirePayload () {
+        if (!rp_.request.has_fire) {
+            return true;
         }
+        auto& payload = rp_.request.fire.payload;
+        if (rp_.payload.size > sizeof(payload.bytes)) {
+            return false;
+        }
+        memcpy(payload.bytes, rp_.payload.bytes, rp_.payload.size);
+        payload.size = pb_size_t(rp_.payload.size);
+        return true;
     }
 };
 
@@ -146,7 +305,177 @@ asyncForwardOneRequest (Proxy& proxy, typename Proxy::Server::RequestPair rp,
     return init.result.get();
 }
 
+// Rewrite the request ID a frame is sent under or in reply to, with
+// rpc::rewriteRequestId or rpc::rewriteInReplyTo.
+inline Status rewriteFrameId (PooledBuffer& frame, uint32_t id,
+        void (*rewrite)(uint8_t*, size_t, uint32_t, size_t&, Status&)) {
+    auto size = frame.bytes.size();
+    frame.bytes.resize(size + kMaxIdGrowth);
+    size_t newSize;
+    Status status;
+    rewrite(frame.bytes.data(), size, id, newSize, status);
+    frame.bytes.resize(newSize);
+    return status;
+}
+
+// As ForwardOneRequestOperation, but the request and its reply are forwarded
+// as the frames they arrived in. Only their request IDs, and the request's
+// timeout, are rewritten in place; nothing is decoded or re-encoded.
 template <class Proxy>
+struct ForwardOneFrameOperation {
+    using SRequestPair = typename Proxy::Server::RequestPair;
+    using CRequestId = typename Proxy::Client::RequestId;
+    using Clock = std::chrono::steady_clock;
+
+    static_assert(std::is_same<typename Proxy::Server::RequestId, uint32_t>::value,
+        "only plain uint32_t request IDs can be rewritten in place");
+
+    explicit ForwardOneFrameOperation (Proxy& proxy, SRequestPair rp)
+        : proxy_(proxy)
+        , rp_(rp)
+    {}
+
+    Proxy& proxy_;
+
+    SRequestPair rp_;
+
+    CRequestId clientRequestId_ = {};
+    Clock::time_point deadline_;
+    Status status_ = Status::OK;
+
+    boost::system::error_code rc_ = boost::asio::error::operation_aborted;
+
+    std::tuple<boost::system::error_code> result () const {
+        return std::make_tuple(rc_);
+    }
+
+    template <class Op>
+    void operator() (Op&& op, boost::system::error_code ec = {}, BufferPtr frame = nullptr) {
+        using boost::log::add_value;
+        using std::to_string;
+
+        if (!ec) reenter (op) {
+            // Each entry of a batch has its own request ID, and rewriting
+            // those would mean re-encoding the batch.
+            if (barobo_rpc_Request_Type_BATCH == rp_.request.type) {
+                BOOST_LOG(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
+                               << "BATCH requests cannot be forwarded";
+                yield asyncReply(proxy_.server(), rp_.id, Status::PROTOCOL_ERROR, std::move(op));
+                rc_ = ec;
+                yield break;
+            }
+            if (barobo_rpc_Request_Type_CANCEL == rp_.request.type) {
+                forwardCancel(proxy_, rp_);
+                rc_ = ec;
+                yield break;
+            }
+            if (hasExpired(rp_.request, rp_.age())) {
+                BOOST_LOG(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
+                               << "Request expired before it could be forwarded";
+                yield asyncReply(proxy_.server(), rp_.id, Status::TIMED_OUT, std::move(op));
+                rc_ = ec;
+                yield break;
+            }
+            deadline_ = forwardingDeadline(rp_);
+            clientRequestId_ = proxy_.client().nextRequestId();
+            status_ = rewriteRequest();
+            if (hasError(status_)) {
+                BOOST_LOG(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
+                               << "Request could not be rewritten: " << statusToString(status_);
+                yield asyncReply(proxy_.server(), rp_.id, status_, std::move(op));
+                rc_ = ec;
+                yield break;
+            }
+            if (barobo_rpc_Request_Type_DISCONNECT == rp_.request.type) {
+                yield proxy_.client().asyncSendMessage(rp_.frame, std::move(op));
+                proxy_.close();
+                yield break;
+            }
+            // As in ForwardOneRequestOperation, be ready for the reply, and
+            // for a CANCEL, before sending.
+            proxy_.forwarded()[rp_.id] = clientRequestId_;
+            yield {
+                auto& client = proxy_.client();
+                auto clientRequestId = clientRequestId_;
+                auto frame = rp_.frame;
+                client.asyncReceiveReplyFrame(clientRequestId, rp_.request.type,
+                    deadline_ - Clock::now(), std::move(op));
+                client.asyncSendMessage(frame,
+                    [&client, clientRequestId] (boost::system::error_code ec) {
+                        if (ec) {
+                            client.abandonReply(clientRequestId, ec);
+                        }
+                    });
+            }
+            forgetForwarded(proxy_, rp_.id, clientRequestId_);
+            if (frame && barobo_rpc_Request_Type_CONNECT == rp_.request.type) {
+                noteServerVersions(proxy_, *frame);
+            }
+            if (!frame) {
+                BOOST_LOG(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
+                               << "Request timed out";
+                yield asyncReply(proxy_.server(), rp_.id, Status::TIMED_OUT, std::move(op));
+            }
+            else if (hasError(status_ = rewriteFrameId(*frame, rp_.id, &rewriteInReplyTo))) {
+                BOOST_LOG(proxy_.log()) << add_value("RequestId", to_string(rp_.id))
+                               << "Reply could not be rewritten: " << statusToString(status_);
+                yield asyncReply(proxy_.server(), rp_.id, status_, std::move(op));
+            }
+            else {
+                yield proxy_.server().asyncSendMessage(frame, std::move(op));
+            }
+            rc_ = ec;
+        }
+        else {
+            forgetForwarded(proxy_, rp_.id, clientRequestId_);
+            if (boost::asio::error::operation_aborted != ec) {
+                rc_ = ec;
+                BOOST_LOG(proxy_.log()) << "ForwardOneFrameOperation I/O error: " << ec.message();
+                proxy_.close(ec);
+                BOOST_LOG(proxy_.log()) << "Error closing proxy: " << ec.message();
+            }
+        }
+    }
+
+    // The payload view into the frame does not survive this.
+    Status rewriteRequest () {
+        auto& frame = *rp_.frame;
+        auto status = rewriteFrameId(frame, clientRequestId_, &rewriteRequestId);
+        if (!hasError(status) && rp_.request.has_timeout) {
+            rewriteTimeout(frame.bytes.data(), frame.bytes.size(),
+                requestTimeout(deadline_ - Clock::now()), status);
+        }
+        return status;
+    }
+};
+
+template <class Proxy, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
+asyncForwardOneFrame (Proxy& proxy, typename Proxy::Server::RequestPair rp,
+        CompletionToken&& token) {
+    util::asio::AsyncCompletion<
+        CompletionToken, void(boost::system::error_code)
+    > init { std::forward<CompletionToken>(token) };
+
+    using Op = ForwardOneFrameOperation<Proxy>;
+    util::asio::v1::makeOperation<Op>(std::move(init.handler), proxy, rp)();
+
+    return init.result.get();
+}
+
+template <class Proxy, class Handler>
+void asyncForwardOne (Proxy& proxy, typename Proxy::Server::RequestPair rp,
+        Handler&& handler, std::false_type /* frames */) {
+    asyncForwardOneRequest(proxy, rp, std::forward<Handler>(handler));
+}
+
+template <class Proxy, class Handler>
+void asyncForwardOne (Proxy& proxy, typename Proxy::Server::RequestPair rp,
+        Handler&& handler, std::true_type /* frames */) {
+    asyncForwardOneFrame(proxy, rp, std::forward<Handler>(handler));
+}
+
+template <class Proxy, bool Frames = false>
 struct ForwardRequestsOperation {
     using RequestId = typename Proxy::Server::RequestId;
     using RequestPair = typename Proxy::Server::RequestPair;
@@ -168,7 +497,7 @@ struct ForwardRequestsOperation {
         if (!ec) reenter (op) {
             do {
                 yield proxy_.server().asyncReceiveRequest(std::move(op));
-                fork asyncForwardOneRequest(proxy_, rp, Op{op});
+                fork asyncForwardOne(proxy_, rp, Op{op}, std::integral_constant<bool, Frames>());
             } while (op.is_parent());
         }
         else if (boost::asio::error::operation_aborted != ec) {
@@ -193,6 +522,20 @@ asyncForwardRequests (Proxy& proxy, CompletionToken&& token) {
     return init.result.get();
 }
 
+// As asyncForwardRequests, but see ForwardOneFrameOperation.
+template <class Proxy, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, ForwardHandlerSignature)
+asyncForwardRequestFrames (Proxy& proxy, CompletionToken&& token) {
+    util::asio::AsyncCompletion<
+        CompletionToken, ForwardHandlerSignature
+    > init { std::forward<CompletionToken>(token) };
+
+    using Op = ForwardRequestsOperation<Proxy, true>;
+    util::asio::v1::makeOperation<Op>(std::move(init.handler), proxy)();
+
+    return init.result.get();
+}
+
 template <class Proxy>
 struct ForwardBroadcastsOperation {
     explicit ForwardBroadcastsOperation (Proxy& proxy)
@@ -238,7 +581,52 @@ asyncForwardBroadcasts (Proxy& proxy, CompletionToken&& token) {
     return init.result.get();
 }
 
+// Broadcast frames need no rewriting at all, so they are passed on untouched.
 template <class Proxy>
+struct ForwardBroadcastFramesOperation {
+    explicit ForwardBroadcastFramesOperation (Proxy& proxy)
+        : proxy_(proxy)
+    {}
+
+    Proxy& proxy_;
+
+    boost::system::error_code rc_ = boost::asio::error::operation_aborted;
+
+    std::tuple<boost::system::error_code> result () const {
+        return std::make_tuple(rc_);
+    }
+
+    template <class Op>
+    void operator() (Op&& op, boost::system::error_code ec = {}, BufferPtr frame = nullptr) {
+        if (!ec) reenter (op) {
+            while (true) {
+                yield proxy_.client().asyncReceiveBroadcastFrame(std::move(op));
+                yield proxy_.server().asyncSendMessage(frame, std::move(op));
+            }
+        }
+        else if (boost::asio::error::operation_aborted != ec) {
+            rc_ = ec;
+            BOOST_LOG(proxy_.log()) << "ForwardBroadcastFramesOperation I/O error: " << ec.message();
+            proxy_.close(ec);
+            BOOST_LOG(proxy_.log()) << "Error closing proxy: " << ec.message();
+        }
+    }
+};
+
+template <class Proxy, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, ForwardHandlerSignature)
+asyncForwardBroadcastFrames (Proxy& proxy, CompletionToken&& token) {
+    util::asio::AsyncCompletion<
+        CompletionToken, ForwardHandlerSignature
+    > init { std::forward<CompletionToken>(token) };
+
+    using Op = ForwardBroadcastFramesOperation<Proxy>;
+    util::asio::v1::makeOperation<Op>(std::move(init.handler), proxy)();
+
+    return init.result.get();
+}
+
+template <class Proxy, bool Frames = false>
 struct RunProxyOperation {
     explicit RunProxyOperation (Proxy& proxy)
         : proxy_(proxy)
@@ -257,10 +645,10 @@ struct RunProxyOperation {
         if (!ec) reenter (op) {
             fork Op{op}();
             if (op.is_child()) {
-                yield asyncForwardRequests(proxy_, std::move(op));
+                yield forwardRequests(std::move(op), std::integral_constant<bool, Frames>());
             }
             else {
-                yield asyncForwardBroadcasts(proxy_, std::move(op));
+                yield forwardBroadcasts(std::move(op), std::integral_constant<bool, Frames>());
             }
         }
         else if (boost::asio::error::operation_aborted != ec) {
@@ -270,6 +658,26 @@ struct RunProxyOperation {
             BOOST_LOG(proxy_.log()) << "Error closing proxy: " << ec.message();
         }
     }
+
+    template <class Op>
+    void forwardRequests (Op&& op, std::false_type) {
+        asyncForwardRequests(proxy_, std::forward<Op>(op));
+    }
+
+    template <class Op>
+    void forwardRequests (Op&& op, std::true_type) {
+        asyncForwardRequestFrames(proxy_, std::forward<Op>(op));
+    }
+
+    template <class Op>
+    void forwardBroadcasts (Op&& op, std::false_type) {
+        asyncForwardBroadcasts(proxy_, std::forward<Op>(op));
+    }
+
+    template <class Op>
+    void forwardBroadcasts (Op&& op, std::true_type) {
+        asyncForwardBroadcastFrames(proxy_, std::forward<Op>(op));
+    }
 };
 
 // Forward requests from the given server to the given client, forward replies
@@ -288,6 +696,23 @@ asyncRunProxy (Proxy& proxy, CompletionToken&& token) {
     return init.result.get();
 }
 
+// As asyncRunProxy, but messages are forwarded as the frames they arrived in,
+// with only their request IDs rewritten in place: payloads are never decoded
+// or re-encoded, which is most of what a proxy otherwise spends its time on.
+// The server's request IDs must be plain uint32_t. BATCH requests are refused.
+template <class Proxy, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, ForwardHandlerSignature)
+asyncRunFrameProxy (Proxy& proxy, CompletionToken&& token) {
+    util::asio::AsyncCompletion<
+        CompletionToken, ForwardHandlerSignature
+    > init { std::forward<CompletionToken>(token) };
+
+    using Op = RunProxyOperation<Proxy, true>;
+    util::asio::v1::makeOperation<Op>(std::move(init.handler), proxy)();
+
+    return init.result.get();
+}
+
 }} // namespace rpc::asio
 
 #include <boost/asio/unyield.hpp>
@@ -0,0 +1,143 @@
+#ifndef RPC_ASIO_REPLYTABLE_HPP
+#define RPC_ASIO_REPLYTABLE_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace rpc {
+namespace asio {
+
+// An open-addressing hash table from request ID to T, for a client's
+// outstanding requests. Request IDs are allocated sequentially, so they are
+// used as their own hash: consecutive requests land in consecutive slots, and
+// linear probing rarely has to look past the first one. Erasing shifts later
+// entries back rather than leaving tombstones. The table doubles when it is
+// half full, and otherwise never allocates.
+template <class T>
+class ReplyTable {
+public:
+    explicit ReplyTable (size_t capacity = 16) : mSlots(roundUp(capacity)) {}
+
+    size_t size () const { return mSize; }
+    bool empty () const { return !mSize; }
+
+    // Return false, and do nothing, if id is already present.
+    bool insert (uint32_t id, T value) {
+        if (2 * (mSize + 1) > mSlots.size()) {
+            grow();
+        }
+        auto i = probe(id);
+        if (mSlots[i].used) {
+            return false;
+        }
+        mSlots[i].used = true;
+        mSlots[i].id = id;
+        mSlots[i].value = std::move(value);
+        ++mSize;
+        return true;
+    }
+
+    // Return the value for id, or nullptr if there is none.
+    T* find (uint32_t id) {
+        auto i = probe(id);
+        return mSlots[i].used ? &mSlots[i].value : nullptr;
+    }
+
+    // Move the value for id into value and erase it. Return false if there is
+    // none.
+    bool take (uint32_t id, T& value) {
+        auto i = probe(id);
+        if (!mSlots[i].used) {
+            return false;
+        }
+        value = std::move(mSlots[i].value);
+        erase(i);
+        return true;
+    }
+
+    // Call fn(id, value) for every entry, then empty the table.
+    template <class Fn>
+    void drain (Fn&& fn) {
+        for (auto& slot : mSlots) {
+            if (slot.used) {
+                slot.used = false;
+                fn(slot.id, std::move(slot.value));
+                slot.value = T();
+            }
+        }
+        mSize = 0;
+    }
+
+private:
+    struct Slot {
+        uint32_t id = 0;
+        bool used = false;
+        T value = T();
+    };
+
+    static size_t roundUp (size_t n) {
+        size_t capacity = 2;
+        while (capacity < n) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    size_t mask () const { return mSlots.size() - 1; }
+
+    // The slot holding id, or the empty slot where it would go.
+    size_t probe (uint32_t id) const {
+        auto i = id & mask();
+        while (mSlots[i].used && mSlots[i].id != id) {
+            i = (i + 1) & mask();
+        }
+        return i;
+    }
+
+    void erase (size_t i) {
+        mSlots[i].used = false;
+        mSlots[i].value = T();
+        --mSize;
+        // Shift back any entries which probed past the hole.
+        auto j = i;
+        while (true) {
+            j = (j + 1) & mask();
+            if (!mSlots[j].used) {
+                break;
+            }
+            auto home = mSlots[j].id & mask();
+            auto displaced = i <= j
+                ? (home <= i || home > j)
+                : (home <= i && home > j);
+            if (displaced) {
+                mSlots[i] = std::move(mSlots[j]);
+                mSlots[j].used = false;
+                mSlots[j].value = T();
+                i = j;
+            }
+        }
+    }
+
+    void grow () {
+        std::vector<Slot> old(mSlots.size() * 2);
+        mSlots.swap(old);
+        mSize = 0;
+        for (auto& slot : old) {
+            if (slot.used) {
+                auto inserted = insert(slot.id, std::move(slot.value));
+                assert(inserted);
+                (void)inserted;
+            }
+        }
+    }
+
+    std::vector<Slot> mSlots;
+    size_t mSize = 0;
+};
+
+}} // namespace rpc::asio
+
+#endif
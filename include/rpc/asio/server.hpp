@@ -3,6 +3,12 @@
 
 #include "rpc.pb.h"
 
+#include <rpc/asio/bufferpool.hpp>
+#include <rpc/asio/metrics.hpp>
+
+#include <rpc/message.hpp>
+#include <rpc/subscriptions.hpp>
+
 #include <util/log.hpp>
 #include <util/asio/asynccompletion.hpp>
 
@@ -12,21 +18,68 @@
 
 #include <boost/log/attributes/constant.hpp>
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
 #include <utility>
+#include <vector>
 
 #include <boost/asio/yield.hpp>
 
 namespace rpc {
 namespace asio {
 
+// The asio Server doesn't know its interface's broadcast count, so its
+// subscription bitmap grows as needed. See rpc/subscriptions.hpp.
+class DynamicSubscriptionBitmap {
+public:
+    bool test (size_t i) const {
+        return i < mBits.size() && mBits[i];
+    }
+
+    void set (size_t i, bool value) {
+        if (i >= mBits.size()) {
+            mBits.resize(i + 1);
+        }
+        mBits[i] = value;
+    }
+
+    void clear () {
+        mBits.clear();
+    }
+
+private:
+    std::vector<bool> mBits;
+};
+
 template <class MessageQueue>
 class Server {
 public:
     using RequestId = uint32_t;
+    using Clock = std::chrono::steady_clock;
+    // A FIRE request's payload is not copied into request.fire.payload.
+    // Instead, payload refers to it within the received frame, which the
+    // RequestPair keeps out of the buffer pool. For a BATCH request, payload
+    // refers to the batch. The frame is the encoded barobo_rpc_ClientMessage
+    // exactly as received, so a proxy may forward it as is.
     struct RequestPair {
         RequestId id;
         barobo_rpc_Request request;
+        PayloadView payload;
+        BufferPtr frame;
+        // When the frame came out of the message queue.
+        Clock::time_point received;
+
+        // Milliseconds since the request was received, which count against
+        // its deadline (see hasExpired).
+        uint32_t age () const {
+            return uint32_t(std::chrono::duration_cast<std::chrono::milliseconds>(
+                Clock::now() - received).count());
+        }
     };
 
     typedef void RequestHandlerSignature(boost::system::error_code, RequestPair);
@@ -34,12 +87,19 @@ public:
 
 	explicit Server (boost::asio::io_service& ios)
 		: mMessageQueue(ios)
+        , mBufferPool(std::make_shared<BufferPool>())
+        , mMetrics(std::make_shared<Metrics>())
+        , mWritableHandler(std::make_shared<WritableHandler>())
 	{
         mLog.add_attribute("Protocol", boost::log::attributes::constant<std::string>("RB-SV"));
     }
 
     Server (Server&& that)
         : mMessageQueue(std::move(that.mMessageQueue))
+        , mSubscriptions(std::move(that.mSubscriptions))
+        , mBufferPool(std::move(that.mBufferPool))
+        , mMetrics(std::move(that.mMetrics))
+        , mWritableHandler(std::move(that.mWritableHandler))
         , mLog(that.mLog)
     {}
 
@@ -62,6 +122,29 @@ public:
 
     util::log::Logger& log () { return mLog; }
 
+    // The connected client's broadcast subscriptions, maintained by
+    // asyncServeUntilDisconnection and checked by asyncBroadcast.
+    DynamicSubscriptionBitmap& subscriptions () { return mSubscriptions; }
+    const DynamicSubscriptionBitmap& subscriptions () const { return mSubscriptions; }
+
+    // Every message the server sends or receives is in a buffer from here.
+    BufferPool& bufferPool () { return *mBufferPool; }
+
+    // The connection's traffic, and how long each method's onFire calls take.
+    // See rpc/asio/metrics.hpp.
+    Metrics& metrics () { return *mMetrics; }
+    const Metrics& metrics () const { return *mMetrics; }
+
+    // Called each time a message the server sent has gone out, after that
+    // send's own handler, i.e., whenever the transport can take another
+    // message. A BroadcastCoalescer uses it to send what it has pending (see
+    // rpc/asio/broadcastcoalescer.hpp). There is room for one handler: setting
+    // another replaces it, and setting an empty one removes it.
+    using WritableHandler = std::function<void()>;
+    void setWritableHandler (WritableHandler handler) {
+        *mWritableHandler = std::move(handler);
+    }
+
     template <class Handler>
     BOOST_ASIO_INITFN_RESULT_TYPE(Handler, RequestHandlerSignature)
     asyncReceiveRequest (Handler&& handler) {
@@ -70,16 +153,22 @@ public:
         > init { std::forward<Handler>(handler) };
         auto& realHandler = init.handler;
 
-        auto buf = std::make_shared<std::vector<uint8_t>>(1024);
-        mMessageQueue.asyncReceive(boost::asio::buffer(*buf),
+        auto buf = mBufferPool->acquire(
+            std::max<size_t>(barobo_rpc_ClientMessage_size, RPC_BATCH_MAX_SIZE));
+        mMessageQueue.asyncReceive(boost::asio::buffer(buf->bytes),
             [this, realHandler, buf] (boost::system::error_code ec, size_t size) mutable {
                 if (!ec) {
                     if (size) {
+                        this->mMetrics->addBytesIn(size);
+                        buf->bytes.resize(size);
                         barobo_rpc_ClientMessage message;
+                        PayloadView payload;
                         Status status;
-                        rpc::decode(message, buf->data(), size, status);
+                        rpc::decode(message, payload, buf->bytes.data(), size, status);
                         this->mMessageQueue.get_io_service().post(
-                            std::bind(realHandler, status, RequestPair{message.id, message.request}));
+                            std::bind(realHandler, status,
+                                RequestPair{message.id, message.request, payload, buf,
+                                    Clock::now()}));
                     }
                     else {
                         // it's cool, just a keepalive
@@ -111,15 +200,12 @@ public:
         message.inReplyTo = requestId;
         message.has_broadcast = false;
 
-        auto buf = std::make_shared<std::vector<uint8_t>>(1024);
+        auto buf = mBufferPool->acquire(barobo_rpc_ServerMessage_size);
         try {
             pb_size_t bytesWritten;
-            rpc::encode(message, buf->data(), buf->size(), bytesWritten);
-            buf->resize(bytesWritten);
-            mMessageQueue.asyncSend(boost::asio::buffer(*buf),
-                [buf, realHandler] (boost::system::error_code ec) mutable {
-                    realHandler(ec);
-                });
+            rpc::encode(message, buf->bytes.data(), buf->bytes.size(), bytesWritten);
+            buf->bytes.resize(bytesWritten);
+            send(buf, realHandler);
         }
         catch (boost::system::system_error& e) {
             BOOST_LOG(mLog) << "error sending reply";
@@ -145,15 +231,12 @@ public:
         message.has_broadcast = true;
         memcpy(&message.broadcast, &broadcast, sizeof(broadcast));
 
-        auto buf = std::make_shared<std::vector<uint8_t>>(1024);
+        auto buf = mBufferPool->acquire(barobo_rpc_ServerMessage_size);
         try {
             pb_size_t bytesWritten;
-            rpc::encode(message, buf->data(), buf->size(), bytesWritten);
-            buf->resize(bytesWritten);
-            mMessageQueue.asyncSend(boost::asio::buffer(*buf),
-                [buf, realHandler] (boost::system::error_code ec) mutable {
-                    realHandler(ec);
-                });
+            rpc::encode(message, buf->bytes.data(), buf->bytes.size(), bytesWritten);
+            buf->bytes.resize(bytesWritten);
+            send(buf, realHandler);
         }
         catch (boost::system::system_error& e) {
             BOOST_LOG(mLog) << "error sending broadcast";
@@ -163,9 +246,44 @@ public:
         return init.result.get();
     }
 
+    // Send a buffer containing an already-encoded barobo_rpc_ServerMessage.
+    template <class Handler>
+    BOOST_ASIO_INITFN_RESULT_TYPE(Handler, void(boost::system::error_code))
+    asyncSendMessage (BufferPtr buf, Handler&& handler) {
+        util::asio::AsyncCompletion<
+            Handler, void(boost::system::error_code)
+        > init { std::forward<Handler>(handler) };
+        auto& realHandler = init.handler;
+
+        send(buf, realHandler);
+
+        return init.result.get();
+    }
+
 private:
+    template <class Handler>
+    void send (BufferPtr buf, Handler& realHandler) {
+        mMessageQueue.asyncSend(boost::asio::buffer(buf->bytes),
+            [buf, realHandler, metrics=mMetrics, writable=mWritableHandler]
+            (boost::system::error_code ec) mutable {
+                if (!ec) {
+                    metrics->addBytesOut(buf->bytes.size());
+                }
+                realHandler(ec);
+                if (!ec && *writable) {
+                    (*writable)();
+                }
+            });
+    }
+
     MessageQueue mMessageQueue;
 
+    DynamicSubscriptionBitmap mSubscriptions;
+
+    std::shared_ptr<BufferPool> mBufferPool;
+    std::shared_ptr<Metrics> mMetrics;
+    std::shared_ptr<WritableHandler> mWritableHandler;
+
     util::log::Logger mLog;
 };
 
@@ -177,19 +295,23 @@ asyncBroadcast (S& server, Broadcast args, Handler&& handler) {
     > init { std::forward<Handler>(handler) };
     auto& realHandler = init.handler;
 
-    barobo_rpc_Broadcast broadcast;
-    broadcast = decltype(broadcast)();
-    broadcast.id = componentId(args);
+    // Drop broadcasts the client is not subscribed to before encoding them.
+    if (!isSubscribed<Broadcast>(server.subscriptions())) {
+        server.get_io_service().post(std::bind(realHandler, boost::system::error_code()));
+        return init.result.get();
+    }
+
+    auto buf = server.bufferPool().acquire(
+        MaxBroadcastMessageSize<MaxEncodedSize<Broadcast>::value>::value);
+    pb_size_t bytesWritten;
     Status status;
-    rpc::encode(args,
-        broadcast.payload.bytes,
-        sizeof(broadcast.payload.bytes),
-        broadcast.payload.size, status);
+    rpc::encodeBroadcast(args, buf->bytes.data(), buf->bytes.size(), bytesWritten, status);
     if (hasError(status)) {
         server.get_io_service().post(std::bind(realHandler, status));
     }
     else {
-        server.asyncSendBroadcast(broadcast, realHandler);
+        buf->bytes.resize(bytesWritten);
+        server.asyncSendMessage(buf, realHandler);
     }
 
     return init.result.get();
@@ -263,11 +385,142 @@ asyncWaitForConnection (S& server, CompletionToken&& token) {
 }
 #endif
 
+// The RESULT replies a ServeUntilDisconnectionOperation has started writing,
+// or which methods have deferred, but which have not yet completed. Up to
+// limit() of them may be in flight while the operation goes on receiving
+// requests; when the pipeline is full, the operation parks itself here until
+// a reply completes.
+template <class S>
+class ReplyPipeline : public std::enable_shared_from_this<ReplyPipeline<S>> {
+public:
+    ReplyPipeline (S& server, size_t limit)
+        : mServer(server)
+        , mLimit(std::max(limit, size_t(1)))
+    {}
+
+    size_t limit () const { return mLimit; }
+    size_t inFlight () const { return mInFlight; }
+    bool full () const { return mInFlight >= mLimit; }
+
+    // The first error any reply completed with.
+    boost::system::error_code error () const { return mError; }
+
+    void send (BufferPtr buf) {
+        ++mInFlight;
+        write(std::move(buf));
+    }
+
+    // Call op with no arguments when the next reply completes.
+    template <class Op>
+    void park (Op&& op) {
+        assert(mInFlight && !mParked);
+        mParked = std::forward<Op>(op);
+    }
+
+    // Deferred replies hold a slot in the pipeline from the moment the method
+    // defers until the reply is written. They may be fulfilled from any
+    // thread: the reply is written from the server's io_service.
+    DeferredTarget deferredTarget () {
+        return DeferredTarget{&ReplyPipeline::reserve, &ReplyPipeline::sendDeferred,
+            &ReplyPipeline::isCancelled, this};
+    }
+
+    // Drop the deferred reply to the given request, if it is still owed. The
+    // method's Deferred sees that it has been cancelled. Replies which are
+    // already being written are past recall.
+    void cancel (uint32_t requestId) {
+        if (mDeferredIds.count(requestId)) {
+            std::lock_guard<std::mutex> lock{mCancelledMutex};
+            mCancelledIds.insert(requestId);
+        }
+    }
+
+private:
+    static bool isCancelled (void* context, uint32_t requestId) {
+        auto self = static_cast<ReplyPipeline*>(context);
+        std::lock_guard<std::mutex> lock{self->mCancelledMutex};
+        return self->mCancelledIds.count(requestId);
+    }
+
+    static void reserve (void* context, uint32_t requestId) {
+        auto self = static_cast<ReplyPipeline*>(context);
+        self->mDeferredIds.insert(requestId);
+        ++self->mInFlight;
+        // Stay alive until every deferred reply is fulfilled, even if the
+        // serving operation finishes first.
+        if (!self->mDeferred++) {
+            self->mKeepAlive = self->shared_from_this();
+        }
+    }
+
+    static void sendDeferred (void* context, uint32_t requestId,
+            const uint8_t* bytes, size_t size) {
+        auto self = static_cast<ReplyPipeline*>(context)->shared_from_this();
+        auto buf = self->mServer.bufferPool().acquire(size);
+        std::copy(bytes, bytes + size, buf->bytes.begin());
+        self->mServer.get_io_service().post([self, requestId, buf] () mutable {
+            self->mDeferredIds.erase(requestId);
+            {
+                std::lock_guard<std::mutex> lock{self->mCancelledMutex};
+                if (self->mCancelledIds.erase(requestId)) {
+                    buf->bytes.clear();
+                }
+            }
+            if (!--self->mDeferred) {
+                self->mKeepAlive.reset();
+            }
+            if (buf->bytes.size()) {
+                self->write(std::move(buf));
+            }
+            else {
+                self->complete(boost::system::error_code());
+            }
+        });
+    }
+
+    void write (BufferPtr buf) {
+        auto self = this->shared_from_this();
+        mServer.asyncSendMessage(buf, [self] (boost::system::error_code ec) {
+            self->complete(ec);
+        });
+    }
+
+    void complete (boost::system::error_code ec) {
+        --mInFlight;
+        if (ec && !mError) {
+            mError = ec;
+        }
+        if (mParked) {
+            auto resume = std::move(mParked);
+            mParked = nullptr;
+            resume();
+        }
+    }
+
+    S& mServer;
+    size_t mLimit;
+    size_t mInFlight = 0;
+    size_t mDeferred = 0;
+    boost::system::error_code mError;
+    std::function<void()> mParked;
+    std::shared_ptr<ReplyPipeline> mKeepAlive;
+
+    // Only touched from the io_service.
+    std::unordered_set<uint32_t> mDeferredIds;
+    // Also read by Deferreds, from any thread.
+    std::mutex mCancelledMutex;
+    std::unordered_set<uint32_t> mCancelledIds;
+};
+
 template <class Interface, class S, class Impl>
 struct ServeUntilDisconnectionOperation {
     using RequestPair = typename S::RequestPair;
 
-    ServeUntilDisconnectionOperation (S& server, Impl& impl) : server_(server), impl_(impl) {}
+    ServeUntilDisconnectionOperation (S& server, Impl& impl, size_t maxInFlight)
+        : server_(server)
+        , impl_(impl)
+        , pipeline_(std::make_shared<ReplyPipeline<S>>(server, maxInFlight))
+    {}
 
     S& server_;
     Impl& impl_;
@@ -275,6 +528,10 @@ struct ServeUntilDisconnectionOperation {
     boost::system::error_code rc_ = boost::asio::error::operation_aborted;
     RequestPair rp_;
 
+    std::shared_ptr<ReplyPipeline<S>> pipeline_;
+    BufferPtr reply_;
+    Status status_;
+
     auto result () {
         return std::make_tuple(rc_, rp_);
     }
@@ -283,33 +540,85 @@ struct ServeUntilDisconnectionOperation {
     void operator() (Op&& op, boost::system::error_code ec = {}, RequestPair rp = {}) {
         if (!ec) reenter (op) {
             while (1) {
+                while (pipeline_->full()) {
+                    yield pipeline_->park(std::move(op));
+                }
+                if (pipeline_->error()) {
+                    rc_ = pipeline_->error();
+                    yield break;
+                }
                 yield server_.asyncReceiveRequest(std::move(op));
                 if (barobo_rpc_Request_Type_DISCONNECT == rp.request.type) {
-                    rc_ = ec;
                     rp_ = rp;
+                    // Let the client see every reply before we finish.
+                    while (pipeline_->inFlight()) {
+                        yield pipeline_->park(std::move(op));
+                    }
+                    rc_ = pipeline_->error();
                     yield break;
                 }
                 else if (barobo_rpc_Request_Type_CONNECT == rp.request.type) {
+                    server_.subscriptions().clear();
                     yield asyncReply(
                         server_, rp.id, Versions::create<Interface>(), std::move(op));
                 }
+                else if (barobo_rpc_Request_Type_SUBSCRIBE == rp.request.type
+                        || barobo_rpc_Request_Type_UNSUBSCRIBE == rp.request.type) {
+                    if (!rp.request.has_subscription) {
+                        rc_ = Status::PROTOCOL_ERROR;
+                        yield break;
+                    }
+                    yield asyncReply(server_, rp.id,
+                        setSubscription<Interface>(server_.subscriptions(),
+                            rp.request.subscription.id,
+                            barobo_rpc_Request_Type_SUBSCRIBE == rp.request.type),
+                        std::move(op));
+                }
                 else if (barobo_rpc_Request_Type_FIRE == rp.request.type) {
                     if (!rp.request.has_fire) {
                         rc_ = Status::PROTOCOL_ERROR;
                         yield break;
                     }
+                    else if (hasExpired(rp.request, rp.age())) {
+                        // The client has given up, so don't do the work.
+                        server_.metrics().record(rp.request.fire.id, Status::TIMED_OUT);
+                        if (MethodInUnion<Interface>::isFireAndForget(rp.request.fire.id)) {
+                            continue;
+                        }
+                        reply_ = serveStatus(rp.id, Status::TIMED_OUT, status_);
+                        if (hasError(status_)) {
+                            rc_ = status_;
+                            yield break;
+                        }
+                        pipeline_->send(std::move(reply_));
+                    }
                     else {
-                        yield {
-                            Status status;
-                            auto reply = serve(rp.request.fire, status);
-                            if (hasError(status)) {
-                                rc_ = status;
-                                break;
-                            }
-                            else {
-                                server_.asyncSendReply(rp.id, reply, std::move(op));
-                            }
+                        reply_ = serve(rp.id, rp.request.fire.id, rp.payload, status_);
+                        if (hasError(status_)) {
+                            rc_ = status_;
+                            yield break;
                         }
+                        // Fire-and-forget methods and deferred replies have
+                        // nothing to send yet. Other replies are written while
+                        // we receive the next request.
+                        if (reply_->bytes.size()) {
+                            pipeline_->send(std::move(reply_));
+                        }
+                    }
+                }
+                else if (barobo_rpc_Request_Type_CANCEL == rp.request.type) {
+                    // No reply, whether or not there was anything to cancel.
+                    if (!rp.request.has_cancel) {
+                        rc_ = Status::PROTOCOL_ERROR;
+                        yield break;
+                    }
+                    pipeline_->cancel(rp.request.cancel.id);
+                }
+                else if (barobo_rpc_Request_Type_BATCH == rp.request.type) {
+                    serveBatch(rp, status_);
+                    if (hasError(status_)) {
+                        rc_ = status_;
+                        yield break;
                     }
                 }
                 else {
@@ -323,40 +632,211 @@ struct ServeUntilDisconnectionOperation {
         }
     }
 
-    barobo_rpc_Reply serve (barobo_rpc_Request_Fire fire, Status& status) {
+    // Invoke the method and encode its RESULT reply in one pass. The time
+    // taken, which for a deferred method ends when onFire returns, goes in the
+    // server's metrics.
+    BufferPtr
+    serve (typename S::RequestId requestId, uint32_t componentId, PayloadView payload,
+            Status& status) {
         MethodInUnion<Interface> m;
-        barobo_rpc_Reply reply = decltype(reply)();
-        m.invoke(impl_, fire.id, fire.payload, reply.result.payload, status);
+        auto buf = server_.bufferPool().acquire(MaxMessageSize<Interface>::serverMessage);
+        pb_size_t bytesWritten = 0;
+        auto start = std::chrono::steady_clock::now();
+        m.invoke(impl_, componentId, payload,
+            ReplySink{requestId, componentId, buf->bytes.data(), buf->bytes.size(),
+                bytesWritten, pipeline_->deferredTarget()},
+            status);
+        server_.metrics().record(componentId, status, std::chrono::steady_clock::now() - start);
+        buf->bytes.resize(bytesWritten);
+        return buf;
+    }
+
+    BufferPtr
+    serveStatus (typename S::RequestId requestId, Status value, Status& status) {
+        auto buf = server_.bufferPool().acquire(MaxControlReplyMessageSize::value);
+        pb_size_t bytesWritten = 0;
+        encodeStatus(requestId, value, buf->bytes.data(), buf->bytes.size(),
+            bytesWritten, status);
+        buf->bytes.resize(bytesWritten);
+        return buf;
+    }
+
+    // Serve each request of a batch, and collect their replies into BATCH
+    // replies of at most RPC_BATCH_MAX_SIZE bytes, the most a client will
+    // receive; if not even one reply would fit in a batch that size, the
+    // replies are sent singly instead. A batch may carry FIRE, SUBSCRIBE,
+    // UNSUBSCRIBE and CANCEL requests; any other entry is answered with
+    // PROTOCOL_ERROR, and an entry which cannot be decoded at all is skipped,
+    // leaving its request to time out. Unlike a lone request, a method which
+    // fails only fails its own entry. Deferred replies are sent on their own,
+    // as usual. Entries are served in order, so a FIRE entry may expire while
+    // those before it run; it is then answered with TIMED_OUT. Fire-and-forget
+    // entries get no reply even if they expire or fail.
+    //
+    // The replies go straight into the pipeline, so a batch may put it over
+    // its limit; the next request waits until it has drained.
+    void serveBatch (const RequestPair& rp, Status& status) {
+        auto batch = rp.payload;
+        const size_t kMaxReplySize = rpc::_::Max<
+            MaxMessageSize<Interface>::serverMessage,
+            MaxControlReplyMessageSize::value>::value;
+
+        // Don't serve any of a batch whose framing is broken.
+        PayloadView entry;
+        for (auto rest = batch; nextBatchEntry(rest, entry, status);) {}
+        if (hasError(status)) {
+            return;
+        }
+
+        auto buf = server_.bufferPool().acquire(RPC_BATCH_MAX_SIZE);
+        BatchWriter writer{buf->bytes.data(), buf->bytes.size()};
+        const auto canBatch = writer.entrySize() >= kMaxReplySize;
+        while (nextBatchEntry(batch, entry, status)) {
+            barobo_rpc_ClientMessage clMessage;
+            PayloadView payload;
+            Status decodeStatus;
+            decode(clMessage, payload, entry.bytes, entry.size, decodeStatus);
+            if (hasError(decodeStatus)) {
+                continue;
+            }
+
+            // Where this entry's reply, if it has one, goes.
+            BufferPtr single;
+            uint8_t* out;
+            size_t outSize;
+            if (canBatch) {
+                if (writer.entrySize() < kMaxReplySize) {
+                    sendBatch(std::move(buf), writer, status);
+                    if (hasError(status)) {
+                        return;
+                    }
+                    buf = server_.bufferPool().acquire(RPC_BATCH_MAX_SIZE);
+                    writer = BatchWriter{buf->bytes.data(), buf->bytes.size()};
+                }
+                out = writer.entryBytes();
+                outSize = writer.entrySize();
+            }
+            else {
+                single = server_.bufferPool().acquire(kMaxReplySize);
+                out = single->bytes.data();
+                outSize = single->bytes.size();
+            }
+
+            auto& request = clMessage.request;
+            auto replyStatus = Status::PROTOCOL_ERROR;
+            pb_size_t bytesWritten = 0;
+            if (barobo_rpc_Request_Type_FIRE == request.type && request.has_fire
+                    && hasExpired(request, rp.age())) {
+                replyStatus = Status::TIMED_OUT;
+                server_.metrics().record(request.fire.id, replyStatus);
+            }
+            else if (barobo_rpc_Request_Type_FIRE == request.type && request.has_fire) {
+                MethodInUnion<Interface> m;
+                auto start = std::chrono::steady_clock::now();
+                m.invoke(impl_, request.fire.id, payload,
+                    ReplySink{clMessage.id, request.fire.id, out, outSize,
+                        bytesWritten, pipeline_->deferredTarget()},
+                    replyStatus);
+                server_.metrics().record(request.fire.id, replyStatus,
+                    std::chrono::steady_clock::now() - start);
+                if (!hasError(replyStatus)) {
+                    addReply(writer, std::move(single), bytesWritten);
+                    continue;
+                }
+            }
+            if (barobo_rpc_Request_Type_FIRE == request.type && request.has_fire
+                    && MethodInUnion<Interface>::isFireAndForget(request.fire.id)) {
+                // Nobody is waiting to hear that it expired or failed.
+                continue;
+            }
+            else if (barobo_rpc_Request_Type_CANCEL == request.type && request.has_cancel) {
+                pipeline_->cancel(request.cancel.id);
+                continue;
+            }
+            else if ((barobo_rpc_Request_Type_SUBSCRIBE == request.type
+                    || barobo_rpc_Request_Type_UNSUBSCRIBE == request.type)
+                    && request.has_subscription) {
+                replyStatus = setSubscription<Interface>(server_.subscriptions(),
+                    request.subscription.id,
+                    barobo_rpc_Request_Type_SUBSCRIBE == request.type);
+            }
+
+            encodeStatus(clMessage.id, replyStatus, out, outSize, bytesWritten, status);
+            if (hasError(status)) {
+                return;
+            }
+            addReply(writer, std::move(single), bytesWritten);
+        }
         if (!hasError(status)) {
-            reply.type = barobo_rpc_Reply_Type_RESULT;
-            reply.has_result = true;
-            reply.result.id = fire.id;
+            sendBatch(std::move(buf), writer, status);
+        }
+    }
+
+    // A reply encoded at writer.entryBytes() is committed to the batch; one
+    // encoded into a buffer of its own is sent now.
+    void addReply (BatchWriter& writer, BufferPtr single, pb_size_t bytesWritten) {
+        if (!bytesWritten) {
+            return;
+        }
+        if (single) {
+            single->bytes.resize(bytesWritten);
+            pipeline_->send(std::move(single));
+        }
+        else {
+            writer.commit(bytesWritten);
+        }
+    }
+
+    void sendBatch (BufferPtr buf, BatchWriter& writer, Status& status) {
+        if (!writer.count()) {
+            return;
+        }
+        pb_size_t bytesWritten = 0;
+        writer.finishReply(bytesWritten, status);
+        if (!hasError(status)) {
+            buf->bytes.resize(bytesWritten);
+            pipeline_->send(std::move(buf));
         }
-        return reply;
     }
 };
 
+// Serve requests until the client disconnects. Up to maxInFlight RESULT
+// replies, including those of deferred methods (see rpc::Deferred), may be
+// outstanding while the next requests are received and invoked; with
+// maxInFlight == 1, requests are served strictly one at a time.
 template <class Interface, class S, class Impl, class CompletionToken>
 BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, typename S::RequestHandlerSignature)
-asyncServeUntilDisconnection (S& server, Impl& impl, CompletionToken&& token) {
+asyncServeUntilDisconnection (S& server, Impl& impl, size_t maxInFlight, CompletionToken&& token) {
     util::asio::AsyncCompletion<
         CompletionToken, typename S::RequestHandlerSignature
     > init { std::forward<CompletionToken>(token) };
 
     using Op = ServeUntilDisconnectionOperation<Interface, S, Impl>;
-    util::asio::v1::makeOperation<Op>(std::move(init.handler), server, impl)();
+    util::asio::v1::makeOperation<Op>(std::move(init.handler), server, impl, maxInFlight)();
 
     return init.result.get();
 }
 
+template <class Interface, class S, class Impl, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, typename S::RequestHandlerSignature)
+asyncServeUntilDisconnection (S& server, Impl& impl, CompletionToken&& token) {
+    return asyncServeUntilDisconnection<Interface>(server, impl, 1,
+        std::forward<CompletionToken>(token));
+}
+
 template <class Interface, class S, class Impl>
 struct RunServerOperation {
     using RequestPair = typename S::RequestPair;
 
-    RunServerOperation (S& server, Impl& impl) : server_(server), impl_(impl) {}
+    RunServerOperation (S& server, Impl& impl, size_t maxInFlight)
+        : server_(server)
+        , impl_(impl)
+        , maxInFlight_(maxInFlight)
+    {}
 
     S& server_;
     Impl& impl_;
+    size_t maxInFlight_;
 
     boost::system::error_code rc_ = boost::asio::error::operation_aborted;
 
@@ -371,7 +851,8 @@ struct RunServerOperation {
             //BOOST_LOG(server_.log()) << "connection received";
             //yield asyncReply(server_, rp.id, Versions::create<Interface>(), std::move(op));
             BOOST_LOG(server_.log()) << "now serving!";
-            yield asyncServeUntilDisconnection<Interface>(server_, impl_, std::move(op));
+            yield asyncServeUntilDisconnection<Interface>(
+                server_, impl_, maxInFlight_, std::move(op));
             BOOST_LOG(server_.log()) << "finished serving";
             yield asyncReply(server_, rp.id, Status::OK, std::move(op));
             rc_ = ec;
@@ -384,17 +865,23 @@ struct RunServerOperation {
 
 template <class Interface, class S, class Impl, class CompletionToken>
 BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
-asyncRunServer (S& server, Impl& impl, CompletionToken&& token) {
+asyncRunServer (S& server, Impl& impl, size_t maxInFlight, CompletionToken&& token) {
     util::asio::AsyncCompletion<
         CompletionToken, void(boost::system::error_code)
     > init { std::forward<CompletionToken>(token) };
 
     using Op = RunServerOperation<Interface, S, Impl>;
-    util::asio::v1::makeOperation<Op>(std::move(init.handler), server, impl)();
+    util::asio::v1::makeOperation<Op>(std::move(init.handler), server, impl, maxInFlight)();
 
     return init.result.get();
 }
 
+template <class Interface, class S, class Impl, class CompletionToken>
+BOOST_ASIO_INITFN_RESULT_TYPE(CompletionToken, void(boost::system::error_code))
+asyncRunServer (S& server, Impl& impl, CompletionToken&& token) {
+    return asyncRunServer<Interface>(server, impl, 1, std::forward<CompletionToken>(token));
+}
+
 } // namespace asio
 } // namespace rpc
 
@@ -0,0 +1,509 @@
+#ifndef RPC_ASIO_SHMMESSAGEQUEUE_HPP
+#define RPC_ASIO_SHMMESSAGEQUEUE_HPP
+
+#ifndef __linux__
+#error "rpc/asio/shmmessagequeue.hpp needs Linux futexes"
+#endif
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/io_service.hpp>
+
+#include <boost/optional.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace rpc {
+namespace asio {
+
+namespace _ {
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+    "Shared memory rings need lock-free 32-bit atomics");
+
+// Futexes on words in a MAP_SHARED mapping work across processes, as long as
+// we do not use the FUTEX_PRIVATE_FLAG variants.
+inline void futexWait (std::atomic<uint32_t>& word, uint32_t expected,
+        std::chrono::seconds timeout) {
+    auto ts = timespec{};
+    ts.tv_sec = time_t(timeout.count());
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected,
+        &ts, nullptr, 0);
+}
+
+inline void futexWake (std::atomic<uint32_t>& word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX,
+        nullptr, nullptr, 0);
+}
+
+const size_t kCacheLine = 64;
+
+// One side's wakeup state. The peer bumps bell, and wakes us if we are
+// waiting, whenever it writes to the ring we read or frees space in the ring
+// we write. pid is the process which mapped this side, or zero until one has,
+// so the peer can tell if it dies without closing.
+struct ShmEndpoint {
+    alignas(kCacheLine) std::atomic<uint32_t> bell;
+    std::atomic<uint32_t> waiting;
+    std::atomic<uint32_t> closed;
+    std::atomic<uint32_t> pid;
+};
+
+// A single-producer, single-consumer byte ring. head and tail count bytes
+// written and read, and wrap freely; each message is a 32-bit length followed
+// by that many bytes, split across the end of data if need be.
+struct ShmRing {
+    static const uint32_t kCapacity = 64 * 1024;
+
+    alignas(kCacheLine) std::atomic<uint32_t> head;
+    alignas(kCacheLine) std::atomic<uint32_t> tail;
+    alignas(kCacheLine) uint8_t data[kCapacity];
+
+    void copyIn (uint32_t offset, const void* bytes, size_t size) {
+        auto begin = offset % kCapacity;
+        auto first = std::min<size_t>(size, kCapacity - begin);
+        memcpy(data + begin, bytes, first);
+        memcpy(data, static_cast<const uint8_t*>(bytes) + first, size - first);
+    }
+
+    void copyOut (uint32_t offset, void* bytes, size_t size) const {
+        auto begin = offset % kCapacity;
+        auto first = std::min<size_t>(size, kCapacity - begin);
+        memcpy(bytes, data + begin, first);
+        memcpy(static_cast<uint8_t*>(bytes) + first, data, size - first);
+    }
+};
+
+struct ShmSegment {
+    static const uint32_t kMagic = 0x52425348; // "RBSH"
+
+    std::atomic<uint32_t> magic;
+    std::atomic<uint32_t> opened;
+    // Side 0 created the segment, side 1 opened it. Side i writes rings[i]
+    // and reads rings[1 - i].
+    ShmEndpoint endpoints[2];
+    ShmRing rings[2];
+};
+
+// The process-local half of a ShmMessageQueue: the mapping, the pending
+// operations, and a thread which sleeps on our futex until the peer lets one
+// of them make progress.
+class ShmConnection {
+public:
+    using SendHandler = std::function<void(boost::system::error_code)>;
+    using ReceiveHandler = std::function<void(boost::system::error_code, size_t)>;
+
+    ShmConnection (boost::asio::io_service& context, int fd, ShmSegment* segment, size_t side)
+        : mContext(context)
+        , mFd(fd)
+        , mSegment(segment)
+        , mSide(side)
+        , mSpins(std::thread::hardware_concurrency() > 1 ? kSpins : 0)
+    {
+        self().pid.store(uint32_t(getpid()));
+        mThread = std::thread(&ShmConnection::run, this);
+    }
+
+    ShmConnection (const ShmConnection&) = delete;
+    ShmConnection& operator= (const ShmConnection&) = delete;
+
+    ~ShmConnection () {
+        close();
+        mThread.join();
+        munmap(mSegment, sizeof(ShmSegment));
+        ::close(mFd);
+    }
+
+    // Fail pending operations, and tell the peer we are gone. The mapping
+    // lives until we are destroyed, as the worker thread may still be using
+    // it.
+    void close () {
+        {
+            std::lock_guard<std::mutex> lock{mMutex};
+            if (mStopping) {
+                return;
+            }
+            mStopping = true;
+            failAll(boost::asio::error::operation_aborted);
+        }
+        self().closed.store(1);
+        ring(self());
+        ring(peer());
+    }
+
+    void asyncSend (boost::asio::const_buffer buffer, SendHandler handler) {
+        std::lock_guard<std::mutex> lock{mMutex};
+        if (mStopping) {
+            post(std::move(handler), boost::asio::error::bad_descriptor);
+        }
+        else if (peerClosed()) {
+            post(std::move(handler), boost::asio::error::broken_pipe);
+        }
+        else if (boost::asio::buffer_size(buffer) + sizeof(uint32_t) > ShmRing::kCapacity) {
+            post(std::move(handler), boost::asio::error::message_size);
+        }
+        else if (mSends.empty() && tryWrite(buffer)) {
+            post(std::move(handler), boost::system::error_code{});
+        }
+        else {
+            mSends.push_back(PendingSend{buffer, std::move(handler), work()});
+        }
+    }
+
+    void asyncReceive (boost::asio::mutable_buffer buffer, ReceiveHandler handler) {
+        std::lock_guard<std::mutex> lock{mMutex};
+        if (mStopping || mReceive) {
+            // Like a socket, we do not queue receives.
+            post(std::move(handler), boost::asio::error::bad_descriptor, 0);
+            return;
+        }
+        mReceive.emplace(PendingReceive{buffer, std::move(handler), work()});
+        pumpReceive();
+    }
+
+private:
+    // Pending operations keep the io_service running, as they would on a
+    // socket.
+    struct PendingSend {
+        boost::asio::const_buffer buffer;
+        SendHandler handler;
+        boost::asio::io_service::work work;
+    };
+
+    struct PendingReceive {
+        boost::asio::mutable_buffer buffer;
+        ReceiveHandler handler;
+        boost::asio::io_service::work work;
+    };
+
+    // Busy-poll this many times before sleeping on the futex. A round trip to
+    // a peer which answers promptly then never costs a context switch. On a
+    // single core, polling only delays the peer, so we go straight to sleep.
+    static const int kSpins = 1 << 14;
+
+    // How often a sleeping connection checks that its peer's process is still
+    // alive. A peer which crashed never sets closed, and its pid is only
+    // meaningful if both processes share a PID namespace. A function, since
+    // std::chrono::seconds takes its count by reference, and a static const
+    // member bound to a reference needs an out-of-line definition.
+    static std::chrono::seconds livenessInterval () {
+        return std::chrono::seconds(1);
+    }
+
+    ShmEndpoint& self () { return mSegment->endpoints[mSide]; }
+    ShmEndpoint& peer () { return mSegment->endpoints[1 - mSide]; }
+    ShmRing& txRing () { return mSegment->rings[mSide]; }
+    ShmRing& rxRing () { return mSegment->rings[1 - mSide]; }
+
+    static void ring (ShmEndpoint& endpoint) {
+        endpoint.bell.fetch_add(1);
+        if (endpoint.waiting.load()) {
+            futexWake(endpoint.bell);
+        }
+    }
+
+    boost::asio::io_service::work work () {
+        return boost::asio::io_service::work{mContext};
+    }
+
+    template <class Handler, class... Args>
+    void post (Handler&& handler, Args&&... args) {
+        mContext.post(std::bind(std::forward<Handler>(handler), std::forward<Args>(args)...));
+    }
+
+    bool tryWrite (boost::asio::const_buffer buffer) {
+        auto& tx = txRing();
+        auto size = uint32_t(boost::asio::buffer_size(buffer));
+        auto head = tx.head.load(std::memory_order_relaxed);
+        auto tail = tx.tail.load(std::memory_order_acquire);
+        if (ShmRing::kCapacity - (head - tail) < sizeof(size) + size) {
+            return false;
+        }
+        tx.copyIn(head, &size, sizeof(size));
+        tx.copyIn(head + sizeof(size), boost::asio::buffer_cast<const void*>(buffer), size);
+        tx.head.store(head + sizeof(size) + size, std::memory_order_release);
+        ring(peer());
+        return true;
+    }
+
+    // Requires mMutex and a pending receive. Return true if it completed.
+    bool pumpReceive () {
+        auto& rx = rxRing();
+        auto tail = rx.tail.load(std::memory_order_relaxed);
+        auto head = rx.head.load(std::memory_order_acquire);
+        if (head == tail) {
+            if (peerClosed()) {
+                post(std::move(mReceive->handler), boost::asio::error::eof, 0);
+                mReceive = boost::none;
+                return true;
+            }
+            return false;
+        }
+        uint32_t length;
+        rx.copyOut(tail, &length, sizeof(length));
+        auto size = length;
+        auto ec = boost::system::error_code{};
+        if (size > boost::asio::buffer_size(mReceive->buffer)) {
+            // Drop the message, as a datagram socket would truncate it.
+            ec = boost::asio::error::message_size;
+            size = 0;
+        }
+        else {
+            rx.copyOut(tail + sizeof(size),
+                boost::asio::buffer_cast<void*>(mReceive->buffer), size);
+        }
+        rx.tail.store(tail + sizeof(length) + length, std::memory_order_release);
+        ring(peer());
+        post(std::move(mReceive->handler), ec, size_t(size));
+        mReceive = boost::none;
+        return true;
+    }
+
+    // Requires mMutex. Return true if any pending operation completed.
+    bool pump () {
+        auto progress = false;
+        if (peerClosed()) {
+            progress = !mSends.empty();
+            for (auto& send : mSends) {
+                post(std::move(send.handler), boost::asio::error::broken_pipe);
+            }
+            mSends.clear();
+        }
+        while (!mSends.empty() && tryWrite(mSends.front().buffer)) {
+            post(std::move(mSends.front().handler), boost::system::error_code{});
+            mSends.pop_front();
+            progress = true;
+        }
+        if (mReceive && pumpReceive()) {
+            progress = true;
+        }
+        return progress;
+    }
+
+    // Requires mMutex.
+    bool peerClosed () {
+        return mPeerDied || peer().closed.load();
+    }
+
+    // Notice if the peer's process has gone without closing its side.
+    void checkPeer () {
+        auto pid = pid_t(peer().pid.load());
+        if (pid && -1 == kill(pid, 0) && ESRCH == errno) {
+            std::lock_guard<std::mutex> lock{mMutex};
+            mPeerDied = true;
+        }
+    }
+
+    // Requires mMutex.
+    void failAll (boost::system::error_code ec) {
+        for (auto& send : mSends) {
+            post(std::move(send.handler), ec);
+        }
+        mSends.clear();
+        if (mReceive) {
+            post(std::move(mReceive->handler), ec, 0);
+            mReceive = boost::none;
+        }
+    }
+
+    void run () {
+        auto spins = 0;
+        auto nextCheck = std::chrono::steady_clock::now();
+        while (true) {
+            auto bell = self().bell.load();
+            {
+                std::lock_guard<std::mutex> lock{mMutex};
+                if (mStopping) {
+                    return;
+                }
+                if (pump()) {
+                    spins = 0;
+                    continue;
+                }
+            }
+            if (spins < mSpins) {
+                ++spins;
+                while (spins < mSpins && bell == self().bell.load()) {
+                    ++spins;
+                }
+                continue;
+            }
+            // Anyone ringing after this sees we are waiting and wakes us, and
+            // anyone ringing before it makes futexWait return at once.
+            self().waiting.store(1);
+            futexWait(self().bell, bell, livenessInterval());
+            self().waiting.store(0);
+            spins = 0;
+            auto now = std::chrono::steady_clock::now();
+            if (now >= nextCheck) {
+                checkPeer();
+                nextCheck = now + livenessInterval();
+            }
+        }
+    }
+
+    boost::asio::io_service& mContext;
+    int mFd;
+    ShmSegment* mSegment;
+    size_t mSide;
+    int mSpins;
+
+    std::mutex mMutex;
+    bool mStopping = false;
+    bool mPeerDied = false;
+    std::deque<PendingSend> mSends;
+    boost::optional<PendingReceive> mReceive;
+
+    std::thread mThread;
+};
+
+} // namespace _
+
+// A MessageQueue for rpc::asio::Client and Server between processes on the
+// same host, carrying messages through a pair of lock-free rings in a
+// memory-mapped file. One side calls create(), the other open() on the same
+// path; a path under /dev/shm keeps the rings off disk. Each queue has a
+// thread which sleeps on a futex until the peer has sent something or made
+// room, so an idle connection costs nothing, and it polls briefly before
+// sleeping, so a busy one rarely needs a system call.
+//
+// Like a datagram socket, a send is all-or-nothing, and a receive into too
+// small a buffer fails with message_size and drops the message. A message may
+// be at most 64 KiB, less four bytes. Once the peer has closed its queue, or
+// its process has died, sends fail with broken_pipe, and a receive fails with
+// eof when everything the peer sent has been read. A peer which died is
+// noticed within a second or so, provided both processes share a PID
+// namespace.
+class ShmMessageQueue {
+public:
+    explicit ShmMessageQueue (boost::asio::io_service& context)
+        : mContext(&context)
+    {}
+
+    boost::asio::io_service& get_io_service () { return *mContext; }
+
+    bool is_open () const { return bool(mConnection); }
+
+    // Create and map a new segment at path, replacing any file there.
+    void create (const std::string& path, boost::system::error_code& ec) {
+        connect(path, O_RDWR | O_CREAT | O_TRUNC, 0, ec);
+    }
+
+    // Map the segment created by our peer at path.
+    void open (const std::string& path, boost::system::error_code& ec) {
+        connect(path, O_RDWR, 1, ec);
+    }
+
+    // Safe to call more than once. The peer's pending receive fails with eof
+    // once it has read everything we sent. Our own pending operations fail
+    // with operation_aborted, and the segment is unmapped, so the queue may
+    // create() or open() another.
+    void close (boost::system::error_code& ec) {
+        ec = {};
+        if (mConnection) {
+            mConnection->close();
+            mConnection.reset();
+        }
+    }
+
+    template <class Handler>
+    void asyncSend (boost::asio::const_buffer buffer, Handler&& handler) {
+        if (!mConnection) {
+            mContext->post(std::bind(std::forward<Handler>(handler),
+                boost::system::error_code(boost::asio::error::bad_descriptor)));
+            return;
+        }
+        mConnection->asyncSend(buffer, std::forward<Handler>(handler));
+    }
+
+    template <class Handler>
+    void asyncReceive (boost::asio::mutable_buffer buffer, Handler&& handler) {
+        if (!mConnection) {
+            mContext->post(std::bind(std::forward<Handler>(handler),
+                boost::system::error_code(boost::asio::error::bad_descriptor), size_t(0)));
+            return;
+        }
+        mConnection->asyncReceive(buffer, std::forward<Handler>(handler));
+    }
+
+private:
+    void connect (const std::string& path, int flags, size_t side, boost::system::error_code& ec) {
+        ec = {};
+        if (mConnection) {
+            ec = boost::asio::error::already_open;
+            return;
+        }
+        auto fd = ::open(path.c_str(), flags | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (-1 == fd) {
+            ec = boost::system::error_code(errno, boost::system::system_category());
+            return;
+        }
+        auto fail = [&] (int error) {
+            ec = boost::system::error_code(error, boost::system::system_category());
+            ::close(fd);
+        };
+        if (!side && -1 == ftruncate(fd, sizeof(_::ShmSegment))) {
+            fail(errno);
+            return;
+        }
+        struct stat st;
+        if (-1 == fstat(fd, &st)) {
+            fail(errno);
+            return;
+        }
+        if (size_t(st.st_size) < sizeof(_::ShmSegment)) {
+            fail(ENODATA);
+            return;
+        }
+        auto address = mmap(nullptr, sizeof(_::ShmSegment), PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0);
+        if (MAP_FAILED == address) {
+            fail(errno);
+            return;
+        }
+        // A freshly truncated file is all zeros, which is a valid empty
+        // segment; the magic number tells the peer we are done with it.
+        auto segment = static_cast<_::ShmSegment*>(address);
+        if (!side) {
+            segment->magic.store(_::ShmSegment::kMagic);
+        }
+        else if (_::ShmSegment::kMagic != segment->magic.load() || segment->opened.exchange(1)) {
+            auto error = _::ShmSegment::kMagic != segment->magic.load() ? ENODATA : EADDRINUSE;
+            munmap(address, sizeof(_::ShmSegment));
+            fail(error);
+            return;
+        }
+        mConnection = std::make_unique<_::ShmConnection>(*mContext, fd, segment, side);
+    }
+
+    boost::asio::io_service* mContext;
+    std::unique_ptr<_::ShmConnection> mConnection;
+};
+
+} // namespace asio
+} // namespace rpc
+
+#endif
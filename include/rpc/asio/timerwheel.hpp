@@ -0,0 +1,153 @@
+#ifndef RPC_ASIO_TIMERWHEEL_HPP
+#define RPC_ASIO_TIMERWHEEL_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace rpc {
+namespace asio {
+
+// A hierarchical timer wheel of Keys, with time measured in integral ticks.
+// Level 0 has a bucket per tick for the next 64 ticks, level 1 a bucket per
+// 64 ticks for the next 64^2, and so on; deadlines beyond the last level are
+// clamped to it. When time reaches the start of a higher level bucket, its
+// entries cascade down into lower levels, so inserting is O(1) and each entry
+// moves at most once per level.
+//
+// There is no cancellation. Instead, the owner looks up each expired key and
+// ignores those it no longer cares about, which is why the deadline is
+// reported along with the key. Buckets keep their capacity, so a wheel in
+// steady use stops allocating.
+template <class Key>
+class TimerWheel {
+public:
+    static const unsigned kLevels = 4;
+    static const unsigned kBits = 6;
+    static const uint64_t kBuckets = uint64_t(1) << kBits;
+    static const uint64_t kHorizon = uint64_t(1) << (kBits * kLevels);
+
+    explicit TimerWheel (uint64_t now = 0) : mNow(now) {}
+
+    uint64_t now () const { return mNow; }
+    bool empty () const { return !mSize; }
+
+    // Expire key at the given tick, or at the next tick if that has passed.
+    // Return the deadline it will be reported with, after clamping.
+    uint64_t insert (Key key, uint64_t deadline) {
+        if (deadline <= mNow) {
+            deadline = mNow + 1;
+        }
+        if (deadline - mNow >= kHorizon) {
+            deadline = mNow + kHorizon - 1;
+        }
+        place(Entry{std::move(key), deadline});
+        return deadline;
+    }
+
+    // The next tick at which advance() will have anything to do. Only
+    // meaningful if the wheel is not empty.
+    uint64_t nextEvent () const {
+        auto next = ~uint64_t(0);
+        for (unsigned level = 0; level < kLevels; ++level) {
+            auto shift = kBits * level;
+            auto bits = mOccupied[level];
+            for (uint64_t index = 0; bits; ++index, bits >>= 1) {
+                if (bits & 1) {
+                    // The first tick after now at which this bucket comes up.
+                    auto start = (((mNow >> shift) & ~(kBuckets - 1)) + index) << shift;
+                    if (start <= mNow) {
+                        start += kBuckets << shift;
+                    }
+                    if (start < next) {
+                        next = start;
+                    }
+                }
+            }
+        }
+        return next;
+    }
+
+    // Move time forward to the given tick, calling expire(key, deadline) for
+    // every entry whose deadline has passed.
+    template <class Fn>
+    void advance (uint64_t now, Fn&& expire) {
+        while (mNow < now) {
+            if (empty()) {
+                mNow = now;
+                break;
+            }
+            auto next = nextEvent();
+            if (next > now) {
+                mNow = now;
+                break;
+            }
+            mNow = next;
+            for (unsigned level = kLevels - 1; level > 0; --level) {
+                auto shift = kBits * level;
+                if (!(mNow & ((uint64_t(1) << shift) - 1))) {
+                    for (auto& entry : takeBucket(level, (mNow >> shift) & (kBuckets - 1))) {
+                        place(std::move(entry));
+                    }
+                    mScratch.clear();
+                }
+            }
+            for (auto& entry : takeBucket(0, mNow & (kBuckets - 1))) {
+                expire(entry.key, entry.deadline);
+            }
+            mScratch.clear();
+        }
+    }
+
+    void clear () {
+        for (auto& level : mBuckets) {
+            for (auto& bucket : level) {
+                bucket.clear();
+            }
+        }
+        for (auto& bits : mOccupied) {
+            bits = 0;
+        }
+        mSize = 0;
+    }
+
+private:
+    struct Entry {
+        Key key;
+        uint64_t deadline;
+    };
+
+    // File an entry with mNow <= deadline < mNow + kHorizon. An entry due now
+    // goes in the level 0 bucket which is about to expire.
+    void place (Entry entry) {
+        auto delta = entry.deadline - mNow;
+        unsigned level = 0;
+        while (delta >= (uint64_t(1) << (kBits * (level + 1)))) {
+            ++level;
+        }
+        auto index = (entry.deadline >> (kBits * level)) & (kBuckets - 1);
+        mBuckets[level][index].push_back(std::move(entry));
+        mOccupied[level] |= uint64_t(1) << index;
+        ++mSize;
+    }
+
+    // Swap a bucket's entries out into mScratch, so that they may be
+    // reinserted or expired without touching the bucket being iterated.
+    std::vector<Entry>& takeBucket (unsigned level, uint64_t index) {
+        mScratch.swap(mBuckets[level][index]);
+        mOccupied[level] &= ~(uint64_t(1) << index);
+        mSize -= mScratch.size();
+        return mScratch;
+    }
+
+    uint64_t mNow;
+    size_t mSize = 0;
+    uint64_t mOccupied[kLevels] = {};
+    std::vector<Entry> mBuckets[kLevels][kBuckets];
+    std::vector<Entry> mScratch;
+};
+
+}} // namespace rpc::asio
+
+#endif
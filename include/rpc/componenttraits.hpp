@@ -27,13 +27,69 @@ struct IsMethod { static const bool value = false; };
 template <class Broadcast>
 struct IsBroadcast { static const bool value = false; };
 
+// Metafunction giving a broadcast's position in its interface's list of
+// broadcasts, counting from zero.
+template <class Broadcast>
+struct BroadcastIndex;
+
+// The number of broadcasts in an interface, size, and a way to visit them:
+//   BroadcastList<Interface>::forEach(visitor);
+// calls visitor(broadcastStruct, BroadcastIndex<...>::value) for each one.
+template <class Interface>
+struct BroadcastList;
+
+// Metafunction to identify whether a broadcast is selective: clients only
+// receive it after subscribing to it. See RPCDEF_SELECTIVE_BROADCASTS.
+template <class Broadcast>
+struct IsSelective { static const bool value = false; };
+
+// Metafunction to identify whether a method is fire-and-forget: the server
+// sends no reply for it, not even an error STATUS, and the client does not
+// wait for one. Both the method's In and Result structs are marked. See
+// RPCDEF_FIRE_AND_FORGET.
+template <class Component>
+struct IsFireAndForget { static const bool value = false; };
+
+// Metafunction giving the worst-case encoded size of a component message, as
+// computed by nanopb.
+template <class Component>
+struct MaxEncodedSize;
+
+// Straight-line codec for a component message whose fields are all required
+// scalars, which ribbon-bridge-generator.py writes as a specialization with
+// value true, maxSize, and
+//   static size_t size (const Component&);
+//   static uint8_t* write (const Component&, uint8_t* out);
+//   static bool read (Component&, const uint8_t* in, size_t size);
+// write produces the same bytes as pb_encode. read returns false if the input
+// is not exactly what write would produce, in which case the message must be
+// decoded with pb_decode after all. See rpc/fixedlayout.hpp.
+template <class Component>
+struct FixedLayout { static const bool value = false; };
+
+// Metafunction giving the worst-case encoded size of the messages an
+// interface's client and server exchange: clientMessage for a
+// barobo_rpc_ClientMessage, serverMessage for a barobo_rpc_ServerMessage, and
+// value for the larger of the two.
+template <class Interface>
+struct MaxMessageSize;
+
 // Union containing a data member for every component message of an interface,
 // and an invoke member, such that:
 //   MethodInUnion<Interface>().invoke(server, id, inPayload, outPayload, status);
 // executes the method specified by the given component id, using the arguments
 // encoded in the barobo_rpc_Request_Fire_payload_t parameter, inPayload, and
 // encodes the result in the barobo_rpc_Reply_Result_payload_t parameter,
-// outPayload.
+// outPayload. Alternatively,
+//   MethodInUnion<Interface>().invoke(server, id, inView, sink, status);
+// decodes the arguments straight out of the PayloadView, inView, and hands the
+// method's result struct to sink(result, status), which lets the caller encode
+// it directly into an outgoing message (see ReplySink). If the server
+// implements the deferred form of onFire for the method, the sink's
+// defer<Result>(status) member supplies the Deferred it is called with instead.
+// MethodInUnion<Interface>::isFireAndForget(id) tells whether the method with
+// the given component id is fire-and-forget, for replies which are decided
+// before or instead of invoking it.
 template <class Interface>
 union MethodInUnion;
 
@@ -58,6 +114,20 @@ struct ResultOf<T&> : ResultOf<T> { };
 RPC_DEFINE_TRAIT_HAS_MEMBER_FUNCTION_OVERLOAD(onFire)
 RPC_DEFINE_TRAIT_HAS_MEMBER_FUNCTION_OVERLOAD(onBroadcast)
 
+// A handle to a method's reply, which a server may send after onFire has
+// returned. See rpc/message.hpp.
+template <class Result>
+class Deferred;
+
+// Metafunction with value true if T implements the deferred form of onFire for
+// Method, i.e., void onFire(Method, Deferred<ResultOf<Method>::type>), rather
+// than ResultOf<Method>::type onFire(Method).
+template <class T, class Method>
+struct HasDeferredOnFire {
+    static const bool value = HasMemberFunctionOverloadonFire<T,
+        void(Method, Deferred<typename ResultOf<Method>::type>)>::value;
+};
+
 template <class T, class Interface>
 struct AssertServerImplementsInterface;
 
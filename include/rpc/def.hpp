@@ -3,6 +3,7 @@
 
 #include <rpc/version.hpp>
 #include <rpc/componenttraits.hpp>
+#include <rpc/dispatchtable.hpp>
 #include <rpc/hash.hpp>
 #include <rpc/message.hpp>
 
@@ -11,7 +12,9 @@
 #include <boost/preprocessor/seq/enum.hpp>
 #include <boost/preprocessor/seq/fold_left.hpp>
 #include <boost/preprocessor/seq/for_each.hpp>
+#include <boost/preprocessor/seq/for_each_i.hpp>
 #include <boost/preprocessor/seq/reverse.hpp>
+#include <boost/preprocessor/seq/size.hpp>
 #include <boost/preprocessor/seq/transform.hpp>
 #include <boost/preprocessor/tuple/elem.hpp>
 #include <boost/preprocessor/tuple/to_seq.hpp>
@@ -172,16 +175,82 @@
             BOOST_PP_SEQ_TRANSFORM(rpcdef_make_broadcast_struct, \
                 interface, broadcasts))
 
+#define rpcdef_define_BroadcastIndex(r, interface, i, brdcst) \
+    template <> \
+    struct BroadcastIndex<Broadcast<interface>::brdcst> { \
+        static const size_t value = i; \
+    };
+
+#define rpcdef_visit_broadcast(r, interface, i, brdcst) \
+    visitor(Broadcast<interface>::brdcst(), size_t(i));
+
+#define RPCDEF_BroadcastList(interface, broadcasts) \
+    BOOST_PP_SEQ_FOR_EACH_I(rpcdef_define_BroadcastIndex, interface, broadcasts) \
+    template <> \
+    struct BroadcastList<interface> { \
+        static const size_t size = BOOST_PP_SEQ_SIZE(broadcasts); \
+        template <class Visitor> \
+        static void forEach (Visitor& visitor) { \
+            BOOST_PP_SEQ_FOR_EACH_I(rpcdef_visit_broadcast, interface, broadcasts) \
+        } \
+    };
+
+//////////////////////////////////////////////////////////////////////////////
+// Encoded sizes
+
+// nanopb only defines a component's _size macro if all its fields are bounded,
+// so every component message needs max_size/max_count options where relevant.
+#define rpcdef_define_MaxEncodedSize(s, prefix, component) \
+    template <> \
+    struct MaxEncodedSize<BOOST_PP_CAT(prefix, component)> { \
+        static const size_t value = BOOST_PP_CAT(prefix, BOOST_PP_CAT(component, _size)); \
+    };
+
+#define RPCDEF_MaxEncodedSize(prefix, methods, broadcasts) \
+    BOOST_PP_SEQ_FOR_EACH(rpcdef_define_MaxEncodedSize, prefix, \
+            BOOST_PP_SEQ_TRANSFORM(add_suffix, _In, methods)) \
+    BOOST_PP_SEQ_FOR_EACH(rpcdef_define_MaxEncodedSize, prefix, \
+            BOOST_PP_SEQ_TRANSFORM(add_suffix, _Result, methods)) \
+    BOOST_PP_SEQ_FOR_EACH(rpcdef_define_MaxEncodedSize, prefix, broadcasts)
+
+#define rpcdef_max_encoded_size(s, prefix, component) \
+    MaxEncodedSize<BOOST_PP_CAT(prefix, component)>::value
+
+#define rpcdef_max_encoded_size_of(prefix, components) \
+    _::MaxOf<BOOST_PP_SEQ_ENUM(BOOST_PP_SEQ_TRANSFORM( \
+            rpcdef_max_encoded_size, prefix, components))>::value
+
+#define RPCDEF_MaxMessageSize(interfaceNames, methods, broadcasts) \
+    template <> \
+    struct MaxMessageSize<rpcdef_cat_scope(interfaceNames)> { \
+        static const size_t clientMessage = MaxFireMessageSize< \
+            rpcdef_max_encoded_size_of(rpcdef_underscored_token(interfaceNames), \
+                BOOST_PP_SEQ_TRANSFORM(add_suffix, _In, methods))>::value; \
+        static const size_t serverMessage = _::MaxOf< \
+            MaxResultMessageSize< \
+                rpcdef_max_encoded_size_of(rpcdef_underscored_token(interfaceNames), \
+                    BOOST_PP_SEQ_TRANSFORM(add_suffix, _Result, methods))>::value, \
+            MaxBroadcastMessageSize< \
+                rpcdef_max_encoded_size_of(rpcdef_underscored_token(interfaceNames), \
+                    broadcasts)>::value, \
+            MaxControlReplyMessageSize::value>::value; \
+        static const size_t value = _::Max<clientMessage, serverMessage>::value; \
+    };
+
 //////////////////////////////////////////////////////////////////////////////
 // Component Unions
 
 #if HAVE_CONSTEXPR_FUNCTION_TEMPLATES
 
+// Component IDs are constant expressions, so dispatch is a switch, which
+// costs no RAM and lets the compiler pick a jump table or a binary search.
+// Duplicate case labels reject component name hash collisions.
+
 # define rpcdef_case_invoke_fire(s, interface, method) \
     case ::rpc::componentId(MethodIn<interface>::method{}): \
         decode(this->method, in.bytes, in.size, status); \
         if (!hasError(status)) { \
-            encode(server.onFire(this->method), out.bytes, sizeof(out.bytes), out.size, status); \
+            _::fire(server, this->method, sink, status); \
         } \
         break;
 
@@ -199,48 +268,52 @@
         if (!hasError(status)) { \
             client.onBroadcast(this->brdcst); \
         } \
-        break; \
+        break;
 
 # define rpcdef_invoke_broadcast_impl(interface, broadcasts) \
     switch (componentId) { \
         BOOST_PP_SEQ_FOR_EACH(rpcdef_case_invoke_broadcast, interface, broadcasts) \
         default: \
             status = Status::INTERFACE_ERROR; \
+            break; \
     }
 
 #else // HAVE_CONSTEXPR_FUNCTION_TEMPLATES
 
-#include <map>
+// Without constexpr component IDs, both unions dispatch through a DispatchTable
+// of captureless lambdas, built on first use.
 
 # define rpcdef_case_invoke_fire(s, interface, method) \
     { ::rpc::componentId(MethodIn<interface>::method{}) \
     , [] (MethodInUnion<interface>& self, \
         T& server, \
-        barobo_rpc_Request_Fire_payload_t& in, \
-        barobo_rpc_Reply_Result_payload_t& out, \
+        PayloadView in, \
+        Sink& sink, \
         Status& status) { \
         decode(self.method, in.bytes, in.size, status); \
         if (!hasError(status)) { \
-            encode(server.onFire(self.method), out.bytes, sizeof(out.bytes), out.size, status); \
+            _::fire(server, self.method, sink, status); \
         } \
     } },
 
 # define rpcdef_invoke_fire_impl(interface, methods) \
-    static const auto delegates = std::map<uint32_t, std::function<void(MethodInUnion<interface>&, T&, \
-        barobo_rpc_Request_Fire_payload_t&, barobo_rpc_Reply_Result_payload_t&, Status&)>>{ \
+    using Delegate = void(*)(MethodInUnion<interface>&, T&, PayloadView, Sink&, Status&); \
+    static const DispatchTable<Delegate, BOOST_PP_SEQ_SIZE(methods)> delegates {{ \
         BOOST_PP_SEQ_FOR_EACH(rpcdef_case_invoke_fire, interface, methods) \
-    }; \
-    status = Status::INTERFACE_ERROR; \
-    auto iter = delegates.find(componentId); \
-    if (iter != delegates.end()) { \
-        iter->second(*this, server, in, out, status); \
+    }}; \
+    auto delegate = delegates.find(componentId); \
+    if (delegate) { \
+        delegate(*this, server, in, sink, status); \
+    } \
+    else { \
+        status = Status::INTERFACE_ERROR; \
     }
 
 # define rpcdef_case_invoke_broadcast(s, interface, brdcst) \
     { ::rpc::componentId(Broadcast<interface>::brdcst{}) \
     , [] (BroadcastUnion<interface>& self, \
         T& client, \
-        barobo_rpc_Broadcast_payload_t& in, \
+        PayloadView in, \
         Status& status) { \
         decode(self.brdcst, in.bytes, in.size, status); \
         if (!hasError(status)) { \
@@ -249,31 +322,54 @@
     } },
 
 # define rpcdef_invoke_broadcast_impl(interface, broadcasts) \
-    static const auto delegates = std::map<uint32_t, std::function<void(BroadcastUnion<interface>&, T&, \
-        barobo_rpc_Broadcast_payload_t&, Status&)>>{ \
+    using Delegate = void(*)(BroadcastUnion<interface>&, T&, PayloadView, Status&); \
+    static const DispatchTable<Delegate, BOOST_PP_SEQ_SIZE(broadcasts)> delegates {{ \
         BOOST_PP_SEQ_FOR_EACH(rpcdef_case_invoke_broadcast, interface, broadcasts) \
-    }; \
-    status = Status::INTERFACE_ERROR; \
-    auto iter = delegates.find(componentId); \
-    if (iter != delegates.end()) { \
-        iter->second(*this, client, in, status); \
+    }}; \
+    auto delegate = delegates.find(componentId); \
+    if (delegate) { \
+        delegate(*this, client, in, status); \
+    } \
+    else { \
+        status = Status::INTERFACE_ERROR; \
     }
 
 #endif // HAVE_CONSTEXPR_FUNCTION_TEMPLATES
 
 #define rpcdef_decl_method_input_object(s, interface, method) MethodIn<interface>::method method;
 
+// RPCDEF_FIRE_AND_FORGET comes after RPCDEF_HPP, so IsFireAndForget must not be
+// looked up until isFireAndForget is used: hence the dependent Interface.
+#define rpcdef_if_fire_and_forget(s, interface, method) \
+    if (::rpc::componentId(typename MethodIn<Interface>::method{}) == componentId) { \
+        return IsFireAndForget<typename MethodIn<Interface>::method>::value; \
+    }
+
 #define RPCDEF_MethodInUnion(interface, methods) \
     template <> \
     union MethodInUnion<interface> { \
+        template <class T, class Sink> \
+        void invoke (T& server, \
+                uint32_t componentId, \
+                PayloadView in, \
+                Sink&& sink, \
+                Status& status) { \
+            (void)AssertServerImplementsInterface<T, interface>(); \
+            rpcdef_invoke_fire_impl(interface, methods) \
+        } \
         template <class T> \
         void invoke (T& server, \
                 uint32_t componentId, \
                 barobo_rpc_Request_Fire_payload_t& in, \
                 barobo_rpc_Reply_Result_payload_t& out, \
                 Status& status) { \
-            (void)AssertServerImplementsInterface<T, interface>(); \
-            rpcdef_invoke_fire_impl(interface, methods) \
+            invoke(server, componentId, PayloadView{in.bytes, in.size}, \
+                PayloadSink<barobo_rpc_Reply_Result_payload_t>{out}, status); \
+        } \
+        template <class Interface = interface> \
+        static bool isFireAndForget (uint32_t componentId) { \
+            BOOST_PP_SEQ_FOR_EACH(rpcdef_if_fire_and_forget, interface, methods) \
+            return false; \
         } \
         BOOST_PP_SEQ_FOR_EACH(rpcdef_decl_method_input_object, interface, methods) \
     };
@@ -287,11 +383,18 @@
         template <class T> \
         void invoke (T& client, \
                 uint32_t componentId, \
-                barobo_rpc_Broadcast_payload_t& in, \
+                PayloadView in, \
                 Status& status) { \
             (void)AssertClientImplementsInterface<T, interface>(); \
             rpcdef_invoke_broadcast_impl(interface, broadcasts) \
         } \
+        template <class T> \
+        void invoke (T& client, \
+                uint32_t componentId, \
+                barobo_rpc_Broadcast_payload_t& in, \
+                Status& status) { \
+            invoke(client, componentId, PayloadView{in.bytes, in.size}, status); \
+        } \
     };
 
 
@@ -343,7 +446,8 @@
 #define rpcdef_server_fire_assertion(s, interface, method) \
     static_assert(HasMemberFunctionOverloadonFire \
             < T \
-            , rpc::MethodResult<interface>::method(rpc::MethodIn<interface>::method)>::value, \
+            , rpc::MethodResult<interface>::method(rpc::MethodIn<interface>::method)>::value \
+            || HasDeferredOnFire<T, rpc::MethodIn<interface>::method>::value, \
             BOOST_PP_STRINGIZE(interface) \
             " server does not implement onFire(" \
             BOOST_PP_STRINGIZE(method) ")");
@@ -354,9 +458,45 @@
         BOOST_PP_SEQ_FOR_EACH(rpcdef_server_fire_assertion, interface, methods) \
     };
 
+//////////////////////////////////////////////////////////////////////////////
+// Fire-and-forget methods
+
+#define rpcdef_fire_and_forget(s, interface, method) \
+    static_assert(0 == MaxEncodedSize<MethodResult<interface>::method>::value, \
+            BOOST_PP_STRINGIZE(interface) "::" BOOST_PP_STRINGIZE(method) \
+            " must have an empty Result to be fire-and-forget"); \
+    rpcdef_define_true_metafunc(s, IsFireAndForget, MethodIn<interface>::method) \
+    rpcdef_define_true_metafunc(s, IsFireAndForget, MethodResult<interface>::method)
+
+// Mark methods of an interface defined by RPCDEF_HPP as fire-and-forget. Use it
+// right after RPCDEF_HPP, at global namespace scope, e.g.:
+//   RPCDEF_FIRE_AND_FORGET((barobo, Widget), (unaryNoResult))
+#define RPCDEF_FIRE_AND_FORGET(interfaceNames, methods) \
+    namespace rpc { \
+    BOOST_PP_SEQ_FOR_EACH(rpcdef_fire_and_forget, rpcdef_cat_scope(interfaceNames), methods) \
+    }
+
+//////////////////////////////////////////////////////////////////////////////
+// Selective broadcasts
+
+#define rpcdef_selective_broadcast(s, interface, brdcst) \
+    rpcdef_define_true_metafunc(s, IsSelective, Broadcast<interface>::brdcst)
+
+// Mark broadcasts of an interface defined by RPCDEF_HPP as selective, i.e.,
+// only sent to clients which SUBSCRIBE to them. Use it right after RPCDEF_HPP,
+// at global namespace scope, e.g.:
+//   RPCDEF_SELECTIVE_BROADCASTS((barobo, Widget), (broadcast))
+#define RPCDEF_SELECTIVE_BROADCASTS(interfaceNames, broadcasts) \
+    namespace rpc { \
+    BOOST_PP_SEQ_FOR_EACH(rpcdef_selective_broadcast, rpcdef_cat_scope(interfaceNames), broadcasts) \
+    }
+
 //////////////////////////////////////////////////////////////////////////////
 // Complete header and cpp file defines
 
+// ribbon-bridge-generator.py writes the same definitions from a .proto file.
+// See nanopb_add_proto's RPC_INTERFACE option in ribbon-bridge-functions.cmake.
+
 #define RPCDEF_CPP(interfaceNames, methods, broadcasts) \
     namespace rpc { \
     RPCDEF_pbFields_methods(rpcdef_underscored_token(interfaceNames), methods) \
@@ -373,7 +513,10 @@
     RPCDEF_IsMethod(rpcdef_cat_scope(interfaceNames), methods) \
     RPCDEF_Broadcast(interfaceNames, broadcasts) \
     RPCDEF_IsBroadcast(rpcdef_cat_scope(interfaceNames), broadcasts) \
+    RPCDEF_BroadcastList(rpcdef_cat_scope(interfaceNames), broadcasts) \
     RPCDEF_componentId(rpcdef_cat_scope(interfaceNames), methods, broadcasts) \
+    RPCDEF_MaxEncodedSize(rpcdef_underscored_token(interfaceNames), methods, broadcasts) \
+    RPCDEF_MaxMessageSize(interfaceNames, methods, broadcasts) \
     RPCDEF_AssertServerImplementsInterface(rpcdef_cat_scope(interfaceNames), methods) \
     RPCDEF_AssertClientImplementsInterface(rpcdef_cat_scope(interfaceNames), broadcasts) \
     RPCDEF_MethodInUnion(rpcdef_cat_scope(interfaceNames), methods) \
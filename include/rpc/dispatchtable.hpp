@@ -0,0 +1,164 @@
+#ifndef RPC_DISPATCHTABLE_HPP
+#define RPC_DISPATCHTABLE_HPP
+
+#include <rpc/config.hpp>
+#include <rpc/stdlibheaders.hpp>
+
+namespace rpc {
+
+namespace _ {
+
+template <size_t N, size_t P = 1, bool Done = (P >= N)>
+struct NextPowerOfTwo { static const size_t value = NextPowerOfTwo<N, P * 2>::value; };
+
+template <size_t N, size_t P>
+struct NextPowerOfTwo<N, P, true> { static const size_t value = P; };
+
+} // namespace _
+
+// A perfect hash table mapping N component IDs to function pointers. It is
+// built once, from an array of Entry objects, using hash-and-displace: IDs
+// are first hashed into buckets, and then each bucket gets its own seed such
+// that its IDs hash to free slots. Finding a function is then two hashes, one
+// load from the seed array, and one comparison, with no allocation and no
+// branching on the number of entries.
+//
+// The table has between 1.5 and 3 slots per entry, plus a 16-bit seed for
+// every four slots. It is built at run time, so it lives in RAM: def.hpp only
+// uses it where component IDs are not constant expressions, and a switch
+// does the job otherwise. If the table cannot be built, e.g., because of
+// duplicate IDs (component name hash collisions), an assertion trips, and
+// without assertions, find() returns nullptr for every ID rather than risk
+// returning the wrong function.
+template <class Fn, size_t N>
+class DispatchTable {
+    static_assert(N > 0, "DispatchTable must have at least one entry");
+
+public:
+    struct Entry {
+        uint32_t id;
+        Fn fn;
+    };
+
+    explicit DispatchTable (const Entry (&entries)[N]) {
+        for (size_t i = 0; i < kSlots; ++i) {
+            mIds[i] = 0;
+            mFns[i] = nullptr;
+        }
+        mValid = build(entries);
+        assert(mValid);
+    }
+
+    // Return the function registered for id, or nullptr if there is none.
+    Fn find (uint32_t id) const {
+        auto i = slot(id, mSeeds[bucket(id)]);
+        return mValid && mIds[i] == id ? mFns[i] : nullptr;
+    }
+
+private:
+    static const size_t kSlots = _::NextPowerOfTwo<N + N / 2 + 1>::value;
+    static const size_t kBuckets = kSlots < 4 ? 1 : kSlots / 4;
+
+    static uint32_t mix (uint32_t x) {
+        x ^= x >> 16;
+        x *= 0x45d9f3bu;
+        x ^= x >> 16;
+        return x;
+    }
+
+    static size_t bucket (uint32_t id) {
+        return (mix(id) >> 16) & (kBuckets - 1);
+    }
+
+    static size_t slot (uint32_t id, uint16_t seed) {
+        return mix(id + seed * 0x9e3779b9u) & (kSlots - 1);
+    }
+
+    bool build (const Entry (&entries)[N]) {
+        // Counting sort the entries by bucket.
+        size_t begin[kBuckets + 1] = {};
+        for (size_t i = 0; i < N; ++i) {
+            ++begin[bucket(entries[i].id) + 1];
+        }
+        for (size_t b = 0; b < kBuckets; ++b) {
+            begin[b + 1] += begin[b];
+        }
+        size_t next[kBuckets];
+        for (size_t b = 0; b < kBuckets; ++b) {
+            next[b] = begin[b];
+        }
+        size_t order[N];
+        for (size_t i = 0; i < N; ++i) {
+            order[next[bucket(entries[i].id)]++] = i;
+        }
+
+        // Place the largest buckets first, while the table is emptiest.
+        size_t buckets[kBuckets];
+        for (size_t b = 0; b < kBuckets; ++b) {
+            auto j = b;
+            for (; j > 0 && bucketSize(begin, buckets[j - 1]) < bucketSize(begin, b); --j) {
+                buckets[j] = buckets[j - 1];
+            }
+            buckets[j] = b;
+        }
+
+        for (auto b : buckets) {
+            const auto first = order + begin[b];
+            const auto last = order + begin[b + 1];
+            for (auto i = first; i != last; ++i) {
+                for (auto j = first; j != i; ++j) {
+                    if (entries[*i].id == entries[*j].id) {
+                        return false;
+                    }
+                }
+            }
+
+            uint32_t seed = 0;
+            for (; seed <= 0xffff; ++seed) {
+                if (fits(entries, first, last, uint16_t(seed))) {
+                    break;
+                }
+            }
+            if (seed > 0xffff) {
+                return false;
+            }
+            mSeeds[b] = uint16_t(seed);
+            for (auto i = first; i != last; ++i) {
+                auto s = slot(entries[*i].id, mSeeds[b]);
+                mIds[s] = entries[*i].id;
+                mFns[s] = entries[*i].fn;
+            }
+        }
+        return true;
+    }
+
+    static size_t bucketSize (const size_t (&begin)[kBuckets + 1], size_t b) {
+        return begin[b + 1] - begin[b];
+    }
+
+    // True if the given entries all hash to distinct, unoccupied slots.
+    bool fits (const Entry (&entries)[N], const size_t* first, const size_t* last,
+            uint16_t seed) const {
+        for (auto i = first; i != last; ++i) {
+            auto s = slot(entries[*i].id, seed);
+            if (mFns[s]) {
+                return false;
+            }
+            for (auto j = first; j != i; ++j) {
+                if (s == slot(entries[*j].id, seed)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool mValid;
+    uint16_t mSeeds[kBuckets] = {};
+    uint32_t mIds[kSlots];
+    Fn mFns[kSlots];
+};
+
+} // namespace rpc
+
+#endif
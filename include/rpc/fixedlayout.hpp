@@ -0,0 +1,158 @@
+#ifndef RPC_FIXEDLAYOUT_HPP
+#define RPC_FIXEDLAYOUT_HPP
+
+#include <rpc/stdlibheaders.hpp>
+
+#include <string.h>
+
+// Protobuf wire format primitives for FixedLayout specializations (see
+// rpc/componenttraits.hpp). Generated codecs write and compare field tags as
+// byte constants and call these for the values, so each field costs a few
+// stores or loads instead of a trip through pb_encode's or pb_decode's field
+// table.
+
+namespace rpc {
+namespace _ {
+
+inline size_t wireVarintSize (uint64_t value) {
+    size_t n = 1;
+    while (value >>= 7) {
+        ++n;
+    }
+    return n;
+}
+
+inline uint64_t wireZigZag32 (int32_t value) {
+    return (uint32_t(value) << 1) ^ uint32_t(value >> 31);
+}
+
+inline uint64_t wireZigZag64 (int64_t value) {
+    return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+inline uint32_t wireFloatBits (float value) {
+    static_assert(sizeof(float) == sizeof(uint32_t), "float must be 32 bits");
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+inline float wireBitsFloat (uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline uint8_t* putVarint (uint8_t* out, uint64_t value) {
+    while (value >= 0x80) {
+        *out++ = uint8_t(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = uint8_t(value);
+    return out;
+}
+
+inline uint8_t* putFixed32 (uint8_t* out, uint32_t value) {
+    out[0] = uint8_t(value);
+    out[1] = uint8_t(value >> 8);
+    out[2] = uint8_t(value >> 16);
+    out[3] = uint8_t(value >> 24);
+    return out + 4;
+}
+
+inline uint8_t* putFixed64 (uint8_t* out, uint64_t value) {
+    return putFixed32(putFixed32(out, uint32_t(value)), uint32_t(value >> 32));
+}
+
+// The get* functions read a field's value from the front of [in, end),
+// and advance in past it. They return false if [in, end) doesn't start with
+// what they expect, or, for varints, if the value doesn't fit the field, so
+// that pb_decode gets to handle it in its own way.
+
+inline bool getVarint (const uint8_t*& in, const uint8_t* end, uint64_t& value) {
+    value = 0;
+    for (unsigned shift = 0; in != end && shift < 64; shift += 7) {
+        auto byte = *in++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <class T>
+bool getUnsigned (const uint8_t*& in, const uint8_t* end, T& field) {
+    uint64_t value;
+    if (!getVarint(in, end, value)) {
+        return false;
+    }
+    field = T(value);
+    return uint64_t(field) == value;
+}
+
+template <class T>
+bool getSigned (const uint8_t*& in, const uint8_t* end, T& field) {
+    uint64_t value;
+    if (!getVarint(in, end, value)) {
+        return false;
+    }
+    field = T(int64_t(value));
+    return int64_t(field) == int64_t(value);
+}
+
+template <class T>
+bool getZigZag (const uint8_t*& in, const uint8_t* end, T& field) {
+    uint64_t value;
+    if (!getVarint(in, end, value)) {
+        return false;
+    }
+    auto decoded = int64_t(value >> 1) ^ -int64_t(value & 1);
+    field = T(decoded);
+    return int64_t(field) == decoded;
+}
+
+inline bool getBool (const uint8_t*& in, const uint8_t* end, bool& field) {
+    if (in == end || *in > 1) {
+        return false;
+    }
+    field = 1 == *in++;
+    return true;
+}
+
+template <class T>
+bool getFixed32 (const uint8_t*& in, const uint8_t* end, T& field) {
+    if (end - in < 4) {
+        return false;
+    }
+    field = T(uint32_t(in[0])
+        | uint32_t(in[1]) << 8
+        | uint32_t(in[2]) << 16
+        | uint32_t(in[3]) << 24);
+    in += 4;
+    return true;
+}
+
+template <class T>
+bool getFixed64 (const uint8_t*& in, const uint8_t* end, T& field) {
+    uint32_t low, high;
+    if (!getFixed32(in, end, low) || !getFixed32(in, end, high)) {
+        return false;
+    }
+    field = T(uint64_t(high) << 32 | low);
+    return true;
+}
+
+inline bool getFloat (const uint8_t*& in, const uint8_t* end, float& field) {
+    uint32_t bits;
+    if (!getFixed32(in, end, bits)) {
+        return false;
+    }
+    field = wireBitsFloat(bits);
+    return true;
+}
+
+} // namespace _
+} // namespace rpc
+
+#endif
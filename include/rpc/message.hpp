@@ -7,14 +7,34 @@
 # include <rpc/system_error.hpp>
 #endif
 
+#include <rpc/componenttraits.hpp>
+#include <rpc/enableif.hpp>
 #include <rpc/status.hpp>
 
 #include "rpc.pb.h"
 
-#define RPC_MESSAGE_MAX_SIZE 256
+// Large enough for any message of any interface, since rpc.proto limits
+// component message payloads to a fixed size. Prefer MaxMessageSize<Interface>
+// where the interface is known.
+#define RPC_MESSAGE_MAX_SIZE \
+    (barobo_rpc_ClientMessage_size > barobo_rpc_ServerMessage_size \
+        ? barobo_rpc_ClientMessage_size : barobo_rpc_ServerMessage_size)
+
+// BATCH messages are not limited by rpc.proto, so transports which carry them
+// need a limit of their own. Receive buffers must be at least this large.
+#ifndef RPC_BATCH_MAX_SIZE
+#define RPC_BATCH_MAX_SIZE 1024
+#endif
 
 namespace rpc {
 
+// A component message which is still encoded inside the buffer of the message
+// which carried it.
+struct PayloadView {
+    const uint8_t* bytes;
+    size_t size;
+};
+
 namespace _ {
 
 // Look up the pb_field_t* of a protobuf given its type (i.e., compile-time).
@@ -27,23 +47,502 @@ template <class Interface>
 const pb_field_t* pbFieldPtr (uint32_t);
 
 void encode (const void*, const pb_field_t*, uint8_t*, size_t, pb_size_t&, Status&);
-void decode (void*, const pb_field_t*, uint8_t*, size_t size, Status&);
+void decode (void*, const pb_field_t*, const uint8_t*, size_t size, Status&);
+
+// Encode a complete barobo_rpc_ClientMessage FIRE request, barobo_rpc_ServerMessage
+// RESULT reply, or barobo_rpc_ServerMessage BROADCAST, respectively. The
+// component message is encoded straight into the enclosing message's stream,
+// so it is never staged in a payload buffer.
+void encodeFire (uint32_t requestId, uint32_t componentId, uint32_t timeout,
+    const void*, const pb_field_t*, uint8_t*, size_t, pb_size_t&, Status&);
+void encodeResult (uint32_t inReplyTo, uint32_t componentId,
+    const void*, const pb_field_t*, uint8_t*, size_t, pb_size_t&, Status&);
+void encodeBroadcast (uint32_t componentId,
+    const void*, const pb_field_t*, uint8_t*, size_t, pb_size_t&, Status&);
+
+// As above, but with the component message already encoded.
+void encodeFire (uint32_t requestId, uint32_t componentId, uint32_t timeout,
+    PayloadView, uint8_t*, size_t, pb_size_t&, Status&);
+void encodeResult (uint32_t inReplyTo, uint32_t componentId,
+    PayloadView, uint8_t*, size_t, pb_size_t&, Status&);
+void encodeBroadcast (uint32_t componentId,
+    PayloadView, uint8_t*, size_t, pb_size_t&, Status&);
+
+// A FixedLayout component, for the encoders below. Its codec writes it
+// straight into the enclosing message, once the length prefix in front of it
+// is written.
+struct FixedPayload {
+    const void* component;
+    size_t size;
+    uint8_t* (*write)(const void* component, uint8_t* out);
+};
+
+void encodeFire (uint32_t requestId, uint32_t componentId, uint32_t timeout,
+    FixedPayload, uint8_t*, size_t, pb_size_t&, Status&);
+void encodeResult (uint32_t inReplyTo, uint32_t componentId,
+    FixedPayload, uint8_t*, size_t, pb_size_t&, Status&);
+void encodeBroadcast (uint32_t componentId,
+    FixedPayload, uint8_t*, size_t, pb_size_t&, Status&);
+
+template <size_t N, bool = (N < 128)>
+struct VarintSize { static const size_t value = 1 + VarintSize<(N >> 7)>::value; };
+
+template <size_t N>
+struct VarintSize<N, true> { static const size_t value = 1; };
+
+template <size_t A, size_t B>
+struct Max { static const size_t value = A < B ? B : A; };
+
+template <size_t N, size_t... Ns>
+struct MaxOf { static const size_t value = Max<N, MaxOf<Ns...>::value>::value; };
+
+template <size_t N>
+struct MaxOf<N> { static const size_t value = N; };
+
+// Every field in rpc.proto has a one-byte tag. uint32 fields take at most five
+// bytes of varint, and all enum values fit in one.
+template <size_t N>
+struct DelimitedFieldSize { static const size_t value = 1 + VarintSize<N>::value + N; };
+
+const size_t kMaxUint32FieldSize = 1 + 5;
+const size_t kMaxEnumFieldSize = 1 + 1;
+
+// A barobo_rpc_Request_Fire, barobo_rpc_Reply_Result, or barobo_rpc_Broadcast
+// with a payload of at most PayloadSize bytes.
+template <size_t PayloadSize>
+struct MaxComponentMessageSize {
+    static const size_t value = kMaxUint32FieldSize
+        + DelimitedFieldSize<PayloadSize>::value;
+};
+
+// Wrap a FixedLayout component for the encoders which take a FixedPayload.
+template <class Component>
+uint8_t* writeFixedLayout (const void* component, uint8_t* out) {
+    return FixedLayout<Component>::write(*static_cast<const Component*>(component), out);
+}
+
+template <class Component>
+FixedPayload fixedPayload (const Component& component) {
+    return FixedPayload{&component, FixedLayout<Component>::size(component),
+        &writeFixedLayout<Component>};
+}
 
 } // namespace _
 
+// A barobo_rpc_Request timeout of zero milliseconds would have expired before
+// it was sent, so encoders use it to mean the request has no deadline.
+const uint32_t kNoTimeout = 0;
+
+// True if the request's deadline passed before the server got to it. age is
+// how many milliseconds the request has spent with the server so far.
+inline bool hasExpired (const barobo_rpc_Request& request, uint32_t age) {
+    return request.has_timeout && request.timeout <= age;
+}
+
+// Worst-case encoded size of a barobo_rpc_ClientMessage carrying a FIRE
+// request with a payload of at most PayloadSize bytes. Requests without a
+// payload are always smaller.
+template <size_t PayloadSize>
+struct MaxFireMessageSize {
+    static const size_t value = _::kMaxUint32FieldSize
+        + _::DelimitedFieldSize<_::kMaxEnumFieldSize
+            + _::DelimitedFieldSize<_::MaxComponentMessageSize<PayloadSize>::value>::value
+            + _::kMaxUint32FieldSize
+        >::value;
+};
+
+// Worst-case encoded size of a barobo_rpc_ServerMessage carrying a RESULT
+// reply with a payload of at most PayloadSize bytes.
+template <size_t PayloadSize>
+struct MaxResultMessageSize {
+    static const size_t value = _::kMaxEnumFieldSize + _::kMaxUint32FieldSize
+        + _::DelimitedFieldSize<_::kMaxEnumFieldSize
+            + _::DelimitedFieldSize<_::MaxComponentMessageSize<PayloadSize>::value>::value
+        >::value;
+};
+
+// Worst-case encoded size of a barobo_rpc_ServerMessage carrying a BROADCAST
+// with a payload of at most PayloadSize bytes.
+template <size_t PayloadSize>
+struct MaxBroadcastMessageSize {
+    static const size_t value = _::kMaxEnumFieldSize
+        + _::DelimitedFieldSize<_::MaxComponentMessageSize<PayloadSize>::value>::value;
+};
+
+// The most a batch adds to each entry (a tag and a length), and to the batch as
+// a whole (the enclosing barobo_rpc_ClientMessage or barobo_rpc_ServerMessage).
+const size_t kBatchEntryOverhead = 1 + 5;
+const size_t kBatchOverhead = _::kMaxUint32FieldSize
+    + 1 + 5 + _::kMaxEnumFieldSize + 1 + 5;
+
+// Worst-case encoded size of a barobo_rpc_ServerMessage carrying a VERSIONS
+// or STATUS reply.
+struct MaxControlReplyMessageSize {
+    static const size_t value = _::kMaxEnumFieldSize + _::kMaxUint32FieldSize
+        + _::DelimitedFieldSize<_::kMaxEnumFieldSize
+            + _::Max<
+                _::DelimitedFieldSize<barobo_rpc_Versions_size>::value,
+                _::DelimitedFieldSize<barobo_rpc_Reply_Status_size>::value
+            >::value
+        >::value;
+};
+
 template <class NanopbStruct>
 void encode (const NanopbStruct& message,
     uint8_t* bytes, size_t size,
-    pb_size_t& nWritten, Status& status) {
+    pb_size_t& nWritten, Status& status,
+    ONLY_IF(!FixedLayout<NanopbStruct>::value)) {
     _::encode(&message, _::pbFieldPtr<NanopbStruct>(), bytes, size, nWritten, status);
 }
 
+template <class NanopbStruct>
+void encode (const NanopbStruct& message,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status,
+    ONLY_IF(FixedLayout<NanopbStruct>::value)) {
+    nWritten = 0;
+    if (FixedLayout<NanopbStruct>::size(message) > size) {
+        status = Status::ENCODING_FAILURE;
+        return;
+    }
+    nWritten = pb_size_t(FixedLayout<NanopbStruct>::write(message, bytes) - bytes);
+    status = Status::OK;
+}
+
 template <class NanopbStruct>
 void decode (NanopbStruct& message,
-    uint8_t* bytes, size_t size, Status& status) {
+    const uint8_t* bytes, size_t size, Status& status,
+    ONLY_IF(!FixedLayout<NanopbStruct>::value)) {
     _::decode(&message, _::pbFieldPtr<NanopbStruct>(), bytes, size, status);
 }
 
+// Any encoder may have put the fields in a different order, or added unknown
+// ones, so if the FixedLayout codec can't read the message, nanopb still gets
+// a go at it.
+template <class NanopbStruct>
+void decode (NanopbStruct& message,
+    const uint8_t* bytes, size_t size, Status& status,
+    ONLY_IF(FixedLayout<NanopbStruct>::value)) {
+    if (FixedLayout<NanopbStruct>::read(message, bytes, size)) {
+        status = Status::OK;
+    }
+    else {
+        _::decode(&message, _::pbFieldPtr<NanopbStruct>(), bytes, size, status);
+    }
+}
+
+// Decode a barobo_rpc_ClientMessage without copying its FIRE payload, if any.
+// message.request.fire.payload is left empty, and payload instead refers to
+// the payload's bytes within [bytes, bytes + size). For a BATCH request,
+// payload refers to the encoded batch instead; see nextBatchEntry.
+void decode (barobo_rpc_ClientMessage& message, PayloadView& payload,
+    const uint8_t* bytes, size_t size, Status& status);
+
+// Likewise, decode a barobo_rpc_ServerMessage without copying the payload of
+// its RESULT reply or BROADCAST: payload refers to it instead, or, for a
+// BATCH message, to the encoded batch.
+void decode (barobo_rpc_ServerMessage& message, PayloadView& payload,
+    const uint8_t* bytes, size_t size, Status& status);
+
+// Find the encoded batch within a barobo_rpc_ServerMessage of type BATCH.
+void decodeBatch (const uint8_t* bytes, size_t size, PayloadView& batch, Status& status);
+
+// Take the next entry, an encoded barobo_rpc_ClientMessage or
+// barobo_rpc_ServerMessage, off the front of an encoded batch. Return false
+// when there are none left, or if the batch is malformed, in which case
+// status is set to DECODING_FAILURE.
+bool nextBatchEntry (PayloadView& batch, PayloadView& entry, Status& status);
+
+// Assembles a BATCH message in place. Each entry is encoded straight into the
+// buffer at entryBytes(), then committed; finishing the batch writes the
+// enclosing message around the entries, moving them down if need be.
+class BatchWriter {
+public:
+    BatchWriter (uint8_t* bytes, size_t size);
+
+    // Where to encode the next entry, and how much room there is for it.
+    uint8_t* entryBytes () const;
+    size_t entrySize () const;
+
+    // Add the entry of the given size just encoded at entryBytes().
+    void commit (size_t size);
+
+    // Copy in an entry encoded elsewhere. Return false if it does not fit.
+    bool append (const uint8_t* bytes, size_t size);
+
+    size_t count () const { return mCount; }
+
+    // Write a barobo_rpc_ClientMessage BATCH request or a
+    // barobo_rpc_ServerMessage BATCH reply, respectively. The writer may not
+    // be used afterwards.
+    void finishRequest (uint32_t requestId, pb_size_t& nWritten, Status& status);
+    void finishReply (pb_size_t& nWritten, Status& status);
+
+private:
+    void finish (const uint8_t* envelope, size_t envelopeSize,
+        pb_size_t& nWritten, Status& status);
+
+    uint8_t* mBytes;
+    uint8_t* mPos;
+    uint8_t* mEnd;
+    size_t mCount = 0;
+};
+
+// Zero-decode forwarding: a proxy may pass messages through as they are,
+// rewriting in place only the request ID it forwards a barobo_rpc_ClientMessage
+// under, or the inReplyTo of a barobo_rpc_ServerMessage REPLY it passes back.
+// The rest of the message, payload included, is never touched. A new ID may
+// take up to kMaxIdGrowth more bytes than the old one, so the buffer must have
+// room for them past size. newSize is set to the message's new length.
+const size_t kMaxIdGrowth = 4;
+
+void rewriteRequestId (uint8_t* bytes, size_t size, uint32_t requestId,
+    size_t& newSize, Status& status);
+void rewriteInReplyTo (uint8_t* bytes, size_t size, uint32_t inReplyTo,
+    size_t& newSize, Status& status);
+
+// Lower the timeout of an encoded barobo_rpc_ClientMessage in place, without
+// changing its length. A message without a timeout is left alone.
+void rewriteTimeout (uint8_t* bytes, size_t size, uint32_t timeout, Status& status);
+
+// Read the type, and the inReplyTo if there is one, of an encoded
+// barobo_rpc_ServerMessage without decoding the rest. Return false if the
+// message is malformed.
+bool peekServerMessage (const uint8_t* bytes, size_t size,
+    uint32_t& type, bool& hasInReplyTo, uint32_t& inReplyTo);
+
+// Read the component ID of an encoded barobo_rpc_ServerMessage BROADCAST
+// without decoding the rest. Return false if there is none.
+bool peekBroadcastId (const uint8_t* bytes, size_t size, uint32_t& componentId);
+
+// Encode a barobo_rpc_ServerMessage STATUS reply.
+void encodeStatus (uint32_t inReplyTo, Status value,
+    uint8_t* bytes, size_t size, pb_size_t& nWritten, Status& status);
+
+// The timeout, in milliseconds, is how long the client will still wait for
+// the reply; pass kNoTimeout if it will wait indefinitely.
+template <class Method>
+void encodeFire (uint32_t requestId, const Method& args, uint32_t timeout,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status,
+    ONLY_IF(!FixedLayout<Method>::value)) {
+    _::encodeFire(requestId, componentId(args), timeout, &args, _::pbFieldPtr<Method>(),
+        bytes, size, nWritten, status);
+}
+
+template <class Method>
+void encodeFire (uint32_t requestId, const Method& args, uint32_t timeout,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status,
+    ONLY_IF(FixedLayout<Method>::value)) {
+    _::encodeFire(requestId, componentId(args), timeout, _::fixedPayload(args),
+        bytes, size, nWritten, status);
+}
+
+template <class Method>
+void encodeFire (uint32_t requestId, const Method& args,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeFire(requestId, args, kNoTimeout, bytes, size, nWritten, status);
+}
+
+template <class Result>
+void encodeResult (uint32_t inReplyTo, uint32_t componentId, const Result& result,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status,
+    ONLY_IF(!FixedLayout<Result>::value)) {
+    _::encodeResult(inReplyTo, componentId, &result, _::pbFieldPtr<Result>(),
+        bytes, size, nWritten, status);
+}
+
+template <class Result>
+void encodeResult (uint32_t inReplyTo, uint32_t componentId, const Result& result,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status,
+    ONLY_IF(FixedLayout<Result>::value)) {
+    _::encodeResult(inReplyTo, componentId, _::fixedPayload(result),
+        bytes, size, nWritten, status);
+}
+
+template <class Broadcast>
+void encodeBroadcast (const Broadcast& args,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status,
+    ONLY_IF(!FixedLayout<Broadcast>::value)) {
+    _::encodeBroadcast(componentId(args), &args, _::pbFieldPtr<Broadcast>(),
+        bytes, size, nWritten, status);
+}
+
+template <class Broadcast>
+void encodeBroadcast (const Broadcast& args,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status,
+    ONLY_IF(FixedLayout<Broadcast>::value)) {
+    _::encodeBroadcast(componentId(args), _::fixedPayload(args),
+        bytes, size, nWritten, status);
+}
+
+// Where a transport wants deferred replies sent. If reserve is not null, it is
+// called when a method defers its reply to the given request. send is then
+// called exactly once, possibly from another thread, with the encoded
+// barobo_rpc_ServerMessage. It is called with size zero if the method is
+// fire-and-forget, or the client has cancelled the request, and there is
+// nothing to send. If cancelled is not null, it reports whether the client
+// has cancelled the request, and may likewise be called from any thread.
+struct DeferredTarget {
+    void (*reserve)(void* context, uint32_t inReplyTo);
+    void (*send)(void* context, uint32_t inReplyTo, const uint8_t* bytes, size_t size);
+    bool (*cancelled)(void* context, uint32_t inReplyTo);
+    void* context;
+};
+
+// A method's reply, for servers which implement the deferred form of onFire:
+//   void onFire(MethodIn<Interface>::method, Deferred<MethodResult<Interface>::method>);
+// onFire may return before the method has finished, so long running methods
+// do not hold up the connection. Call the Deferred with the method's result,
+// or fail it with an error status, exactly once, from any thread the
+// transport allows. The transport must outlive it.
+template <class Result>
+class Deferred {
+public:
+    Deferred (DeferredTarget target, uint32_t inReplyTo, uint32_t componentId)
+        : mTarget(target)
+        , mInReplyTo(inReplyTo)
+        , mComponentId(componentId)
+    {}
+
+    void operator() (const Result& result) const {
+        if (cancelled()) {
+            send(nullptr, 0);
+            return;
+        }
+        uint8_t bytes[kMaxReplySize];
+        pb_size_t nWritten = 0;
+        auto status = Status::OK;
+        if (!IsFireAndForget<Result>::value) {
+            encodeResult(mInReplyTo, mComponentId, result,
+                bytes, sizeof(bytes), nWritten, status);
+        }
+        if (hasError(status)) {
+            fail(status);
+        }
+        else {
+            send(bytes, nWritten);
+        }
+    }
+
+    // Reply with a STATUS instead of a result. Fire-and-forget methods have
+    // no reply to fail, so nothing is sent for them.
+    void fail (Status error) const {
+        if (IsFireAndForget<Result>::value || cancelled()) {
+            send(nullptr, 0);
+            return;
+        }
+        uint8_t bytes[kMaxReplySize];
+        pb_size_t nWritten = 0;
+        Status status;
+        encodeStatus(mInReplyTo, error, bytes, sizeof(bytes), nWritten, status);
+        send(bytes, hasError(status) ? 0 : nWritten);
+    }
+
+    uint32_t inReplyTo () const { return mInReplyTo; }
+
+    // True if the client has cancelled the request, so nobody is waiting for
+    // the reply. A long running method may poll this and give up early; it
+    // must still call the Deferred, which then sends nothing.
+    bool cancelled () const {
+        return mTarget.cancelled && mTarget.cancelled(mTarget.context, mInReplyTo);
+    }
+
+private:
+    static const size_t kMaxReplySize = _::Max<
+        MaxResultMessageSize<MaxEncodedSize<Result>::value>::value,
+        MaxControlReplyMessageSize::value>::value;
+
+    void send (const uint8_t* bytes, size_t size) const {
+        if (mTarget.send) {
+            mTarget.send(mTarget.context, mInReplyTo, bytes, size);
+        }
+    }
+
+    DeferredTarget mTarget;
+    uint32_t mInReplyTo;
+    uint32_t mComponentId;
+};
+
+// Result sinks for MethodInUnion<Interface>::invoke. PayloadSink encodes the
+// result into a nanopb bytes field, such as barobo_rpc_Reply_Result_payload_t.
+// ReplySink encodes a complete RESULT reply message into a buffer, unless the
+// method is fire-and-forget, in which case it writes nothing. A ReplySink
+// also writes nothing for a deferred reply, which goes to its target later.
+template <class Payload>
+struct PayloadSink {
+    Payload& payload;
+
+    template <class Result>
+    void operator() (const Result& result, Status& status) {
+        encode(result, payload.bytes, sizeof(payload.bytes), payload.size, status);
+    }
+
+    // A payload field has nowhere to send a reply later.
+    template <class Result>
+    Deferred<Result> defer (Status& status) {
+        status = Status::INTERFACE_ERROR;
+        return Deferred<Result>{DeferredTarget{nullptr, nullptr, nullptr, nullptr}, 0, 0};
+    }
+};
+
+struct ReplySink {
+    uint32_t inReplyTo;
+    uint32_t componentId;
+    uint8_t* bytes;
+    size_t size;
+    pb_size_t& nWritten;
+    DeferredTarget target;
+
+    template <class Result>
+    void operator() (const Result& result, Status& status) {
+        if (IsFireAndForget<Result>::value) {
+            nWritten = 0;
+            status = Status::OK;
+        }
+        else {
+            encodeResult(inReplyTo, componentId, result, bytes, size, nWritten, status);
+        }
+    }
+
+    template <class Result>
+    Deferred<Result> defer (Status& status) {
+        nWritten = 0;
+        status = Status::OK;
+        if (target.reserve) {
+            target.reserve(target.context, inReplyTo);
+        }
+        return Deferred<Result>{target, inReplyTo, componentId};
+    }
+};
+
+namespace _ {
+
+// Call whichever form of onFire the server implements for the method, and
+// hand its result or its Deferred to the sink.
+template <class T, class Method, class Sink>
+void fire (T& server, const Method& args, Sink& sink, Status& status,
+        ONLY_IF(!(HasDeferredOnFire<T, Method>::value))) {
+    sink(server.onFire(args), status);
+}
+
+template <class T, class Method, class Sink>
+void fire (T& server, const Method& args, Sink& sink, Status& status,
+        ONLY_IF((HasDeferredOnFire<T, Method>::value))) {
+    auto deferred = sink.template defer<typename ResultOf<Method>::type>(status);
+    if (!hasError(status)) {
+        server.onFire(args, deferred);
+    }
+}
+
+} // namespace _
+
 #ifdef HAVE_EXCEPTIONS
 
 template <class NanopbStruct>
@@ -59,7 +558,7 @@ void encode (const NanopbStruct& message,
 
 template <class NanopbStruct>
 void decode (NanopbStruct& message,
-    uint8_t* bytes, size_t size) {
+    const uint8_t* bytes, size_t size) {
     Status status;
     decode(message, bytes, size, status);
     if (hasError(status)) {
@@ -9,44 +9,72 @@
 #include <rpc/buffer.hpp>
 #include <rpc/message.hpp>
 #include <rpc/status.hpp>
+#include <rpc/subscriptions.hpp>
 #include <rpc/version.hpp>
 
 namespace rpc {
 
-template <class T, class Interface>
+// Metafunction giving the size of a Server's default buffers. BATCH requests
+// and replies may be as large as RPC_BATCH_MAX_SIZE, so unless the
+// interface's messages are larger still, that is the size.
+template <class Interface>
+struct ServerBufferSize {
+    static const size_t value =
+        _::Max<MaxMessageSize<Interface>::value, RPC_BATCH_MAX_SIZE>::value;
+};
+
+// CRTP base for an RPC server. T must implement onFire for each of the
+// interface's methods, and bufferToClient(const BufferType&) to send encoded
+// messages to the client. onFire may take a Deferred and reply later, in which
+// case bufferToClient is called on whichever thread fulfils the Deferred.
+// BufferType can be any struct with a byte array member, bytes, and a
+// pb_size_t member, size, just like rpc::Buffer. A BufferType smaller than
+// ServerBufferSize<Interface> cannot receive large BATCH requests, and if it
+// cannot hold a BATCH reply of even one entry, batched requests are replied to
+// singly.
+//
+// A CANCEL request drops the deferred reply to the request it names, if that
+// reply is one of the first MaxDeferred still outstanding. A deferred reply
+// beyond those is still sent, but cannot be cancelled; T may define a public
+// deferredUntracked(uint32_t requestId) member to hear of it, e.g., to log it
+// or raise MaxDeferred. If Deferreds are fulfilled on other threads than the
+// one receiving requests, T must also define public lockDeferred() and
+// unlockDeferred() members, e.g., locking and unlocking a mutex, to guard the
+// server's record of them.
+template <class T, class Interface,
+          class BufferT = Buffer<ServerBufferSize<Interface>::value>,
+          size_t MaxDeferred = 4>
 class Server {
 public:
-    using BufferType = Buffer<256>;
+    using BufferType = BufferT;
+
+    static_assert(sizeof(BufferType::bytes) >= MaxMessageSize<Interface>::serverMessage,
+        "Server buffer type too small for the interface's server messages");
+
+    static_assert(MaxDeferred > 0, "Server must track at least one deferred reply");
+
+    static const size_t kMaxDeferredRequests = MaxDeferred;
 
     Server () { (void)AssertServerImplementsInterface<T, Interface>(); }
 
-    template <class C>
-    Status broadcast (C args, ONLY_IF(IsBroadcast<C>::value)) {
-        barobo_rpc_ServerMessage message;
-        memset(&message, 0, sizeof(message));
+    // For servers which fulfil Deferreds on the thread receiving requests.
+    void lockDeferred () {}
+    void unlockDeferred () {}
 
-        message.type = barobo_rpc_ServerMessage_Type_BROADCAST;
-        message.has_inReplyTo = false;
-        message.has_broadcast = true;
-        message.broadcast.id = componentId(C());
+    // For servers which need not hear of deferred replies they cannot cancel.
+    void deferredUntracked (uint32_t requestId) { (void)requestId; }
 
+    // Broadcasts the client is not subscribed to are dropped before encoding.
+    template <class C>
+    Status broadcast (C args, ONLY_IF(IsBroadcast<C>::value)) {
+        if (!isSubscribed<C>(mSubscriptions)) {
+            return Status::OK;
+        }
+        BufferType buffer;
         auto status = Status::OK;
-        encode(args,
-            message.broadcast.payload.bytes,
-            sizeof(message.broadcast.payload.bytes),
-            message.broadcast.payload.size,
-            status);
-
+        encodeBroadcast(args, buffer.bytes, sizeof(buffer.bytes), buffer.size, status);
         if (!hasError(status)) {
-            BufferType buffer;
-            encode(message,
-                buffer.bytes,
-                sizeof(buffer.bytes),
-                buffer.size,
-                status);
-            if (!hasError(status)) {
-                static_cast<T*>(this)->bufferToClient(buffer);
-            }
+            static_cast<T*>(this)->bufferToClient(buffer);
         }
 
         return status;
@@ -96,17 +124,191 @@ public:
         return status;
     }
 
-    Status receiveClientBuffer (BufferType in) {
+    Status receiveClientBuffer (const BufferType& in) {
+        return receiveClientBytes(in.bytes, in.size);
+    }
+
+    // Handle an encoded barobo_rpc_ClientMessage straight out of the
+    // transport's receive buffer. Any FIRE payload is decoded directly into
+    // the method's input struct, and the reply, if any (fire-and-forget
+    // methods have none), is passed to bufferToClient.
+    //
+    // Transports which queue incoming messages may pass how many milliseconds
+    // the message waited, as age. It counts against the request's deadline:
+    // a FIRE request which has outlived it gets a TIMED_OUT status rather
+    // than being invoked, since the client has stopped waiting for it.
+    Status receiveClientBytes (const uint8_t* bytes, size_t size, uint32_t age = 0) {
+        barobo_rpc_ClientMessage message;
+        PayloadView payload;
+        Status status;
+        decode(message, payload, bytes, size, status);
+        if (hasError(status)) {
+            return status;
+        }
+        return receiveClientRequest(message, payload, age);
+    }
+
+    // As above, but encode the reply into the caller's buffer,
+    // [out, out + outSize), rather than passing it to bufferToClient.
+    // outWritten is set to the length of the reply, or zero if there is none.
+    // The replies to a BATCH request are written as a BATCH reply; should they
+    // not all fit in one, the earlier BATCH replies are passed to
+    // bufferToClient, and only the last is left in the caller's buffer.
+    Status receiveClientBytes (const uint8_t* bytes, size_t size,
+            uint8_t* out, size_t outSize, size_t& outWritten, uint32_t age = 0) {
+        outWritten = 0;
         barobo_rpc_ClientMessage message;
+        PayloadView payload;
         Status status;
-        decode(message, in.bytes, in.size, status);
+        decode(message, payload, bytes, size, status);
         if (hasError(status)) {
             return status;
         }
-        return receiveClientRequest(message);
+        pb_size_t nWritten = 0;
+        if (barobo_rpc_Request_Type_BATCH == message.request.type) {
+            status = receiveBatch(payload, age, out, outSize, nWritten, nullptr);
+        }
+        else {
+            status = replyToClientRequest(message, payload, out, outSize, nWritten, age);
+        }
+        outWritten = nWritten;
+        return status;
     }
 
     Status receiveClientRequest (barobo_rpc_ClientMessage clMessage) {
+        auto& payload = clMessage.request.fire.payload;
+        return receiveClientRequest(clMessage, PayloadView{payload.bytes, payload.size});
+    }
+
+    // Handle a client request whose FIRE payload, if any, is given by the
+    // payload parameter rather than clMessage.request.fire.payload. For a
+    // BATCH request, payload is the encoded batch.
+    Status receiveClientRequest (const barobo_rpc_ClientMessage& clMessage,
+            PayloadView payload, uint32_t age = 0) {
+        BufferType response;
+        if (barobo_rpc_Request_Type_BATCH == clMessage.request.type) {
+            auto status = receiveBatch(payload, age,
+                response.bytes, sizeof(response.bytes), response.size, &response);
+            // Whatever went wrong, the replies we have are still owed.
+            if (response.size) {
+                static_cast<T*>(this)->bufferToClient(response);
+            }
+            return status;
+        }
+        auto status = replyToClientRequest(clMessage, payload,
+            response.bytes, sizeof(response.bytes), response.size, age);
+        if (!hasError(status) && response.size) {
+            static_cast<T*>(this)->bufferToClient(response);
+        }
+        return status;
+    }
+
+private:
+    // Serve each request of a batch in turn. Their replies are collected into
+    // BATCH replies in [bytes, bytes + size), each as large as BufferType
+    // allows; if there is not room for a batch of even one reply, the replies
+    // are written singly instead. All but the last are passed to
+    // bufferToClient as they fill up. The last is left in the buffer, with
+    // nWritten set to its length, or zero if there are no replies. response
+    // is the BufferType which owns the buffer, if any.
+    Status receiveBatch (PayloadView batch, uint32_t age,
+            uint8_t* bytes, size_t size, pb_size_t& nWritten, BufferType* response) {
+        const size_t kMaxReplySize = MaxMessageSize<Interface>::serverMessage;
+        if (size > sizeof(BufferType::bytes)) {
+            size = sizeof(BufferType::bytes);
+        }
+        nWritten = 0;
+        BatchWriter writer{bytes, size};
+        auto canBatch = writer.entrySize() >= kMaxReplySize;
+
+        PayloadView entry;
+        Status status;
+        while (nextBatchEntry(batch, entry, status)) {
+            barobo_rpc_ClientMessage clMessage;
+            PayloadView payload;
+            decode(clMessage, payload, entry.bytes, entry.size, status);
+            if (hasError(status)) {
+                break;
+            }
+            if (!canBatch) {
+                if (nWritten) {
+                    sendBatchPart(bytes, nWritten, response);
+                    nWritten = 0;
+                }
+                status = replyToBatchEntry(clMessage, payload, bytes, size, nWritten, age);
+                if (hasError(status)) {
+                    nWritten = 0;
+                    break;
+                }
+                continue;
+            }
+            if (writer.entrySize() < kMaxReplySize) {
+                pb_size_t batchSize = 0;
+                writer.finishReply(batchSize, status);
+                if (hasError(status)) {
+                    break;
+                }
+                sendBatchPart(bytes, batchSize, response);
+                writer = BatchWriter{bytes, size};
+            }
+            pb_size_t entrySize = 0;
+            status = replyToBatchEntry(clMessage, payload,
+                writer.entryBytes(), writer.entrySize(), entrySize, age);
+            if (hasError(status)) {
+                break;
+            }
+            if (entrySize) {
+                writer.commit(entrySize);
+            }
+        }
+
+        // Whatever went wrong, the replies we have are still owed.
+        if (canBatch && writer.count()) {
+            Status finishStatus;
+            writer.finishReply(nWritten, finishStatus);
+            if (!hasError(status)) {
+                status = finishStatus;
+            }
+        }
+        return status;
+    }
+
+    // Pass the first size bytes of a batch's replies to bufferToClient, so the
+    // buffer can be reused for the rest.
+    void sendBatchPart (const uint8_t* bytes, pb_size_t size, BufferType* response) {
+        if (response) {
+            response->size = size;
+            static_cast<T*>(this)->bufferToClient(*response);
+            return;
+        }
+        BufferType buffer;
+        memcpy(buffer.bytes, bytes, size);
+        buffer.size = size;
+        static_cast<T*>(this)->bufferToClient(buffer);
+    }
+
+    // Batches carry FIRE, SUBSCRIBE, UNSUBSCRIBE and CANCEL requests only; anything
+    // else in one, including another batch, is a protocol error.
+    Status replyToBatchEntry (const barobo_rpc_ClientMessage& clMessage,
+            PayloadView payload, uint8_t* bytes, size_t size, pb_size_t& nWritten,
+            uint32_t age) {
+        switch (clMessage.request.type) {
+            case barobo_rpc_Request_Type_FIRE:
+            case barobo_rpc_Request_Type_SUBSCRIBE:
+            case barobo_rpc_Request_Type_UNSUBSCRIBE:
+            case barobo_rpc_Request_Type_CANCEL:
+                return replyToClientRequest(clMessage, payload, bytes, size, nWritten, age);
+            default:
+                Status status;
+                encodeStatus(clMessage.id, Status::PROTOCOL_ERROR, bytes, size, nWritten, status);
+                return status;
+        }
+    }
+
+    // Handle a client request, encoding the reply into [bytes, bytes + size).
+    Status replyToClientRequest (const barobo_rpc_ClientMessage& clMessage,
+            PayloadView payload, uint8_t* bytes, size_t size, pb_size_t& nWritten,
+            uint32_t age) {
         barobo_rpc_ServerMessage svMessage;
         memset(&svMessage, 0, sizeof(svMessage));
 
@@ -117,6 +319,7 @@ public:
         svMessage.has_reply = true;
         switch (clMessage.request.type) {
             case barobo_rpc_Request_Type_CONNECT:
+                mSubscriptions.clear();
                 svMessage.reply.type = barobo_rpc_Reply_Type_VERSIONS;
                 svMessage.reply.has_versions = true;
                 svMessage.reply.versions.rpc.major = Version<>::major;
@@ -137,26 +340,66 @@ public:
                     svMessage.reply.has_status = true;
                     svMessage.reply.status.value = barobo_rpc_Status_PROTOCOL_ERROR;
                 }
+                else if (hasExpired(clMessage.request, age)) {
+                    if (MethodInUnion<Interface>::isFireAndForget(clMessage.request.fire.id)) {
+                        nWritten = 0;
+                        return Status::OK;
+                    }
+                    svMessage.reply.type = barobo_rpc_Reply_Type_STATUS;
+                    svMessage.reply.has_status = true;
+                    svMessage.reply.status.value = barobo_rpc_Status_TIMED_OUT;
+                }
                 else {
+                    // The RESULT reply is encoded in the same pass as the
+                    // method's result, so on success we are done here.
+                    // Nobody is waiting to hear that a fire-and-forget method
+                    // failed, so that is not replied to either.
                     MethodInUnion<Interface> argument;
                     Status status;
                     argument.invoke(static_cast<T&>(*this),
                         clMessage.request.fire.id,
-                        clMessage.request.fire.payload,
-                        svMessage.reply.result.payload,
+                        payload,
+                        ReplySink{clMessage.id, clMessage.request.fire.id,
+                            bytes, size, nWritten,
+                            DeferredTarget{&Server::reserveDeferred, &Server::sendDeferred,
+                                &Server::isCancelled, static_cast<T*>(this)}},
                         status);
-                    if (hasError(status)) {
-                        svMessage.reply.type = barobo_rpc_Reply_Type_STATUS;
-                        svMessage.reply.has_status = true;
-                        svMessage.reply.status.value = decltype(svMessage.reply.status.value)(status);
+                    if (!hasError(status)) {
+                        return status;
                     }
-                    else {
-                        svMessage.reply.type = barobo_rpc_Reply_Type_RESULT;
-                        svMessage.reply.has_result = true;
-                        svMessage.reply.result.id = clMessage.request.fire.id;
+                    if (MethodInUnion<Interface>::isFireAndForget(clMessage.request.fire.id)) {
+                        nWritten = 0;
+                        return Status::OK;
                     }
+                    svMessage.reply.type = barobo_rpc_Reply_Type_STATUS;
+                    svMessage.reply.has_status = true;
+                    svMessage.reply.status.value = decltype(svMessage.reply.status.value)(status);
                 }
                 break;
+            case barobo_rpc_Request_Type_SUBSCRIBE:
+            case barobo_rpc_Request_Type_UNSUBSCRIBE:
+                svMessage.reply.type = barobo_rpc_Reply_Type_STATUS;
+                svMessage.reply.has_status = true;
+                if (!clMessage.request.has_subscription) {
+                    svMessage.reply.status.value = barobo_rpc_Status_PROTOCOL_ERROR;
+                }
+                else {
+                    auto status = setSubscription<Interface>(mSubscriptions,
+                        clMessage.request.subscription.id,
+                        barobo_rpc_Request_Type_SUBSCRIBE == clMessage.request.type);
+                    svMessage.reply.status.value = decltype(svMessage.reply.status.value)(status);
+                }
+                break;
+            case barobo_rpc_Request_Type_CANCEL:
+                if (clMessage.request.has_cancel) {
+                    cancel(clMessage.request.cancel.id);
+                    nWritten = 0;
+                    return Status::OK;
+                }
+                svMessage.reply.type = barobo_rpc_Reply_Type_STATUS;
+                svMessage.reply.has_status = true;
+                svMessage.reply.status.value = barobo_rpc_Status_PROTOCOL_ERROR;
+                break;
             default:
                 svMessage.reply.type = barobo_rpc_Reply_Type_STATUS;
                 svMessage.reply.has_status = true;
@@ -164,15 +407,93 @@ public:
                 break;
         }
 
-        BufferType response;
         Status status;
-        encode(svMessage, response.bytes, sizeof(response.bytes), response.size, status);
-        if (!hasError(status)) {
-            static_cast<T*>(this)->bufferToClient(response);
+        encode(svMessage, bytes, size, nWritten, status);
+        return status;
+    }
+
+    class DeferredLock {
+    public:
+        explicit DeferredLock (T& impl) : mImpl(impl) { mImpl.lockDeferred(); }
+        ~DeferredLock () { mImpl.unlockDeferred(); }
+
+        DeferredLock (const DeferredLock&) = delete;
+        DeferredLock& operator= (const DeferredLock&) = delete;
+
+    private:
+        T& mImpl;
+    };
+
+    // Only requests with an outstanding deferred reply can be cancelled, so
+    // CANCEL requests for any others are ignored.
+    void cancel (uint32_t requestId) {
+        DeferredLock lock{static_cast<T&>(*this)};
+        if (auto slot = findDeferred(requestId)) {
+            slot->cancelled = true;
         }
+    }
 
-        return status;
+    static void reserveDeferred (void* context, uint32_t requestId) {
+        auto self = static_cast<Server*>(static_cast<T*>(context));
+        {
+            DeferredLock lock{*static_cast<T*>(context)};
+            for (auto& slot : self->mDeferred) {
+                if (!slot.outstanding) {
+                    slot.id = requestId;
+                    slot.outstanding = true;
+                    slot.cancelled = false;
+                    return;
+                }
+            }
+        }
+        // Every slot is taken, so a CANCEL for this request will be ignored.
+        static_cast<T*>(context)->deferredUntracked(requestId);
+    }
+
+    static bool isCancelled (void* context, uint32_t requestId) {
+        auto self = static_cast<Server*>(static_cast<T*>(context));
+        DeferredLock lock{*static_cast<T*>(context)};
+        auto slot = self->findDeferred(requestId);
+        return slot && slot->cancelled;
+    }
+
+    static void sendDeferred (void* context, uint32_t inReplyTo, const uint8_t* bytes, size_t size) {
+        // The request is done with, so its ID may be reused.
+        auto self = static_cast<Server*>(static_cast<T*>(context));
+        {
+            DeferredLock lock{*static_cast<T*>(context)};
+            if (auto slot = self->findDeferred(inReplyTo)) {
+                slot->outstanding = false;
+            }
+        }
+        // A reply too large for BufferType can't be sent, so it is dropped,
+        // and the client's request times out.
+        if (size && size <= sizeof(BufferType::bytes)) {
+            BufferType buffer;
+            memcpy(buffer.bytes, bytes, size);
+            buffer.size = decltype(buffer.size)(size);
+            static_cast<T*>(context)->bufferToClient(buffer);
+        }
     }
+
+    SubscriptionBitmap<BroadcastList<Interface>::size> mSubscriptions;
+
+    struct DeferredRequest {
+        uint32_t id;
+        bool outstanding;
+        bool cancelled;
+    };
+
+    DeferredRequest* findDeferred (uint32_t requestId) {
+        for (auto& slot : mDeferred) {
+            if (slot.outstanding && slot.id == requestId) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    DeferredRequest mDeferred[kMaxDeferredRequests] = {};
 };
 
 } // namespace rpc
@@ -0,0 +1,106 @@
+#ifndef RPC_SUBSCRIPTIONS_HPP
+#define RPC_SUBSCRIPTIONS_HPP
+
+#include <rpc/stdlibheaders.hpp>
+#include <rpc/componenttraits.hpp>
+#include <rpc/status.hpp>
+
+namespace rpc {
+
+// Whether a client receives a broadcast depends on whether the broadcast is
+// selective, and on whether the client has toggled it away from that default
+// with a SUBSCRIBE or UNSUBSCRIBE request. A subscription bitmap records only
+// the toggles, indexed by BroadcastIndex, so a clear bitmap means "defaults"
+// and a new connection needs no setup.
+//
+// The Bitmap parameters below need test(size_t) and set(size_t, bool)
+// members. SubscriptionBitmap is the fixed-size implementation used by
+// rpc::Server; rpc::asio::DynamicSubscriptionBitmap grows as needed.
+template <size_t N>
+class SubscriptionBitmap {
+public:
+    SubscriptionBitmap () { clear(); }
+
+    bool test (size_t i) const {
+        return i < N && (mBits[i / 8] >> (i % 8)) & 1;
+    }
+
+    void set (size_t i, bool value) {
+        if (i < N) {
+            auto mask = uint8_t(1 << (i % 8));
+            mBits[i / 8] = value ? mBits[i / 8] | mask : mBits[i / 8] & ~mask;
+        }
+    }
+
+    void clear () {
+        for (auto& byte : mBits) {
+            byte = 0;
+        }
+    }
+
+private:
+    // An interface with no broadcasts still gets one byte: ISO C++ has no
+    // zero-size arrays.
+    uint8_t mBits[N ? (N + 7) / 8 : 1];
+};
+
+template <class Broadcast, class Bitmap>
+bool isSubscribed (const Bitmap& toggles) {
+    return IsSelective<Broadcast>::value == toggles.test(BroadcastIndex<Broadcast>::value);
+}
+
+namespace _ {
+
+template <class Bitmap>
+struct SubscriptionSetter {
+    Bitmap& toggles;
+    uint32_t id;
+    bool subscribed;
+    bool found;
+
+    template <class Broadcast>
+    void operator() (const Broadcast& broadcast, size_t index) {
+        if (componentId(broadcast) == id) {
+            toggles.set(index, subscribed == IsSelective<Broadcast>::value);
+            found = true;
+        }
+    }
+};
+
+template <class Bitmap>
+struct SubscriptionTester {
+    const Bitmap& toggles;
+    uint32_t id;
+    bool subscribed;
+
+    template <class Broadcast>
+    void operator() (const Broadcast& broadcast, size_t index) {
+        if (componentId(broadcast) == id) {
+            subscribed = IsSelective<Broadcast>::value == toggles.test(index);
+        }
+    }
+};
+
+} // namespace _
+
+// As isSubscribed above, for the broadcast with the given component ID. No
+// client receives a broadcast the interface does not have.
+template <class Interface, class Bitmap>
+bool isSubscribed (const Bitmap& toggles, uint32_t id) {
+    auto tester = _::SubscriptionTester<Bitmap>{toggles, id, false};
+    BroadcastList<Interface>::forEach(tester);
+    return tester.subscribed;
+}
+
+// Handle a SUBSCRIBE (subscribed == true) or UNSUBSCRIBE request for the
+// broadcast with the given component ID.
+template <class Interface, class Bitmap>
+Status setSubscription (Bitmap& toggles, uint32_t id, bool subscribed) {
+    auto setter = _::SubscriptionSetter<Bitmap>{toggles, id, subscribed, false};
+    BroadcastList<Interface>::forEach(setter);
+    return setter.found ? Status::OK : Status::INTERFACE_ERROR;
+}
+
+} // namespace rpc
+
+#endif
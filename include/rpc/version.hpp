@@ -67,6 +67,12 @@ struct Version<void> {
 	static VersionTriplet triplet () { return { major, minor, patch }; }
 };
 
+// SUBSCRIBE, UNSUBSCRIBE, BATCH, and CANCEL requests arrived in RPC version
+// 0.4. Servers of earlier versions reject them as protocol errors.
+inline bool acceptsExtendedRequests (const VersionTriplet& rpcVersion) {
+	return rpcVersion.major() > 0 || rpcVersion.minor() >= 4;
+}
+
 class Versions {
 public:
 	Versions () = default;
@@ -9,7 +9,11 @@ set(CMAKE_FIND_ROOT_PATH_MODE_INCLUDE NO_CMAKE_FIND_ROOT_PATH)
 find_package(Nanopb REQUIRED)
 set(CMAKE_FIND_ROOT_PATH_MODE_INCLUDE ${oldCfrpmi})
 
-# nanopb_add_proto(<target-name> <proto-filepath> [<other-source-files>...])
+# Remember where the interface generator lives: CMAKE_CURRENT_LIST_DIR means something else once
+# we're inside a function.
+set(RPC_GENERATOR ${CMAKE_CURRENT_LIST_DIR}/ribbon-bridge-generator.py)
+
+# nanopb_add_proto(<target-name> <proto-filepath> [RPC_INTERFACE] [<other-source-files>...])
 #
 # Define a target to represent a nanopb protobuf library. You can use
 # <target-name> in the rest of your code as a static library target (but
@@ -18,10 +22,44 @@ set(CMAKE_FIND_ROOT_PATH_MODE_INCLUDE ${oldCfrpmi})
 #   $<TARGET_PROPERTY:<target-name>,INCLUDE_DIRECTORIES>
 #
 # generator expression in a suitable command's arguments.
+#
+# If RPC_INTERFACE is given, the .proto defines a ribbon-bridge interface, and
+# ribbon-bridge-generator.py also generates gen-<name>.pb.hpp and
+# gen-<name>.pb.cpp from it, in place of a hand-written RPCDEF_HPP/RPCDEF_CPP
+# pair. The target's user still has to link it against rpc.
 function(nanopb_add_proto _targetName _protoFile)
+    cmake_parse_arguments(_arg "RPC_INTERFACE" "" "" ${ARGN})
     list(APPEND NANOPB_IMPORT_DIRS ${RPC_PROTO_INCLUDE_DIR})
     nanopb_generate_cpp(sources headers ${_protoFile})
 
+    if(_arg_RPC_INTERFACE)
+        if(NOT PYTHON_EXECUTABLE)
+            find_package(PythonInterp REQUIRED)
+        endif()
+        get_filename_component(protoFile ${_protoFile} ABSOLUTE)
+        get_filename_component(protoDir ${protoFile} DIRECTORY)
+        get_filename_component(protoName ${protoFile} NAME_WE)
+        set(descriptorSet ${CMAKE_CURRENT_BINARY_DIR}/${protoName}.desc)
+        set(interfaceHeader ${CMAKE_CURRENT_BINARY_DIR}/gen-${protoName}.pb.hpp)
+        set(interfaceSource ${CMAKE_CURRENT_BINARY_DIR}/gen-${protoName}.pb.cpp)
+        set(protoIncludes -I${protoDir} -I${RPC_PROTO_INCLUDE_DIR})
+        foreach(dir ${NANOPB_IMPORT_DIRS})
+            list(APPEND protoIncludes -I${dir})
+        endforeach()
+        add_custom_command(
+            OUTPUT ${interfaceHeader} ${interfaceSource}
+            COMMAND ${PROTOBUF_PROTOC_EXECUTABLE} ${protoIncludes}
+                --include_imports -o ${descriptorSet} ${protoFile}
+            COMMAND ${PYTHON_EXECUTABLE} ${RPC_GENERATOR}
+                ${descriptorSet} ${protoFile} ${interfaceHeader} ${interfaceSource}
+            DEPENDS ${protoFile} ${RPC_GENERATOR}
+            COMMENT "Generating ribbon-bridge interface from ${_protoFile}"
+            VERBATIM
+        )
+        list(APPEND sources ${interfaceSource})
+        list(APPEND headers ${interfaceHeader})
+    endif()
+
     if(MSVC)
         # Disable warning C4127: conditional expression is constant
         set_source_files_properties(${sources}
@@ -29,7 +67,7 @@ function(nanopb_add_proto _targetName _protoFile)
         )
     endif()
 
-    add_library(${_targetName} STATIC ${sources} ${headers} ${ARGN})
+    add_library(${_targetName} STATIC ${sources} ${headers} ${_arg_UNPARSED_ARGUMENTS})
     set(headerDirs)
     foreach(header ${headers})
         get_filename_component(headerDir ${header} DIRECTORY)
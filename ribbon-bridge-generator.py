@@ -0,0 +1,540 @@
+#!/usr/bin/env python3
+"""Generate ribbon-bridge interface code from a .proto file.
+
+    protoc --include_imports -o widget.desc -I... widget.proto
+    ribbon-bridge-generator.py widget.desc widget.proto gen-widget.pb.hpp gen-widget.pb.cpp
+
+The output takes the place of a hand-written RPCDEF_HPP/RPCDEF_CPP pair (see
+include/rpc/def.hpp): the same specializations of the templates in
+include/rpc/componenttraits.hpp, spelled out per interface instead of expanded
+from preprocessor sequences in every translation unit. Component IDs are
+computed here, and the method and broadcast unions dispatch on them with a
+switch. Components whose fields are all required scalars also get a
+FixedLayout codec, which rpc::encode and rpc::decode use in place of nanopb's
+table-driven pb_encode and pb_decode.
+
+The interface is the .proto's package. Each top-level message with nested In
+and Result messages is a method; every other top-level message not used as a
+field type is a broadcast. The options in proto/rpc-options.proto give the
+interface version, and mark fire-and-forget methods and selective broadcasts.
+
+We read the FileDescriptorSet with a minimal protobuf wire decoder, so the
+generator needs nothing but Python itself.
+"""
+
+import os
+import sys
+
+# Field numbers from google/protobuf/descriptor.proto.
+FILE_SET_FILE = 1
+FILE_NAME = 1
+FILE_PACKAGE = 2
+FILE_MESSAGE_TYPE = 4
+FILE_OPTIONS = 8
+MESSAGE_NAME = 1
+MESSAGE_FIELD = 2
+MESSAGE_NESTED_TYPE = 3
+MESSAGE_OPTIONS = 7
+FIELD_NAME = 1
+FIELD_NUMBER = 3
+FIELD_LABEL = 4
+FIELD_TYPE = 5
+FIELD_TYPE_NAME = 6
+FIELD_OPTIONS = 8
+LABEL_REQUIRED = 2
+NANOPB_FIELD_OPTIONS = 1010
+
+# Field types FixedLayout codecs handle, from FieldDescriptorProto.Type, with
+# their kind, wire type, and the most bytes a value can take. double is left to
+# nanopb, since it is only 32 bits on AVR.
+FIXED_LAYOUT_TYPES = {
+    2: ('float', 5, 4),         # float
+    7: ('fixed32', 5, 4),       # fixed32
+    15: ('fixed32', 5, 4),      # sfixed32
+    6: ('fixed64', 1, 8),       # fixed64
+    16: ('fixed64', 1, 8),      # sfixed64
+    13: ('unsigned', 0, 5),     # uint32
+    4: ('unsigned', 0, 10),     # uint64
+    5: ('signed', 0, 10),       # int32
+    3: ('signed', 0, 10),       # int64
+    14: ('signed', 0, 10),      # enum
+    17: ('zigzag32', 0, 5),     # sint32
+    18: ('zigzag64', 0, 10),    # sint64
+    8: ('bool', 0, 1),          # bool
+}
+
+# Extension field numbers from proto/rpc-options.proto.
+OPTION_VERSION = 50000
+OPTION_METHOD = 50000
+OPTION_BROADCAST = 50001
+METHOD_FIRE_AND_FORGET = 1
+BROADCAST_SELECTIVE = 1
+
+
+class GeneratorError(Exception):
+    pass
+
+
+def read_varint(data, pos):
+    result = 0
+    shift = 0
+    while True:
+        if pos >= len(data):
+            raise GeneratorError('truncated varint')
+        byte = data[pos]
+        pos += 1
+        result |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return result, pos
+
+
+def fields(data):
+    """Yield (number, value) for each field of an encoded message. Varints are
+    ints, length-delimited fields are bytearrays, and fixed fields are skipped."""
+    pos = 0
+    while pos < len(data):
+        key, pos = read_varint(data, pos)
+        number, wire_type = key >> 3, key & 7
+        if wire_type == 0:
+            value, pos = read_varint(data, pos)
+            yield number, value
+        elif wire_type == 2:
+            size, pos = read_varint(data, pos)
+            yield number, data[pos:pos + size]
+            pos += size
+        elif wire_type == 1:
+            pos += 8
+        elif wire_type == 5:
+            pos += 4
+        else:
+            raise GeneratorError('unsupported wire type {}'.format(wire_type))
+
+
+def field(data, number, default=None):
+    for n, value in fields(data):
+        if n == number:
+            default = value
+    return default
+
+
+def submessage(data, number):
+    """Merge every occurrence of an embedded message field, as protobuf does.
+    protoc emits one occurrence per option statement."""
+    return bytearray().join(repeated(data, number))
+
+
+def repeated(data, number):
+    return [value for n, value in fields(data) if n == number]
+
+
+def varint_bytes(value):
+    out = []
+    while value >= 0x80:
+        out.append((value & 0x7f) | 0x80)
+        value >>= 7
+    out.append(value)
+    return out
+
+
+def fixed_layout_fields(message):
+    """Return (name, number, kind, tag bytes, max value size) for each field of
+    a message FixedLayout can encode, in the order nanopb encodes them, or None
+    if it can't. We give up on fields with nanopb options, which may change
+    their C type or drop them from the struct."""
+    result = []
+    for f in repeated(message, MESSAGE_FIELD):
+        type_ = FIXED_LAYOUT_TYPES.get(field(f, FIELD_TYPE))
+        if (type_ is None or field(f, FIELD_LABEL) != LABEL_REQUIRED
+                or submessage(submessage(f, FIELD_OPTIONS), NANOPB_FIELD_OPTIONS)):
+            return None
+        kind, wire_type, size = type_
+        number = field(f, FIELD_NUMBER)
+        result.append((field(f, FIELD_NAME).decode(), number, kind,
+                       varint_bytes(number << 3 | wire_type), size))
+    return sorted(result, key=lambda f: f[1])
+
+
+def larson_hash(s):
+    """rpc::hash from include/rpc/hash.hpp."""
+    h = 0
+    for c in s.encode('ascii'):
+        h = (h * 101 + c) & 0xffffffff
+    return h
+
+
+class Interface(object):
+    def __init__(self, file_proto):
+        package = field(file_proto, FILE_PACKAGE, b'').decode()
+        if not package:
+            raise GeneratorError('an interface .proto needs a package')
+        self.names = package.split('.')
+        self.scope = '::'.join(self.names)
+        self.prefix = '_'.join(self.names) + '_'
+
+        version = submessage(submessage(file_proto, FILE_OPTIONS), OPTION_VERSION)
+        self.version = tuple(field(version, n, 0) for n in (1, 2, 3))
+
+        messages = repeated(file_proto, FILE_MESSAGE_TYPE)
+        field_types = set()
+        for message in messages:
+            self.collect_field_types(message, field_types)
+
+        self.methods = []
+        self.fixed_layouts = []
+        self.fire_and_forget = []
+        self.broadcasts = []
+        self.selective = []
+        for message in messages:
+            name = field(message, MESSAGE_NAME).decode()
+            nested = [field(m, MESSAGE_NAME).decode()
+                      for m in repeated(message, MESSAGE_NESTED_TYPE)]
+            options = submessage(message, MESSAGE_OPTIONS)
+            if 'In' in nested and 'Result' in nested:
+                self.methods.append(name)
+                for m in repeated(message, MESSAGE_NESTED_TYPE):
+                    suffix = field(m, MESSAGE_NAME).decode()
+                    if suffix in ('In', 'Result'):
+                        self.add_fixed_layout('{}_{}'.format(name, suffix), m)
+                method = submessage(options, OPTION_METHOD)
+                if field(method, METHOD_FIRE_AND_FORGET, 0):
+                    self.fire_and_forget.append(name)
+            elif '.{}.{}'.format(package, name) not in field_types:
+                self.broadcasts.append(name)
+                self.add_fixed_layout(name, message)
+                broadcast = submessage(options, OPTION_BROADCAST)
+                if field(broadcast, BROADCAST_SELECTIVE, 0):
+                    self.selective.append(name)
+
+        ids = {}
+        for name in self.methods + self.broadcasts:
+            other = ids.setdefault(larson_hash(name), name)
+            if other != name:
+                raise GeneratorError('{} and {} have the same component ID'.format(other, name))
+
+    def add_fixed_layout(self, component, message):
+        fields = fixed_layout_fields(message)
+        if fields is not None:
+            self.fixed_layouts.append((self.prefix + component, fields))
+
+    def collect_field_types(self, message, types):
+        for f in repeated(message, MESSAGE_FIELD):
+            type_name = field(f, FIELD_TYPE_NAME)
+            if type_name:
+                types.add(type_name.decode())
+        for nested in repeated(message, MESSAGE_NESTED_TYPE):
+            self.collect_field_types(nested, types)
+
+
+FIXED_LAYOUT_WRITE = {
+    'float': '_::putFixed32(out, _::wireFloatBits(m.{}))',
+    'fixed32': '_::putFixed32(out, uint32_t(m.{}))',
+    'fixed64': '_::putFixed64(out, uint64_t(m.{}))',
+    'unsigned': '_::putVarint(out, m.{})',
+    'signed': '_::putVarint(out, uint64_t(int64_t(m.{})))',
+    'zigzag32': '_::putVarint(out, _::wireZigZag32(m.{}))',
+    'zigzag64': '_::putVarint(out, _::wireZigZag64(m.{}))',
+}
+
+FIXED_LAYOUT_SIZE = {
+    'unsigned': '_::wireVarintSize(m.{})',
+    'signed': '_::wireVarintSize(uint64_t(int64_t(m.{})))',
+    'zigzag32': '_::wireVarintSize(_::wireZigZag32(m.{}))',
+    'zigzag64': '_::wireVarintSize(_::wireZigZag64(m.{}))',
+}
+
+FIXED_LAYOUT_READ = {
+    'float': '_::getFloat(in, end, m.{})',
+    'fixed32': '_::getFixed32(in, end, m.{})',
+    'fixed64': '_::getFixed64(in, end, m.{})',
+    'unsigned': '_::getUnsigned(in, end, m.{})',
+    'signed': '_::getSigned(in, end, m.{})',
+    'zigzag32': '_::getZigZag(in, end, m.{})',
+    'zigzag64': '_::getZigZag(in, end, m.{})',
+    'bool': '_::getBool(in, end, m.{})',
+}
+
+
+def write_fixed_layout(w, component, fields):
+    m = ' m' if fields else ''
+    constant = sum(len(tag) + (size if kind not in FIXED_LAYOUT_SIZE else 0)
+                   for _, _, kind, tag, size in fields)
+    w('template <>\nstruct FixedLayout<{}> {{\n'.format(component))
+    w('    static const bool value = true;\n')
+    w('    static const size_t maxSize = {};\n'.format(
+        sum(len(tag) + size for _, _, _, tag, size in fields)))
+
+    varying = [FIXED_LAYOUT_SIZE[kind].format(name)
+               for name, _, kind, _, _ in fields if kind in FIXED_LAYOUT_SIZE]
+    w('    static size_t size (const {}&{}) {{\n'.format(
+        component, m if varying else ''))
+    w('        return {};\n'.format('\n            + '.join([str(constant)] + varying)))
+    w('    }\n')
+
+    w('    static uint8_t* write (const {}&{}, uint8_t* out) {{\n'.format(component, m))
+    for name, _, kind, tag, _ in fields:
+        for byte in tag:
+            w('        *out++ = 0x{:02x};\n'.format(byte))
+        if kind == 'bool':
+            w('        *out++ = m.{} ? 1 : 0;\n'.format(name))
+        else:
+            w('        out = {};\n'.format(FIXED_LAYOUT_WRITE[kind].format(name)))
+    w('        return out;\n    }\n')
+
+    w('    static bool read ({}&{}, const uint8_t*{}, size_t size) {{\n'.format(
+        component, m, ' in' if fields else ''))
+    if fields:
+        w('        auto end = in + size;\n        return ')
+        for name, _, kind, tag, _ in fields:
+            for byte in tag:
+                w('in != end && *in++ == 0x{:02x}\n            && '.format(byte))
+            w('{}\n            && '.format(FIXED_LAYOUT_READ[kind].format(name)))
+        w('in == end;\n')
+    else:
+        w('        return 0 == size;\n')
+    w('    }\n};\n\n')
+
+
+def write_header(out, interface, pb_header, guard):
+    i = interface
+    w = out.write
+    w('// Generated by ribbon-bridge-generator.py. Do not edit.\n\n')
+    w('#ifndef {0}\n#define {0}\n\n'.format(guard))
+    w('#include <rpc/config.hpp>\n')
+    w('#include <rpc/version.hpp>\n')
+    w('#include <rpc/componenttraits.hpp>\n')
+    w('#include <rpc/fixedlayout.hpp>\n')
+    w('#include <rpc/hash.hpp>\n')
+    w('#include <rpc/message.hpp>\n\n')
+    w('#include "{}"\n\n'.format(pb_header))
+
+    for name in i.names[:-1]:
+        w('namespace {} {{ '.format(name))
+    w('struct {};'.format(i.names[-1]))
+    w(' }' * (len(i.names) - 1))
+    w('\n\nnamespace rpc {\n\n')
+
+    w('template <>\nstruct Version<{}> {{\n'.format(i.scope))
+    for part, value in zip(('major', 'minor', 'patch'), i.version):
+        w('    static const uint32_t {} = {};\n'.format(part, value))
+    w('    static VersionTriplet triplet () { return { major, minor, patch }; }\n};\n\n')
+
+    for kind, suffix in (('MethodIn', '_In'), ('MethodResult', '_Result')):
+        w('template <>\nstruct {}<{}> {{\n'.format(kind, i.scope))
+        for m in i.methods:
+            w('    using {} = {}{}{};\n'.format(m, i.prefix, m, suffix))
+        w('};\n\n')
+
+    w('template <>\nstruct Broadcast<{}> {{\n'.format(i.scope))
+    for b in i.broadcasts:
+        w('    using {} = {}{};\n'.format(b, i.prefix, b))
+    w('};\n\n')
+
+    def in_(m):
+        return 'MethodIn<{}>::{}'.format(i.scope, m)
+
+    def result(m):
+        return 'MethodResult<{}>::{}'.format(i.scope, m)
+
+    def broadcast(b):
+        return 'Broadcast<{}>::{}'.format(i.scope, b)
+
+    def true_metafunc(metafunc, component):
+        w('template <>\nstruct {}<{}> {{ static const bool value = true; }};\n'.format(
+            metafunc, component))
+
+    for m in i.methods:
+        w('template <>\nstruct ResultOf<{}> {{ using type = {}; }};\n'.format(in_(m), result(m)))
+        true_metafunc('IsMethod', in_(m))
+        true_metafunc('IsMethod', result(m))
+    w('\n')
+
+    for index, b in enumerate(i.broadcasts):
+        true_metafunc('IsBroadcast', broadcast(b))
+        w('template <>\nstruct BroadcastIndex<{}> {{ static const size_t value = {}; }};\n'.format(
+            broadcast(b), index))
+    for b in i.selective:
+        true_metafunc('IsSelective', broadcast(b))
+    w('\ntemplate <>\nstruct BroadcastList<{}> {{\n'.format(i.scope))
+    w('    static const size_t size = {};\n'.format(len(i.broadcasts)))
+    w('    template <class Visitor>\n    static void forEach (Visitor&{}) {{\n'.format(
+        ' visitor' if i.broadcasts else ''))
+    for index, b in enumerate(i.broadcasts):
+        w('        visitor({}(), size_t({}));\n'.format(broadcast(b), index))
+    w('    }\n};\n\n')
+
+    # Literal IDs, so the unions below can switch on them. Where the compiler
+    # can run rpc::hash, it checks our arithmetic.
+    for component in [in_(m) for m in i.methods] + [broadcast(b) for b in i.broadcasts]:
+        name = component.rsplit('::', 1)[1]
+        w('template <>\n#if HAVE_CONSTEXPR_FUNCTION_TEMPLATES\nconstexpr\n#else\nstatic inline\n#endif\n')
+        w('uint32_t componentId ({}) {{ return {}u; }}\n'.format(component, larson_hash(name)))
+    w('#if HAVE_CONSTEXPR_FUNCTION_TEMPLATES\n')
+    for name in i.methods + i.broadcasts:
+        w('static_assert({}u == hash("{}"), "component ID mismatch");\n'.format(
+            larson_hash(name), name))
+    w('#endif\n\n')
+
+    components = (['{}_In'.format(m) for m in i.methods]
+                  + ['{}_Result'.format(m) for m in i.methods] + i.broadcasts)
+    for c in components:
+        w('template <>\nstruct MaxEncodedSize<{0}{1}> {{ static const size_t value = {0}{1}_size; }};\n'
+          .format(i.prefix, c))
+
+    for m in i.fire_and_forget:
+        w('static_assert(0 == MaxEncodedSize<{}>::value,\n'
+          '    "{}::{} must have an empty Result to be fire-and-forget");\n'.format(
+              result(m), i.scope, m))
+        true_metafunc('IsFireAndForget', in_(m))
+        true_metafunc('IsFireAndForget', result(m))
+
+    def max_of(names):
+        if not names:
+            return '0'
+        return '_::MaxOf<{}>::value'.format(', '.join(
+            'MaxEncodedSize<{}{}>::value'.format(i.prefix, n) for n in names))
+
+    w('\ntemplate <>\nstruct MaxMessageSize<{}> {{\n'.format(i.scope))
+    w('    static const size_t clientMessage = MaxFireMessageSize<\n        {}>::value;\n'.format(
+        max_of(['{}_In'.format(m) for m in i.methods])))
+    w('    static const size_t serverMessage = _::MaxOf<\n')
+    w('        MaxResultMessageSize<{}>::value,\n'.format(
+        max_of(['{}_Result'.format(m) for m in i.methods])))
+    w('        MaxBroadcastMessageSize<{}>::value,\n'.format(max_of(i.broadcasts)))
+    w('        MaxControlReplyMessageSize::value>::value;\n')
+    w('    static const size_t value = _::Max<clientMessage, serverMessage>::value;\n};\n\n')
+
+    # Components whose fields are all required scalars get straight-line
+    # codecs; the rest go through nanopb.
+    for component, fields in i.fixed_layouts:
+        write_fixed_layout(w, component, fields)
+
+    w('template <class T>\nstruct AssertServerImplementsInterface<T, {}> {{\n'.format(i.scope))
+    for m in i.methods:
+        w('    static_assert(HasMemberFunctionOverloadonFire<T, {}({})>::value\n'
+          '            || HasDeferredOnFire<T, {}>::value,\n'
+          '        "{} server does not implement onFire({})");\n'.format(
+              result(m), in_(m), in_(m), i.scope, m))
+    w('};\n\n')
+
+    w('template <class T>\nstruct AssertClientImplementsInterface<T, {}> {{\n'.format(i.scope))
+    for b in i.broadcasts:
+        w('    static_assert(HasMemberFunctionOverloadonBroadcast<T, void({})>::value,\n'
+          '        "{} client must implement onBroadcast({})");\n'.format(broadcast(b), i.scope, b))
+    w('};\n\n')
+
+    w('template <>\nunion MethodInUnion<{}> {{\n'.format(i.scope))
+    w('    template <class T, class Sink>\n'
+      '    void invoke (T& server, uint32_t componentId, PayloadView in, Sink&& sink,\n'
+      '            Status& status) {{\n'
+      '        (void)AssertServerImplementsInterface<T, {}>();\n'
+      '        switch (componentId) {{\n'.format(i.scope))
+    for m in i.methods:
+        w('            case {}u:\n'
+          '                decode({}, in.bytes, in.size, status);\n'
+          '                if (!hasError(status)) {{\n'
+          '                    _::fire(server, {}, sink, status);\n'
+          '                }}\n'
+          '                break;\n'.format(larson_hash(m), m, m))
+    w('            default:\n'
+      '                status = Status::INTERFACE_ERROR;\n'
+      '                break;\n'
+      '        }\n'
+      '    }\n'
+      '    template <class T>\n'
+      '    void invoke (T& server, uint32_t componentId,\n'
+      '            barobo_rpc_Request_Fire_payload_t& in,\n'
+      '            barobo_rpc_Reply_Result_payload_t& out,\n'
+      '            Status& status) {\n'
+      '        invoke(server, componentId, PayloadView{in.bytes, in.size},\n'
+      '            PayloadSink<barobo_rpc_Reply_Result_payload_t>{out}, status);\n'
+      '    }\n')
+    w('    static bool isFireAndForget (uint32_t componentId) {\n')
+    if i.fire_and_forget:
+        w('        switch (componentId) {\n')
+        for m in i.fire_and_forget:
+            w('            case {}u:\n'.format(larson_hash(m)))
+        w('                return true;\n'
+          '            default:\n'
+          '                return false;\n'
+          '        }\n')
+    else:
+        w('        (void)componentId;\n'
+          '        return false;\n')
+    w('    }\n')
+    for m in i.methods:
+        w('    {} {};\n'.format(in_(m), m))
+    w('};\n\n')
+
+    w('template <>\nunion BroadcastUnion<{}> {{\n'.format(i.scope))
+    w('    template <class T>\n'
+      '    void invoke (T& client, uint32_t componentId, PayloadView in, Status& status) {{\n'
+      '        (void)AssertClientImplementsInterface<T, {}>();\n'
+      '        switch (componentId) {{\n'.format(i.scope))
+    for b in i.broadcasts:
+        w('            case {}u:\n'
+          '                decode({}, in.bytes, in.size, status);\n'
+          '                if (!hasError(status)) {{\n'
+          '                    client.onBroadcast({});\n'
+          '                }}\n'
+          '                break;\n'.format(larson_hash(b), b, b))
+    w('            default:\n'
+      '                status = Status::INTERFACE_ERROR;\n'
+      '                break;\n'
+      '        }\n'
+      '    }\n'
+      '    template <class T>\n'
+      '    void invoke (T& client, uint32_t componentId,\n'
+      '            barobo_rpc_Broadcast_payload_t& in, Status& status) {\n'
+      '        invoke(client, componentId, PayloadView{in.bytes, in.size}, status);\n'
+      '    }\n')
+    for b in i.broadcasts:
+        w('    {} {};\n'.format(broadcast(b), b))
+    w('};\n\n')
+
+    w('} // namespace rpc\n\n#endif\n')
+
+
+def write_source(out, interface, header):
+    i = interface
+    w = out.write
+    w('// Generated by ribbon-bridge-generator.py. Do not edit.\n\n')
+    w('#include "{}"\n\nnamespace rpc {{\nnamespace _ {{\n\n'.format(header))
+    components = (['{}_In'.format(m) for m in i.methods]
+                  + ['{}_Result'.format(m) for m in i.methods] + i.broadcasts)
+    for c in components:
+        w('template <>\nconst pb_field_t* pbFieldPtr<{0}{1}> () {{ return {0}{1}_fields; }}\n'
+          .format(i.prefix, c))
+    w('\n} // namespace _\n} // namespace rpc\n')
+
+
+def main(argv):
+    if len(argv) != 5:
+        sys.stderr.write('usage: {} <descriptor-set> <proto-file> <out.hpp> <out.cpp>\n'
+                         .format(argv[0]))
+        return 2
+    descriptorSet, proto, hpp, cpp = argv[1:]
+    with open(descriptorSet, 'rb') as f:
+        files = repeated(bytearray(f.read()), FILE_SET_FILE)
+    # protoc lists imports first, so the file we asked for comes last.
+    basename = os.path.basename(proto)
+    matches = [p for p in files if os.path.basename(field(p, FILE_NAME, b'').decode()) == basename]
+    if not matches:
+        raise GeneratorError('{} is not in {}'.format(proto, descriptorSet))
+    interface = Interface(matches[-1])
+
+    pb_header = os.path.splitext(basename)[0] + '.pb.h'
+    guard = '_'.join(interface.names + ['INTERFACE'])
+    with open(hpp, 'w') as out:
+        write_header(out, interface, pb_header, guard)
+    with open(cpp, 'w') as out:
+        write_source(out, interface, os.path.basename(hpp))
+    return 0
+
+
+if __name__ == '__main__':
+    try:
+        sys.exit(main(sys.argv))
+    except GeneratorError as e:
+        sys.stderr.write('ribbon-bridge-generator: {}\n'.format(e))
+        sys.exit(1)
@@ -7,6 +7,566 @@
 namespace rpc {
 namespace _ {
 
+namespace {
+
+// All of the fields we encode by hand have field numbers below 16, so their
+// tags always fit in one byte.
+size_t varintSize (uint64_t value) {
+    size_t n = 1;
+    while (value >>= 7) {
+        ++n;
+    }
+    return n;
+}
+
+size_t varintFieldSize (uint64_t value) {
+    return 1 + varintSize(value);
+}
+
+// Request.batch and ServerMessage.batch are FT_IGNORE, so nanopb generates no
+// tags for them.
+const uint32_t kRequestBatchTag = 5;
+const uint32_t kServerMessageBatchTag = 5;
+
+static_assert(barobo_rpc_Request_Batch_requests_tag == barobo_rpc_ServerMessage_Batch_replies_tag,
+    "BatchWriter and nextBatchEntry expect both kinds of batch entry to share a tag");
+const uint32_t kBatchEntryTag = barobo_rpc_Request_Batch_requests_tag;
+
+size_t delimitedFieldSize (size_t length) {
+    return 1 + varintSize(length) + length;
+}
+
+bool encodeVarintField (pb_ostream_t* stream, uint32_t tag, uint64_t value) {
+    return pb_encode_tag(stream, PB_WT_VARINT, tag)
+        && pb_encode_varint(stream, value);
+}
+
+bool encodeDelimitedFieldHeader (pb_ostream_t* stream, uint32_t tag, size_t length) {
+    return pb_encode_tag(stream, PB_WT_STRING, tag)
+        && pb_encode_varint(stream, length);
+}
+
+// Request.Fire, Reply.Result and Broadcast share the same layout: a component
+// ID followed by a payload. We already know the payload size from a sizing
+// pass, so we can write the component message directly after its length
+// prefix.
+size_t componentMessageSize (uint32_t componentId, size_t payloadSize) {
+    return varintFieldSize(componentId) + delimitedFieldSize(payloadSize);
+}
+
+// The payload of a component message: a nanopb struct to encode, or, if
+// pbFields is null, a payload already encoded.
+struct Payload {
+    const void* pbStruct;
+    const pb_field_t* pbFields;
+    PayloadView encoded;
+    FixedPayload fixed;
+};
+
+Payload makePayload (const void* pbStruct, const pb_field_t* pbFields) {
+    return Payload{pbStruct, pbFields, PayloadView{nullptr, 0}, FixedPayload{nullptr, 0, nullptr}};
+}
+
+Payload makePayload (PayloadView encoded) {
+    return Payload{nullptr, nullptr, encoded, FixedPayload{nullptr, 0, nullptr}};
+}
+
+Payload makePayload (FixedPayload fixed) {
+    return Payload{nullptr, nullptr, PayloadView{nullptr, 0}, fixed};
+}
+
+// Let a FixedLayout codec write its component at the stream's position. The
+// streams here all come from pb_ostream_from_buffer, whose state is that
+// position; a sizing stream, with no callback, just counts the bytes.
+bool writeFixedPayload (pb_ostream_t* stream, const FixedPayload& payload) {
+    if (stream->max_size - stream->bytes_written < payload.size) {
+        return false;
+    }
+    if (stream->callback) {
+        auto out = static_cast<uint8_t*>(stream->state);
+        auto end = payload.write(payload.component, out);
+        if (size_t(end - out) != payload.size) {
+            return false;
+        }
+        stream->state = end;
+    }
+    stream->bytes_written += payload.size;
+    return true;
+}
+
+bool encodeComponentMessage (pb_ostream_t* stream, uint32_t idTag, uint32_t payloadTag,
+    uint32_t componentId, const Payload& payload, size_t payloadSize) {
+    if (!encodeVarintField(stream, idTag, componentId)
+        || !encodeDelimitedFieldHeader(stream, payloadTag, payloadSize)) {
+        return false;
+    }
+    if (payload.fixed.write) {
+        return writeFixedPayload(stream, payload.fixed);
+    }
+    if (!payload.pbFields) {
+        return pb_write(stream, payload.encoded.bytes, payload.encoded.size);
+    }
+    auto start = stream->bytes_written;
+    return pb_encode(stream, payload.pbFields, payload.pbStruct)
+        && stream->bytes_written - start == payloadSize;
+}
+
+// Just enough of a protobuf wire format reader to pick apart the message
+// envelopes in place.
+class WireReader {
+public:
+    WireReader (const uint8_t* bytes, size_t size)
+        : mPos(bytes)
+        , mEnd(bytes + size)
+    {}
+
+    bool atEnd () const { return mPos == mEnd; }
+    const uint8_t* pos () const { return mPos; }
+
+    bool varint (uint64_t& value) {
+        value = 0;
+        for (unsigned shift = 0; shift < 64 && mPos != mEnd; shift += 7) {
+            auto byte = *mPos++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool varint (uint32_t& value) {
+        uint64_t v;
+        auto success = varint(v);
+        value = uint32_t(v);
+        return success;
+    }
+
+    bool tag (uint32_t& fieldNumber, pb_wire_type_t& wireType) {
+        uint32_t key;
+        if (!varint(key) || !(key >> 3)) {
+            return false;
+        }
+        fieldNumber = key >> 3;
+        wireType = pb_wire_type_t(key & 0x07);
+        return true;
+    }
+
+    bool delimited (PayloadView& view) {
+        uint64_t length;
+        if (!varint(length) || length > uint64_t(mEnd - mPos)) {
+            return false;
+        }
+        view.bytes = mPos;
+        view.size = size_t(length);
+        mPos += length;
+        return true;
+    }
+
+    bool skip (pb_wire_type_t wireType) {
+        uint64_t v;
+        PayloadView view;
+        switch (wireType) {
+            case PB_WT_VARINT: return varint(v);
+            case PB_WT_64BIT: return advance(8);
+            case PB_WT_STRING: return delimited(view);
+            case PB_WT_32BIT: return advance(4);
+            default: return false;
+        }
+    }
+
+private:
+    bool advance (size_t n) {
+        if (n > size_t(mEnd - mPos)) {
+            return false;
+        }
+        mPos += n;
+        return true;
+    }
+
+    const uint8_t* mPos;
+    const uint8_t* mEnd;
+};
+
+// The payload is left where it is, in the message being decoded.
+bool decodeComponentMessage (PayloadView in, uint32_t idTag, uint32_t payloadTag,
+        uint32_t& componentId, PayloadView& payload) {
+    auto reader = WireReader{in.bytes, in.size};
+    bool hasId = false;
+    bool hasPayload = false;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return false;
+        }
+        if (idTag == fieldNumber && PB_WT_VARINT == wireType) {
+            hasId = reader.varint(componentId);
+            if (!hasId) { return false; }
+        }
+        else if (payloadTag == fieldNumber && PB_WT_STRING == wireType) {
+            hasPayload = reader.delimited(payload);
+            if (!hasPayload) { return false; }
+        }
+        else if (!reader.skip(wireType)) {
+            return false;
+        }
+    }
+    return hasId && hasPayload;
+}
+
+// Request.Subscription and Request.Cancel each hold nothing but an ID.
+bool decodeIdMessage (PayloadView in, uint32_t idTag, uint32_t& id) {
+    auto reader = WireReader{in.bytes, in.size};
+    bool hasId = false;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return false;
+        }
+        if (idTag == fieldNumber && PB_WT_VARINT == wireType) {
+            hasId = reader.varint(id);
+            if (!hasId) { return false; }
+        }
+        else if (!reader.skip(wireType)) {
+            return false;
+        }
+    }
+    return hasId;
+}
+
+bool decodeRequest (PayloadView in, barobo_rpc_Request& request, PayloadView& payload) {
+    auto reader = WireReader{in.bytes, in.size};
+    bool hasType = false;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return false;
+        }
+        if (barobo_rpc_Request_type_tag == fieldNumber && PB_WT_VARINT == wireType) {
+            uint32_t type;
+            hasType = reader.varint(type);
+            if (!hasType) { return false; }
+            request.type = barobo_rpc_Request_Type(type);
+        }
+        else if (barobo_rpc_Request_fire_tag == fieldNumber && PB_WT_STRING == wireType) {
+            PayloadView fire;
+            if (!reader.delimited(fire)
+                || !decodeComponentMessage(fire, barobo_rpc_Request_Fire_id_tag,
+                    barobo_rpc_Request_Fire_payload_tag, request.fire.id, payload)) {
+                return false;
+            }
+            request.has_fire = true;
+        }
+        else if (barobo_rpc_Request_subscription_tag == fieldNumber && PB_WT_STRING == wireType) {
+            PayloadView subscription;
+            if (!reader.delimited(subscription)
+                || !decodeIdMessage(subscription, barobo_rpc_Request_Subscription_id_tag,
+                    request.subscription.id)) {
+                return false;
+            }
+            request.has_subscription = true;
+        }
+        else if (barobo_rpc_Request_cancel_tag == fieldNumber && PB_WT_STRING == wireType) {
+            PayloadView cancel;
+            if (!reader.delimited(cancel)
+                || !decodeIdMessage(cancel, barobo_rpc_Request_Cancel_id_tag, request.cancel.id)) {
+                return false;
+            }
+            request.has_cancel = true;
+        }
+        else if (barobo_rpc_Request_timeout_tag == fieldNumber && PB_WT_VARINT == wireType) {
+            if (!reader.varint(request.timeout)) {
+                return false;
+            }
+            request.has_timeout = true;
+        }
+        else if (kRequestBatchTag == fieldNumber && PB_WT_STRING == wireType) {
+            if (!reader.delimited(payload)) {
+                return false;
+            }
+        }
+        else if (!reader.skip(wireType)) {
+            return false;
+        }
+    }
+    return hasType;
+}
+
+// VersionTriplet's fields are all required.
+bool decodeVersionTriplet (PayloadView in, barobo_rpc_VersionTriplet& triplet) {
+    auto reader = WireReader{in.bytes, in.size};
+    unsigned seen = 0;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return false;
+        }
+        uint32_t* field = nullptr;
+        if (PB_WT_VARINT == wireType) {
+            switch (fieldNumber) {
+                case barobo_rpc_VersionTriplet_major_tag: field = &triplet.major; break;
+                case barobo_rpc_VersionTriplet_minor_tag: field = &triplet.minor; break;
+                case barobo_rpc_VersionTriplet_patch_tag: field = &triplet.patch; break;
+            }
+        }
+        if (field) {
+            if (!reader.varint(*field)) { return false; }
+            seen |= 1u << fieldNumber;
+        }
+        else if (!reader.skip(wireType)) {
+            return false;
+        }
+    }
+    return seen == ((1u << barobo_rpc_VersionTriplet_major_tag)
+        | (1u << barobo_rpc_VersionTriplet_minor_tag)
+        | (1u << barobo_rpc_VersionTriplet_patch_tag));
+}
+
+bool decodeVersions (PayloadView in, barobo_rpc_Versions& versions) {
+    auto reader = WireReader{in.bytes, in.size};
+    bool hasRpc = false;
+    bool hasInterface = false;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return false;
+        }
+        PayloadView triplet;
+        if (barobo_rpc_Versions_rpc_tag == fieldNumber && PB_WT_STRING == wireType) {
+            hasRpc = reader.delimited(triplet) && decodeVersionTriplet(triplet, versions.rpc);
+            if (!hasRpc) { return false; }
+        }
+        else if (barobo_rpc_Versions_interface_tag == fieldNumber && PB_WT_STRING == wireType) {
+            hasInterface = reader.delimited(triplet)
+                && decodeVersionTriplet(triplet, versions.interface);
+            if (!hasInterface) { return false; }
+        }
+        else if (!reader.skip(wireType)) {
+            return false;
+        }
+    }
+    return hasRpc && hasInterface;
+}
+
+bool decodeReply (PayloadView in, barobo_rpc_Reply& reply, PayloadView& payload) {
+    auto reader = WireReader{in.bytes, in.size};
+    bool hasType = false;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return false;
+        }
+        if (barobo_rpc_Reply_type_tag == fieldNumber && PB_WT_VARINT == wireType) {
+            uint32_t type;
+            hasType = reader.varint(type);
+            if (!hasType) { return false; }
+            reply.type = barobo_rpc_Reply_Type(type);
+        }
+        else if (barobo_rpc_Reply_versions_tag == fieldNumber && PB_WT_STRING == wireType) {
+            PayloadView versions;
+            if (!reader.delimited(versions) || !decodeVersions(versions, reply.versions)) {
+                return false;
+            }
+            reply.has_versions = true;
+        }
+        else if (barobo_rpc_Reply_status_tag == fieldNumber && PB_WT_STRING == wireType) {
+            PayloadView status;
+            uint32_t value;
+            if (!reader.delimited(status)
+                || !decodeIdMessage(status, barobo_rpc_Reply_Status_value_tag, value)) {
+                return false;
+            }
+            reply.status.value = decltype(reply.status.value)(value);
+            reply.has_status = true;
+        }
+        else if (barobo_rpc_Reply_result_tag == fieldNumber && PB_WT_STRING == wireType) {
+            PayloadView result;
+            if (!reader.delimited(result)
+                || !decodeComponentMessage(result, barobo_rpc_Reply_Result_id_tag,
+                    barobo_rpc_Reply_Result_payload_tag, reply.result.id, payload)) {
+                return false;
+            }
+            reply.has_result = true;
+        }
+        else if (!reader.skip(wireType)) {
+            return false;
+        }
+    }
+    return hasType;
+}
+
+// Find a field at the top level of a message. For a varint, value is the
+// varint's own bytes; for a length-delimited field, its contents.
+bool findField (PayloadView in, uint32_t number, pb_wire_type_t type, PayloadView& value) {
+    auto reader = WireReader{in.bytes, in.size};
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return false;
+        }
+        auto start = reader.pos();
+        if (!reader.skip(wireType)) {
+            return false;
+        }
+        if (number == fieldNumber && type == wireType) {
+            if (PB_WT_STRING == type) {
+                WireReader{start, size_t(reader.pos() - start)}.delimited(value);
+            }
+            else {
+                value = PayloadView{start, size_t(reader.pos() - start)};
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Write a varint of exactly width bytes, padding it with redundant
+// continuation bytes if the value needs fewer. Decoders accept these.
+void writeVarint (uint8_t* bytes, size_t width, uint32_t value) {
+    for (size_t i = 0; i + 1 < width; ++i) {
+        bytes[i] = uint8_t(0x80 | (value & 0x7f));
+        value >>= 7;
+    }
+    bytes[width - 1] = uint8_t(value);
+}
+
+// Overwrite the top-level varint field with the given number, moving the rest
+// of the message along if the new value needs more room than the old.
+void rewriteVarintField (uint8_t* bytes, size_t size, uint32_t number, uint32_t value,
+        size_t& newSize, Status& status) {
+    newSize = size;
+    PayloadView field;
+    if (!findField(PayloadView{bytes, size}, number, PB_WT_VARINT, field)) {
+        status = Status::PROTOCOL_ERROR;
+        return;
+    }
+    auto at = const_cast<uint8_t*>(field.bytes);
+    auto width = field.size;
+    auto needed = varintSize(value);
+    if (needed > width) {
+        auto tail = at + width;
+        memmove(at + needed, tail, size_t(bytes + size - tail));
+        newSize += needed - width;
+        width = needed;
+    }
+    writeVarint(at, width, value);
+    status = Status::OK;
+}
+
+// The receiving end may decode into the static payload fields of rpc.proto, so
+// we must respect their max_size.
+bool payloadSize (const Payload& payload, size_t maxSize, size_t& size) {
+    if (payload.fixed.write) {
+        size = payload.fixed.size;
+    }
+    else if (!payload.pbFields) {
+        size = payload.encoded.size;
+    }
+    else if (!pb_get_encoded_size(&size, payload.pbFields, payload.pbStruct)) {
+        return false;
+    }
+    return size <= maxSize;
+}
+
+void encodeFire (uint32_t requestId, uint32_t componentId, uint32_t timeout,
+    const Payload& component,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    nWritten = 0;
+    status = Status::ENCODING_FAILURE;
+
+    size_t payload;
+    if (!payloadSize(component, sizeof(barobo_rpc_Request_Fire_payload_t::bytes), payload)) {
+        return;
+    }
+    auto fireSize = componentMessageSize(componentId, payload);
+    auto requestSize = varintFieldSize(barobo_rpc_Request_Type_FIRE)
+        + delimitedFieldSize(fireSize)
+        + (kNoTimeout != timeout ? varintFieldSize(timeout) : 0);
+
+    auto stream = pb_ostream_from_buffer(bytes, size);
+    if (encodeVarintField(&stream, barobo_rpc_ClientMessage_id_tag, requestId)
+        && encodeDelimitedFieldHeader(&stream, barobo_rpc_ClientMessage_request_tag, requestSize)
+        && encodeVarintField(&stream, barobo_rpc_Request_type_tag, barobo_rpc_Request_Type_FIRE)
+        && encodeDelimitedFieldHeader(&stream, barobo_rpc_Request_fire_tag, fireSize)
+        && encodeComponentMessage(&stream,
+            barobo_rpc_Request_Fire_id_tag, barobo_rpc_Request_Fire_payload_tag,
+            componentId, component, payload)
+        && (kNoTimeout == timeout
+            || encodeVarintField(&stream, barobo_rpc_Request_timeout_tag, timeout))) {
+        status = Status::OK;
+    }
+    nWritten = pb_size_t(stream.bytes_written);
+    assert(nWritten == stream.bytes_written);
+}
+
+void encodeResult (uint32_t inReplyTo, uint32_t componentId,
+    const Payload& component,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    nWritten = 0;
+    status = Status::ENCODING_FAILURE;
+
+    size_t payload;
+    if (!payloadSize(component, sizeof(barobo_rpc_Reply_Result_payload_t::bytes), payload)) {
+        return;
+    }
+    auto resultSize = componentMessageSize(componentId, payload);
+    auto replySize = varintFieldSize(barobo_rpc_Reply_Type_RESULT)
+        + delimitedFieldSize(resultSize);
+
+    auto stream = pb_ostream_from_buffer(bytes, size);
+    if (encodeVarintField(&stream, barobo_rpc_ServerMessage_type_tag,
+            barobo_rpc_ServerMessage_Type_REPLY)
+        && encodeDelimitedFieldHeader(&stream, barobo_rpc_ServerMessage_reply_tag, replySize)
+        && encodeVarintField(&stream, barobo_rpc_Reply_type_tag, barobo_rpc_Reply_Type_RESULT)
+        && encodeDelimitedFieldHeader(&stream, barobo_rpc_Reply_result_tag, resultSize)
+        && encodeComponentMessage(&stream,
+            barobo_rpc_Reply_Result_id_tag, barobo_rpc_Reply_Result_payload_tag,
+            componentId, component, payload)
+        && encodeVarintField(&stream, barobo_rpc_ServerMessage_inReplyTo_tag, inReplyTo)) {
+        status = Status::OK;
+    }
+    nWritten = pb_size_t(stream.bytes_written);
+    assert(nWritten == stream.bytes_written);
+}
+
+void encodeBroadcast (uint32_t componentId,
+    const Payload& component,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    nWritten = 0;
+    status = Status::ENCODING_FAILURE;
+
+    size_t payload;
+    if (!payloadSize(component, sizeof(barobo_rpc_Broadcast_payload_t::bytes), payload)) {
+        return;
+    }
+    auto broadcastSize = componentMessageSize(componentId, payload);
+
+    auto stream = pb_ostream_from_buffer(bytes, size);
+    if (encodeVarintField(&stream, barobo_rpc_ServerMessage_type_tag,
+            barobo_rpc_ServerMessage_Type_BROADCAST)
+        && encodeDelimitedFieldHeader(&stream, barobo_rpc_ServerMessage_broadcast_tag, broadcastSize)
+        && encodeComponentMessage(&stream,
+            barobo_rpc_Broadcast_id_tag, barobo_rpc_Broadcast_payload_tag,
+            componentId, component, payload)) {
+        status = Status::OK;
+    }
+    nWritten = pb_size_t(stream.bytes_written);
+    assert(nWritten == stream.bytes_written);
+}
+
+} // namespace <anonymous>
+
 template <>
 const pb_field_t* pbFieldPtr<barobo_rpc_ClientMessage> () {
     return barobo_rpc_ClientMessage_fields;
@@ -30,7 +590,7 @@ void encode (const void* pbStruct, const pb_field_t* pbFields,
 }
 
 void decode (void* pbStruct, const pb_field_t* pbFields,
-    uint8_t* bytes, size_t size, Status& status) {
+    const uint8_t* bytes, size_t size, Status& status) {
     auto stream = pb_istream_from_buffer(bytes, size);
     status = Status::OK;
     if (!pb_decode(&stream, pbFields, pbStruct)) {
@@ -38,5 +598,393 @@ void decode (void* pbStruct, const pb_field_t* pbFields,
     }
 }
 
+void encodeFire (uint32_t requestId, uint32_t componentId, uint32_t timeout,
+    const void* pbStruct, const pb_field_t* pbFields,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeFire(requestId, componentId, timeout, makePayload(pbStruct, pbFields),
+        bytes, size, nWritten, status);
+}
+
+void encodeFire (uint32_t requestId, uint32_t componentId, uint32_t timeout,
+    PayloadView payload,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeFire(requestId, componentId, timeout, makePayload(payload),
+        bytes, size, nWritten, status);
+}
+
+void encodeResult (uint32_t inReplyTo, uint32_t componentId,
+    const void* pbStruct, const pb_field_t* pbFields,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeResult(inReplyTo, componentId, makePayload(pbStruct, pbFields),
+        bytes, size, nWritten, status);
+}
+
+void encodeResult (uint32_t inReplyTo, uint32_t componentId,
+    PayloadView payload,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeResult(inReplyTo, componentId, makePayload(payload),
+        bytes, size, nWritten, status);
+}
+
+void encodeBroadcast (uint32_t componentId,
+    const void* pbStruct, const pb_field_t* pbFields,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeBroadcast(componentId, makePayload(pbStruct, pbFields),
+        bytes, size, nWritten, status);
+}
+
+void encodeBroadcast (uint32_t componentId,
+    PayloadView payload,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeBroadcast(componentId, makePayload(payload),
+        bytes, size, nWritten, status);
+}
+
+void encodeFire (uint32_t requestId, uint32_t componentId, uint32_t timeout,
+    FixedPayload payload,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeFire(requestId, componentId, timeout, makePayload(payload),
+        bytes, size, nWritten, status);
+}
+
+void encodeResult (uint32_t inReplyTo, uint32_t componentId,
+    FixedPayload payload,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeResult(inReplyTo, componentId, makePayload(payload),
+        bytes, size, nWritten, status);
+}
+
+void encodeBroadcast (uint32_t componentId,
+    FixedPayload payload,
+    uint8_t* bytes, size_t size,
+    pb_size_t& nWritten, Status& status) {
+    encodeBroadcast(componentId, makePayload(payload),
+        bytes, size, nWritten, status);
+}
+
 } // namespace _
+
+void encodeStatus (uint32_t inReplyTo, Status value,
+    uint8_t* bytes, size_t size, pb_size_t& nWritten, Status& status) {
+    barobo_rpc_ServerMessage svMessage;
+    memset(&svMessage, 0, sizeof(svMessage));
+    svMessage.type = barobo_rpc_ServerMessage_Type_REPLY;
+    svMessage.has_reply = true;
+    svMessage.reply.type = barobo_rpc_Reply_Type_STATUS;
+    svMessage.reply.has_status = true;
+    svMessage.reply.status.value = decltype(svMessage.reply.status.value)(value);
+    svMessage.has_inReplyTo = true;
+    svMessage.inReplyTo = inReplyTo;
+    encode(svMessage, bytes, size, nWritten, status);
+}
+
+// Space for the largest envelope is left at the front of the buffer, and the
+// entries are moved down behind the real one when the batch is finished.
+BatchWriter::BatchWriter (uint8_t* bytes, size_t size)
+    : mBytes(bytes)
+    , mPos(bytes + (size < kBatchOverhead ? size : kBatchOverhead))
+    , mEnd(bytes + size)
+{}
+
+// An entry's length prefix can be no longer than that of the largest entry
+// which would fit.
+uint8_t* BatchWriter::entryBytes () const {
+    return mPos + 1 + _::varintSize(size_t(mEnd - mPos));
+}
+
+size_t BatchWriter::entrySize () const {
+    auto entry = entryBytes();
+    return entry < mEnd ? size_t(mEnd - entry) : 0;
+}
+
+void BatchWriter::commit (size_t size) {
+    assert(size <= entrySize());
+    auto entry = entryBytes();
+    auto stream = pb_ostream_from_buffer(mPos, size_t(entry - mPos));
+    auto success = _::encodeDelimitedFieldHeader(&stream, _::kBatchEntryTag, size);
+    assert(success);
+    (void)success;
+    memmove(mPos + stream.bytes_written, entry, size);
+    mPos += stream.bytes_written + size;
+    ++mCount;
+}
+
+bool BatchWriter::append (const uint8_t* bytes, size_t size) {
+    if (size > entrySize()) {
+        return false;
+    }
+    memcpy(entryBytes(), bytes, size);
+    commit(size);
+    return true;
+}
+
+void BatchWriter::finishRequest (uint32_t requestId, pb_size_t& nWritten, Status& status) {
+    nWritten = 0;
+    if (mEnd - mBytes < ptrdiff_t(kBatchOverhead)) {
+        status = Status::ENCODING_FAILURE;
+        return;
+    }
+    auto batch = size_t(mPos - (mBytes + kBatchOverhead));
+    auto requestSize = _::varintFieldSize(barobo_rpc_Request_Type_BATCH)
+        + _::delimitedFieldSize(batch);
+    uint8_t envelope[kBatchOverhead];
+    auto stream = pb_ostream_from_buffer(envelope, sizeof(envelope));
+    auto success = _::encodeVarintField(&stream, barobo_rpc_ClientMessage_id_tag, requestId)
+        && _::encodeDelimitedFieldHeader(&stream, barobo_rpc_ClientMessage_request_tag, requestSize)
+        && _::encodeVarintField(&stream, barobo_rpc_Request_type_tag, barobo_rpc_Request_Type_BATCH)
+        && _::encodeDelimitedFieldHeader(&stream, _::kRequestBatchTag, batch);
+    assert(success);
+    (void)success;
+    finish(envelope, stream.bytes_written, nWritten, status);
+}
+
+void BatchWriter::finishReply (pb_size_t& nWritten, Status& status) {
+    nWritten = 0;
+    if (mEnd - mBytes < ptrdiff_t(kBatchOverhead)) {
+        status = Status::ENCODING_FAILURE;
+        return;
+    }
+    auto batch = size_t(mPos - (mBytes + kBatchOverhead));
+    uint8_t envelope[kBatchOverhead];
+    auto stream = pb_ostream_from_buffer(envelope, sizeof(envelope));
+    auto success = _::encodeVarintField(&stream, barobo_rpc_ServerMessage_type_tag,
+            barobo_rpc_ServerMessage_Type_BATCH)
+        && _::encodeDelimitedFieldHeader(&stream, _::kServerMessageBatchTag, batch);
+    assert(success);
+    (void)success;
+    finish(envelope, stream.bytes_written, nWritten, status);
+}
+
+void BatchWriter::finish (const uint8_t* envelope, size_t envelopeSize,
+        pb_size_t& nWritten, Status& status) {
+    auto batch = size_t(mPos - (mBytes + kBatchOverhead));
+    memmove(mBytes + envelopeSize, mBytes + kBatchOverhead, batch);
+    memcpy(mBytes, envelope, envelopeSize);
+    nWritten = pb_size_t(envelopeSize + batch);
+    assert(nWritten == envelopeSize + batch);
+    status = Status::OK;
+}
+
+void decodeBatch (const uint8_t* bytes, size_t size, PayloadView& batch, Status& status) {
+    batch = PayloadView{nullptr, 0};
+    status = Status::DECODING_FAILURE;
+
+    auto reader = _::WireReader{bytes, size};
+    bool hasBatch = false;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return;
+        }
+        if (_::kServerMessageBatchTag == fieldNumber && PB_WT_STRING == wireType) {
+            hasBatch = reader.delimited(batch);
+            if (!hasBatch) { return; }
+        }
+        else if (!reader.skip(wireType)) {
+            return;
+        }
+    }
+    if (hasBatch) {
+        status = Status::OK;
+    }
+}
+
+bool nextBatchEntry (PayloadView& batch, PayloadView& entry, Status& status) {
+    status = Status::OK;
+    auto reader = _::WireReader{batch.bytes, batch.size};
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            status = Status::DECODING_FAILURE;
+            break;
+        }
+        if (_::kBatchEntryTag == fieldNumber && PB_WT_STRING == wireType) {
+            if (!reader.delimited(entry)) {
+                status = Status::DECODING_FAILURE;
+                break;
+            }
+            auto end = entry.bytes + entry.size;
+            batch.size -= size_t(end - batch.bytes);
+            batch.bytes = end;
+            return true;
+        }
+        else if (!reader.skip(wireType)) {
+            status = Status::DECODING_FAILURE;
+            break;
+        }
+    }
+    batch = PayloadView{nullptr, 0};
+    return false;
+}
+
+void rewriteRequestId (uint8_t* bytes, size_t size, uint32_t requestId,
+        size_t& newSize, Status& status) {
+    _::rewriteVarintField(bytes, size, barobo_rpc_ClientMessage_id_tag, requestId,
+        newSize, status);
+}
+
+void rewriteInReplyTo (uint8_t* bytes, size_t size, uint32_t inReplyTo,
+        size_t& newSize, Status& status) {
+    _::rewriteVarintField(bytes, size, barobo_rpc_ServerMessage_inReplyTo_tag, inReplyTo,
+        newSize, status);
+}
+
+void rewriteTimeout (uint8_t* bytes, size_t size, uint32_t timeout, Status& status) {
+    status = Status::OK;
+    PayloadView request;
+    PayloadView field;
+    if (!_::findField(PayloadView{bytes, size}, barobo_rpc_ClientMessage_request_tag,
+            PB_WT_STRING, request)) {
+        status = Status::PROTOCOL_ERROR;
+        return;
+    }
+    if (!_::findField(request, barobo_rpc_Request_timeout_tag, PB_WT_VARINT, field)) {
+        return;
+    }
+    // Growing the field would mean growing the request's length prefix too.
+    if (_::varintSize(timeout) > field.size) {
+        status = Status::ENCODING_FAILURE;
+        return;
+    }
+    _::writeVarint(const_cast<uint8_t*>(field.bytes), field.size, timeout);
+}
+
+bool peekServerMessage (const uint8_t* bytes, size_t size,
+        uint32_t& type, bool& hasInReplyTo, uint32_t& inReplyTo) {
+    auto reader = _::WireReader{bytes, size};
+    bool hasType = false;
+    hasInReplyTo = false;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return false;
+        }
+        if (barobo_rpc_ServerMessage_type_tag == fieldNumber && PB_WT_VARINT == wireType) {
+            hasType = reader.varint(type);
+            if (!hasType) { return false; }
+        }
+        else if (barobo_rpc_ServerMessage_inReplyTo_tag == fieldNumber
+                && PB_WT_VARINT == wireType) {
+            hasInReplyTo = reader.varint(inReplyTo);
+            if (!hasInReplyTo) { return false; }
+        }
+        else if (!reader.skip(wireType)) {
+            return false;
+        }
+    }
+    return hasType;
+}
+
+bool peekBroadcastId (const uint8_t* bytes, size_t size, uint32_t& componentId) {
+    PayloadView broadcast;
+    PayloadView id;
+    return _::findField(PayloadView{bytes, size}, barobo_rpc_ServerMessage_broadcast_tag,
+            PB_WT_STRING, broadcast)
+        && _::findField(broadcast, barobo_rpc_Broadcast_id_tag, PB_WT_VARINT, id)
+        && _::WireReader{id.bytes, id.size}.varint(componentId);
+}
+
+void decode (barobo_rpc_ServerMessage& message, PayloadView& payload,
+    const uint8_t* bytes, size_t size, Status& status) {
+    memset(&message, 0, sizeof(message));
+    payload = PayloadView{nullptr, 0};
+    status = Status::DECODING_FAILURE;
+
+    auto reader = _::WireReader{bytes, size};
+    bool hasType = false;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return;
+        }
+        if (barobo_rpc_ServerMessage_type_tag == fieldNumber && PB_WT_VARINT == wireType) {
+            uint32_t type;
+            hasType = reader.varint(type);
+            if (!hasType) { return; }
+            message.type = barobo_rpc_ServerMessage_Type(type);
+        }
+        else if (barobo_rpc_ServerMessage_reply_tag == fieldNumber && PB_WT_STRING == wireType) {
+            PayloadView reply;
+            if (!reader.delimited(reply) || !_::decodeReply(reply, message.reply, payload)) {
+                return;
+            }
+            message.has_reply = true;
+        }
+        else if (barobo_rpc_ServerMessage_inReplyTo_tag == fieldNumber
+                && PB_WT_VARINT == wireType) {
+            if (!reader.varint(message.inReplyTo)) {
+                return;
+            }
+            message.has_inReplyTo = true;
+        }
+        else if (barobo_rpc_ServerMessage_broadcast_tag == fieldNumber
+                && PB_WT_STRING == wireType) {
+            PayloadView broadcast;
+            if (!reader.delimited(broadcast)
+                || !_::decodeComponentMessage(broadcast, barobo_rpc_Broadcast_id_tag,
+                    barobo_rpc_Broadcast_payload_tag, message.broadcast.id, payload)) {
+                return;
+            }
+            message.has_broadcast = true;
+        }
+        else if (_::kServerMessageBatchTag == fieldNumber && PB_WT_STRING == wireType) {
+            if (!reader.delimited(payload)) {
+                return;
+            }
+        }
+        else if (!reader.skip(wireType)) {
+            return;
+        }
+    }
+    if (hasType) {
+        status = Status::OK;
+    }
+}
+
+void decode (barobo_rpc_ClientMessage& message, PayloadView& payload,
+    const uint8_t* bytes, size_t size, Status& status) {
+    memset(&message, 0, sizeof(message));
+    payload = PayloadView{nullptr, 0};
+    status = Status::DECODING_FAILURE;
+
+    auto reader = _::WireReader{bytes, size};
+    bool hasId = false;
+    bool hasRequest = false;
+    while (!reader.atEnd()) {
+        uint32_t fieldNumber;
+        pb_wire_type_t wireType;
+        if (!reader.tag(fieldNumber, wireType)) {
+            return;
+        }
+        if (barobo_rpc_ClientMessage_id_tag == fieldNumber && PB_WT_VARINT == wireType) {
+            hasId = reader.varint(message.id);
+            if (!hasId) { return; }
+        }
+        else if (barobo_rpc_ClientMessage_request_tag == fieldNumber && PB_WT_STRING == wireType) {
+            PayloadView request;
+            hasRequest = reader.delimited(request)
+                && _::decodeRequest(request, message.request, payload);
+            if (!hasRequest) { return; }
+        }
+        else if (!reader.skip(wireType)) {
+            return;
+        }
+    }
+    if (hasId && hasRequest) {
+        status = Status::OK;
+    }
+}
+
 } // namespace rpc
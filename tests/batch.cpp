@@ -0,0 +1,490 @@
+// Test BATCH requests and replies: assembling and walking batches with
+// rpc::BatchWriter, rpc::nextBatchEntry and rpc::decodeBatch, both servers'
+// replies to a batch mixing FIRE, CANCEL and SUBSCRIBE requests, split across
+// several BATCH replies, and rpc::asio::asyncFireBatch against the asio server.
+
+#include <util/asio/operation.hpp>
+
+#include "gen-widget.pb.hpp"
+
+#include <rpc/message.hpp>
+#include <rpc/server.hpp>
+#include <rpc/asio/client.hpp>
+#include <rpc/asio/server.hpp>
+#include <rpc/asio/shmmessagequeue.hpp>
+
+#include <boost/asio/io_service.hpp>
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using Bytes = std::vector<uint8_t>;
+
+using MethodIn = rpc::MethodIn<barobo::Widget>;
+using MethodResult = rpc::MethodResult<barobo::Widget>;
+using Broadcast = rpc::Broadcast<barobo::Widget>;
+
+using Shm = rpc::asio::ShmMessageQueue;
+
+struct WidgetImpl {
+    MethodResult::nullaryNoResult onFire (MethodIn::nullaryNoResult) {
+        return MethodResult::nullaryNoResult{};
+    }
+
+    MethodResult::nullaryWithResult onFire (MethodIn::nullaryWithResult) {
+        return MethodResult::nullaryWithResult{2.5f};
+    }
+
+    MethodResult::unaryNoResult onFire (MethodIn::unaryNoResult) {
+        return MethodResult::unaryNoResult{};
+    }
+
+    MethodResult::unaryWithResult onFire (MethodIn::unaryWithResult args) {
+        return MethodResult::unaryWithResult{args.value * 2};
+    }
+};
+
+// An rpc::Server whose buffers hold only a few replies, so that the replies
+// to a batch are split across several BATCH replies.
+class BatchServer : public rpc::Server<BatchServer, barobo::Widget, rpc::Buffer<256>> {
+public:
+    template <class Method>
+    auto onFire (Method args) -> decltype(WidgetImpl().onFire(args)) {
+        return mImpl.onFire(args);
+    }
+
+    void bufferToClient (const BufferType& buffer) {
+        frames.emplace_back(buffer.bytes, buffer.bytes + buffer.size);
+    }
+
+    std::vector<Bytes> frames;
+
+private:
+    WidgetImpl mImpl;
+};
+
+template <class Method>
+Bytes fireEntry (uint32_t requestId, const Method& args) {
+    uint8_t bytes[barobo_rpc_ClientMessage_size];
+    pb_size_t nWritten;
+    rpc::Status status;
+    rpc::encodeFire(requestId, args, rpc::kNoTimeout, bytes, sizeof(bytes), nWritten, status);
+    assert(!rpc::hasError(status));
+    return Bytes(bytes, bytes + nWritten);
+}
+
+// A SUBSCRIBE, UNSUBSCRIBE or CANCEL request naming the given ID.
+Bytes requestEntry (uint32_t requestId, barobo_rpc_Request_Type type, uint32_t id) {
+    barobo_rpc_ClientMessage message;
+    memset(&message, 0, sizeof(message));
+    message.id = requestId;
+    message.request.type = type;
+    if (barobo_rpc_Request_Type_CANCEL == type) {
+        message.request.has_cancel = true;
+        message.request.cancel.id = id;
+    }
+    else {
+        message.request.has_subscription = true;
+        message.request.subscription.id = id;
+    }
+    uint8_t bytes[barobo_rpc_ClientMessage_size];
+    pb_size_t nWritten;
+    rpc::Status status;
+    rpc::encode(message, bytes, sizeof(bytes), nWritten, status);
+    assert(!rpc::hasError(status));
+    return Bytes(bytes, bytes + nWritten);
+}
+
+Bytes batchRequest (uint32_t requestId, const std::vector<Bytes>& entries) {
+    Bytes bytes(RPC_BATCH_MAX_SIZE);
+    rpc::BatchWriter writer{bytes.data(), bytes.size()};
+    for (auto& entry : entries) {
+        auto success = writer.append(entry.data(), entry.size());
+        assert(success);
+        (void)success;
+    }
+    pb_size_t nWritten;
+    rpc::Status status;
+    writer.finishRequest(requestId, nWritten, status);
+    assert(!rpc::hasError(status));
+    bytes.resize(nWritten);
+    return bytes;
+}
+
+std::vector<Bytes> batchEntries (rpc::PayloadView batch) {
+    std::vector<Bytes> entries;
+    rpc::PayloadView entry;
+    rpc::Status status;
+    while (rpc::nextBatchEntry(batch, entry, status)) {
+        entries.emplace_back(entry.bytes, entry.bytes + entry.size);
+    }
+    assert(!rpc::hasError(status));
+    return entries;
+}
+
+// Entries committed in place and appended, large and small, come back out of
+// both kinds of batch as they went in; entries which do not fit are refused.
+void testBatchWriter () {
+    std::vector<Bytes> entries;
+    entries.push_back(fireEntry(1, MethodIn::unaryWithResult{0.5f}));
+    entries.push_back(Bytes(200, 0xa5));
+    entries.push_back(requestEntry(3, barobo_rpc_Request_Type_CANCEL, 1));
+    entries.push_back(Bytes(1, 0));
+
+    uint8_t bytes[RPC_BATCH_MAX_SIZE];
+    rpc::BatchWriter writer{bytes, sizeof(bytes)};
+    pb_size_t nWritten;
+    rpc::Status status;
+    rpc::encodeFire(1, MethodIn::unaryWithResult{0.5f}, rpc::kNoTimeout,
+        writer.entryBytes(), writer.entrySize(), nWritten, status);
+    assert(!rpc::hasError(status));
+    writer.commit(nWritten);
+    for (size_t i = 1; i < entries.size(); ++i) {
+        assert(writer.append(entries[i].data(), entries[i].size()));
+    }
+    assert(entries.size() == writer.count());
+    writer.finishRequest(0x4000, nWritten, status);
+    assert(!rpc::hasError(status));
+
+    barobo_rpc_ClientMessage request;
+    rpc::PayloadView payload;
+    rpc::decode(request, payload, bytes, nWritten, status);
+    assert(!rpc::hasError(status));
+    assert(0x4000 == request.id);
+    assert(barobo_rpc_Request_Type_BATCH == request.request.type);
+    assert(entries == batchEntries(payload));
+
+    // Every entry but the last is cut short by truncating the batch.
+    auto truncated = payload;
+    --truncated.size;
+    rpc::PayloadView entry;
+    size_t n = 0;
+    while (rpc::nextBatchEntry(truncated, entry, status)) {
+        ++n;
+    }
+    assert(rpc::Status::DECODING_FAILURE == status);
+    assert(entries.size() - 1 == n);
+
+    writer = rpc::BatchWriter{bytes, sizeof(bytes)};
+    for (auto& e : entries) {
+        assert(writer.append(e.data(), e.size()));
+    }
+    writer.finishReply(nWritten, status);
+    assert(!rpc::hasError(status));
+    rpc::PayloadView batch;
+    rpc::decodeBatch(bytes, nWritten, batch, status);
+    assert(!rpc::hasError(status));
+    assert(entries == batchEntries(batch));
+
+    barobo_rpc_ServerMessage reply;
+    rpc::decode(reply, payload, bytes, nWritten, status);
+    assert(!rpc::hasError(status));
+    assert(barobo_rpc_ServerMessage_Type_BATCH == reply.type);
+    assert(payload.bytes == batch.bytes && payload.size == batch.size);
+
+    // A batch with no entries.
+    writer = rpc::BatchWriter{bytes, sizeof(bytes)};
+    writer.finishReply(nWritten, status);
+    assert(!rpc::hasError(status));
+    rpc::decodeBatch(bytes, nWritten, batch, status);
+    assert(!rpc::hasError(status));
+    assert(batchEntries(batch).empty());
+
+    // A small batch takes what it can, and the rest is refused.
+    uint8_t small[64];
+    writer = rpc::BatchWriter{small, sizeof(small)};
+    auto e = Bytes(20, 0x5a);
+    assert(writer.append(e.data(), e.size()));
+    assert(writer.append(e.data(), e.size()));
+    assert(!writer.append(e.data(), e.size()));
+    assert(!writer.append(entries[1].data(), entries[1].size()));
+    assert(2 == writer.count());
+    writer.finishRequest(1, nWritten, status);
+    assert(!rpc::hasError(status));
+    rpc::decode(request, payload, small, nWritten, status);
+    assert(!rpc::hasError(status));
+    assert((std::vector<Bytes>{e, e}) == batchEntries(payload));
+}
+
+struct Reply {
+    uint32_t inReplyTo;
+    barobo_rpc_Reply_Type type;
+    float value;
+    rpc::Status status;
+};
+
+// Decode one reply, batched or not, and note whether it was a batch.
+void readReplies (const Bytes& frame, std::vector<Reply>& replies, bool& wasBatch) {
+    barobo_rpc_ServerMessage message;
+    rpc::PayloadView payload;
+    rpc::Status status;
+    rpc::decode(message, payload, frame.data(), frame.size(), status);
+    assert(!rpc::hasError(status));
+    wasBatch = barobo_rpc_ServerMessage_Type_BATCH == message.type;
+    if (wasBatch) {
+        for (auto& entry : batchEntries(payload)) {
+            bool nested;
+            readReplies(entry, replies, nested);
+            assert(!nested);
+        }
+        return;
+    }
+
+    assert(barobo_rpc_ServerMessage_Type_REPLY == message.type);
+    assert(message.has_inReplyTo && message.has_reply);
+    Reply reply{message.inReplyTo, message.reply.type, 0, rpc::Status::OK};
+    if (barobo_rpc_Reply_Type_RESULT == message.reply.type) {
+        auto id = message.reply.result.id;
+        if (rpc::componentId(MethodIn::unaryWithResult{}) == id) {
+            MethodResult::unaryWithResult result;
+            rpc::decode(result, payload.bytes, payload.size, status);
+            reply.value = result.value;
+        }
+        else {
+            assert(rpc::componentId(MethodIn::nullaryWithResult{}) == id);
+            MethodResult::nullaryWithResult result;
+            rpc::decode(result, payload.bytes, payload.size, status);
+            reply.value = result.value;
+        }
+        assert(!rpc::hasError(status));
+    }
+    else {
+        assert(barobo_rpc_Reply_Type_STATUS == message.reply.type);
+        reply.status = rpc::Status(message.reply.status.value);
+    }
+    replies.push_back(reply);
+}
+
+const size_t kBatchFires = 44;
+const uint32_t kFirstFireId = 10;
+const uint32_t kCancelId = 100;
+const uint32_t kUnsubscribeId = 101;
+
+// SUBSCRIBE requests for a broadcast and for something which isn't one,
+// enough FIRE requests that their replies fill more than one BATCH reply,
+// a CANCEL naming nothing outstanding, and an UNSUBSCRIBE.
+Bytes mixedBatch () {
+    std::vector<Bytes> entries;
+    entries.push_back(requestEntry(1, barobo_rpc_Request_Type_SUBSCRIBE,
+        rpc::componentId(Broadcast::broadcast{})));
+    entries.push_back(requestEntry(2, barobo_rpc_Request_Type_SUBSCRIBE, 0xdead));
+    // Mostly nullaryWithResult, whose replies are larger than its requests.
+    for (uint32_t i = 0; i < kBatchFires; ++i) {
+        entries.push_back(i % 4
+            ? fireEntry(kFirstFireId + i, MethodIn::nullaryWithResult{})
+            : fireEntry(kFirstFireId + i, MethodIn::unaryWithResult{float(i)}));
+    }
+    entries.push_back(requestEntry(kCancelId, barobo_rpc_Request_Type_CANCEL, 12345));
+    entries.push_back(requestEntry(kUnsubscribeId, barobo_rpc_Request_Type_UNSUBSCRIBE,
+        rpc::componentId(Broadcast::broadcast{})));
+    auto batch = batchRequest(7, entries);
+    assert(batch.size() <= RPC_BATCH_MAX_SIZE);
+    return batch;
+}
+
+// The replies to mixedBatch, in order: none for the CANCEL, and none for the
+// batch itself.
+void checkMixedReplies (const std::vector<Reply>& replies) {
+    assert(kBatchFires + 3 == replies.size());
+    auto reply = replies.begin();
+    assert(1 == reply->inReplyTo && barobo_rpc_Reply_Type_STATUS == reply->type);
+    assert(rpc::Status::OK == reply->status);
+    ++reply;
+    assert(2 == reply->inReplyTo && barobo_rpc_Reply_Type_STATUS == reply->type);
+    assert(rpc::Status::INTERFACE_ERROR == reply->status);
+    ++reply;
+    for (uint32_t i = 0; i < kBatchFires; ++i, ++reply) {
+        assert(kFirstFireId + i == reply->inReplyTo);
+        assert(barobo_rpc_Reply_Type_RESULT == reply->type);
+        assert((i % 4 ? 2.5f : float(i) * 2) == reply->value);
+    }
+    assert(kUnsubscribeId == reply->inReplyTo && barobo_rpc_Reply_Type_STATUS == reply->type);
+    assert(rpc::Status::OK == reply->status);
+}
+
+// rpc::Server's replies to a batch, passed to bufferToClient, or with the
+// last left in the caller's buffer.
+void testServerBatch () {
+    auto batch = mixedBatch();
+
+    BatchServer server;
+    auto status = server.receiveClientBytes(batch.data(), batch.size());
+    assert(!rpc::hasError(status));
+    assert(server.frames.size() > 1);
+    std::vector<Reply> replies;
+    for (auto& frame : server.frames) {
+        assert(frame.size() <= sizeof(BatchServer::BufferType::bytes));
+        bool wasBatch;
+        readReplies(frame, replies, wasBatch);
+        assert(wasBatch);
+    }
+    checkMixedReplies(replies);
+    auto nFrames = server.frames.size();
+
+    server.frames.clear();
+    uint8_t out[256];
+    size_t outWritten;
+    status = server.receiveClientBytes(batch.data(), batch.size(),
+        out, sizeof(out), outWritten, 0);
+    assert(!rpc::hasError(status));
+    assert(outWritten);
+    assert(nFrames - 1 == server.frames.size());
+    server.frames.emplace_back(out, out + outWritten);
+    replies.clear();
+    for (auto& frame : server.frames) {
+        bool wasBatch;
+        readReplies(frame, replies, wasBatch);
+        assert(wasBatch);
+    }
+    checkMixedReplies(replies);
+}
+
+// A Server and a peer connected over a shared memory queue.
+std::string shmPath () {
+    static int n = 0;
+    return "/dev/shm/rpc-batch-test-" + std::to_string(getpid()) + "-" + std::to_string(n++);
+}
+
+void connect (Shm& server, Shm& peer) {
+    auto path = shmPath();
+    boost::system::error_code ec;
+    server.create(path, ec);
+    assert(!ec);
+    peer.open(path, ec);
+    assert(!ec);
+    unlink(path.c_str());
+}
+
+// The asio server's replies to a batch, sent as BATCH replies no larger than
+// RPC_BATCH_MAX_SIZE.
+void testAsioServerBatch () {
+    boost::asio::io_service ios;
+    rpc::asio::Server<Shm> server{ios};
+    Shm peer{ios};
+    connect(server.messageQueue(), peer);
+
+    WidgetImpl impl;
+    rpc::asio::asyncRunServer<barobo::Widget>(server, impl,
+        [] (boost::system::error_code) {});
+
+    auto batch = mixedBatch();
+    peer.asyncSend(boost::asio::buffer(batch), [] (boost::system::error_code ec) {
+        assert(!ec);
+    });
+
+    std::vector<Reply> replies;
+    size_t nFrames = 0;
+    Bytes frame(RPC_BATCH_MAX_SIZE);
+    std::function<void(boost::system::error_code, size_t)> receive;
+    receive = [&] (boost::system::error_code ec, size_t size) {
+        assert(!ec);
+        assert(size <= RPC_BATCH_MAX_SIZE);
+        bool wasBatch;
+        readReplies(Bytes(frame.begin(), frame.begin() + size), replies, wasBatch);
+        assert(wasBatch);
+        ++nFrames;
+        if (replies.size() < kBatchFires + 3) {
+            peer.asyncReceive(boost::asio::buffer(frame), receive);
+            return;
+        }
+        peer.close(ec);
+        server.close(ec);
+    };
+    peer.asyncReceive(boost::asio::buffer(frame), receive);
+    ios.run();
+
+    assert(nFrames > 1);
+    checkMixedReplies(replies);
+}
+
+struct ClientImpl {
+    void onBroadcast (Broadcast::broadcast) {}
+};
+
+// asyncFireBatch against the asio server: every request's handler gets its
+// result, and a batch too large to send fails every request in it.
+void testFireBatch () {
+    boost::asio::io_service ios;
+    rpc::asio::Server<Shm> server{ios};
+    rpc::asio::Client<Shm> client{ios};
+    connect(server.messageQueue(), client.messageQueue());
+
+    WidgetImpl impl;
+    rpc::asio::asyncRunServer<barobo::Widget>(server, impl,
+        [] (boost::system::error_code) {});
+    ClientImpl clientImpl;
+    rpc::asio::asyncRunClient<barobo::Widget>(client, clientImpl,
+        [] (boost::system::error_code) {});
+
+    const size_t kFires = 32;
+    const auto timeout = std::chrono::seconds(5);
+    size_t nResults = 0;
+    size_t nFailures = 0;
+    auto done = [&] {
+        if (kFires + 4 == nResults && 50 == nFailures) {
+            boost::system::error_code ec;
+            client.messageQueue().close(ec);
+            server.close(ec);
+        }
+    };
+
+    rpc::asio::FireBatch<rpc::asio::Client<Shm>> batch{client};
+    for (size_t i = 0; i < kFires; ++i) {
+        batch.add(MethodIn::nullaryWithResult{}, timeout,
+            [&] (boost::system::error_code ec, MethodResult::nullaryWithResult result) {
+                assert(!ec);
+                assert(2.5f == result.value);
+                ++nResults;
+                done();
+            });
+    }
+    for (size_t i = 0; i < 4; ++i) {
+        batch.add(MethodIn::unaryWithResult{float(i)}, timeout,
+            [&, i] (boost::system::error_code ec, MethodResult::unaryWithResult result) {
+                assert(!ec);
+                assert(float(i) * 2 == result.value);
+                ++nResults;
+                done();
+            });
+    }
+    bool sent = false;
+    rpc::asio::asyncFireBatch(client, std::move(batch), [&] (boost::system::error_code ec) {
+        assert(!ec);
+        sent = true;
+    });
+
+    rpc::asio::FireBatch<rpc::asio::Client<Shm>> tooLarge{client};
+    for (size_t i = 0; i < 50; ++i) {
+        tooLarge.add(MethodIn::unaryWithResult{float(i)}, timeout,
+            [&] (boost::system::error_code ec, MethodResult::unaryWithResult) {
+                assert(rpc::Status::ENCODING_FAILURE == ec);
+                ++nFailures;
+                done();
+            });
+    }
+    bool refused = false;
+    rpc::asio::asyncFireBatch(client, std::move(tooLarge), [&] (boost::system::error_code ec) {
+        assert(rpc::Status::ENCODING_FAILURE == ec);
+        refused = true;
+    });
+
+    ios.run();
+    assert(sent && refused);
+    assert(kFires + 4 == nResults);
+    assert(50 == nFailures);
+}
+
+int main () {
+    testBatchWriter();
+    testServerBatch();
+    testAsioServerBatch();
+    testFireBatch();
+    std::cout << "Batch OK\n";
+    return 0;
+}
@@ -0,0 +1,342 @@
+// Test the FixedLayout codecs ribbon-bridge-generator.py writes for
+// proto/fixedlayout.proto, and the wire format primitives in
+// rpc/fixedlayout.hpp they are built from, against hand-encoded messages.
+
+#include "gen-fixedlayout.pb.hpp"
+
+#include <rpc/message.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+using Bytes = std::vector<uint8_t>;
+
+using Scalars = barobo_FixedLayoutTest_scalars_In;
+using Tags = barobo_FixedLayoutTest_tags;
+
+static_assert(rpc::FixedLayout<Scalars>::value, "scalars.In should have a FixedLayout codec");
+static_assert(rpc::FixedLayout<Tags>::value, "tags should have a FixedLayout codec");
+static_assert(!rpc::FixedLayout<barobo_FixedLayoutTest_sparse>::value,
+    "optional fields should leave sparse to nanopb");
+
+void putVarint (Bytes& out, uint64_t value) {
+    while (value > 0x7f) {
+        out.push_back(uint8_t(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back(uint8_t(value));
+}
+
+void putTag (Bytes& out, uint32_t number, uint32_t wireType) {
+    putVarint(out, (number << 3) | wireType);
+}
+
+void putVarintField (Bytes& out, uint32_t number, uint64_t value) {
+    putTag(out, number, PB_WT_VARINT);
+    putVarint(out, value);
+}
+
+void putFixed32Field (Bytes& out, uint32_t number, uint32_t value) {
+    putTag(out, number, PB_WT_32BIT);
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(uint8_t(value >> (8 * i)));
+    }
+}
+
+void putFixed64Field (Bytes& out, uint32_t number, uint64_t value) {
+    putTag(out, number, PB_WT_64BIT);
+    for (int i = 0; i < 8; ++i) {
+        out.push_back(uint8_t(value >> (8 * i)));
+    }
+}
+
+uint64_t zigZag (int64_t value) {
+    return value < 0 ? ~(uint64_t(value) << 1) : uint64_t(value) << 1;
+}
+
+// Every field, in order, as any protobuf encoder would write it: negative
+// int32s, int64s, and enums as ten-byte varints, sint32s and sint64s
+// zigzagged.
+Bytes encode (const Scalars& m) {
+    Bytes out;
+    putVarintField(out, 1, uint64_t(int64_t(m.i32)));
+    putVarintField(out, 2, uint64_t(m.i64));
+    putVarintField(out, 3, m.u32);
+    putVarintField(out, 4, m.u64);
+    putVarintField(out, 5, zigZag(m.s32));
+    putVarintField(out, 6, zigZag(m.s64));
+    putVarintField(out, 7, uint64_t(int64_t(m.level)));
+    putVarintField(out, 8, m.flag);
+    putFixed32Field(out, 9, rpc::_::wireFloatBits(m.real));
+    putFixed32Field(out, 10, m.f32);
+    putFixed32Field(out, 11, uint32_t(m.sf32));
+    putFixed64Field(out, 12, m.f64);
+    putFixed64Field(out, 13, uint64_t(m.sf64));
+    return out;
+}
+
+Bytes encode (const Tags& m) {
+    Bytes out;
+    putVarintField(out, 1, m.first);
+    putVarintField(out, 16, zigZag(m.second));
+    putVarintField(out, 2047, uint64_t(int64_t(m.last)));
+    return out;
+}
+
+template <class T>
+Bytes write (const T& m) {
+    Bytes out(rpc::FixedLayout<T>::maxSize);
+    auto end = rpc::FixedLayout<T>::write(m, out.data());
+    out.resize(size_t(end - out.data()));
+    assert(out.size() == rpc::FixedLayout<T>::size(m));
+    return out;
+}
+
+bool operator== (const Scalars& a, const Scalars& b) {
+    return a.i32 == b.i32 && a.i64 == b.i64 && a.u32 == b.u32 && a.u64 == b.u64
+        && a.s32 == b.s32 && a.s64 == b.s64 && a.level == b.level && a.flag == b.flag
+        && a.real == b.real && a.f32 == b.f32 && a.sf32 == b.sf32
+        && a.f64 == b.f64 && a.sf64 == b.sf64;
+}
+
+bool operator== (const Tags& a, const Tags& b) {
+    return a.first == b.first && a.second == b.second && a.last == b.last;
+}
+
+Scalars smallScalars () {
+    Scalars m = {};
+    m.u32 = 1;
+    m.level = barobo_FixedLayoutTest_Level_HIGH;
+    m.flag = true;
+    m.real = 1.5f;
+    return m;
+}
+
+// Every varint at its longest.
+Scalars largeScalars () {
+    Scalars m;
+    m.i32 = std::numeric_limits<int32_t>::min();
+    m.i64 = std::numeric_limits<int64_t>::min();
+    m.u32 = std::numeric_limits<uint32_t>::max();
+    m.u64 = std::numeric_limits<uint64_t>::max();
+    m.s32 = std::numeric_limits<int32_t>::min();
+    m.s64 = std::numeric_limits<int64_t>::min();
+    m.level = barobo_FixedLayoutTest_Level_LOW;
+    m.flag = false;
+    m.real = -0.25f;
+    m.f32 = 0xdeadbeef;
+    m.sf32 = -2;
+    m.f64 = 0x0123456789abcdef;
+    m.sf64 = -3;
+    return m;
+}
+
+void testPrimitives () {
+    using namespace rpc::_;
+
+    assert(1 == wireVarintSize(0));
+    assert(1 == wireVarintSize(0x7f));
+    assert(2 == wireVarintSize(0x80));
+    assert(5 == wireVarintSize(0xffffffff));
+    assert(10 == wireVarintSize(uint64_t(int64_t(-1))));
+
+    assert(0 == wireZigZag32(0));
+    assert(1 == wireZigZag32(-1));
+    assert(2 == wireZigZag32(1));
+    assert(0xfffffffe == wireZigZag32(std::numeric_limits<int32_t>::max()));
+    assert(0xffffffff == wireZigZag32(std::numeric_limits<int32_t>::min()));
+    assert(3 == wireZigZag64(-2));
+    assert(0xffffffffffffffff == wireZigZag64(std::numeric_limits<int64_t>::min()));
+
+    assert(-0.25f == wireBitsFloat(wireFloatBits(-0.25f)));
+    assert(0x3fc00000 == wireFloatBits(1.5f));
+
+    for (uint64_t value : { uint64_t(0), uint64_t(0x7f), uint64_t(0x80), uint64_t(0xffffffff),
+            std::numeric_limits<uint64_t>::max() }) {
+        uint8_t buffer[10];
+        auto end = putVarint(buffer, value);
+        assert(size_t(end - buffer) == wireVarintSize(value));
+        const uint8_t* in = buffer;
+        uint64_t decoded;
+        assert(getVarint(in, end, decoded) && in == end && decoded == value);
+    }
+
+    // A varint padded with continuation bytes still reads as its value, but
+    // one which runs off the end, or past 64 bits, doesn't.
+    const uint8_t padded[] = { 0x81, 0x80, 0x80, 0x00 };
+    const uint8_t* in = padded;
+    uint32_t u32;
+    assert(getUnsigned(in, padded + sizeof(padded), u32) && 1 == u32);
+    in = padded;
+    assert(!getUnsigned(in, padded + 2, u32));
+    const uint8_t tooLong[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 };
+    in = tooLong;
+    uint64_t u64;
+    assert(!getUnsigned(in, tooLong + sizeof(tooLong), u64));
+
+    // Values which don't fit the field are left to nanopb.
+    uint8_t buffer[10];
+    auto end = putVarint(buffer, uint64_t(1) << 32);
+    in = buffer;
+    assert(!getUnsigned(in, end, u32));
+    int32_t i32;
+    end = putVarint(buffer, uint64_t(1) << 40);
+    in = buffer;
+    assert(!getSigned(in, end, i32));
+    end = putVarint(buffer, uint64_t(int64_t(-5)));
+    in = buffer;
+    assert(getSigned(in, end, i32) && -5 == i32 && in == end);
+    end = putVarint(buffer, wireZigZag64(int64_t(1) << 40));
+    in = buffer;
+    assert(!getZigZag(in, end, i32));
+
+    const uint8_t two[] = { 2 };
+    in = two;
+    bool flag;
+    assert(!getBool(in, two + 1, flag));
+    in = two;
+    assert(!getFixed32(in, two + 1, u32));
+}
+
+void testScalars () {
+    for (auto m : { smallScalars(), largeScalars() }) {
+        auto bytes = write(m);
+        assert(bytes == encode(m));
+        assert(bytes.size() <= rpc::FixedLayout<Scalars>::maxSize);
+
+        Scalars decoded;
+        assert(rpc::FixedLayout<Scalars>::read(decoded, bytes.data(), bytes.size()));
+        assert(decoded == m);
+    }
+
+    // The longest message is exactly maxSize long.
+    assert(write(largeScalars()).size() == rpc::FixedLayout<Scalars>::maxSize);
+
+    // Negative int32s and enums are sign-extended to ten bytes, and sint32s
+    // zigzagged to a single byte.
+    auto m = smallScalars();
+    m.i32 = -1;
+    m.s32 = -1;
+    m.level = barobo_FixedLayoutTest_Level_LOW;
+    auto bytes = write(m);
+    const uint8_t minusOne[] = { 0x08, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 };
+    assert(Bytes(bytes.begin(), bytes.begin() + sizeof(minusOne))
+        == Bytes(minusOne, minusOne + sizeof(minusOne)));
+    assert(bytes == encode(m));
+    Scalars decoded;
+    assert(rpc::FixedLayout<Scalars>::read(decoded, bytes.data(), bytes.size()));
+    assert(-1 == decoded.i32 && -1 == decoded.s32);
+    assert(barobo_FixedLayoutTest_Level_LOW == decoded.level);
+}
+
+void testTags () {
+    Tags m;
+    m.first = 300;
+    m.second = -3;
+    m.last = -1;
+    auto bytes = write(m);
+    assert(bytes == encode(m));
+    // Field 16 is the first to need a two-byte tag, and 2047 the last.
+    const uint8_t expected[] = { 0x08, 0xac, 0x02, 0x80, 0x01, 0x05, 0xf8, 0x7f };
+    assert(Bytes(bytes.begin(), bytes.begin() + sizeof(expected))
+        == Bytes(expected, expected + sizeof(expected)));
+    assert(bytes.size() == sizeof(expected) + 10);
+
+    Tags decoded;
+    assert(rpc::FixedLayout<Tags>::read(decoded, bytes.data(), bytes.size()));
+    assert(decoded == m);
+}
+
+// FixedLayout<T>::read only takes exactly what write would have written; the
+// rest is for nanopb.
+void testRejects () {
+    auto m = largeScalars();
+    auto bytes = write(m);
+    Scalars decoded;
+
+    for (size_t size = 0; size < bytes.size(); ++size) {
+        assert(!rpc::FixedLayout<Scalars>::read(decoded, bytes.data(), size));
+    }
+
+    auto padded = bytes;
+    putVarintField(padded, 14, 1);
+    assert(!rpc::FixedLayout<Scalars>::read(decoded, padded.data(), padded.size()));
+
+    Bytes reordered;
+    putVarintField(reordered, 2, uint64_t(m.i64));
+    putVarintField(reordered, 1, uint64_t(int64_t(m.i32)));
+    auto rest = encode(m);
+    reordered.insert(reordered.end(), rest.begin() + 11 + 11, rest.end());
+    assert(reordered.size() == bytes.size());
+    assert(!rpc::FixedLayout<Scalars>::read(decoded, reordered.data(), reordered.size()));
+
+    auto notBool = write(smallScalars());
+    auto flag = std::find(notBool.begin(), notBool.end(), uint8_t(0x40));
+    assert(flag != notBool.end() && 1 == flag[1]);
+    flag[1] = 2;
+    assert(!rpc::FixedLayout<Scalars>::read(decoded, notBool.data(), notBool.size()));
+
+    // Varints an encoder has padded are still read without nanopb's help.
+    Tags tags = { 1, 0, 0 };
+    Bytes paddedVarint = { 0x08, 0x81, 0x80, 0x00, 0x80, 0x01, 0x00, 0xf8, 0x7f, 0x00 };
+    Tags decodedTags;
+    assert(rpc::FixedLayout<Tags>::read(decodedTags, paddedVarint.data(), paddedVarint.size()));
+    assert(decodedTags == tags);
+}
+
+// rpc::encode and rpc::decode use the FixedLayout codecs, and decode falls
+// back to nanopb for whatever they won't read.
+void testMessage () {
+    rpc::Status status;
+    auto m = largeScalars();
+    auto expected = write(m);
+
+    uint8_t buffer[rpc::FixedLayout<Scalars>::maxSize];
+    pb_size_t nWritten;
+    rpc::encode(m, buffer, sizeof(buffer) - 1, nWritten, status);
+    assert(rpc::Status::ENCODING_FAILURE == status);
+    rpc::encode(m, buffer, sizeof(buffer), nWritten, status);
+    assert(!rpc::hasError(status));
+    assert(Bytes(buffer, buffer + nWritten) == expected);
+
+    Scalars decoded;
+    rpc::decode(decoded, expected.data(), expected.size(), status);
+    assert(!rpc::hasError(status));
+    assert(decoded == m);
+
+    // An unknown field on the end, and fields out of order.
+    auto padded = expected;
+    putVarintField(padded, 14, 1);
+    decoded = Scalars();
+    rpc::decode(decoded, padded.data(), padded.size(), status);
+    assert(!rpc::hasError(status));
+    assert(decoded == m);
+
+    Tags tags = { 300, -3, -1 };
+    Bytes reordered;
+    putVarintField(reordered, 2047, uint64_t(int64_t(tags.last)));
+    putVarintField(reordered, 16, zigZag(tags.second));
+    putVarintField(reordered, 1, tags.first);
+    Tags decodedTags = {};
+    rpc::decode(decodedTags, reordered.data(), reordered.size(), status);
+    assert(!rpc::hasError(status));
+    assert(decodedTags == tags);
+
+    // Truncated messages fail in nanopb too.
+    rpc::decode(decoded, expected.data(), expected.size() - 1, status);
+    assert(rpc::Status::DECODING_FAILURE == status);
+}
+
+int main () {
+    testPrimitives();
+    testScalars();
+    testTags();
+    testRejects();
+    testMessage();
+    std::cout << "FixedLayout OK\n";
+    return 0;
+}
@@ -0,0 +1,303 @@
+// Test the asio client's flow control: requests are admitted to the request
+// window in FIFO order, a request's slot is given back when it times out or
+// is cancelled, and flowControlStats reports it all.
+
+#include <util/asio/operation.hpp>
+
+#include "gen-widget.pb.hpp"
+
+#include <rpc/message.hpp>
+#include <rpc/asio/client.hpp>
+#include <rpc/asio/shmmessagequeue.hpp>
+
+#include <boost/asio/io_service.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using MethodIn = rpc::MethodIn<barobo::Widget>;
+using MethodResult = rpc::MethodResult<barobo::Widget>;
+using Broadcast = rpc::Broadcast<barobo::Widget>;
+
+using Shm = rpc::asio::ShmMessageQueue;
+using Client = rpc::asio::Client<Shm>;
+
+using std::chrono::milliseconds;
+
+// Acquire n slots, noting the tag in admitted when they are granted.
+void acquire (Client& client, size_t n, int tag, std::vector<int>& admitted) {
+    client.asyncAcquireRequestSlots(n, [tag, &admitted] (boost::system::error_code ec) {
+        assert(!ec);
+        admitted.push_back(tag);
+    });
+}
+
+void runReady (boost::asio::io_service& ios) {
+    ios.poll();
+    ios.reset();
+}
+
+// Slots are granted in the order they are asked for, even to a request which
+// would fit in the window while one before it still waits. A request for
+// more than the whole window waits until nothing else is outstanding.
+void testAdmission () {
+    boost::asio::io_service ios;
+    Client client{ios};
+    std::vector<int> admitted;
+
+    client.setRequestWindow(2);
+    acquire(client, 1, 0, admitted);
+    acquire(client, 1, 1, admitted);
+    acquire(client, 1, 2, admitted);
+    runReady(ios);
+    assert((std::vector<int>{0, 1}) == admitted);
+    auto stats = client.flowControlStats();
+    assert(2 == stats.window);
+    assert(2 == stats.outstanding);
+    assert(1 == stats.queueDepth);
+    assert(0 == stats.queuedRequests);
+
+    acquire(client, 3, 3, admitted);
+    acquire(client, 1, 4, admitted);
+    client.releaseRequestSlot();
+    runReady(ios);
+    assert((std::vector<int>{0, 1, 2}) == admitted);
+
+    // The batch of three waits for the window to empty, and a request
+    // after it waits too, though there would be room for it.
+    client.releaseRequestSlot();
+    acquire(client, 1, 5, admitted);
+    runReady(ios);
+    assert((std::vector<int>{0, 1, 2}) == admitted);
+    stats = client.flowControlStats();
+    assert(1 == stats.outstanding);
+    assert(3 == stats.queueDepth);
+    assert(3 == stats.maxQueueDepth);
+
+    client.releaseRequestSlot();
+    runReady(ios);
+    assert((std::vector<int>{0, 1, 2, 3}) == admitted);
+    assert(3 == client.flowControlStats().outstanding);
+
+    // The window is over-full until two of the batch's slots come back.
+    client.releaseRequestSlot();
+    runReady(ios);
+    assert((std::vector<int>{0, 1, 2, 3}) == admitted);
+    client.releaseRequestSlot();
+    runReady(ios);
+    assert((std::vector<int>{0, 1, 2, 3, 4}) == admitted);
+
+    stats = client.flowControlStats();
+    assert(2 == stats.outstanding);
+    assert(1 == stats.queueDepth);
+    assert(3 == stats.queuedRequests);
+    assert(stats.maxWait <= stats.totalWait);
+
+    // Widening the window admits those waiting; a zero window is unlimited.
+    client.setRequestWindow(3);
+    runReady(ios);
+    assert(5 == admitted.back());
+    client.setRequestWindow(0);
+    for (int i = 6; i < 16; ++i) {
+        acquire(client, 1, i, admitted);
+    }
+    runReady(ios);
+    assert(16 == admitted.size());
+    assert(13 == client.flowControlStats().outstanding);
+    while (client.flowControlStats().outstanding) {
+        client.releaseRequestSlot();
+    }
+
+    // Cancelling the client fails those still waiting.
+    client.setRequestWindow(1);
+    acquire(client, 1, 16, admitted);
+    bool aborted = false;
+    client.asyncAcquireRequestSlot([&] (boost::system::error_code ec) {
+        assert(boost::asio::error::operation_aborted == ec);
+        aborted = true;
+    });
+    runReady(ios);
+    assert(17 == admitted.size());
+    client.cancel();
+    runReady(ios);
+    assert(aborted);
+    assert(0 == client.flowControlStats().queueDepth);
+}
+
+struct ClientImpl {
+    void onBroadcast (Broadcast::broadcast) {}
+};
+
+// A client whose requests go to a peer which replies only when told to.
+struct Fixture {
+    Fixture () : client(ios), peer(ios) {
+        auto path = "/dev/shm/rpc-flowcontrol-test-" + std::to_string(getpid());
+        boost::system::error_code ec;
+        peer.create(path, ec);
+        assert(!ec);
+        client.messageQueue().open(path, ec);
+        assert(!ec);
+        unlink(path.c_str());
+        rpc::asio::asyncRunClient<barobo::Widget>(client, impl,
+            [] (boost::system::error_code) {});
+    }
+
+    // Call onRequest with each request the client sends.
+    void receive () {
+        peer.asyncReceive(boost::asio::buffer(frame), [this] (boost::system::error_code ec, size_t size) {
+            if (ec) {
+                return;
+            }
+            barobo_rpc_ClientMessage message;
+            rpc::PayloadView payload;
+            rpc::Status status;
+            rpc::decode(message, payload, frame, size, status);
+            assert(!rpc::hasError(status));
+            onRequest(message);
+            receive();
+        });
+    }
+
+    void reply (uint32_t inReplyTo, float value) {
+        auto buf = std::make_shared<std::vector<uint8_t>>(barobo_rpc_ServerMessage_size);
+        pb_size_t nWritten;
+        rpc::Status status;
+        rpc::encodeResult(inReplyTo, rpc::componentId(MethodIn::unaryWithResult{}),
+            MethodResult::unaryWithResult{value}, buf->data(), buf->size(), nWritten, status);
+        assert(!rpc::hasError(status));
+        buf->resize(nWritten);
+        peer.asyncSend(boost::asio::buffer(*buf), [buf] (boost::system::error_code ec) {
+            assert(!ec);
+        });
+    }
+
+    void close () {
+        boost::system::error_code ec;
+        client.messageQueue().close(ec);
+        peer.close(ec);
+    }
+
+    boost::asio::io_service ios;
+    Client client;
+    Shm peer;
+    ClientImpl impl;
+    uint8_t frame[RPC_BATCH_MAX_SIZE];
+    std::function<void(const barobo_rpc_ClientMessage&)> onRequest;
+};
+
+// A request which times out gives its slot to the next in line, and one which
+// times out while waiting is never sent. The server is told how much of the
+// timeout was left when the request was sent.
+void testTimeout () {
+    Fixture f;
+    f.client.setRequestWindow(1);
+
+    std::vector<barobo_rpc_ClientMessage> requests;
+    f.onRequest = [&] (const barobo_rpc_ClientMessage& message) {
+        requests.push_back(message);
+        // Let the first time out, and answer the second.
+        if (2 == requests.size()) {
+            f.reply(message.id, 3);
+        }
+    };
+    f.receive();
+
+    std::vector<int> completed;
+    rpc::asio::asyncFire(f.client, MethodIn::unaryWithResult{1}, milliseconds(50),
+        [&] (boost::system::error_code ec, MethodResult::unaryWithResult) {
+            assert(rpc::Status::TIMED_OUT == ec);
+            completed.push_back(0);
+        });
+    rpc::asio::asyncFire(f.client, MethodIn::unaryWithResult{2}, milliseconds(1000),
+        [&] (boost::system::error_code ec, MethodResult::unaryWithResult result) {
+            assert(!ec);
+            assert(3 == result.value);
+            completed.push_back(1);
+        });
+    rpc::asio::asyncFire(f.client, MethodIn::unaryWithResult{4}, milliseconds(20),
+        [&] (boost::system::error_code ec, MethodResult::unaryWithResult) {
+            assert(rpc::Status::TIMED_OUT == ec);
+            completed.push_back(2);
+            f.close();
+        });
+    f.ios.run();
+
+    assert((std::vector<int>{0, 1, 2}) == completed);
+    assert(2 == requests.size());
+    assert(requests[0].request.has_timeout && requests[0].request.timeout <= 50);
+    assert(requests[1].request.has_timeout && requests[1].request.timeout <= 1000 - 40);
+
+    auto stats = f.client.flowControlStats();
+    assert(0 == stats.outstanding);
+    assert(0 == stats.queueDepth);
+    assert(2 == stats.maxQueueDepth);
+    assert(2 == stats.queuedRequests);
+    assert(stats.maxWait >= milliseconds(40));
+}
+
+// Cancelling a request gives its slot to the next in line, and tells the
+// server to drop it.
+void testCancel () {
+    Fixture f;
+    f.client.setRequestWindow(1);
+    // Only a server known to understand CANCEL is sent one.
+    f.client.setServerVersions(rpc::Versions::create<barobo::Widget>());
+
+    std::vector<barobo_rpc_ClientMessage> requests;
+    f.onRequest = [&] (const barobo_rpc_ClientMessage& message) {
+        requests.push_back(message);
+        if (1 == requests.size()) {
+            f.client.cancel(message.id);
+        }
+        else if (barobo_rpc_Request_Type_FIRE == message.request.type) {
+            f.reply(message.id, 5);
+        }
+    };
+    f.receive();
+
+    std::vector<int> completed;
+    rpc::asio::asyncFire(f.client, MethodIn::unaryWithResult{1}, milliseconds(5000),
+        [&] (boost::system::error_code ec, MethodResult::unaryWithResult) {
+            assert(boost::asio::error::operation_aborted == ec);
+            completed.push_back(0);
+        });
+    rpc::asio::asyncFire(f.client, MethodIn::unaryWithResult{2}, milliseconds(5000),
+        [&] (boost::system::error_code ec, MethodResult::unaryWithResult result) {
+            assert(!ec);
+            assert(5 == result.value);
+            completed.push_back(1);
+            f.close();
+        });
+    f.ios.run();
+
+    assert((std::vector<int>{0, 1}) == completed);
+    assert(3 == requests.size());
+    auto cancelled = requests[0].id;
+    size_t cancels = 0;
+    for (auto& message : requests) {
+        if (barobo_rpc_Request_Type_CANCEL == message.request.type) {
+            assert(message.request.has_cancel && cancelled == message.request.cancel.id);
+            ++cancels;
+        }
+    }
+    assert(1 == cancels);
+
+    auto stats = f.client.flowControlStats();
+    assert(0 == stats.outstanding);
+    assert(1 == stats.queuedRequests);
+}
+
+int main () {
+    testAdmission();
+    testTimeout();
+    testCancel();
+    std::cout << "Flow control OK\n";
+    return 0;
+}
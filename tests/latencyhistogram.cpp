@@ -0,0 +1,135 @@
+// Test rpc::asio::LatencyHistogram: every value falls in a bucket whose
+// bounds contain it, buckets tile the range with the promised precision, and
+// valueAt reads quantiles back out of a snapshot.
+
+#include <rpc/asio/metrics.hpp>
+
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using rpc::asio::LatencyHistogram;
+
+using std::chrono::nanoseconds;
+
+const size_t kLastBucket = LatencyHistogram::kBuckets - 1;
+
+void checkValue (uint64_t ns) {
+    auto bucket = LatencyHistogram::bucketOf(ns);
+    assert(bucket < LatencyHistogram::kBuckets);
+    assert(LatencyHistogram::bucketLowerBound(bucket) <= ns);
+    assert(ns <= LatencyHistogram::bucketUpperBound(bucket));
+}
+
+// Small values are exact, the buckets are contiguous, and each is no wider
+// than 1/kSubBuckets of the values in it, up to the last, which takes
+// everything from 2^kMaxExponent ns on.
+void testBuckets () {
+    for (uint64_t ns = 0; ns < LatencyHistogram::kSubBuckets; ++ns) {
+        assert(ns == LatencyHistogram::bucketOf(ns));
+        assert(ns == LatencyHistogram::bucketLowerBound(size_t(ns)));
+        assert(ns == LatencyHistogram::bucketUpperBound(size_t(ns)));
+    }
+
+    for (size_t bucket = 0; bucket < LatencyHistogram::kBuckets; ++bucket) {
+        auto lower = LatencyHistogram::bucketLowerBound(bucket);
+        auto upper = LatencyHistogram::bucketUpperBound(bucket);
+        assert(lower <= upper);
+        assert(bucket == LatencyHistogram::bucketOf(lower));
+        assert(bucket == LatencyHistogram::bucketOf(upper));
+        if (bucket) {
+            assert(LatencyHistogram::bucketUpperBound(bucket - 1) + 1 == lower);
+        }
+        if (bucket >= LatencyHistogram::kSubBuckets && bucket < kLastBucket) {
+            assert((upper - lower + 1) * LatencyHistogram::kSubBuckets <= lower);
+        }
+    }
+
+    for (unsigned bit = 0; bit < 64; ++bit) {
+        auto power = uint64_t(1) << bit;
+        checkValue(power - 1);
+        checkValue(power);
+        checkValue(power + 1);
+        checkValue(power + power / 3);
+    }
+
+    auto overflow = uint64_t(1) << LatencyHistogram::kMaxExponent;
+    assert(kLastBucket == LatencyHistogram::bucketOf(overflow));
+    assert(kLastBucket == LatencyHistogram::bucketOf(UINT64_MAX));
+}
+
+// Quantiles are reported as the upper bound of their bucket, but never more
+// than the largest value recorded.
+void testValueAt () {
+    LatencyHistogram histogram;
+    auto empty = histogram.snapshot();
+    assert(0 == empty.count);
+    assert(0 == empty.meanNs());
+    assert(nanoseconds(0) == empty.valueAt(0.5));
+
+    for (int ns = 1; ns <= 100; ++ns) {
+        histogram.record(nanoseconds(ns));
+    }
+    auto s = histogram.snapshot();
+    assert(100 == s.count);
+    assert(5050 == s.sumNs);
+    assert(100 == s.maxNs);
+    assert(50.5 == s.meanNs());
+    assert(nanoseconds(1) == s.valueAt(0));
+    assert(nanoseconds(1) == s.valueAt(0.01));
+    assert(nanoseconds(LatencyHistogram::bucketUpperBound(LatencyHistogram::bucketOf(50)))
+        == s.valueAt(0.5));
+    assert(nanoseconds(LatencyHistogram::bucketUpperBound(LatencyHistogram::bucketOf(90)))
+        == s.valueAt(0.9));
+    assert(nanoseconds(100) == s.valueAt(0.999));
+    assert(nanoseconds(100) == s.valueAt(1));
+
+    // Negative durations count as zero, and overlong ones land in the last
+    // bucket, where the maximum stands in for its unbounded upper bound.
+    LatencyHistogram extremes;
+    extremes.record(nanoseconds(-5));
+    extremes.record(std::chrono::seconds(100));
+    s = extremes.snapshot();
+    assert(1 == s.buckets[0]);
+    assert(1 == s.buckets[kLastBucket]);
+    assert(nanoseconds(0) == s.valueAt(0.5));
+    assert(std::chrono::seconds(100) == s.valueAt(1));
+}
+
+// Recording may happen on several threads at once without losing samples.
+void testConcurrentRecord () {
+    LatencyHistogram histogram;
+    const int kThreads = 4;
+    const int kSamples = 10000;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; ++t) {
+        threads.emplace_back([&histogram, t] {
+            for (int i = 0; i < kSamples; ++i) {
+                histogram.record(nanoseconds(1000 * (t + 1)));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto s = histogram.snapshot();
+    assert(kThreads * kSamples == s.count);
+    assert(uint64_t(kSamples) * 1000 * (1 + 2 + 3 + 4) == s.sumNs);
+    assert(uint64_t(1000 * kThreads) == s.maxNs);
+    uint64_t total = 0;
+    for (auto n : s.buckets) {
+        total += n;
+    }
+    assert(s.count == total);
+}
+
+int main () {
+    testBuckets();
+    testValueAt();
+    testConcurrentRecord();
+    std::cout << "LatencyHistogram OK\n";
+    return 0;
+}
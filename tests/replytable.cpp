@@ -0,0 +1,148 @@
+// Test rpc::asio::ReplyTable against std::map.
+
+#include "rpc/asio/replytable.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <random>
+
+using Table = rpc::asio::ReplyTable<int>;
+
+void check (Table& table, const std::map<uint32_t, int>& model) {
+    assert(table.size() == model.size());
+    for (auto& kv : model) {
+        auto value = table.find(kv.first);
+        assert(value && *value == kv.second);
+    }
+}
+
+// A cluster of entries which probes past the end of the slot array, and is
+// then erased from the front, so each erase has to shift entries back across
+// the wraparound.
+void testWraparoundCluster () {
+    auto table = Table{8};
+    auto model = std::map<uint32_t, int>{};
+    // 6 and 14 hash to slot 6, 7 and 15 to slot 7, so 14 lands in slot 0 and
+    // 15 in slot 1.
+    for (uint32_t id : { 6, 7, 14, 15 }) {
+        assert(table.insert(id, int(id) * 10));
+        model[id] = int(id) * 10;
+    }
+    check(table, model);
+
+    int value = 0;
+    assert(table.take(6, value) && 60 == value);
+    model.erase(6);
+    check(table, model);
+    assert(!table.find(6));
+
+    assert(table.take(7, value) && 70 == value);
+    model.erase(7);
+    check(table, model);
+
+    assert(!table.take(7, value));
+    assert(table.insert(22, 220));
+    model[22] = 220;
+    check(table, model);
+}
+
+// Erasing from the middle of a probe cluster must not strand the entries
+// after it.
+void testEraseInsideCluster () {
+    auto table = Table{16};
+    auto model = std::map<uint32_t, int>{};
+    // All of these hash to slot 3.
+    for (uint32_t id : { 3, 19, 35, 51 }) {
+        assert(table.insert(id, int(id)));
+        model[id] = int(id);
+    }
+    // 4 hashes to slot 4, which 19 already occupies, so it joins the cluster.
+    assert(table.insert(4, 4));
+    model[4] = 4;
+    check(table, model);
+
+    int value = 0;
+    assert(table.take(19, value) && 19 == value);
+    model.erase(19);
+    check(table, model);
+
+    assert(table.take(3, value) && 3 == value);
+    model.erase(3);
+    check(table, model);
+
+    assert(!table.insert(51, 0));
+    check(table, model);
+}
+
+// Request IDs wrap from UINT32_MAX to zero.
+void testIdWraparound () {
+    auto table = Table{4};
+    auto model = std::map<uint32_t, int>{};
+    auto id = uint32_t(UINT32_MAX - 5);
+    for (int i = 0; i < 12; ++i, ++id) {
+        assert(table.insert(id, i));
+        model[id] = i;
+    }
+    check(table, model);
+    int value = 0;
+    assert(table.take(UINT32_MAX, value) && 5 == value);
+    model.erase(UINT32_MAX);
+    assert(table.take(0, value) && 6 == value);
+    model.erase(0);
+    check(table, model);
+}
+
+// Doubling keeps every entry.
+void testGrowth () {
+    auto table = Table{2};
+    auto model = std::map<uint32_t, int>{};
+    for (uint32_t id = 0; id < 1000; id += 3) {
+        assert(table.insert(id, int(id)));
+        model[id] = int(id);
+        check(table, model);
+    }
+
+    auto drained = std::map<uint32_t, int>{};
+    table.drain([&] (uint32_t id, int value) { drained[id] = value; });
+    assert(drained == model);
+    assert(table.empty());
+    assert(!table.find(3));
+}
+
+// Sequential IDs, taken out of order, as a client with requests of varying
+// latency would.
+void testRandom () {
+    auto rng = std::mt19937{42};
+    auto table = Table{};
+    auto model = std::map<uint32_t, int>{};
+    auto next = uint32_t(UINT32_MAX - 1000);
+    for (int i = 0; i < 100000; ++i) {
+        if (model.size() < 50 && (model.empty() || rng() % 2)) {
+            assert(table.insert(next, i));
+            model[next++] = i;
+        }
+        else {
+            auto iter = model.begin();
+            std::advance(iter, rng() % model.size());
+            int value = 0;
+            assert(table.take(iter->first, value) && value == iter->second);
+            model.erase(iter);
+        }
+        if (!(i % 97)) {
+            check(table, model);
+        }
+    }
+    check(table, model);
+}
+
+int main () {
+    testWraparoundCluster();
+    testEraseInsideCluster();
+    testIdWraparound();
+    testGrowth();
+    testRandom();
+    std::cout << "ReplyTable OK\n";
+    return 0;
+}
@@ -0,0 +1,209 @@
+// Test rewriting request IDs and timeouts in encoded messages, as proxies
+// forwarding frames do: rpc::rewriteRequestId, rpc::rewriteInReplyTo,
+// rpc::rewriteTimeout, and rpc::asio::rewriteFrameId.
+
+#include "rpc/asio/proxy.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+using Bytes = std::vector<uint8_t>;
+
+void putVarint (Bytes& out, uint32_t value) {
+    while (value > 0x7f) {
+        out.push_back(uint8_t(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back(uint8_t(value));
+}
+
+void putVarintField (Bytes& out, uint32_t number, uint32_t value) {
+    putVarint(out, (number << 3) | PB_WT_VARINT);
+    putVarint(out, value);
+}
+
+void putDelimitedField (Bytes& out, uint32_t number, const Bytes& contents) {
+    putVarint(out, (number << 3) | PB_WT_STRING);
+    putVarint(out, uint32_t(contents.size()));
+    out.insert(out.end(), contents.begin(), contents.end());
+}
+
+// A DISCONNECT request, which has no payload to get in the way, with an
+// optional timeout.
+Bytes clientMessage (uint32_t id, bool hasTimeout = false, uint32_t timeout = 0) {
+    Bytes request;
+    putVarintField(request, barobo_rpc_Request_type_tag, barobo_rpc_Request_Type_DISCONNECT);
+    if (hasTimeout) {
+        putVarintField(request, barobo_rpc_Request_timeout_tag, timeout);
+    }
+    Bytes message;
+    putVarintField(message, barobo_rpc_ClientMessage_id_tag, id);
+    putDelimitedField(message, barobo_rpc_ClientMessage_request_tag, request);
+    return message;
+}
+
+// A STATUS reply, which is followed by the reply itself, so a rewrite which
+// grows the inReplyTo has to move a tail along.
+Bytes serverMessage (bool hasInReplyTo, uint32_t inReplyTo = 0) {
+    Bytes reply;
+    putVarintField(reply, barobo_rpc_Reply_type_tag, barobo_rpc_Reply_Type_STATUS);
+    Bytes status;
+    putVarintField(status, barobo_rpc_Reply_Status_value_tag, barobo_rpc_Status_INTERFACE_ERROR);
+    putDelimitedField(reply, barobo_rpc_Reply_status_tag, status);
+    Bytes message;
+    putVarintField(message, barobo_rpc_ServerMessage_type_tag, barobo_rpc_ServerMessage_Type_REPLY);
+    if (hasInReplyTo) {
+        putVarintField(message, barobo_rpc_ServerMessage_inReplyTo_tag, inReplyTo);
+    }
+    putDelimitedField(message, barobo_rpc_ServerMessage_reply_tag, reply);
+    return message;
+}
+
+// Rewrite a message the way the proxy does, with kMaxIdGrowth bytes of room.
+Bytes rewriteId (void (*rewrite)(uint8_t*, size_t, uint32_t, size_t&, rpc::Status&),
+        Bytes message, uint32_t id, rpc::Status& status) {
+    auto size = message.size();
+    message.resize(size + rpc::kMaxIdGrowth, 0xee);
+    size_t newSize;
+    rewrite(message.data(), size, id, newSize, status);
+    assert(newSize <= message.size());
+    message.resize(newSize);
+    return message;
+}
+
+uint32_t requestIdOf (const Bytes& message) {
+    barobo_rpc_ClientMessage decoded;
+    rpc::PayloadView payload;
+    rpc::Status status;
+    rpc::decode(decoded, payload, message.data(), message.size(), status);
+    assert(!rpc::hasError(status));
+    return decoded.id;
+}
+
+uint32_t inReplyToOf (const Bytes& message) {
+    uint32_t type;
+    bool hasInReplyTo;
+    uint32_t inReplyTo;
+    assert(rpc::peekServerMessage(message.data(), message.size(), type, hasInReplyTo, inReplyTo));
+    assert(barobo_rpc_ServerMessage_Type_REPLY == type && hasInReplyTo);
+    return inReplyTo;
+}
+
+// An ID which needs more bytes than the old one moves the rest of the message
+// along; one which needs fewer is padded, so the message keeps its length.
+void testRequestId () {
+    rpc::Status status;
+    // From one byte to five uses all of kMaxIdGrowth.
+    for (uint32_t id : { 0x80u, 0x4000u, 0x200000u, 0xffffffffu }) {
+        auto rewritten = rewriteId(&rpc::rewriteRequestId, clientMessage(1), id, status);
+        assert(!rpc::hasError(status));
+        assert(rewritten == clientMessage(id));
+        assert(requestIdOf(rewritten) == id);
+    }
+
+    auto original = clientMessage(0xffffffff);
+    auto rewritten = rewriteId(&rpc::rewriteRequestId, original, 1, status);
+    assert(!rpc::hasError(status));
+    assert(rewritten.size() == original.size());
+    assert(requestIdOf(rewritten) == 1);
+
+    // The timeout after the ID survives the move.
+    rewritten = rewriteId(&rpc::rewriteRequestId, clientMessage(2, true, 300), 0x10000000, status);
+    assert(!rpc::hasError(status));
+    assert(rewritten == clientMessage(0x10000000, true, 300));
+}
+
+void testInReplyTo () {
+    rpc::Status status;
+    for (uint32_t id : { 0x80u, 0xffffffffu }) {
+        auto rewritten = rewriteId(&rpc::rewriteInReplyTo, serverMessage(true, 7), id, status);
+        assert(!rpc::hasError(status));
+        assert(rewritten == serverMessage(true, id));
+        assert(inReplyToOf(rewritten) == id);
+    }
+
+    auto original = serverMessage(true, 0x200000);
+    auto rewritten = rewriteId(&rpc::rewriteInReplyTo, original, 3, status);
+    assert(!rpc::hasError(status));
+    assert(rewritten.size() == original.size());
+    assert(inReplyToOf(rewritten) == 3);
+}
+
+// Without the field there is nothing to rewrite, and the message is left
+// alone.
+void testMissingField () {
+    rpc::Status status;
+    auto original = serverMessage(false);
+    auto rewritten = rewriteId(&rpc::rewriteInReplyTo, original, 9, status);
+    assert(rpc::Status::PROTOCOL_ERROR == status);
+    assert(rewritten == original);
+
+    // A truncated message has no ID we can find either.
+    auto truncated = clientMessage(0x4000);
+    truncated.resize(2);
+    rewritten = rewriteId(&rpc::rewriteRequestId, truncated, 9, status);
+    assert(rpc::Status::PROTOCOL_ERROR == status);
+    assert(rewritten == truncated);
+}
+
+void testTimeout () {
+    rpc::Status status;
+
+    auto message = clientMessage(1, true, 300);
+    rpc::rewriteTimeout(message.data(), message.size(), 5, status);
+    assert(!rpc::hasError(status));
+    assert(message.size() == clientMessage(1, true, 300).size());
+    barobo_rpc_ClientMessage decoded;
+    rpc::PayloadView payload;
+    rpc::decode(decoded, payload, message.data(), message.size(), status);
+    assert(!rpc::hasError(status));
+    assert(decoded.request.has_timeout && 5 == decoded.request.timeout);
+
+    // A timeout which would need more bytes than the old one can't be
+    // written without growing the request's length prefix.
+    message = clientMessage(1, true, 100);
+    auto original = message;
+    rpc::rewriteTimeout(message.data(), message.size(), 1000, status);
+    assert(rpc::Status::ENCODING_FAILURE == status);
+    assert(message == original);
+
+    // Requests without a timeout keep it that way.
+    message = clientMessage(1);
+    original = message;
+    rpc::rewriteTimeout(message.data(), message.size(), 5, status);
+    assert(!rpc::hasError(status));
+    assert(message == original);
+}
+
+void testFrameId () {
+    rpc::asio::PooledBuffer frame;
+    frame.bytes = clientMessage(1);
+    auto status = rpc::asio::rewriteFrameId(frame, 0xffffffff, &rpc::rewriteRequestId);
+    assert(!rpc::hasError(status));
+    assert(frame.bytes == clientMessage(0xffffffff));
+
+    frame.bytes = serverMessage(true, 0xffffffff);
+    status = rpc::asio::rewriteFrameId(frame, 1, &rpc::rewriteInReplyTo);
+    assert(!rpc::hasError(status));
+    assert(frame.bytes.size() == serverMessage(true, 0xffffffff).size());
+    assert(inReplyToOf(frame.bytes) == 1);
+
+    // On failure the frame is left as it was, not with kMaxIdGrowth bytes of
+    // junk on the end.
+    frame.bytes = serverMessage(false);
+    status = rpc::asio::rewriteFrameId(frame, 1, &rpc::rewriteInReplyTo);
+    assert(rpc::Status::PROTOCOL_ERROR == status);
+    assert(frame.bytes == serverMessage(false));
+}
+
+int main () {
+    testRequestId();
+    testInReplyTo();
+    testMissingField();
+    testTimeout();
+    testFrameId();
+    std::cout << "Rewrite OK\n";
+    return 0;
+}
@@ -0,0 +1,291 @@
+// Test rpc::asio::ShmMessageQueue: messages go through whole and in order,
+// including those which fill the ring or wrap around its end, and closing
+// either side, or the peer's process dying, fails what it should.
+
+#include <rpc/asio/shmmessagequeue.hpp>
+
+#include <boost/asio/io_service.hpp>
+
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+using Bytes = std::vector<uint8_t>;
+using Shm = rpc::asio::ShmMessageQueue;
+
+namespace error = boost::asio::error;
+
+const size_t kMaxMessageSize = 64 * 1024 - 4;
+
+std::string shmPath () {
+    static int n = 0;
+    return "/dev/shm/rpc-shm-test-" + std::to_string(getpid()) + "-" + std::to_string(n++);
+}
+
+void connect (Shm& a, Shm& b) {
+    auto path = shmPath();
+    boost::system::error_code ec;
+    a.create(path, ec);
+    assert(!ec);
+    b.open(path, ec);
+    assert(!ec);
+    unlink(path.c_str());
+}
+
+Bytes message (size_t size, uint8_t seed) {
+    Bytes bytes(size);
+    for (size_t i = 0; i < size; ++i) {
+        bytes[i] = uint8_t(seed + i * 7);
+    }
+    return bytes;
+}
+
+// Run handlers until done is set. The queues' threads post completions from
+// outside, so the io_service may briefly run out of work.
+void runUntil (boost::asio::io_service& ios, const bool& done) {
+    while (!done) {
+        if (!ios.run_one()) {
+            ios.reset();
+        }
+    }
+}
+
+boost::system::error_code send (Shm& queue, const Bytes& bytes) {
+    boost::system::error_code result;
+    bool done = false;
+    queue.asyncSend(boost::asio::buffer(bytes), [&] (boost::system::error_code ec) {
+        result = ec;
+        done = true;
+    });
+    runUntil(queue.get_io_service(), done);
+    return result;
+}
+
+boost::system::error_code receive (Shm& queue, Bytes& bytes, size_t capacity) {
+    boost::system::error_code result;
+    bool done = false;
+    bytes.resize(capacity);
+    queue.asyncReceive(boost::asio::buffer(bytes), [&] (boost::system::error_code ec, size_t size) {
+        result = ec;
+        bytes.resize(size);
+        done = true;
+    });
+    runUntil(queue.get_io_service(), done);
+    return result;
+}
+
+void checkDelivery (Shm& from, Shm& to, const Bytes& bytes) {
+    assert(!send(from, bytes));
+    Bytes received;
+    assert(!receive(to, received, kMaxMessageSize));
+    assert(bytes == received);
+}
+
+// Messages of all sizes, both ways.
+void testRoundTrip () {
+    boost::asio::io_service ios;
+    Shm a{ios};
+    Shm b{ios};
+    assert(!a.is_open());
+    connect(a, b);
+    assert(a.is_open() && b.is_open());
+
+    for (auto size : { size_t(0), size_t(1), size_t(3), size_t(1000), kMaxMessageSize }) {
+        checkDelivery(a, b, message(size, 1));
+        checkDelivery(b, a, message(size, 2));
+    }
+
+    // Several sent before any is received arrive in order.
+    for (uint8_t i = 0; i < 10; ++i) {
+        assert(!send(a, message(100 + i, i)));
+    }
+    for (uint8_t i = 0; i < 10; ++i) {
+        Bytes received;
+        assert(!receive(b, received, kMaxMessageSize));
+        assert(message(100 + i, i) == received);
+    }
+
+    boost::system::error_code ec;
+    a.close(ec);
+    b.close(ec);
+}
+
+// Messages of odd sizes wrap around the end of the ring at every alignment,
+// a send which does not fit waits for the receiver to make room, and
+// messages too large for the ring or for the receive buffer are refused.
+void testWrap () {
+    boost::asio::io_service ios;
+    Shm a{ios};
+    Shm b{ios};
+    connect(a, b);
+
+    for (uint8_t i = 0; i < 20; ++i) {
+        checkDelivery(a, b, message(40000 + i, i));
+    }
+
+    // The ring holds one largest message, so a second waits until the first
+    // has been read.
+    auto first = message(kMaxMessageSize, 3);
+    auto second = message(kMaxMessageSize, 4);
+    assert(!send(a, first));
+    bool sent = false;
+    a.asyncSend(boost::asio::buffer(second), [&] (boost::system::error_code ec) {
+        assert(!ec);
+        sent = true;
+    });
+    ios.poll();
+    ios.reset();
+    assert(!sent);
+    Bytes received;
+    assert(!receive(b, received, kMaxMessageSize));
+    assert(first == received);
+    runUntil(ios, sent);
+    assert(!receive(b, received, kMaxMessageSize));
+    assert(second == received);
+
+    assert(error::message_size == send(a, message(kMaxMessageSize + 1, 5)));
+
+    // A message too large for the receive buffer is dropped, and the next
+    // comes through.
+    assert(!send(a, message(100, 6)));
+    assert(!send(a, message(10, 7)));
+    assert(error::message_size == receive(b, received, 99));
+    assert(received.empty());
+    assert(!receive(b, received, 99));
+    assert(message(10, 7) == received);
+
+    boost::system::error_code ec;
+    a.close(ec);
+    b.close(ec);
+}
+
+// Closing one side: its own pending operations are aborted, and it can no
+// longer be used; the peer reads what was sent before it sees eof, and its
+// sends fail.
+void testClose () {
+    boost::asio::io_service ios;
+    Shm a{ios};
+    Shm b{ios};
+    connect(a, b);
+
+    // Receives are not queued.
+    Bytes first(10);
+    bool aborted = false;
+    a.asyncReceive(boost::asio::buffer(first), [&] (boost::system::error_code ec, size_t) {
+        assert(error::operation_aborted == ec);
+        aborted = true;
+    });
+    Bytes received;
+    assert(error::bad_descriptor == receive(a, received, 10));
+
+    assert(!send(a, message(10, 1)));
+    assert(!send(a, message(20, 2)));
+    boost::system::error_code ec;
+    a.close(ec);
+    assert(!ec);
+    runUntil(ios, aborted);
+    assert(!a.is_open());
+    a.close(ec);
+    assert(!ec);
+    assert(error::bad_descriptor == send(a, message(10, 1)));
+    assert(error::bad_descriptor == receive(a, received, 10));
+
+    assert(!receive(b, received, 100));
+    assert(message(10, 1) == received);
+    assert(!receive(b, received, 100));
+    assert(message(20, 2) == received);
+    assert(error::eof == receive(b, received, 100));
+    assert(error::broken_pipe == send(b, message(10, 3)));
+    b.close(ec);
+
+    // A pending receive hears of the close too.
+    connect(a, b);
+    bool eof = false;
+    b.asyncReceive(boost::asio::buffer(first), [&] (boost::system::error_code ec, size_t) {
+        assert(error::eof == ec);
+        eof = true;
+    });
+    a.close(ec);
+    runUntil(ios, eof);
+    b.close(ec);
+}
+
+// Segments which are missing, already open, or not yet made are refused.
+void testConnect () {
+    boost::asio::io_service ios;
+    Shm a{ios};
+    Shm b{ios};
+    Shm c{ios};
+    auto path = shmPath();
+    boost::system::error_code ec;
+
+    b.open(path, ec);
+    assert(ENOENT == ec.value());
+    assert(!b.is_open());
+
+    a.create(path, ec);
+    assert(!ec);
+    a.create(path, ec);
+    assert(error::already_open == ec);
+    b.open(path, ec);
+    assert(!ec);
+    c.open(path, ec);
+    assert(EADDRINUSE == ec.value());
+    assert(!c.is_open());
+    unlink(path.c_str());
+
+    checkDelivery(a, b, message(10, 1));
+    a.close(ec);
+    b.close(ec);
+}
+
+// A peer whose process exits without closing its queue is noticed.
+void testPeerDied () {
+    auto path = shmPath();
+    // Fork before this process has any queue threads.
+    auto pid = fork();
+    assert(-1 != pid);
+    if (!pid) {
+        boost::asio::io_service ios;
+        Shm peer{ios};
+        boost::system::error_code ec;
+        do {
+            usleep(1000);
+            peer.open(path, ec);
+        } while (ec);
+        assert(!send(peer, message(10, 1)));
+        _exit(0);
+    }
+
+    boost::asio::io_service ios;
+    Shm queue{ios};
+    boost::system::error_code ec;
+    queue.create(path, ec);
+    assert(!ec);
+    Bytes received;
+    assert(!receive(queue, received, 100));
+    assert(message(10, 1) == received);
+    int status;
+    assert(pid == waitpid(pid, &status, 0));
+    unlink(path.c_str());
+
+    assert(error::eof == receive(queue, received, 100));
+    assert(error::broken_pipe == send(queue, message(10, 2)));
+    queue.close(ec);
+}
+
+int main () {
+    testPeerDied();
+    testRoundTrip();
+    testWrap();
+    testClose();
+    testConnect();
+    std::cout << "ShmMessageQueue OK\n";
+    return 0;
+}
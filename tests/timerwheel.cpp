@@ -0,0 +1,132 @@
+// Test rpc::asio::TimerWheel: every entry must expire at exactly its
+// deadline, however far away the deadline is and however time advances.
+
+#include "rpc/asio/timerwheel.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <random>
+
+using Wheel = rpc::asio::TimerWheel<int>;
+
+// Advance the wheel and check that it expires exactly the entries the model
+// says are due, each on its deadline.
+void advance (Wheel& wheel, std::multimap<uint64_t, int>& model, uint64_t now) {
+    wheel.advance(now, [&] (int key, uint64_t deadline) {
+        assert(wheel.now() == deadline);
+        auto range = model.equal_range(deadline);
+        auto iter = range.first;
+        while (iter != range.second && iter->second != key) {
+            ++iter;
+        }
+        assert(iter != range.second);
+        model.erase(iter);
+    });
+    assert(wheel.now() == now);
+    assert(model.empty() || model.begin()->first > now);
+    assert(wheel.empty() == model.empty());
+}
+
+// Deadlines on every level, each reached in one jump and in single ticks.
+void testLevels () {
+    const uint64_t deadlines[] = {
+        1, 63, 64, 65, 100, 4095, 4096, 4097, 5000, 262143, 262144, 300000,
+        Wheel::kHorizon - 1
+    };
+    for (auto deadline : deadlines) {
+        auto wheel = Wheel{};
+        auto model = std::multimap<uint64_t, int>{};
+        assert(deadline == wheel.insert(1, deadline));
+        model.emplace(deadline, 1);
+        assert(wheel.nextEvent() <= deadline);
+        advance(wheel, model, deadline - 1);
+        assert(!wheel.empty());
+        advance(wheel, model, deadline);
+        assert(wheel.empty());
+    }
+
+    auto wheel = Wheel{};
+    auto model = std::multimap<uint64_t, int>{};
+    for (auto deadline : deadlines) {
+        if (deadline < 400000) {
+            wheel.insert(int(deadline), deadline);
+            model.emplace(deadline, int(deadline));
+        }
+    }
+    for (uint64_t now = 1; now <= 400000; ++now) {
+        advance(wheel, model, now);
+    }
+    assert(wheel.empty());
+}
+
+// Past deadlines expire on the next tick; those beyond the last level are
+// clamped to it.
+void testClamping () {
+    auto wheel = Wheel{1000};
+    auto model = std::multimap<uint64_t, int>{};
+    assert(1001 == wheel.insert(1, 10));
+    assert(1001 == wheel.insert(2, 1000));
+    assert(1000 + Wheel::kHorizon - 1 == wheel.insert(3, 1000 + 2 * Wheel::kHorizon));
+    model.emplace(1001, 1);
+    model.emplace(1001, 2);
+    model.emplace(1000 + Wheel::kHorizon - 1, 3);
+    assert(1001 == wheel.nextEvent());
+    advance(wheel, model, 1001);
+    advance(wheel, model, 1000 + Wheel::kHorizon);
+    assert(wheel.empty());
+}
+
+// A wheel which starts partway through its higher level buckets, so their
+// indices wrap around before the entries in them come due.
+void testWraparound () {
+    const uint64_t start = 3 * Wheel::kHorizon - 70;
+    auto wheel = Wheel{start};
+    auto model = std::multimap<uint64_t, int>{};
+    const uint64_t offsets[] = { 5, 69, 70, 71, 134, 4000, 4200, 70000, 270000 };
+    for (auto offset : offsets) {
+        wheel.insert(int(offset), start + offset);
+        model.emplace(start + offset, int(offset));
+    }
+    while (!model.empty()) {
+        auto next = wheel.nextEvent();
+        assert(next > wheel.now() && next <= model.begin()->first);
+        advance(wheel, model, next);
+    }
+}
+
+// Random deadlines, inserted as time goes by, with time advancing by random
+// amounts.
+void testRandom () {
+    auto rng = std::mt19937_64{7};
+    auto wheel = Wheel{rng() % Wheel::kHorizon};
+    auto model = std::multimap<uint64_t, int>{};
+    for (int i = 0; i < 20000; ++i) {
+        uint64_t delay = 0;
+        switch (rng() % 4) {
+            case 0: delay = rng() % 64; break;
+            case 1: delay = rng() % 4096; break;
+            case 2: delay = rng() % 262144; break;
+            default: delay = rng() % Wheel::kHorizon; break;
+        }
+        auto deadline = wheel.insert(i, wheel.now() + delay);
+        model.emplace(deadline, i);
+        if (!(rng() % 3)) {
+            advance(wheel, model, wheel.now() + rng() % (rng() % 2 ? 100 : 100000));
+        }
+    }
+    while (!model.empty()) {
+        advance(wheel, model, wheel.nextEvent());
+    }
+    assert(wheel.empty());
+}
+
+int main () {
+    testLevels();
+    testClamping();
+    testWraparound();
+    testRandom();
+    std::cout << "TimerWheel OK\n";
+    return 0;
+}
@@ -0,0 +1,263 @@
+// Test the single-pass encoders, rpc::encodeFire, rpc::encodeResult, and
+// rpc::encodeBroadcast, against pb_encode of the whole barobo_rpc_ClientMessage
+// or barobo_rpc_ServerMessage, and decoding a barobo_rpc_ClientMessage in
+// place against pb_decode.
+
+#include "gen-widget.pb.hpp"
+#include "gen-fixedlayout.pb.hpp"
+
+#include <rpc/message.hpp>
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+using Bytes = std::vector<uint8_t>;
+
+using MethodIn = rpc::MethodIn<barobo::Widget>;
+using MethodResult = rpc::MethodResult<barobo::Widget>;
+using Broadcast = rpc::Broadcast<barobo::Widget>;
+
+using Scalars = rpc::MethodIn<barobo::FixedLayoutTest>::scalars;
+using Tags = rpc::Broadcast<barobo::FixedLayoutTest>::tags;
+
+const uint32_t kIds[] = { 0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 0xffffffff };
+
+// Encode a component with nanopb, even if it has a FixedLayout codec.
+template <class Component, class Payload>
+void pbPayload (const Component& component, Payload& payload) {
+    rpc::Status status;
+    rpc::_::encode(&component, rpc::_::pbFieldPtr<Component>(),
+        payload.bytes, sizeof(payload.bytes), payload.size, status);
+    assert(!rpc::hasError(status));
+}
+
+template <class NanopbStruct, size_t N>
+Bytes pbEncode (const NanopbStruct& message) {
+    uint8_t bytes[N];
+    pb_size_t nWritten;
+    rpc::Status status;
+    rpc::encode(message, bytes, sizeof(bytes), nWritten, status);
+    assert(!rpc::hasError(status));
+    return Bytes(bytes, bytes + nWritten);
+}
+
+Bytes pbEncode (const barobo_rpc_ClientMessage& message) {
+    return pbEncode<barobo_rpc_ClientMessage, barobo_rpc_ClientMessage_size>(message);
+}
+
+Bytes pbEncode (const barobo_rpc_ServerMessage& message) {
+    return pbEncode<barobo_rpc_ServerMessage, barobo_rpc_ServerMessage_size>(message);
+}
+
+template <class Method>
+barobo_rpc_ClientMessage fireMessage (uint32_t requestId, const Method& args, uint32_t timeout) {
+    barobo_rpc_ClientMessage message;
+    memset(&message, 0, sizeof(message));
+    message.id = requestId;
+    message.request.type = barobo_rpc_Request_Type_FIRE;
+    message.request.has_fire = true;
+    message.request.fire.id = rpc::componentId(args);
+    pbPayload(args, message.request.fire.payload);
+    if (rpc::kNoTimeout != timeout) {
+        message.request.has_timeout = true;
+        message.request.timeout = timeout;
+    }
+    return message;
+}
+
+template <class Method>
+void checkFire (const Method& args) {
+    for (auto requestId : kIds) {
+        for (auto timeout : { rpc::kNoTimeout, 1u, 300u, 0xffffffffu }) {
+            uint8_t bytes[barobo_rpc_ClientMessage_size];
+            pb_size_t nWritten;
+            rpc::Status status;
+            rpc::encodeFire(requestId, args, timeout, bytes, sizeof(bytes), nWritten, status);
+            assert(!rpc::hasError(status));
+            assert(Bytes(bytes, bytes + nWritten)
+                == pbEncode(fireMessage(requestId, args, timeout)));
+        }
+    }
+}
+
+template <class Result>
+void checkResult (uint32_t componentId, const Result& result) {
+    for (auto inReplyTo : kIds) {
+        uint8_t bytes[barobo_rpc_ServerMessage_size];
+        pb_size_t nWritten;
+        rpc::Status status;
+        rpc::encodeResult(inReplyTo, componentId, result, bytes, sizeof(bytes), nWritten, status);
+        assert(!rpc::hasError(status));
+
+        barobo_rpc_ServerMessage message;
+        memset(&message, 0, sizeof(message));
+        message.type = barobo_rpc_ServerMessage_Type_REPLY;
+        message.has_reply = true;
+        message.reply.type = barobo_rpc_Reply_Type_RESULT;
+        message.reply.has_result = true;
+        message.reply.result.id = componentId;
+        pbPayload(result, message.reply.result.payload);
+        message.has_inReplyTo = true;
+        message.inReplyTo = inReplyTo;
+        assert(Bytes(bytes, bytes + nWritten) == pbEncode(message));
+    }
+}
+
+template <class B>
+void checkBroadcast (const B& args) {
+    uint8_t bytes[barobo_rpc_ServerMessage_size];
+    pb_size_t nWritten;
+    rpc::Status status;
+    rpc::encodeBroadcast(args, bytes, sizeof(bytes), nWritten, status);
+    assert(!rpc::hasError(status));
+
+    barobo_rpc_ServerMessage message;
+    memset(&message, 0, sizeof(message));
+    message.type = barobo_rpc_ServerMessage_Type_BROADCAST;
+    message.has_broadcast = true;
+    message.broadcast.id = rpc::componentId(args);
+    pbPayload(args, message.broadcast.payload);
+    assert(Bytes(bytes, bytes + nWritten) == pbEncode(message));
+}
+
+Scalars largeScalars () {
+    Scalars m;
+    m.i32 = std::numeric_limits<int32_t>::min();
+    m.i64 = std::numeric_limits<int64_t>::min();
+    m.u32 = std::numeric_limits<uint32_t>::max();
+    m.u64 = std::numeric_limits<uint64_t>::max();
+    m.s32 = std::numeric_limits<int32_t>::min();
+    m.s64 = std::numeric_limits<int64_t>::min();
+    m.level = barobo_FixedLayoutTest_Level_LOW;
+    m.flag = true;
+    m.real = -0.25f;
+    m.f32 = 0xdeadbeef;
+    m.sf32 = -2;
+    m.f64 = 0x0123456789abcdef;
+    m.sf64 = -3;
+    return m;
+}
+
+// Components encoded by nanopb, and by FixedLayout codecs, both empty and not.
+void testEncoders () {
+    checkFire(MethodIn::nullaryNoResult{});
+    checkFire(MethodIn::unaryWithResult{0.5f});
+    checkFire(Scalars());
+    checkFire(largeScalars());
+
+    checkResult(rpc::componentId(MethodIn::nullaryNoResult{}), MethodResult::nullaryNoResult{});
+    checkResult(rpc::componentId(MethodIn::unaryWithResult{}), MethodResult::unaryWithResult{-2.5f});
+    checkResult(rpc::componentId(Scalars()), rpc::MethodResult<barobo::FixedLayoutTest>::scalars());
+
+    checkBroadcast(Broadcast::broadcast{1.5f});
+    checkBroadcast(Tags{300, -3, -1});
+
+    // A buffer one byte short of the message is refused, not overrun.
+    uint8_t bytes[barobo_rpc_ClientMessage_size];
+    pb_size_t nWritten;
+    rpc::Status status;
+    auto expected = pbEncode(fireMessage(1, largeScalars(), 300));
+    rpc::encodeFire(1, largeScalars(), 300, bytes, expected.size() - 1, nWritten, status);
+    assert(rpc::Status::ENCODING_FAILURE == status);
+}
+
+barobo_rpc_ClientMessage requestMessage (uint32_t requestId, barobo_rpc_Request_Type type) {
+    barobo_rpc_ClientMessage message;
+    memset(&message, 0, sizeof(message));
+    message.id = requestId;
+    message.request.type = type;
+    return message;
+}
+
+bool within (rpc::PayloadView view, const Bytes& bytes) {
+    return view.bytes >= bytes.data() && view.bytes + view.size <= bytes.data() + bytes.size();
+}
+
+// Decode an encoded message both ways, and check that they agree.
+void checkDecode (const Bytes& bytes) {
+    barobo_rpc_ClientMessage expected;
+    rpc::Status status;
+    rpc::decode(expected, bytes.data(), bytes.size(), status);
+    assert(!rpc::hasError(status));
+
+    barobo_rpc_ClientMessage actual;
+    rpc::PayloadView payload;
+    rpc::decode(actual, payload, bytes.data(), bytes.size(), status);
+    assert(!rpc::hasError(status));
+
+    assert(actual.id == expected.id);
+    assert(actual.request.type == expected.request.type);
+    assert(actual.request.has_fire == expected.request.has_fire);
+    if (expected.request.has_fire) {
+        assert(actual.request.fire.id == expected.request.fire.id);
+        // The payload is left where it is, not copied.
+        assert(0 == actual.request.fire.payload.size);
+        assert(within(payload, bytes));
+        auto& pbPayload = expected.request.fire.payload;
+        assert(Bytes(payload.bytes, payload.bytes + payload.size)
+            == Bytes(pbPayload.bytes, pbPayload.bytes + pbPayload.size));
+    }
+    else {
+        assert(!payload.bytes && !payload.size);
+    }
+    assert(actual.request.has_subscription == expected.request.has_subscription);
+    assert(actual.request.subscription.id == expected.request.subscription.id);
+    assert(actual.request.has_cancel == expected.request.has_cancel);
+    assert(actual.request.cancel.id == expected.request.cancel.id);
+    assert(actual.request.has_timeout == expected.request.has_timeout);
+    assert(actual.request.timeout == expected.request.timeout);
+
+    // Every truncation of the message is malformed, and both decoders say so.
+    for (size_t size = 0; size < bytes.size(); ++size) {
+        rpc::decode(expected, bytes.data(), size, status);
+        assert(rpc::Status::DECODING_FAILURE == status);
+        rpc::decode(actual, payload, bytes.data(), size, status);
+        assert(rpc::Status::DECODING_FAILURE == status);
+    }
+}
+
+void testDecode () {
+    for (auto requestId : kIds) {
+        // FIRE requests, with and without a timeout.
+        checkDecode(pbEncode(fireMessage(requestId, MethodIn::nullaryNoResult{}, rpc::kNoTimeout)));
+        checkDecode(pbEncode(fireMessage(requestId, MethodIn::unaryWithResult{0.5f}, 300)));
+        checkDecode(pbEncode(fireMessage(requestId, largeScalars(), 0xffffffff)));
+
+        // A timeout on a request other than FIRE.
+        auto message = requestMessage(requestId, barobo_rpc_Request_Type_CONNECT);
+        message.request.has_timeout = true;
+        message.request.timeout = 1;
+        checkDecode(pbEncode(message));
+
+        message = requestMessage(requestId, barobo_rpc_Request_Type_CANCEL);
+        message.request.has_cancel = true;
+        message.request.cancel.id = ~requestId;
+        checkDecode(pbEncode(message));
+
+        for (auto type : { barobo_rpc_Request_Type_SUBSCRIBE, barobo_rpc_Request_Type_UNSUBSCRIBE }) {
+            message = requestMessage(requestId, type);
+            message.request.has_subscription = true;
+            message.request.subscription.id = rpc::componentId(Broadcast::broadcast{});
+            checkDecode(pbEncode(message));
+        }
+    }
+
+    // The single-pass encoder's output decodes the same way.
+    uint8_t bytes[barobo_rpc_ClientMessage_size];
+    pb_size_t nWritten;
+    rpc::Status status;
+    rpc::encodeFire(0x4000, largeScalars(), 300, bytes, sizeof(bytes), nWritten, status);
+    assert(!rpc::hasError(status));
+    checkDecode(Bytes(bytes, bytes + nWritten));
+}
+
+int main () {
+    testEncoders();
+    testDecode();
+    std::cout << "Wire OK\n";
+    return 0;
+}